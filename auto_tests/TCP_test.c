@@ -587,6 +587,11 @@ START_TEST(test_tcp_connection)
 
     int ret = send_packet_tcp_connection(tc_1, 0, "Gentoo", 6);
     ck_assert_msg(ret == 0, "could not send packet.");
+    ck_assert_msg(tcp_connection_multipath_weight(tc_1, 0) > 0, "online relay has no multipath weight.");
+    ret = send_packet_tcp_connection_multipath(tc_1, 0, "Gentoo", 6);
+    ck_assert_msg(ret == 0, "multipath packet not sent through the only relay.");
+    tcp_connection_multipath_rtt(tc_1, 0, 0, 40);
+    ck_assert_msg(tcp_connection_multipath_weight(tc_1, 0) == TCP_MULTIPATH_WEIGHT(40), "rtt not used for the weight.");
     set_packet_tcp_connection_callback(tc_2, &tcp_data_callback, (void *) 120397);
 
     c_sleep(50);
@@ -607,6 +612,8 @@ START_TEST(test_tcp_connection)
     do_tcp_connections(tc_2);
 
     ck_assert_msg(send_packet_tcp_connection(tc_1, 0, "Gentoo", 6) == -1, "could send packet.");
+    ck_assert_msg(send_packet_tcp_connection_multipath(tc_1, 0, "Gentoo", 6) == -1, "could send multipath packet.");
+    ck_assert_msg(tcp_connection_multipath_weight(tc_1, 0) == 0, "killed connection has multipath weight.");
     ck_assert_msg(kill_tcp_connection_to(tc_2, 0) == 0, "could not kill connection to\n");
 
     kill_TCP_server(tcp_s);
@@ -712,6 +719,56 @@ START_TEST(test_tcp_connection2)
 }
 END_TEST
 
+#define MULTIPATH_PATHS 4
+
+START_TEST(test_multipath_pick)
+{
+    /* A fast direct path, two relays and one that is offline */
+    uint32_t weight[MULTIPATH_PATHS] = {TCP_MULTIPATH_WEIGHT(20), TCP_MULTIPATH_WEIGHT(50), TCP_MULTIPATH_WEIGHT(200), 0};
+    int32_t current[MULTIPATH_PATHS] = {0};
+    uint32_t count[MULTIPATH_PATHS] = {0};
+    uint32_t total = weight[0] + weight[1] + weight[2];
+    uint32_t i, run = 0, longest_run = 0;
+    int last = -1;
+
+    /* Every total picks give each path exactly its weight */
+    for (i = 0; i < total * 2; ++i) {
+        int path = multipath_pick(current, weight, MULTIPATH_PATHS);
+        ck_assert_msg(path >= 0 && path < MULTIPATH_PATHS, "bad path %i", path);
+        ++count[path];
+
+        run = path == last ? run + 1 : 1;
+        last = path;
+
+        if (run > longest_run)
+            longest_run = run;
+
+        if (i + 1 == total) {
+            unsigned int j;
+
+            for (j = 0; j < MULTIPATH_PATHS; ++j)
+                ck_assert_msg(count[j] == weight[j], "path %u picked %u times for a weight of %u", j, count[j], weight[j]);
+        }
+    }
+
+    ck_assert_msg(count[0] == weight[0] * 2 && count[1] == weight[1] * 2 && count[2] == weight[2] * 2 && count[3] == 0,
+                  "wrong split: %u %u %u %u", count[0], count[1], count[2], count[3]);
+
+    /* Spread out rather than in bursts: the heaviest path never gets more than its share in a row */
+    ck_assert_msg(longest_run <= weight[0] / (total - weight[0]) + 1, "path picked %u times in a row", longest_run);
+
+    /* Two paths of the same rtt share evenly, one after the other */
+    uint32_t even[2] = {TCP_MULTIPATH_WEIGHT(100), TCP_MULTIPATH_WEIGHT(100)};
+    int32_t even_current[2] = {0};
+
+    for (i = 0; i < 100; ++i)
+        ck_assert_msg(multipath_pick(even_current, even, 2) == (int)(i % 2), "paths of the same rtt not alternated");
+
+    uint32_t none[2] = {0, 0};
+    ck_assert_msg(multipath_pick(even_current, none, 2) == -1, "picked a path with no weight");
+}
+END_TEST
+
 Suite *TCP_suite(void)
 {
     Suite *s = suite_create("TCP");
@@ -722,6 +779,7 @@ Suite *TCP_suite(void)
     DEFTESTCASE_SLOW(client_invalid, 15);
     DEFTESTCASE_SLOW(tcp_connection, 20);
     DEFTESTCASE_SLOW(tcp_connection2, 20);
+    DEFTESTCASE(multipath_pick);
     return s;
 }
 
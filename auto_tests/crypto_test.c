@@ -2,7 +2,10 @@
 #include "config.h"
 #endif
 
-#include "../toxcore/net_crypto.h"
+/* For send_packet_to() and multipath_add_rtt() */
+#include "../toxcore/net_crypto.c"
+#include "../toxcore/TCP_server.h"
+#include "../toxcore/util.h"
 #include <sys/types.h>
 #include <stdint.h>
 #include <string.h>
@@ -12,6 +15,13 @@
 
 #include "helpers.h"
 
+#if defined(_WIN32) || defined(__WIN32__) || defined (WIN32)
+#define c_sleep(x) Sleep(1*x)
+#else
+#include <unistd.h>
+#define c_sleep(x) usleep(1000*x)
+#endif
+
 void rand_bytes(uint8_t *b, size_t blen)
 {
     size_t i;
@@ -272,6 +282,67 @@ START_TEST(test_large_data_symmetric)
 }
 END_TEST
 
+#define BATCH_TEST_NUM 32
+#define BATCH_TEST_SIZE 1024
+
+START_TEST(test_batch_symmetric)
+{
+    unsigned char k[BATCH_TEST_NUM][crypto_box_KEYBYTES];
+    unsigned char n[BATCH_TEST_NUM][crypto_box_NONCEBYTES];
+    unsigned char m[BATCH_TEST_NUM][BATCH_TEST_SIZE];
+    unsigned char c[BATCH_TEST_NUM][BATCH_TEST_SIZE + crypto_box_MACBYTES];
+    unsigned char c_single[BATCH_TEST_SIZE + crypto_box_MACBYTES];
+    unsigned char mprime[BATCH_TEST_NUM][BATCH_TEST_SIZE + crypto_box_MACBYTES];
+    Crypto_Batch_Entry entries[BATCH_TEST_NUM];
+    uint32_t i;
+
+    for (i = 0; i < BATCH_TEST_NUM; ++i) {
+        new_symmetric_key(k[i]);
+        rand_bytes(n[i], crypto_box_NONCEBYTES);
+        rand_bytes(m[i], sizeof(m[i]));
+
+        entries[i].shared_key = k[i];
+        entries[i].nonce = n[i];
+        entries[i].in = m[i];
+        entries[i].length = 1 + i * (BATCH_TEST_SIZE / BATCH_TEST_NUM);
+        entries[i].out = c[i];
+    }
+
+    ck_assert_msg(encrypt_data_symmetric_batch(entries, BATCH_TEST_NUM) == BATCH_TEST_NUM, "could not encrypt batch");
+
+    for (i = 0; i < BATCH_TEST_NUM; ++i) {
+        int c_len = encrypt_data_symmetric(k[i], n[i], m[i], entries[i].length, c_single);
+        ck_assert_msg(entries[i].out_length == c_len, "batch encrypted length differs");
+        ck_assert_msg(memcmp(c[i], c_single, c_len) == 0, "batch encrypted data differs");
+
+        entries[i].in = c[i];
+        entries[i].length = c_len;
+        entries[i].out = mprime[i];
+    }
+
+    /* Corrupt the last packet, it must fail without affecting the others. */
+    c[BATCH_TEST_NUM - 1][0] ^= 1;
+    ck_assert_msg(decrypt_data_symmetric_batch(entries, BATCH_TEST_NUM) == BATCH_TEST_NUM - 1, "bad batch decrypt count");
+    ck_assert_msg(entries[BATCH_TEST_NUM - 1].out_length == -1, "corrupted packet was decrypted");
+
+    for (i = 0; i < BATCH_TEST_NUM - 1; ++i) {
+        ck_assert_msg(entries[i].out_length == (int32_t)(entries[i].length - crypto_box_MACBYTES),
+                      "batch decrypted length differs");
+        ck_assert_msg(memcmp(mprime[i], m[i], entries[i].out_length) == 0, "batch decrypted data differs");
+    }
+
+    /* In place encryption. */
+    memcpy(mprime[0], m[0], BATCH_TEST_SIZE);
+    entries[0].in = mprime[0];
+    entries[0].out = mprime[0];
+    entries[0].length = BATCH_TEST_SIZE;
+    ck_assert_msg(encrypt_data_symmetric_batch(entries, 1) == 1, "could not encrypt in place");
+    ck_assert_msg(encrypt_data_symmetric(k[0], n[0], m[0], BATCH_TEST_SIZE, c_single) == entries[0].out_length,
+                  "in place encrypted length differs");
+    ck_assert_msg(memcmp(mprime[0], c_single, entries[0].out_length) == 0, "in place encrypted data differs");
+}
+END_TEST
+
 void increment_nonce_number_cmp(uint8_t *nonce, uint32_t num)
 {
     uint32_t num1, num2;
@@ -322,6 +393,170 @@ START_TEST(test_increment_nonce)
 }
 END_TEST
 
+/* Sizes of the packets net_crypto.c takes, their contents don't matter for admission. */
+#define TEST_COOKIE_REQUEST_LENGTH (1 + crypto_box_PUBLICKEYBYTES + crypto_box_NONCEBYTES + 72 + crypto_box_MACBYTES)
+#define TEST_HANDSHAKE_LENGTH (1 + 112 + crypto_box_NONCEBYTES * 2 + crypto_box_PUBLICKEYBYTES + crypto_hash_sha512_BYTES + 112 + crypto_box_MACBYTES)
+
+static void send_admission_packet(Net_Crypto *c, uint8_t type, uint32_t source_ip, uint16_t length)
+{
+    uint8_t packet[TEST_HANDSHAKE_LENGTH] = {0};
+    IP_Port source;
+
+    ip_init(&source.ip, 0);
+    source.ip.ip4.uint32 = htonl(source_ip);
+    source.port = htons(33445);
+    packet[0] = type;
+
+    Packet_Handles *handler = &c->dht->net->packethandlers[type];
+    handler->function(handler->object, source, packet, length);
+}
+
+START_TEST(test_admission)
+{
+    IP ip;
+    ip_init(&ip, 0);
+    TCP_Proxy_Info inf = {0};
+    Net_Crypto *c = new_net_crypto(new_DHT(new_networking(ip, 34445)), &inf);
+    ck_assert_msg(c != NULL, "Failed to create net_crypto");
+
+    Crypto_Admission_Stats stats;
+    uint32_t a = 0x01020304, r = 0x05060708, i;
+
+    /* One source gets its burst and no more */
+    for (i = 0; i < CRYPTO_ADMISSION_IP_BURST + 4; ++i)
+        send_admission_packet(c, NET_PACKET_COOKIE_REQUEST, a, TEST_COOKIE_REQUEST_LENGTH);
+
+    crypto_get_admission_stats(c, &stats);
+    ck_assert_msg(stats.cookie_requests_accepted == CRYPTO_ADMISSION_IP_BURST, "Accepted %u",
+                  (unsigned int)stats.cookie_requests_accepted);
+    ck_assert_msg(stats.cookie_requests_rate_limited == 4, "Rate limited %u",
+                  (unsigned int)stats.cookie_requests_rate_limited);
+
+    /* Others are not held back by it */
+    send_admission_packet(c, NET_PACKET_COOKIE_REQUEST, r, TEST_COOKIE_REQUEST_LENGTH);
+    send_admission_packet(c, NET_PACKET_COOKIE_REQUEST, r, TEST_COOKIE_REQUEST_LENGTH);
+    crypto_get_admission_stats(c, &stats);
+    ck_assert_msg(stats.cookie_requests_accepted == CRYPTO_ADMISSION_IP_BURST + 2, "Second source not accepted");
+
+    /* A flood from made up sources is cut down to the global limit, coming back doesn't help them */
+    uint64_t accepted = stats.cookie_requests_accepted;
+    uint32_t flood = CRYPTO_ADMISSION_GLOBAL_BURST * 3;
+    uint32_t repeat;
+
+    for (i = 0; i < flood; ++i)
+        for (repeat = 0; repeat < 4; ++repeat)
+            send_admission_packet(c, NET_PACKET_COOKIE_REQUEST, 0x10000000 + i * 7919, TEST_COOKIE_REQUEST_LENGTH);
+
+    crypto_get_admission_stats(c, &stats);
+    accepted = stats.cookie_requests_accepted - accepted;
+    ck_assert_msg(accepted <= CRYPTO_ADMISSION_GLOBAL_BURST + CRYPTO_ADMISSION_GLOBAL_RATE / 10,
+                  "Flood not limited: accepted %u", (unsigned int)accepted);
+    /* The two sources before took their share of the global burst */
+    ck_assert_msg(accepted >= CRYPTO_ADMISSION_GLOBAL_BURST - CRYPTO_ADMISSION_IP_BURST - 3,
+                  "Flood limited too much: accepted %u", (unsigned int)accepted);
+
+    /* Sources seen before can't get past the global limit either */
+    accepted = stats.cookie_requests_accepted;
+
+    for (i = 0; i < CRYPTO_ADMISSION_GLOBAL_RATE / 16; ++i)
+        send_admission_packet(c, NET_PACKET_COOKIE_REQUEST, 0x10000000 + i * 7919, TEST_COOKIE_REQUEST_LENGTH);
+
+    crypto_get_admission_stats(c, &stats);
+    ck_assert_msg(stats.cookie_requests_accepted - accepted <= CRYPTO_ADMISSION_GLOBAL_RATE / 10,
+                  "Known sources passed the global limit: accepted %u",
+                  (unsigned int)(stats.cookie_requests_accepted - accepted));
+
+    /* Once it refills the source seen before the flood gets in, the limited one stays limited */
+    c_sleep(100);
+    uint64_t limited = stats.cookie_requests_rate_limited;
+    accepted = stats.cookie_requests_accepted;
+    send_admission_packet(c, NET_PACKET_COOKIE_REQUEST, r, TEST_COOKIE_REQUEST_LENGTH);
+
+    for (i = 0; i < 4; ++i)
+        send_admission_packet(c, NET_PACKET_COOKIE_REQUEST, a, TEST_COOKIE_REQUEST_LENGTH);
+
+    crypto_get_admission_stats(c, &stats);
+    ck_assert_msg(stats.cookie_requests_accepted - accepted <= 3, "Limited source was refilled");
+    ck_assert_msg(stats.cookie_requests_accepted - accepted >= 1, "Known source starved after the flood");
+    ck_assert_msg(stats.cookie_requests_rate_limited - limited >= 2, "Limited source was refilled");
+
+    /* Handshakes with a cookie we didn't make are dropped before anything else */
+    send_admission_packet(c, NET_PACKET_CRYPTO_HS, r, TEST_HANDSHAKE_LENGTH);
+    crypto_get_admission_stats(c, &stats);
+    ck_assert_msg(stats.handshakes_bad_cookie == 1, "Bad cookie not counted");
+    ck_assert_msg(stats.handshakes_accepted == 0 && stats.handshakes_rate_limited == 0, "Bad handshake admitted");
+
+    DHT *dht = c->dht;
+    Networking_Core *net = dht->net;
+    kill_net_crypto(c);
+    kill_DHT(dht);
+    kill_networking(net);
+}
+END_TEST
+
+START_TEST(test_multipath_fallback_rtt)
+{
+    uint16_t port = 33448;
+    uint8_t relay_public_key[crypto_box_PUBLICKEYBYTES];
+    uint8_t relay_secret_key[crypto_box_SECRETKEYBYTES];
+    crypto_box_keypair(relay_public_key, relay_secret_key);
+    TCP_Server *tcp_s = new_TCP_server(1, 1, &port, relay_secret_key, NULL);
+    ck_assert_msg(tcp_s != NULL, "Failed to create TCP relay server");
+
+    IP ip;
+    ip_init(&ip, 1);
+    TCP_Proxy_Info inf = {0};
+    Net_Crypto *c = new_net_crypto(new_DHT(new_networking(ip, 34446)), &inf);
+    ck_assert_msg(c != NULL, "Failed to create net_crypto");
+    net_crypto_set_multipath(c, 1);
+
+    /* A peer that never comes online: the relay can only take packets for it out of band, which
+     * send_packet_tcp_connection_multipath() leaves to send_packet_tcp_connection() */
+    uint8_t peer_public_key[crypto_box_PUBLICKEYBYTES], peer_secret_key[crypto_box_SECRETKEYBYTES];
+    uint8_t peer_dht_key[crypto_box_PUBLICKEYBYTES];
+    crypto_box_keypair(peer_public_key, peer_secret_key);
+    crypto_box_keypair(peer_dht_key, peer_secret_key);
+    int id = new_crypto_connection(c, peer_public_key, peer_dht_key);
+    ck_assert_msg(id != -1, "Failed to create crypto connection");
+
+    IP_Port ip_port_tcp_s;
+    ip_port_tcp_s.port = htons(port);
+    ip_port_tcp_s.ip.family = AF_INET6;
+    ip_port_tcp_s.ip.ip6.in6_addr = in6addr_loopback;
+    ck_assert_msg(add_tcp_relay_peer(c, id, ip_port_tcp_s, relay_public_key) == 0, "Failed to add relay");
+
+    uint8_t data[64] = {NET_PACKET_CRYPTO_DATA};
+    uint8_t path = 0;
+    int sent = -1;
+    uint32_t i;
+
+    for (i = 0; i < 100 && sent != 0; ++i) {
+        c_sleep(50);
+        do_TCP_server(tcp_s);
+        do_net_crypto(c);
+        sent = send_packet_to(c, id, data, sizeof(data), &path);
+    }
+
+    ck_assert_msg(sent == 0, "Packet not sent through the relay fallback");
+    ck_assert_msg(path == CRYPTO_PATH_UNKNOWN, "Relay fallback sent on path %u", path);
+
+    /* Its rtt is no measure of the direct path, nor of any one relay */
+    Crypto_Connection *conn = get_crypto_connection(c, id);
+    conn->multipath_udp_rtt = 40;
+    multipath_add_rtt(c, conn, path, 900);
+    ck_assert_msg(conn->multipath_udp_rtt == 40, "Relay rtt taken for the direct path: %u", conn->multipath_udp_rtt);
+    multipath_add_rtt(c, conn, CRYPTO_PATH_DIRECT, 80);
+    ck_assert_msg(conn->multipath_udp_rtt == 45, "Direct rtt not taken: %u", conn->multipath_udp_rtt);
+
+    DHT *dht = c->dht;
+    Networking_Core *net = dht->net;
+    kill_net_crypto(c);
+    kill_DHT(dht);
+    kill_networking(net);
+    kill_TCP_server(tcp_s);
+}
+END_TEST
+
 Suite *crypto_suite(void)
 {
     Suite *s = suite_create("Crypto");
@@ -331,7 +566,10 @@ Suite *crypto_suite(void)
     DEFTESTCASE_SLOW(endtoend, 15); /* waiting up to 15 seconds */
     DEFTESTCASE(large_data);
     DEFTESTCASE(large_data_symmetric);
+    DEFTESTCASE(batch_symmetric);
     DEFTESTCASE_SLOW(increment_nonce, 20);
+    DEFTESTCASE(admission);
+    DEFTESTCASE_SLOW(multipath_fallback_rtt, 10);
 
     return s;
 }
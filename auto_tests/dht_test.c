@@ -4,6 +4,7 @@
 
 #include <sys/param.h>
 #include <time.h>
+#include <pthread.h>
 
 #include "../toxcore/tox.h"
 #include "../toxcore/DHT.c"
@@ -304,14 +305,600 @@ loop_top:
 }
 END_TEST
 
+#define PING_ARRAY_TEST_SIZE 512
+
+START_TEST(test_ping_array)
+{
+    Ping_Array array;
+    ck_assert_msg(ping_array_init(&array, 500, 5) == -1, "Size must be a power of 2.");
+    ck_assert_msg(ping_array_init(&array, PING_ARRAY_TEST_SIZE, 5) == 0, "Failed to init ping array.");
+
+    uint8_t data[sizeof(Node_format) * 2], big[1024], out[1024];
+    randombytes(data, sizeof(data));
+    randombytes(big, sizeof(big));
+
+    uint64_t ping_id = ping_array_add(&array, data, sizeof(data));
+    uint64_t big_id = ping_array_add(&array, big, sizeof(big));
+    ck_assert_msg(ping_id != 0 && big_id != 0, "Failed to add to ping array.");
+    ck_assert_msg(ping_array_check(out, sizeof(data) - 1, &array, ping_id) == -1, "Data copied to a short buffer.");
+    ck_assert_msg(ping_array_check(out, sizeof(out), &array, ping_id ^ PING_ARRAY_TEST_SIZE) == -1, "Wrong id accepted.");
+    ck_assert_msg(ping_array_check(out, sizeof(out), &array, ping_id) == sizeof(data), "Failed to check ping id.");
+    ck_assert_msg(memcmp(out, data, sizeof(data)) == 0, "Wrong data.");
+    ck_assert_msg(ping_array_check(out, sizeof(out), &array, ping_id) == -1, "Ping id accepted twice.");
+    ck_assert_msg(ping_array_check(out, sizeof(out), &array, big_id) == sizeof(big), "Failed to check big ping id.");
+    ck_assert_msg(memcmp(out, big, sizeof(big)) == 0, "Wrong big data.");
+
+    /* Once the array wrapped around, the oldest entries are gone. */
+    ping_id = ping_array_add(&array, data, sizeof(data));
+    big_id = ping_array_add(&array, big, sizeof(big));
+    uint32_t i;
+
+    for (i = 0; i < PING_ARRAY_TEST_SIZE - 1; ++i) {
+        ck_assert_msg(ping_array_add(&array, data, sizeof(data)) != 0, "Failed to add to ping array.");
+    }
+
+    ck_assert_msg(ping_array_check(out, sizeof(out), &array, ping_id) == -1, "Overwritten ping id accepted.");
+    ck_assert_msg(ping_array_check(out, sizeof(out), &array, big_id) == sizeof(big), "Failed to check big ping id.");
+
+    ping_array_free_all(&array);
+}
+END_TEST
+
+START_TEST(test_ping_interval)
+{
+    IP ip;
+    ip_init(&ip, 1);
+    DHT *dht = new_DHT(new_networking(ip, DHT_DEFAULT_PORT + NUM_DHT));
+    ck_assert_msg(dht != 0, "Failed to create DHT.");
+
+    uint8_t public_key[crypto_box_PUBLICKEYBYTES];
+    uint8_t secret_key[crypto_box_SECRETKEYBYTES];
+    crypto_box_keypair(public_key, secret_key);
+    IP_Port ip_port;
+    ip_init(&ip_port.ip, 0);
+    ip_port.ip.ip4.uint32 = htonl(0x7f000001);
+    ip_port.port = htons(DHT_DEFAULT_PORT + NUM_DHT + 1);
+
+    DHT_Bucket bucket = {0};
+    ck_assert_msg(DHT_bucket_add_node(&bucket, public_key, ip_port, 0) == 0, "Failed to add node.");
+    Client_data *client = 0;
+    unsigned int i;
+
+    for (i = 0; i < DHT_BUCKET_NODES; ++i) {
+        if (id_equal(bucket.client_list[i].public_key, public_key))
+            client = &bucket.client_list[i];
+    }
+
+    ck_assert_msg(client != 0, "Node not in the bucket.");
+    ck_assert_msg(client->ping_interval == PING_INTERVAL_MIN, "New nodes must be pinged often.");
+
+    /* A node that answers right away gets pinged less often. */
+    uint64_t now = unix_time();
+    client->timestamp = client->last_pinged = now - PING_INTERVAL_MIN;
+    do_ping_nodes(dht, &bucket);
+    ck_assert_msg(client->last_pinged == now, "Node was not pinged.");
+    DHT_bucket_add_node(&bucket, public_key, ip_port, 0);
+    ck_assert_msg(client->ping_interval == PING_INTERVAL_MIN * 2, "Interval did not grow.");
+
+    /* Hearing from a node suppresses the next ping. */
+    client->last_pinged = now - PING_INTERVAL_MIN * 2;
+    client->timestamp = now - 1;
+    do_ping_nodes(dht, &bucket);
+    ck_assert_msg(client->last_pinged == now - PING_INTERVAL_MIN * 2, "Node pinged although it was heard from.");
+
+    /* A node that needed a retry gets pinged more often. */
+    client->timestamp = now - PING_INTERVAL_MIN * 2 - PING_RETRY_INTERVAL;
+    client->last_pinged = now - PING_RETRY_INTERVAL;
+    do_ping_nodes(dht, &bucket);
+    ck_assert_msg(client->last_pinged == now && client->pings_missed == 1, "Ping was not retried.");
+    DHT_bucket_add_node(&bucket, public_key, ip_port, 0);
+    ck_assert_msg(client->ping_interval == PING_INTERVAL_MIN, "Interval did not shrink.");
+
+    /* And goes bad when it does not answer the retry, which gets as long as the ping did. */
+    Client_data nodes[1];
+    client->timestamp = now - (PING_INTERVAL_MIN + PING_RETRY_INTERVAL * 2 - 1);
+    ck_assert_msg(DHT_bucket_get_nodes(&bucket, nodes, 1, public_key) == 1, "Node went bad before its retry timed out.");
+    client->timestamp = now - (PING_INTERVAL_MIN + PING_RETRY_INTERVAL * 2);
+    ck_assert_msg(DHT_bucket_get_nodes(&bucket, nodes, 1, public_key) == 0, "Node did not go bad.");
+
+    /* However long the interval grew, a node that stops answering goes bad within BAD_NODE_TIMEOUT. */
+    for (i = 0; i < 8; ++i) {
+        client->timestamp = now - 2;
+        client->last_pinged = now - 1;
+        DHT_bucket_add_node(&bucket, public_key, ip_port, 0);
+    }
+
+    ck_assert_msg(client->ping_interval == PING_INTERVAL_MAX, "Interval stopped at %u s.", client->ping_interval);
+    client->timestamp = now - BAD_NODE_TIMEOUT;
+    ck_assert_msg(DHT_bucket_get_nodes(&bucket, nodes, 1, public_key) == 0,
+                  "Node pinged every %u s not bad after %u s.", client->ping_interval, BAD_NODE_TIMEOUT);
+
+    Networking_Core *net = dht->net;
+    kill_DHT(dht);
+    kill_networking(net);
+}
+END_TEST
+
+#define NUM_WARM_DHT 40
+#define WARM_START_UPTIME 1000
+#define WARM_DHT_PORT (DHT_DEFAULT_PORT + NUM_DHT + 10)
+
+static void poll_dhts(DHT **dhts, unsigned int num)
+{
+    unsigned int i;
+
+    for (i = 0; i < num; ++i) {
+        if (dhts[i]) {
+            networking_poll(dhts[i]->net);
+            do_DHT(dhts[i]);
+        }
+    }
+}
+
+static void kill_dht_and_net(DHT *dht)
+{
+    Networking_Core *net = dht->net;
+    kill_DHT(dht);
+    kill_networking(net);
+}
+
+/* Start a DHT on the port of the first DHT, optionally from saved data, and measure in ms
+ * how long it takes to be connected and to find friend.
+ */
+static void age_nodes(DHT_Bucket *bucket, uint32_t seconds)
+{
+    if (bucket->empty) {
+        age_nodes(bucket->buckets[0], seconds);
+        age_nodes(bucket->buckets[1], seconds);
+        return;
+    }
+
+    uint32_t i;
+
+    for (i = 0; i < DHT_BUCKET_NODES; ++i)
+        bucket->client_list[i].first_seen -= seconds;
+}
+
+/* return the longest uptime dhts[0] knows one of the other dhts for. */
+static uint32_t max_uptime(DHT **dhts, uint32_t num)
+{
+    uint32_t i, uptime = 0;
+
+    for (i = 1; i < num; ++i) {
+        const Client_data *client = bucket_get_client(&dhts[0]->bucket_lan, dhts[i]->self_public_key);
+
+        if (client && client->timestamp - client->first_seen > uptime)
+            uptime = client->timestamp - client->first_seen;
+    }
+
+    return uptime;
+}
+
+/* Start dhts[0] again, from the saved data if there is any, and wait for it to find the friend. */
+static void start_dht(DHT **dhts, const uint8_t *data, uint32_t length, const uint8_t *friend_key)
+{
+    IP ip;
+    ip_init(&ip, 1);
+    dhts[0] = new_DHT(new_networking(ip, WARM_DHT_PORT));
+    ck_assert_msg(dhts[0] != 0, "Failed to create DHT.");
+
+    if (data) {
+        ck_assert_msg(DHT_load(dhts[0], data, length) == 0, "Failed to load DHT.");
+        ck_assert_msg(dhts[0]->loaded_num_nodes != 0 && dhts[0]->loaded_num_uptimes == dhts[0]->loaded_num_nodes,
+                      "Node cache not loaded.");
+    } else {
+        IP_Port ip_port;
+        ip_init(&ip_port.ip, 1);
+        ip_port.ip.ip6.uint8[15] = 1;
+        ip_port.port = htons(WARM_DHT_PORT + 1);
+        DHT_bootstrap(dhts[0], ip_port, dhts[1]->self_public_key);
+    }
+
+    uint16_t lock_count;
+    ck_assert_msg(DHT_addfriend(dhts[0], friend_key, &ip_callback, 0, 0, &lock_count) == 0, "Failed to add friend.");
+
+    /* Before a single packet came back, a warm start already looks the friend up from the
+     * cached nodes while a cold one has nobody to ask yet. */
+    int friend_num = friend_number(dhts[0], friend_key);
+    ck_assert_msg(friend_num != -1, "Friend not added.");
+    const DHT_Lookup *lookup = &dhts[0]->friends_list[friend_num].lookup;
+
+    if (data) {
+        unsigned int num_nodes = dhts[0]->loaded_num_nodes < DHT_LOOKUP_NODES ? dhts[0]->loaded_num_nodes : DHT_LOOKUP_NODES;
+        ck_assert_msg(lookup->start_time != 0 && lookup->num_nodes == num_nodes,
+                      "Lookup seeded with %u of %u cached nodes.", lookup->num_nodes, num_nodes);
+        ck_assert_msg(lookup->in_flight == (num_nodes < DHT_LOOKUP_ALPHA ? num_nodes : DHT_LOOKUP_ALPHA),
+                      "%u requests sent to cached nodes.", lookup->in_flight);
+    } else {
+        ck_assert_msg(lookup->num_nodes == 0, "Cold start knew %u nodes.", lookup->num_nodes);
+    }
+
+    uint64_t start = current_time_monotonic();
+    IP_Port ip_port;
+
+    while (DHT_getfriendip(dhts[0], friend_key, &ip_port) != 1) {
+        ck_assert_msg(current_time_monotonic() - start < 60000, "Friend not found.");
+        poll_dhts(dhts, NUM_WARM_DHT);
+        c_sleep(5);
+    }
+}
+
+START_TEST(test_DHT_warm_start)
+{
+    DHT *dhts[NUM_WARM_DHT];
+    unsigned int i;
+
+    for (i = 0; i < NUM_WARM_DHT; ++i) {
+        IP ip;
+        ip_init(&ip, 1);
+        dhts[i] = new_DHT(new_networking(ip, WARM_DHT_PORT + i));
+        ck_assert_msg(dhts[i] != 0, "Failed to create dht instances %u", i);
+    }
+
+    for (i = 0; i < NUM_WARM_DHT; ++i) {
+        IP_Port ip_port;
+        ip_init(&ip_port.ip, 1);
+        ip_port.ip.ip6.uint8[15] = 1;
+        ip_port.port = htons(WARM_DHT_PORT + i);
+        DHT_bootstrap(dhts[(i + NUM_WARM_DHT - 1) % NUM_WARM_DHT], ip_port, dhts[i]->self_public_key);
+    }
+
+    const uint8_t *friend_key = dhts[NUM_WARM_DHT / 2]->self_public_key;
+    uint16_t lock_count;
+    ck_assert_msg(DHT_addfriend(dhts[0], friend_key, &ip_callback, 0, 0, &lock_count) == 0, "Failed to add friend.");
+
+    IP_Port ip_port;
+    uint64_t start = current_time_monotonic();
+
+    while (DHT_getfriendip(dhts[0], friend_key, &ip_port) != 1) {
+        ck_assert_msg(current_time_monotonic() - start < 60000, "Network did not form.");
+        poll_dhts(dhts, NUM_WARM_DHT);
+        c_sleep(50);
+    }
+
+    /* Make the nodes look like they have been up for a while so that there is an uptime to save. */
+    age_nodes(&dhts[0]->bucket_lan, WARM_START_UPTIME);
+
+    /* DHT_save() writes no more than DHT_size() and returns what it wrote. */
+    uint32_t size = DHT_size(dhts[0]);
+    uint8_t *data = malloc(size + 1);
+    ck_assert_msg(data != 0, "Failed to allocate save data.");
+    data[size] = 0xCD;
+    uint32_t length = DHT_save(dhts[0], data);
+    ck_assert_msg(length <= size && data[size] == 0xCD, "DHT_save() wrote more than DHT_size().");
+
+    kill_dht_and_net(dhts[0]);
+
+    start_dht(dhts, 0, 0, friend_key);
+    kill_dht_and_net(dhts[0]);
+
+    start_dht(dhts, data, length, friend_key);
+
+    /* The nodes of the cache keep the uptime they had when we saved. */
+    uint32_t uptime = max_uptime(dhts, NUM_WARM_DHT);
+    ck_assert_msg(uptime >= WARM_START_UPTIME, "Uptime of the cached nodes not restored: %u s.", uptime);
+
+    free(data);
+
+    for (i = 0; i < NUM_WARM_DHT; ++i) {
+        kill_dht_and_net(dhts[i]);
+    }
+}
+END_TEST
+
+#define NUM_THREADED_DHT 64
+#define NUM_DHT_THREADS 8
+#define THREADED_DHT_PORT (WARM_DHT_PORT + NUM_WARM_DHT + 10)
+
+/* Each thread owns a slice of the instances and is the only one to touch them
+ * until it is stopped, the way a thread pool hosting many identities would. */
+typedef struct {
+    DHT **dhts;
+    const uint8_t **friend_keys;
+    unsigned int num_dhts;
+    unsigned int num_found;
+    uint8_t *stop;
+} DHT_Thread;
+
+static void *iterate_dht_thread(void *arg)
+{
+    DHT_Thread *thread = arg;
+
+    while (!__atomic_load_n(thread->stop, __ATOMIC_ACQUIRE)) {
+        unsigned int i, found = 0;
+
+        for (i = 0; i < thread->num_dhts; ++i) {
+            IP_Port ip_port;
+
+            networking_poll(thread->dhts[i]->net);
+            do_DHT(thread->dhts[i]);
+
+            if (DHT_getfriendip(thread->dhts[i], thread->friend_keys[i], &ip_port) == 1)
+                ++found;
+        }
+
+        __atomic_store_n(&thread->num_found, found, __ATOMIC_RELEASE);
+        c_sleep(50);
+    }
+
+    return NULL;
+}
+
+START_TEST(test_DHT_threaded)
+{
+    DHT *dhts[NUM_THREADED_DHT];
+    const uint8_t *friend_keys[NUM_THREADED_DHT];
+    DHT_Thread threads[NUM_DHT_THREADS];
+    pthread_t thread_ids[NUM_DHT_THREADS];
+    uint8_t stop = 0;
+    unsigned int i;
+
+    for (i = 0; i < NUM_THREADED_DHT; ++i) {
+        IP ip;
+        ip_init(&ip, 1);
+        dhts[i] = new_DHT(new_networking(ip, THREADED_DHT_PORT + i));
+        ck_assert_msg(dhts[i] != 0, "Failed to create dht instances %u", i);
+    }
+
+    for (i = 0; i < NUM_THREADED_DHT; ++i) {
+        IP_Port ip_port;
+        ip_init(&ip_port.ip, 1);
+        ip_port.ip.ip6.uint8[15] = 1;
+        ip_port.port = htons(THREADED_DHT_PORT + i);
+        DHT_bootstrap(dhts[(i + NUM_THREADED_DHT - 1) % NUM_THREADED_DHT], ip_port, dhts[i]->self_public_key);
+
+        /* Every friend lives on another thread. */
+        uint16_t lock_count;
+        friend_keys[i] = dhts[(i + NUM_THREADED_DHT / NUM_DHT_THREADS + 1) % NUM_THREADED_DHT]->self_public_key;
+        ck_assert_msg(DHT_addfriend(dhts[i], friend_keys[i], &ip_callback, 0, 0, &lock_count) == 0, "Failed to add friend.");
+    }
+
+    uint64_t start = current_time_monotonic();
+
+    for (i = 0; i < NUM_DHT_THREADS; ++i) {
+        threads[i].dhts = dhts + i * (NUM_THREADED_DHT / NUM_DHT_THREADS);
+        threads[i].friend_keys = friend_keys + i * (NUM_THREADED_DHT / NUM_DHT_THREADS);
+        threads[i].num_dhts = NUM_THREADED_DHT / NUM_DHT_THREADS;
+        threads[i].num_found = 0;
+        threads[i].stop = &stop;
+        ck_assert_msg(pthread_create(&thread_ids[i], NULL, iterate_dht_thread, &threads[i]) == 0,
+                      "Failed to start thread %u", i);
+    }
+
+    unsigned int found = 0;
+
+    while (found != NUM_THREADED_DHT && current_time_monotonic() - start < 60000) {
+        c_sleep(50);
+        found = 0;
+
+        for (i = 0; i < NUM_DHT_THREADS; ++i)
+            found += __atomic_load_n(&threads[i].num_found, __ATOMIC_ACQUIRE);
+    }
+
+    __atomic_store_n(&stop, 1, __ATOMIC_RELEASE);
+
+    for (i = 0; i < NUM_DHT_THREADS; ++i)
+        pthread_join(thread_ids[i], NULL);
+
+    ck_assert_msg(found == NUM_THREADED_DHT, "Only %u of %u friends found.", found, NUM_THREADED_DHT);
+
+    for (i = 0; i < NUM_THREADED_DHT; ++i) {
+        kill_dht_and_net(dhts[i]);
+    }
+}
+END_TEST
+
+#define NUM_LOOKUP_DHT 40
+#define NUM_LOOKUP_TARGETS 4
+#define LOOKUP_DHT_PORT (THREADED_DHT_PORT + NUM_THREADED_DHT + 10)
+
+static const DHT_Lookup *friend_lookup(const DHT *dht, const uint8_t *public_key)
+{
+    unsigned int i;
+
+    for (i = 0; i < dht->num_friends; ++i) {
+        if (id_equal(dht->friends_list[i].public_key, public_key))
+            return &dht->friends_list[i].lookup;
+    }
+
+    return NULL;
+}
+
+/* return 1 if public_key is one of the count keys closest to target among
+ * the keys of the num dhts.
+ */
+static _Bool among_closest(DHT **dhts, unsigned int num, const uint8_t *target, const uint8_t *public_key,
+                           unsigned int count)
+{
+    unsigned int i, closer = 0;
+
+    for (i = 0; i < num; ++i) {
+        if (id_closest(target, dhts[i]->self_public_key, public_key) == 1)
+            ++closer;
+    }
+
+    return closer < count;
+}
+
+START_TEST(test_DHT_lookup)
+{
+    DHT *dhts[NUM_LOOKUP_DHT];
+    unsigned int i, j;
+
+    for (i = 0; i < NUM_LOOKUP_DHT; ++i) {
+        IP ip;
+        ip_init(&ip, 1);
+        dhts[i] = new_DHT(new_networking(ip, LOOKUP_DHT_PORT + i));
+        ck_assert_msg(dhts[i] != 0, "Failed to create dht instances %u", i);
+    }
+
+    for (i = 0; i < NUM_LOOKUP_DHT; ++i) {
+        IP_Port ip_port;
+        ip_init(&ip_port.ip, 1);
+        ip_port.ip.ip6.uint8[15] = 1;
+        ip_port.port = htons(LOOKUP_DHT_PORT + i);
+        DHT_bootstrap(dhts[(i + NUM_LOOKUP_DHT - 1) % NUM_LOOKUP_DHT], ip_port, dhts[i]->self_public_key);
+    }
+
+    uint64_t start = current_time_monotonic();
+
+    while (current_time_monotonic() - start < 5000) {
+        poll_dhts(dhts, NUM_LOOKUP_DHT);
+        c_sleep(20);
+    }
+
+    /* Several lookups run at the same time, the responses to each must only advance its own. */
+    DHT *searcher = dhts[0];
+    const uint8_t *targets[NUM_LOOKUP_TARGETS];
+
+    for (i = 0; i < NUM_LOOKUP_TARGETS; ++i) {
+        uint16_t lock_count;
+        targets[i] = dhts[1 + i * ((NUM_LOOKUP_DHT - 1) / NUM_LOOKUP_TARGETS)]->self_public_key;
+        ck_assert_msg(DHT_addfriend(searcher, targets[i], &ip_callback, 0, 0, &lock_count) == 0, "Failed to add friend.");
+    }
+
+    unsigned int converged = 0;
+    start = current_time_monotonic();
+
+    while (converged != NUM_LOOKUP_TARGETS) {
+        ck_assert_msg(current_time_monotonic() - start < 30000, "Only %u of %u lookups converged.", converged,
+                      NUM_LOOKUP_TARGETS);
+        poll_dhts(dhts, NUM_LOOKUP_DHT);
+        c_sleep(20);
+        converged = 0;
+
+        for (i = 0; i < NUM_LOOKUP_TARGETS; ++i) {
+            const DHT_Lookup *lookup = friend_lookup(searcher, targets[i]);
+
+            if (lookup->last_done != 0 && lookup->start_time == 0)
+                ++converged;
+        }
+    }
+
+    for (i = 0; i < NUM_LOOKUP_TARGETS; ++i) {
+        const DHT_Lookup *lookup = friend_lookup(searcher, targets[i]);
+        unsigned int closest = 0;
+
+        ck_assert_msg(DHT_friend_lookup_time(searcher, targets[i]) != -1, "Lookup time not recorded.");
+        ck_assert_msg(id_equal(lookup->nodes[0].node.public_key, targets[i]), "Lookup %u did not find its target.", i);
+
+        /* The lookup converged on the nodes closest to its own target. Responses hold
+         * MAX_SENT_NODES nodes so only that many are sure to be the closest ones. */
+        for (j = 0; j < lookup->num_nodes && closest < DHT_LOOKUP_K; ++j) {
+            if (lookup->nodes[j].state == DHT_LOOKUP_NODE_FAILED)
+                continue;
+
+            ck_assert_msg(lookup->nodes[j].state == DHT_LOOKUP_NODE_RESPONDED, "Lookup %u node %u did not answer.", i, j);
+            ck_assert_msg(closest >= MAX_SENT_NODES
+                          || among_closest(dhts + 1, NUM_LOOKUP_DHT - 1, targets[i], lookup->nodes[j].node.public_key,
+                                           MAX_SENT_NODES),
+                          "Lookup %u node %u is not among the closest to the target.", i, j);
+            ++closest;
+        }
+
+        ck_assert_msg(closest >= MAX_SENT_NODES, "Lookup %u converged on %u nodes.", i, closest);
+    }
+
+    for (i = 0; i < NUM_LOOKUP_DHT; ++i) {
+        kill_dht_and_net(dhts[i]);
+    }
+}
+END_TEST
+
+/* return the state of the node with public_key in the shortlist of lookup, -1 if it isn't in it. */
+static int lookup_node_state(const DHT_Lookup *lookup, const uint8_t *public_key)
+{
+    unsigned int i;
+
+    for (i = 0; i < lookup->num_nodes; ++i) {
+        if (id_equal(lookup->nodes[i].node.public_key, public_key))
+            return lookup->nodes[i].state;
+    }
+
+    return -1;
+}
+
+static void poll_net(Networking_Core *net)
+{
+    unsigned int i;
+
+    for (i = 0; i < 10; ++i) {
+        c_sleep(5);
+        networking_poll(net);
+    }
+}
+
+START_TEST(test_DHT_lookup_target)
+{
+    DHT *dhts[4];
+    IP_Port ip_ports[4];
+    unsigned int i;
+
+    for (i = 0; i < 4; ++i) {
+        IP ip;
+        ip_init(&ip, 1);
+        dhts[i] = new_DHT(new_networking(ip, LOOKUP_DHT_PORT + NUM_LOOKUP_DHT + i));
+        ck_assert_msg(dhts[i] != 0, "Failed to create dht instances %u", i);
+        ip_init(&ip_ports[i].ip, 1);
+        ip_ports[i].ip.ip6.uint8[15] = 1;
+        ip_ports[i].port = htons(LOOKUP_DHT_PORT + NUM_LOOKUP_DHT + i);
+    }
+
+    /* The searcher only knows the responder, which knows two other nodes. */
+    DHT *searcher = dhts[0], *responder = dhts[1];
+    addto_lists(searcher, ip_ports[1], responder->self_public_key);
+    addto_lists(responder, ip_ports[2], dhts[2]->self_public_key);
+    addto_lists(responder, ip_ports[3], dhts[3]->self_public_key);
+
+    uint8_t target_1[crypto_box_PUBLICKEYBYTES], target_2[crypto_box_PUBLICKEYBYTES];
+    randombytes(target_1, sizeof(target_1));
+    randombytes(target_2, sizeof(target_2));
+    uint16_t lock_count;
+
+    /* The responder answers the request for the first target before it gets the one for the second. */
+    ck_assert_msg(DHT_addfriend(searcher, target_1, &ip_callback, 0, 0, &lock_count) == 0, "Failed to add friend.");
+    poll_net(responder->net);
+    ck_assert_msg(DHT_addfriend(searcher, target_2, &ip_callback, 0, 0, &lock_count) == 0, "Failed to add friend.");
+
+    const DHT_Lookup *lookup_1 = friend_lookup(searcher, target_1);
+    const DHT_Lookup *lookup_2 = friend_lookup(searcher, target_2);
+    ck_assert_msg(lookup_node_state(lookup_1, responder->self_public_key) == DHT_LOOKUP_NODE_SENT,
+                  "First lookup did not ask the responder.");
+    ck_assert_msg(lookup_node_state(lookup_2, responder->self_public_key) == DHT_LOOKUP_NODE_SENT,
+                  "Second lookup did not ask the responder.");
+
+    /* That answer must only advance the lookup for the first target. */
+    poll_net(searcher->net);
+    ck_assert_msg(lookup_node_state(lookup_1, responder->self_public_key) == DHT_LOOKUP_NODE_RESPONDED,
+                  "Answer did not reach the first lookup.");
+    ck_assert_msg(lookup_node_state(lookup_2, responder->self_public_key) == DHT_LOOKUP_NODE_SENT,
+                  "Answer for the first target advanced the second lookup.");
+
+    poll_net(responder->net);
+    poll_net(searcher->net);
+    ck_assert_msg(lookup_node_state(lookup_2, responder->self_public_key) == DHT_LOOKUP_NODE_RESPONDED,
+                  "Answer did not reach the second lookup.");
+
+    for (i = 0; i < 4; ++i) {
+        kill_dht_and_net(dhts[i]);
+    }
+}
+END_TEST
+
 Suite *dht_suite(void)
 {
     Suite *s = suite_create("DHT");
 
     //DEFTESTCASE(addto_lists_ipv4);
     //DEFTESTCASE(addto_lists_ipv6);
+    DEFTESTCASE(ping_array);
+    DEFTESTCASE(ping_interval);
     DEFTESTCASE_SLOW(list, 20);
     DEFTESTCASE_SLOW(DHT_test, 50);
+    DEFTESTCASE_SLOW(DHT_warm_start, 100);
+    DEFTESTCASE_SLOW(DHT_threaded, 80);
+    DEFTESTCASE_SLOW(DHT_lookup, 50);
+    DEFTESTCASE(DHT_lookup_target);
     return s;
 }
 
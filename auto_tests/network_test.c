@@ -26,6 +26,7 @@ START_TEST(test_addr_resolv_localhost)
 
     const char localhost[] = "localhost";
     int localhost_split = 0;
+    char ip_str[IP_NTOA_LEN];
 
     IP ip;
     ip_init(&ip, 0); // ipv6enabled = 0
@@ -51,7 +52,7 @@ START_TEST(test_addr_resolv_localhost)
 
     if (res > 0) {
         ck_assert_msg(ip.family == AF_INET6, "Expected family AF_INET6 (%u), got %u.", AF_INET6, ip.family);
-        ck_assert_msg(!memcmp(&ip.ip6, &in6addr_loopback, sizeof(IP6)), "Expected ::1, got %s.", ip_ntoa(&ip));
+        ck_assert_msg(!memcmp(&ip.ip6, &in6addr_loopback, sizeof(IP6)), "Expected ::1, got %s.", ip_ntoa(&ip, ip_str, sizeof(ip_str)));
     }
 
     if (!localhost_split) {
@@ -64,7 +65,7 @@ START_TEST(test_addr_resolv_localhost)
 
         if (res > 0) {
             ck_assert_msg(ip.family == AF_INET6, "Expected family AF_INET6 (%u), got %u.", AF_INET6, ip.family);
-            ck_assert_msg(!memcmp(&ip.ip6, &in6addr_loopback, sizeof(IP6)), "Expected ::1, got %s.", ip_ntoa(&ip));
+            ck_assert_msg(!memcmp(&ip.ip6, &in6addr_loopback, sizeof(IP6)), "Expected ::1, got %s.", ip_ntoa(&ip, ip_str, sizeof(ip_str)));
 
             ck_assert_msg(extra.family == AF_INET, "Expected family AF_INET (%u), got %u.", AF_INET, extra.family);
             ck_assert_msg(extra.ip4.uint32 == htonl(0x7F000001), "Expected 127.0.0.1, got %s.", inet_ntoa(extra.ip4.in_addr));
@@ -10,12 +10,14 @@
 #include <time.h>
 
 #include "../toxcore/onion.h"
-#include "../toxcore/onion_announce.h"
 #include "../toxcore/onion_client.h"
 #include "../toxcore/util.h"
 
 #include "helpers.h"
 
+/* The announce store is internal */
+#include "../toxcore/onion_announce.c"
+
 #if defined(_WIN32) || defined(__WIN32__) || defined (WIN32)
 #define c_sleep(x) Sleep(1*x)
 #else
@@ -195,14 +197,17 @@ START_TEST(test_basic)
 
     randombytes(sb_data, sizeof(sb_data));
     memcpy(&s, sb_data, sizeof(uint64_t));
-    memcpy(onion2_a->entries[1].public_key, onion2->dht->self_public_key, crypto_box_PUBLICKEYBYTES);
-    onion2_a->entries[1].time = unix_time();
+    IP_Port ret_ip_port = {{0}};
+    uint8_t ret_data[ONION_RETURN_3] = {0};
+    ck_assert_msg(add_to_entries(onion2_a, ret_ip_port, onion2->dht->self_public_key, zeroes, ret_data) == 0,
+                  "Failed to add announce entry.");
     networking_registerhandler(onion1->net, NET_PACKET_ONION_DATA_RESPONSE, &handle_test_4, onion1);
     send_announce_request(onion1->net, &path, nodes[3], onion1->dht->self_public_key, onion1->dht->self_secret_key,
                           test_3_ping_id, onion1->dht->self_public_key, onion1->dht->self_public_key, s);
 
-    while (memcmp(onion2_a->entries[ONION_ANNOUNCE_MAX_ENTRIES - 2].public_key, onion1->dht->self_public_key,
-                  crypto_box_PUBLICKEYBYTES) != 0) {
+    while (onion2_a->entries_count < 2
+            || memcmp(onion2_a->entries[onion2_a->sorted[1]].public_key, onion1->dht->self_public_key,
+                      crypto_box_PUBLICKEYBYTES) != 0) {
         do_onion(onion1);
         do_onion(onion2);
         c_sleep(50);
@@ -449,12 +454,538 @@ START_TEST(test_announce)
 }
 END_TEST
 
+/* Peel one layer the way a relay would: return the plain text length or -1. */
+static int peel_layer(const uint8_t *secret_key, const uint8_t *public_key, const uint8_t *nonce,
+                      const uint8_t *encrypted, uint16_t length, uint8_t *plain)
+{
+    uint8_t shared_key[crypto_box_BEFORENMBYTES];
+    encrypt_precompute(public_key, secret_key, shared_key);
+    return decrypt_data_symmetric(shared_key, nonce, encrypted, length, plain);
+}
+
+/* Check the packed (ip_port, public_key) at the start of a peeled layer. The public key is the
+ * ephemeral one of the path, so only the port can be compared against the node. */
+static int hop_matches(const uint8_t *plain, const Node_format *node)
+{
+    return memcmp(plain + SIZE_IP, &node->ip_port.port, SIZE_PORT) == 0;
+}
+
+START_TEST(test_onion_packet)
+{
+    IP ip;
+    ip_init(&ip, 1);
+    ip.ip6.uint8[15] = 1;
+    DHT *dht = new_DHT(new_networking(ip, 34570));
+    ck_assert_msg(dht != 0, "DHT failed to initialize.");
+
+    uint8_t node_secret_keys[3][crypto_box_SECRETKEYBYTES];
+    Node_format nodes[3];
+    uint32_t i;
+
+    for (i = 0; i < 3; ++i) {
+        crypto_box_keypair(nodes[i].public_key, node_secret_keys[i]);
+        nodes[i].ip_port.ip = ip;
+        nodes[i].ip_port.port = htons(34571 + i);
+    }
+
+    Onion_Path path;
+    ck_assert_msg(create_onion_path(dht, &path, nodes) == 0, "Failed to create onion path.");
+
+    IP_Port dest = nodes[2].ip_port;
+    dest.port = htons(34580);
+    uint8_t data[ONION_MAX_DATA_SIZE];
+    randombytes(data, sizeof(data));
+
+    uint8_t packet[ONION_MAX_PACKET_SIZE];
+    int len = create_onion_packet(packet, sizeof(packet), &path, dest, data, sizeof(data));
+    ck_assert_msg(len == ONION_MAX_PACKET_SIZE, "Wrong onion packet length %i.", len);
+    ck_assert_msg(packet[0] == NET_PACKET_ONION_SEND_INITIAL, "Wrong onion packet id.");
+
+    const uint8_t *nonce = packet + 1;
+    uint8_t plain1[ONION_MAX_PACKET_SIZE], plain2[ONION_MAX_PACKET_SIZE], plain3[ONION_MAX_PACKET_SIZE];
+    uint32_t offset = 1 + crypto_box_NONCEBYTES;
+    int len1 = peel_layer(node_secret_keys[0], packet + offset, nonce, packet + offset + crypto_box_PUBLICKEYBYTES,
+                          len - (offset + crypto_box_PUBLICKEYBYTES), plain1);
+    ck_assert_msg(len1 != -1, "First layer failed to decrypt.");
+
+    ck_assert_msg(hop_matches(plain1, &nodes[1]), "Wrong second hop.");
+
+    int len2 = peel_layer(node_secret_keys[1], plain1 + SIZE_IPPORT, nonce,
+                          plain1 + SIZE_IPPORT + crypto_box_PUBLICKEYBYTES,
+                          len1 - (SIZE_IPPORT + crypto_box_PUBLICKEYBYTES), plain2);
+    ck_assert_msg(len2 != -1, "Second layer failed to decrypt.");
+    ck_assert_msg(hop_matches(plain2, &nodes[2]), "Wrong third hop.");
+
+    int len3 = peel_layer(node_secret_keys[2], plain2 + SIZE_IPPORT, nonce,
+                          plain2 + SIZE_IPPORT + crypto_box_PUBLICKEYBYTES,
+                          len2 - (SIZE_IPPORT + crypto_box_PUBLICKEYBYTES), plain3);
+    ck_assert_msg(len3 == SIZE_IPPORT + sizeof(data), "Third layer failed to decrypt.");
+    ck_assert_msg(memcmp(plain3 + SIZE_IP, &dest.port, SIZE_PORT) == 0, "Wrong destination.");
+    ck_assert_msg(memcmp(plain3 + SIZE_IPPORT, data, sizeof(data)) == 0, "Wrong data.");
+
+    /* The TCP variant starts at the second layer. */
+    len = create_onion_packet_tcp(packet, sizeof(packet), &path, dest, data, 64);
+    ck_assert_msg(len != -1, "Failed to create TCP onion packet.");
+    ck_assert_msg(hop_matches(packet + crypto_box_NONCEBYTES, &nodes[1]), "Wrong TCP onion first hop.");
+    offset = crypto_box_NONCEBYTES + SIZE_IPPORT;
+    len2 = peel_layer(node_secret_keys[1], packet + offset, packet, packet + offset + crypto_box_PUBLICKEYBYTES,
+                      len - (offset + crypto_box_PUBLICKEYBYTES), plain2);
+    ck_assert_msg(len2 != -1, "TCP onion second layer failed to decrypt.");
+    len3 = peel_layer(node_secret_keys[2], plain2 + SIZE_IPPORT, packet,
+                      plain2 + SIZE_IPPORT + crypto_box_PUBLICKEYBYTES,
+                      len2 - (SIZE_IPPORT + crypto_box_PUBLICKEYBYTES), plain3);
+    ck_assert_msg(len3 == SIZE_IPPORT + 64, "TCP onion third layer failed to decrypt.");
+    ck_assert_msg(memcmp(plain3 + SIZE_IPPORT, data, 64) == 0, "Wrong TCP onion data.");
+
+    Networking_Core *net = dht->net;
+    kill_DHT(dht);
+    kill_networking(net);
+}
+END_TEST
+
+#define RELAY_DATA_ID 200
+
+static uint8_t relay_captured[256][ONION_MAX_PACKET_SIZE];
+static uint16_t relay_captured_length[256];
+static int relay_capture(void *object, IP_Port source, const uint8_t *packet, uint16_t length)
+{
+    memcpy(relay_captured[packet[0]], packet, length);
+    relay_captured_length[packet[0]] = length;
+    return 0;
+}
+
+/* Hand packet to the relay handler directly and wait for what it sent to the sink. */
+static uint16_t relay_step(Onion *relay, Networking_Core *sink, IP_Port source, const uint8_t *packet,
+                           uint16_t length, uint8_t expected_id, uint8_t *out)
+{
+    Packet_Handles *handler = &relay->net->packethandlers[packet[0]];
+    relay_captured_length[expected_id] = 0;
+    ck_assert_msg(handler->function(handler->object, source, packet, length) == 0, "Relay failed on packet %u.",
+                  packet[0]);
+
+    uint32_t i;
+
+    for (i = 0; i < 100 && relay_captured_length[expected_id] == 0; ++i) {
+        networking_poll(sink);
+        c_sleep(10);
+    }
+
+    ck_assert_msg(relay_captured_length[expected_id] != 0, "Relay did not send packet %u.", expected_id);
+    memcpy(out, relay_captured[expected_id], relay_captured_length[expected_id]);
+    return relay_captured_length[expected_id];
+}
+
+START_TEST(test_onion_relay)
+{
+    IP ip;
+    ip_init(&ip, 1);
+    ip.ip6.uint8[15] = 1;
+    Onion *relay = new_onion(new_DHT(new_networking(ip, 34590)));
+    Networking_Core *sink = new_networking(ip, 34591);
+    ck_assert_msg(relay != 0 && sink != 0, "Onion failed to initialize.");
+
+    networking_registerhandler(sink, NET_PACKET_ONION_SEND_1, &relay_capture, 0);
+    networking_registerhandler(sink, NET_PACKET_ONION_SEND_2, &relay_capture, 0);
+    networking_registerhandler(sink, NET_PACKET_ONION_RECV_2, &relay_capture, 0);
+    networking_registerhandler(sink, NET_PACKET_ONION_RECV_1, &relay_capture, 0);
+    networking_registerhandler(sink, RELAY_DATA_ID, &relay_capture, 0);
+
+    /* Every hop of the path is the relay, every hop forwards to the sink. */
+    Node_format nodes[3];
+    uint32_t i;
+
+    for (i = 0; i < 3; ++i) {
+        memcpy(nodes[i].public_key, relay->dht->self_public_key, crypto_box_PUBLICKEYBYTES);
+        nodes[i].ip_port.ip = ip;
+        nodes[i].ip_port.port = sink->port;
+    }
+
+    Onion_Path path;
+    ck_assert_msg(create_onion_path(relay->dht, &path, nodes) == 0, "Failed to create onion path.");
+
+    uint8_t data[400];
+    randombytes(data, sizeof(data));
+    data[0] = RELAY_DATA_ID;
+
+    uint8_t packet[ONION_MAX_PACKET_SIZE], send_1[ONION_MAX_PACKET_SIZE], send_2[ONION_MAX_PACKET_SIZE];
+    uint8_t out[ONION_MAX_PACKET_SIZE];
+    int len = create_onion_packet(packet, sizeof(packet), &path, nodes[2].ip_port, data, sizeof(data));
+    ck_assert_msg(len != -1, "Failed to create onion packet.");
+
+    uint16_t len_1 = relay_step(relay, sink, nodes[0].ip_port, packet, len, NET_PACKET_ONION_SEND_1, send_1);
+    uint16_t len_2 = relay_step(relay, sink, nodes[0].ip_port, send_1, len_1, NET_PACKET_ONION_SEND_2, send_2);
+    uint16_t len_3 = relay_step(relay, sink, nodes[0].ip_port, send_2, len_2, RELAY_DATA_ID, out);
+    ck_assert_msg(len_3 == sizeof(data) + ONION_RETURN_3, "Wrong relayed length %u.", len_3);
+    ck_assert_msg(memcmp(out, data, sizeof(data)) == 0, "Wrong relayed data.");
+
+    /* Send a response back along the return path. */
+    uint8_t response[64];
+    randombytes(response, sizeof(response));
+    response[0] = RELAY_DATA_ID;
+    uint8_t recv[ONION_MAX_PACKET_SIZE];
+    recv[0] = NET_PACKET_ONION_RECV_3;
+    memcpy(recv + 1, out + sizeof(data), ONION_RETURN_3);
+    memcpy(recv + 1 + ONION_RETURN_3, response, sizeof(response));
+    uint16_t recv_len = relay_step(relay, sink, nodes[0].ip_port, recv, 1 + ONION_RETURN_3 + sizeof(response),
+                                   NET_PACKET_ONION_RECV_2, recv);
+    recv_len = relay_step(relay, sink, nodes[0].ip_port, recv, recv_len, NET_PACKET_ONION_RECV_1, recv);
+    recv_len = relay_step(relay, sink, nodes[0].ip_port, recv, recv_len, RELAY_DATA_ID, out);
+    ck_assert_msg(recv_len == sizeof(response) && memcmp(out, response, sizeof(response)) == 0, "Wrong response.");
+
+    Networking_Core *net = relay->net;
+    DHT *dht = relay->dht;
+    kill_onion(relay);
+    kill_DHT(dht);
+    kill_networking(net);
+    kill_networking(sink);
+}
+END_TEST
+
+/* Check the friend schedule is a valid min heap on next_run and that
+ * schedule_index points back into it.
+ */
+static void check_friend_schedule(const Onion_Client *onion_c)
+{
+    uint32_t i, scheduled = 0;
+
+    for (i = 0; i < onion_c->friends_schedule_length; ++i) {
+        uint16_t friend_num = onion_c->friends_schedule[i];
+        ck_assert_msg(friend_num < onion_c->num_friends, "Bad friend %u in schedule.", friend_num);
+        ck_assert_msg(onion_c->friends_list[friend_num].status != 0, "Deleted friend %u in schedule.", friend_num);
+        ck_assert_msg(onion_c->friends_list[friend_num].schedule_index == i + 1, "Bad schedule index for %u.", friend_num);
+
+        if (i != 0) {
+            uint16_t parent = onion_c->friends_schedule[(i - 1) / 2];
+            ck_assert_msg(onion_c->friends_list[parent].next_run <= onion_c->friends_list[friend_num].next_run,
+                          "Schedule is not a heap at %u.", i);
+        }
+    }
+
+    for (i = 0; i < onion_c->num_friends; ++i) {
+        if (onion_c->friends_list[i].schedule_index)
+            ++scheduled;
+    }
+
+    ck_assert_msg(scheduled == onion_c->friends_schedule_length, "%u friends scheduled, heap has %u.", scheduled,
+                  onion_c->friends_schedule_length);
+}
+
+/* return the number of scheduled friends due at or before now. */
+static uint32_t friends_due(const Onion_Client *onion_c)
+{
+    uint32_t i, due = 0;
+
+    for (i = 0; i < onion_c->friends_schedule_length; ++i) {
+        if (onion_c->friends_list[onion_c->friends_schedule[i]].next_run <= unix_time())
+            ++due;
+    }
+
+    return due;
+}
+
+static void run_onion_client(Onion_Client *onion_c)
+{
+    /* Pretend to be connected so that do_onion_client() runs the friends,
+     * and run it again within the same second. */
+    onion_c->onion_connected = 100;
+    onion_c->last_run = 0;
+    do_onion_client(onion_c);
+}
+
+#define NUM_SCHEDULE_FRIENDS 300
+
+START_TEST(test_friend_schedule)
+{
+    unix_time_update();
+    Onions *on = new_onions(34600);
+    ck_assert_msg(on != NULL, "Onions failed to initialize.");
+    Onion_Client *onion_c = on->onion_c;
+
+    uint8_t public_key[crypto_box_PUBLICKEYBYTES];
+    uint32_t i;
+
+    for (i = 0; i < NUM_SCHEDULE_FRIENDS; ++i) {
+        randombytes(public_key, sizeof(public_key));
+        ck_assert_msg(onion_addfriend(onion_c, public_key) == (int)i, "Failed to add friend %u.", i);
+        ck_assert_msg(onion_c->friends_list[i].schedule_index != 0, "New friend %u not scheduled.", i);
+        check_friend_schedule(onion_c);
+    }
+
+    ck_assert_msg(friends_due(onion_c) == NUM_SCHEDULE_FRIENDS, "New friends must be due now.");
+
+    /* Online friends are not searched for and drop out of the schedule. */
+    ck_assert_msg(onion_set_friend_online(onion_c, 5, 1) == 0, "Failed to set friend online.");
+
+    /* Only MAX_ONION_FRIEND_RUNS friends are run per call, the others stay due. */
+    run_onion_client(onion_c);
+    check_friend_schedule(onion_c);
+    ck_assert_msg(friends_due(onion_c) == NUM_SCHEDULE_FRIENDS - MAX_ONION_FRIEND_RUNS,
+                  "%u friends due after one run.", friends_due(onion_c));
+
+    for (i = 0; i < NUM_SCHEDULE_FRIENDS / MAX_ONION_FRIEND_RUNS; ++i) {
+        run_onion_client(onion_c);
+        check_friend_schedule(onion_c);
+    }
+
+    ck_assert_msg(friends_due(onion_c) == 0, "%u friends still due.", friends_due(onion_c));
+    ck_assert_msg(onion_c->friends_list[5].schedule_index == 0, "Online friend still scheduled.");
+    ck_assert_msg(onion_c->friends_schedule_length == NUM_SCHEDULE_FRIENDS - 1, "Offline friends must stay scheduled.");
+
+    for (i = 0; i < NUM_SCHEDULE_FRIENDS; ++i) {
+        if (i != 5)
+            ck_assert_msg(onion_c->friends_list[i].next_run > unix_time(), "Friend %u run but not rescheduled.", i);
+    }
+
+    /* A friend going offline must be searched for right away. */
+    ck_assert_msg(onion_set_friend_online(onion_c, 5, 0) == 0, "Failed to set friend offline.");
+    check_friend_schedule(onion_c);
+    ck_assert_msg(onion_c->friends_schedule[0] == 5 && friends_due(onion_c) == 1, "Offline friend not due.");
+
+    /* Deleting friends anywhere in the heap keeps it consistent. */
+    for (i = 0; i < NUM_SCHEDULE_FRIENDS; i += 3) {
+        ck_assert_msg(onion_delfriend(onion_c, i) == (int)i, "Failed to delete friend %u.", i);
+        check_friend_schedule(onion_c);
+    }
+
+    run_onion_client(onion_c);
+    check_friend_schedule(onion_c);
+    ck_assert_msg(friends_due(onion_c) == 0, "%u friends still due.", friends_due(onion_c));
+
+    /* Deleted slots are reused and the new friends are due now. */
+    for (i = 0; i < NUM_SCHEDULE_FRIENDS; i += 3) {
+        randombytes(public_key, sizeof(public_key));
+        ck_assert_msg(onion_addfriend(onion_c, public_key) != -1, "Failed to add friend.");
+        check_friend_schedule(onion_c);
+    }
+
+    ck_assert_msg(friends_due(onion_c) == (NUM_SCHEDULE_FRIENDS + 2) / 3, "%u friends due.", friends_due(onion_c));
+
+    for (i = 0; i < NUM_SCHEDULE_FRIENDS; ++i) {
+        ck_assert_msg(onion_delfriend(onion_c, i) == (int)i, "Failed to delete friend %u.", i);
+        check_friend_schedule(onion_c);
+    }
+
+    ck_assert_msg(onion_c->friends_schedule_length == 0, "Schedule not empty.");
+    kill_onions(on);
+}
+END_TEST
+
+/* Add a friend that was added offline_time seconds ago and has MAX_ONION_CLIENTS
+ * fresh onion nodes, so that its next run only depends on its ping intervals.
+ */
+static int add_backoff_friend(Onion_Client *onion_c, uint64_t offline_time)
+{
+    uint8_t public_key[crypto_box_PUBLICKEYBYTES];
+    randombytes(public_key, sizeof(public_key));
+    int friend_num = onion_addfriend(onion_c, public_key);
+    ck_assert_msg(friend_num != -1, "Failed to add friend.");
+
+    Onion_Friend *onion_friend = &onion_c->friends_list[friend_num];
+    onion_friend->added_time = unix_time() - offline_time;
+    onion_friend->run_count = 100;
+    onion_friend->last_dht_pk_onion_sent = unix_time();
+    onion_friend->last_dht_pk_dht_sent = 0;
+
+    uint32_t i;
+
+    for (i = 0; i < MAX_ONION_CLIENTS; ++i) {
+        randombytes(onion_friend->clients_list[i].public_key, crypto_box_PUBLICKEYBYTES);
+        onion_friend->clients_list[i].timestamp = unix_time();
+        onion_friend->clients_list[i].last_pinged = unix_time();
+    }
+
+    return friend_num;
+}
+
+START_TEST(test_friend_backoff)
+{
+    unix_time_update();
+    Onions *on = new_onions(34601);
+    ck_assert_msg(on != NULL, "Onions failed to initialize.");
+    Onion_Client *onion_c = on->onion_c;
+
+    int recent = add_backoff_friend(onion_c, 0);
+    int old = add_backoff_friend(onion_c, ONION_FRIEND_BACKOFF_START);
+    int ancient = add_backoff_friend(onion_c, ONION_FRIEND_BACKOFF_START << 10);
+
+    uint64_t start = unix_time();
+    run_onion_client(onion_c);
+    uint64_t end = unix_time();
+    check_friend_schedule(onion_c);
+
+    /* The dhtpk announces are what recently seen friends wait for, they back off too. */
+    uint64_t next_run = onion_c->friends_list[recent].next_run;
+    ck_assert_msg(next_run >= start + ONION_DHTPK_SEND_INTERVAL && next_run <= end + ONION_DHTPK_SEND_INTERVAL,
+                  "Recent friend runs in %llu s.", (unsigned long long)(next_run - start));
+    next_run = onion_c->friends_list[old].next_run;
+    ck_assert_msg(next_run >= start + (ONION_DHTPK_SEND_INTERVAL << 1) && next_run <= end + (ONION_DHTPK_SEND_INTERVAL << 1),
+                  "Old friend runs in %llu s.", (unsigned long long)(next_run - start));
+
+    /* Fully backed off friends still ping their nodes before they time out. */
+    next_run = onion_c->friends_list[ancient].next_run;
+    ck_assert_msg(next_run >= start + ONION_FRIEND_MAX_PING_INTERVAL && next_run <= end + ONION_FRIEND_MAX_PING_INTERVAL,
+                  "Ancient friend runs in %llu s.", (unsigned long long)(next_run - start));
+    ck_assert_msg(ONION_FRIEND_MAX_PING_INTERVAL < FRIEND_ONION_NODE_TIMEOUT, "Nodes would time out.");
+
+    /* Without any nodes friends search for them every 2^backoff seconds, even though
+     * their dhtpk announces can't be sent. */
+    uint32_t i;
+
+    for (i = 0; i < MAX_ONION_CLIENTS; ++i) {
+        onion_c->friends_list[recent].clients_list[i].timestamp = 0;
+        onion_c->friends_list[ancient].clients_list[i].timestamp = 0;
+    }
+
+    onion_c->friends_list[recent].last_dht_pk_onion_sent = 0;
+    onion_c->friends_list[ancient].last_dht_pk_onion_sent = 0;
+    ck_assert_msg(onion_set_friend_online(onion_c, recent, 0) == 0, "Failed to make friend due.");
+    ck_assert_msg(onion_set_friend_online(onion_c, ancient, 0) == 0, "Failed to make friend due.");
+
+    start = unix_time();
+    run_onion_client(onion_c);
+    end = unix_time();
+    check_friend_schedule(onion_c);
+
+    next_run = onion_c->friends_list[recent].next_run;
+    ck_assert_msg(next_run >= start + 1 && next_run <= end + 1, "Recent friend searches in %llu s.",
+                  (unsigned long long)(next_run - start));
+    next_run = onion_c->friends_list[ancient].next_run;
+    ck_assert_msg(next_run >= start + (1 << ONION_FRIEND_MAX_BACKOFF) && next_run <= end + (1 << ONION_FRIEND_MAX_BACKOFF),
+                  "Ancient friend searches in %llu s.", (unsigned long long)(next_run - start));
+
+    kill_onions(on);
+}
+END_TEST
+
+static uint32_t search_packets;
+static int handle_search_packet(void *object, IP_Port source, const uint8_t *packet, uint16_t length)
+{
+    ++search_packets;
+    return 0;
+}
+
+/* Run the onion client and return the number of friend search packets it sent. */
+static uint32_t run_friend_search(Onion_Client *onion_c, Networking_Core *sink)
+{
+    search_packets = 0;
+    run_onion_client(onion_c);
+
+    uint32_t i;
+
+    for (i = 0; i < 10; ++i) {
+        c_sleep(10);
+        networking_poll(sink);
+    }
+
+    return search_packets;
+}
+
+/* Number of packets a single do_friend() run can send over the limit. */
+#define SEARCH_RATE_SLACK (MAX_ONION_CLIENTS / 2 + 2)
+
+START_TEST(test_friend_search_rate)
+{
+    unix_time_update();
+    IP ip;
+    ip_init(&ip, 1);
+    ip.ip6.uint8[15] = 1;
+    Onions *on = new_onions(34602);
+    Networking_Core *sink = new_networking(ip, 34603);
+    ck_assert_msg(on != NULL && sink != NULL, "Onions failed to initialize.");
+    Onion_Client *onion_c = on->onion_c;
+    networking_registerhandler(sink, NET_PACKET_ONION_SEND_INITIAL, &handle_search_packet, 0);
+
+    /* Every onion path goes through the sink. */
+    uint8_t public_key[crypto_box_PUBLICKEYBYTES];
+    IP_Port sink_ip_port = {ip, sink->port};
+    randombytes(public_key, sizeof(public_key));
+    addto_lists(onion_c->dht, sink_ip_port, public_key);
+    ck_assert_msg(DHT_isconnected(onion_c->dht), "DHT not connected.");
+
+    uint32_t i;
+
+    for (i = 0; i < MAX_PATH_NODES; ++i) {
+        randombytes(onion_c->path_nodes[i].public_key, crypto_box_PUBLICKEYBYTES);
+        onion_c->path_nodes[i].ip_port = sink_ip_port;
+    }
+
+    onion_c->path_nodes_index = MAX_PATH_NODES;
+
+    /* Ignore the packets used to announce ourselves. */
+    run_friend_search(onion_c, sink);
+
+    for (i = 0; i < 200; ++i) {
+        randombytes(public_key, sizeof(public_key));
+        ck_assert_msg(onion_addfriend(onion_c, public_key) != -1, "Failed to add friend.");
+    }
+
+#define TEST_SEARCH_RATE 40
+    onion_set_friend_search_rate(onion_c, TEST_SEARCH_RATE);
+
+    /* Start at the beginning of a second so that the bucket doesn't get refilled by the clock
+     * during the next two runs. */
+    uint64_t second = unix_time();
+
+    while (second == unix_time()) {
+        c_sleep(10);
+        unix_time_update();
+    }
+
+    uint32_t sent = run_friend_search(onion_c, sink);
+    ck_assert_msg(sent >= TEST_SEARCH_RATE && sent < TEST_SEARCH_RATE + SEARCH_RATE_SLACK, "Sent %u packets.", sent);
+    uint32_t due = friends_due(onion_c);
+    ck_assert_msg(due > 200 - TEST_SEARCH_RATE, "%u friends run.", 200 - due);
+
+    /* The bucket is empty until it gets refilled. */
+    sent = run_friend_search(onion_c, sink);
+    ck_assert_msg(sent == 0 && friends_due(onion_c) == due, "Sent %u packets with an empty bucket.", sent);
+
+    onion_c->friend_search_refill -= 1;
+    sent = run_friend_search(onion_c, sink);
+    ck_assert_msg(sent > 0 && sent < TEST_SEARCH_RATE + SEARCH_RATE_SLACK, "Sent %u packets after a refill.", sent);
+    ck_assert_msg(friends_due(onion_c) < due, "No friends run after a refill.");
+
+    /* The bucket never holds more than a second worth of packets. */
+    onion_c->friend_search_refill -= 100;
+    sent = run_friend_search(onion_c, sink);
+    ck_assert_msg(sent < TEST_SEARCH_RATE + SEARCH_RATE_SLACK, "Sent %u packets after a long refill.", sent);
+
+    /* Friends that have not been seen in a while get only half of the rate. */
+    for (i = 0; i < onion_c->num_friends; ++i) {
+        onion_c->friends_list[i].added_time = unix_time() - ONION_FRIEND_BACKOFF_START;
+        onion_set_friend_online(onion_c, i, 0);
+    }
+
+    onion_c->friend_search_refill -= 1;
+    sent = run_friend_search(onion_c, sink);
+    ck_assert_msg(sent >= TEST_SEARCH_RATE / 2 && sent < TEST_SEARCH_RATE / 2 + SEARCH_RATE_SLACK,
+                  "Sent %u packets for old friends.", sent);
+
+    /* 0 removes the limit. */
+    onion_set_friend_search_rate(onion_c, 0);
+    due = friends_due(onion_c);
+    sent = run_friend_search(onion_c, sink);
+    ck_assert_msg(friends_due(onion_c) == due - (due < MAX_ONION_FRIEND_RUNS ? due : MAX_ONION_FRIEND_RUNS),
+                  "%u friends still due without a limit.", friends_due(onion_c));
+    ck_assert_msg(sent > TEST_SEARCH_RATE, "Sent %u packets without a limit.", sent);
+#undef TEST_SEARCH_RATE
+
+    kill_networking(sink);
+    kill_onions(on);
+}
+END_TEST
+
 Suite *onion_suite(void)
 {
     Suite *s = suite_create("Onion");
 
     DEFTESTCASE_SLOW(basic, 5);
     DEFTESTCASE_SLOW(announce, 70);
+    DEFTESTCASE_SLOW(onion_packet, 20);
+    DEFTESTCASE_SLOW(onion_relay, 20);
+    DEFTESTCASE(friend_schedule);
+    DEFTESTCASE(friend_backoff);
+    DEFTESTCASE(friend_search_rate);
     return s;
 }
 
@@ -625,6 +625,24 @@ START_TEST(test_few_clients)
         c_sleep(50);
     }
 
+    const uint8_t *batch_data[3] = {data_c, data_c, data_c};
+    size_t batch_length[3] = {TOX_MAX_CUSTOM_PACKET_SIZE, TOX_MAX_CUSTOM_PACKET_SIZE, TOX_MAX_CUSTOM_PACKET_SIZE};
+    size_t batch_ret = tox_friend_send_lossless_packets(tox2, 0, batch_data, batch_length, 3, 0);
+    ck_assert_msg(batch_ret == 3, "tox_friend_send_lossless_packets fail %zu", batch_ret);
+    unsigned int batch_received = 0;
+
+    while (batch_received < 3) {
+        custom_packet = 0;
+        tox_iterate(tox1);
+        tox_iterate(tox2);
+        tox_iterate(tox3);
+
+        batch_received += custom_packet;
+        ck_assert_msg(batch_received <= 3, "Lossless packets fail");
+
+        c_sleep(50);
+    }
+
     packet_number = 200;
     tox_callback_friend_lossy_packet(tox3, &handle_custom_packet, &packet_number);
     memset(data_c, ((uint8_t)packet_number), sizeof(data_c));
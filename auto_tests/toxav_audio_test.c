@@ -0,0 +1,316 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifndef HAVE_LIBCHECK
+#   include <assert.h>
+
+#   define ck_assert(X) assert(X);
+#   define ck_assert_msg(X, ...) assert(X);
+#   define START_TEST(NAME) void NAME ()
+#   define END_TEST
+#else
+#   include "helpers.h"
+#endif
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../toxav/audio.h"
+#include "../toxav/rtp.h"
+#include "../toxcore/network.h"
+
+#if defined(_WIN32) || defined(__WIN32__) || defined (WIN32)
+#define c_sleep(x) Sleep(1*x)
+#else
+#include <unistd.h>
+#define c_sleep(x) usleep(1000*x)
+#endif
+
+
+#define FRAMES 100
+#define FRAME_MS 20
+#define FRAME_SAMPLES 960
+#define LOST_FRAME 40
+#define STALL_START 1300
+#define STALL_END 1400
+
+#define SEND_FRAMES 2000
+#define SEND_STALL_MS 50 /* Longest the sending side holds its lock */
+#define SEND_MAX_MS 20 /* Longest a send may take, well under a stall */
+
+typedef struct {
+    uint32_t frames;
+    uint32_t samples;
+} Receiver;
+
+static void receive_audio(ToxAV *av, uint32_t friend_number, const int16_t *pcm, size_t sample_count,
+                          uint8_t channels, uint32_t sampling_rate, void *user_data)
+{
+    Receiver *r = user_data;
+
+    ++r->frames;
+    r->samples += sample_count;
+}
+
+/* Encode a 20ms frame the way toxav_audio_send_frame does and wrap it like rtp would. */
+static struct RTPMessage *make_frame(ACSession *ac, uint16_t sequnum, uint32_t timestamp)
+{
+    int16_t pcm[FRAME_SAMPLES * 2];
+    uint32_t i;
+
+    for (i = 0; i < FRAME_SAMPLES * 2; ++i)
+        pcm[i] = (int16_t)((i * 64 + sequnum * 512) & 0x3fff);
+
+    uint8_t dest[1024];
+    uint32_t sampling_rate = htonl(48000);
+    memcpy(dest, &sampling_rate, 4);
+
+    int len = opus_encode(ac->encoder, pcm, FRAME_SAMPLES, dest + 4, sizeof(dest) - 4);
+    ck_assert_msg(len > 0, "Encode failed");
+
+    struct RTPMessage *msg = rtp_new_message(len + 4);
+    ck_assert_msg(msg != NULL, "Allocation failed");
+    msg->len = len + 4;
+    msg->header.pt = rtp_TypeAudio % 128;
+    msg->header.sequnum = sequnum;
+    msg->header.timestamp = timestamp;
+    memcpy(msg->data, dest, len + 4);
+    return msg;
+}
+
+/* Stream FRAMES frames over a link with 20-50ms of delay, losing one of them, and stall
+ * the iterate loop for a while in the middle.
+ */
+START_TEST(test_jitter_buffer)
+{
+    Receiver r;
+    memset(&r, 0, sizeof(r));
+
+    ACSession *ac = ac_new(NULL, 0, receive_audio, &r);
+    ck_assert_msg(ac != NULL, "Failed to create audio session");
+
+    uint32_t arrival[FRAMES];
+    struct RTPMessage *msgs[FRAMES];
+    uint64_t start = current_time_monotonic();
+    uint32_t i;
+
+    srand(1);
+
+    for (i = 0; i < FRAMES; ++i) {
+        arrival[i] = i * FRAME_MS + 20 + rand() % 31;
+        msgs[i] = make_frame(ac, i, start + i * FRAME_MS);
+    }
+
+    rtp_free_msg(msgs[LOST_FRAME]);
+    msgs[LOST_FRAME] = NULL;
+
+    ACJitterStats halfway, stats;
+    uint32_t max_burst = 0, delivered = 0;
+    bool have_halfway = false;
+
+    while (1) {
+        uint32_t now = current_time_monotonic() - start;
+
+        for (i = 0; i < FRAMES; ++i)
+            if (msgs[i] && arrival[i] <= now) {
+                ck_assert_msg(ac_queue_message(ac, msgs[i]) == 0, "Failed to queue frame %u", i);
+                msgs[i] = NULL;
+                ++delivered;
+            }
+
+        if (now < STALL_START || now >= STALL_END) {
+            uint32_t before = r.frames;
+            ac_iterate(ac);
+
+            if (r.frames - before > max_burst)
+                max_burst = r.frames - before;
+        }
+
+        if (!have_halfway && now >= FRAMES / 2 * FRAME_MS) {
+            ac_get_jitter_stats(ac, &halfway);
+            have_halfway = true;
+        }
+
+        if (delivered == FRAMES - 1 && r.frames == FRAMES)
+            break;
+
+        ck_assert_msg(now < FRAMES * FRAME_MS + 1000, "Only %u frames played", r.frames);
+        c_sleep(1);
+    }
+
+    ac_get_jitter_stats(ac, &stats);
+    ck_assert_msg(stats.lost == 1 && stats.concealed == 1, "Lost frame not concealed");
+    ck_assert_msg(r.samples == FRAMES * FRAME_SAMPLES, "Played %u samples", r.samples);
+    ck_assert_msg(stats.late == halfway.late, "Packets still late after adapting");
+    ck_assert_msg(stats.jitter > 0 && stats.delay >= FRAME_MS && stats.delay <= 400, "Bad delay estimate");
+    ck_assert_msg(max_burst >= 3, "Stalled iterate did not catch up");
+
+    ac_kill(ac);
+}
+END_TEST
+
+typedef struct {
+    ACSession *ac;
+    pthread_mutex_t lock[1]; /* Stands in for the ToxAV mutex, held through network stalls */
+    bool done;
+
+    uint16_t queued[SEND_FRAMES]; /* Sample count of each frame queued, in order */
+    uint32_t queued_count;
+    uint32_t dropped;
+
+    OpusDecoder *decoder;
+    uint32_t sent;
+    uint32_t mismatched;
+    uint32_t last_timestamp;
+} SendQueue;
+
+static int send_check(void *object, const uint8_t *data, uint16_t length, uint32_t timestamp)
+{
+    SendQueue *q = object;
+    int16_t pcm[5760 * 2];
+    uint32_t sampling_rate;
+
+    memcpy(&sampling_rate, data, sizeof(sampling_rate));
+
+    int samples = opus_decode(q->decoder, data + 4, length - 4, pcm, 5760, 0);
+
+    /* Frames must come out as they went in, in the same order */
+    if (ntohl(sampling_rate) != 48000 || q->sent >= SEND_FRAMES || samples != q->queued[q->sent] ||
+            timestamp < q->last_timestamp)
+        ++q->mismatched;
+
+    q->last_timestamp = timestamp;
+    ++q->sent;
+    return 0;
+}
+
+static void *send_thread(void *arg)
+{
+    SendQueue *q = arg;
+
+    while (!__atomic_load_n(&q->done, __ATOMIC_ACQUIRE) ||
+            q->ac->send_tail != __atomic_load_n(&q->ac->send_head, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(q->lock);
+
+        /* Stalled by the network or another thread, with the lock held */
+        if (rand() % 8 == 0) {
+            uint32_t stall = rand() % SEND_STALL_MS;
+            c_sleep(stall);
+        }
+
+        ac_send_queued(q->ac, send_check, q);
+        pthread_mutex_unlock(q->lock);
+        c_sleep(1);
+    }
+
+    return NULL;
+}
+
+/* Queue frames of changing lengths from one thread while another one sends them, stalling
+ * for up to SEND_STALL_MS at a time with its lock held. Queueing must never wait for it.
+ */
+START_TEST(test_send_queue)
+{
+    static const uint16_t lengths[] = {120, 240, 480, 960};
+    static int16_t pcm[960 * 2];
+    SendQueue q;
+    pthread_t thread;
+    int status;
+    uint32_t i, slowest = 0;
+
+    memset(&q, 0, sizeof(q));
+    srand(2);
+
+    q.ac = ac_new(NULL, 0, receive_audio, NULL);
+    q.decoder = opus_decoder_create(48000, 2, &status);
+    ck_assert_msg(q.ac != NULL && q.decoder != NULL, "Failed to create audio session");
+    ck_assert_msg(pthread_mutex_init(q.lock, NULL) == 0, "Failed to create mutex");
+    ck_assert_msg(pthread_create(&thread, NULL, send_thread, &q) == 0, "Failed to start thread");
+
+    for (i = 0; i < SEND_FRAMES; ++i) {
+        uint16_t length = lengths[i % 4];
+        uint64_t start = current_time_monotonic();
+
+        /* What the frame will be, published to the sending thread with the frame itself */
+        q.queued[q.queued_count] = length;
+
+        int rc = ac_send_frame(q.ac, pcm, length, 2, 48000, 64000);
+        uint32_t took = current_time_monotonic() - start;
+
+        ck_assert_msg(rc == 0 || rc == -2, "Send failed: %d", rc);
+
+        if (rc == 0)
+            ++q.queued_count;
+        else
+            ++q.dropped;
+
+        if (took > slowest)
+            slowest = took;
+
+        c_sleep(1);
+    }
+
+    __atomic_store_n(&q.done, true, __ATOMIC_RELEASE);
+    pthread_join(thread, NULL);
+
+    ck_assert_msg(q.dropped > 0, "Stalls never filled the queue");
+    ck_assert_msg(q.dropped == q.ac->send_dropped, "Drops not counted");
+    ck_assert_msg(q.sent == q.queued_count && q.mismatched == 0, "Frames lost, damaged or reordered");
+    ck_assert_msg(slowest < SEND_MAX_MS, "Send waited for the sending thread: %u ms", slowest);
+
+    ToxAV_Stream_Stats sent, received;
+    memset(&sent, 0, sizeof(sent));
+    memset(&received, 0, sizeof(received));
+    ac_get_stats(q.ac, &sent, &received);
+    ck_assert_msg(sent.frames == q.queued_count, "Counted %u frames encoded", sent.frames);
+    ck_assert_msg(sent.frames_dropped == q.dropped, "Counted %u frames dropped", sent.frames_dropped);
+    ck_assert_msg(sent.codec_time > 0, "Encoding took no time");
+
+    pthread_mutex_destroy(q.lock);
+    opus_decoder_destroy(q.decoder);
+    ac_kill(q.ac);
+}
+END_TEST
+
+
+#ifndef HAVE_LIBCHECK
+int main(int argc, char *argv[])
+{
+    (void) argc;
+    (void) argv;
+
+    test_jitter_buffer();
+    test_send_queue();
+    return 0;
+}
+#else
+Suite *toxav_audio_suite(void)
+{
+    Suite *s = suite_create("ToxAV audio");
+
+    DEFTESTCASE_SLOW(jitter_buffer, 20);
+    DEFTESTCASE_SLOW(send_queue, 20);
+    return s;
+}
+int main(int argc, char *argv[])
+{
+    (void) argc;
+    (void) argv;
+
+    Suite *audio = toxav_audio_suite();
+    SRunner *test_runner = srunner_create(audio);
+
+    setbuf(stdout, NULL);
+
+    srunner_run_all(test_runner, CK_NORMAL);
+    int number_failed = srunner_ntests_failed(test_runner);
+
+    srunner_free(test_runner);
+
+    return number_failed;
+}
+#endif
@@ -0,0 +1,366 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifndef HAVE_LIBCHECK
+#   include <assert.h>
+
+#   define ck_assert(X) assert(X);
+#   define ck_assert_msg(X, ...) assert(X);
+#   define START_TEST(NAME) void NAME ()
+#   define END_TEST
+#else
+#   include "helpers.h"
+#endif
+
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../toxav/bwcontroller.h"
+#include "../toxav/rtp.h"
+#include "../toxcore/tox.h"
+#include "../toxcore/util.h"
+
+#if defined(_WIN32) || defined(__WIN32__) || defined (WIN32)
+#define c_sleep(x) Sleep(1*x)
+#else
+#include <unistd.h>
+#define c_sleep(x) usleep(1000*x)
+#endif
+
+int bwc_handle_data(Tox *tox, uint32_t friendnumber, const uint8_t *data, uint16_t length, void *object);
+
+/* A call over a simulated bottleneck link, run on a simulated clock: audio every 20ms and
+ * video every 33ms at the rate the controller allows, the receiving side estimating and
+ * sending updates back the way bwcontroller.c does.
+ */
+
+#define SIM_MAX_RATE 2000000 /* What the app set */
+#define SIM_AUDIO_BYTES 200
+#define SIM_PROPAGATION_MS 25
+#define SIM_QUEUE_MS 400 /* Drop tail beyond this */
+#define SIM_UPDATE_MS 200
+#define SIM_QUEUE_SIZE 4096
+
+typedef struct {
+    uint64_t arrival;
+    uint32_t timestamp;
+    uint32_t bytes;
+    int lost;
+} SimPacket;
+
+typedef struct {
+    uint64_t now;
+
+    /* Link */
+    uint32_t capacity;
+    float loss; /* Random loss on top of drop tail */
+    double link_free;
+    SimPacket queue[SIM_QUEUE_SIZE];
+    uint32_t queue_start;
+    uint32_t queue_count;
+
+    /* Sender */
+    uint32_t target;
+    uint64_t sent_bytes;
+    uint32_t frames;
+
+    /* Receiver */
+    BWCEstimator est;
+    uint32_t lost;
+    uint32_t recv;
+    uint32_t sent_rate;
+    uint64_t lsu;
+    uint64_t delay_sum;
+    uint32_t delay_count;
+
+    /* Update in flight */
+    uint64_t update_arrival;
+    uint32_t update_lost;
+    uint32_t update_recv;
+    uint32_t update_rate;
+    uint64_t lru;
+} Sim;
+
+static void sim_init(Sim *sim, uint32_t capacity)
+{
+    memset(sim, 0, sizeof(Sim));
+    sim->now = 1000;
+    sim->capacity = capacity;
+    sim->link_free = sim->now;
+    sim->lsu = sim->lru = sim->now;
+    bwc_estimator_init(&sim->est);
+}
+
+static uint32_t sim_send_rate(const Sim *sim)
+{
+    return sim->target ? MIN(sim->target, SIM_MAX_RATE) : SIM_MAX_RATE;
+}
+
+static void sim_send(Sim *sim, uint32_t bytes)
+{
+    ck_assert_msg(sim->queue_count < SIM_QUEUE_SIZE, "Simulation queue full");
+
+    SimPacket *p = &sim->queue[(sim->queue_start + sim->queue_count++) % SIM_QUEUE_SIZE];
+    double start = sim->link_free > sim->now ? sim->link_free : sim->now;
+
+    p->timestamp = sim->now;
+    p->bytes = bytes;
+    p->lost = start - sim->now > SIM_QUEUE_MS || rand() < sim->loss * RAND_MAX;
+
+    if (!p->lost) {
+        sim->link_free = start + bytes * 8000.0 / sim->capacity;
+        sim->delay_sum += sim->link_free - sim->now;
+        ++sim->delay_count;
+    }
+
+    p->arrival = (p->lost ? start : sim->link_free) + SIM_PROPAGATION_MS;
+    sim->sent_bytes += bytes;
+}
+
+static void sim_step(Sim *sim)
+{
+    /* Sender */
+    uint32_t rate = sim_send_rate(sim);
+
+    if (sim->now % 20 == 0)
+        sim_send(sim, SIM_AUDIO_BYTES);
+
+    if (sim->now * 30 / 1000 != (sim->now - 1) * 30 / 1000) {
+        uint32_t audio = SIM_AUDIO_BYTES * 8 * 50;
+        uint32_t frame = (rate > audio + 64000 ? rate - audio : 64000) / 8 / 30;
+
+        while (frame) {
+            uint32_t part = MIN(frame, RTP_FRAGMENT_SIZE);
+            sim_send(sim, part + sizeof(struct RTPHeader) + 1);
+            frame -= part;
+        }
+
+        ++sim->frames;
+    }
+
+    /* Receiver, as bwc_add_recv() and send_update() */
+    while (sim->queue_count && sim->queue[sim->queue_start].arrival <= sim->now) {
+        SimPacket *p = &sim->queue[sim->queue_start];
+
+        if (p->lost) {
+            sim->lost += p->bytes;
+        } else {
+            sim->recv += p->bytes;
+            bwc_estimator_packet(&sim->est, p->timestamp, p->bytes, sim->now);
+        }
+
+        sim->queue_start = (sim->queue_start + 1) % SIM_QUEUE_SIZE;
+        --sim->queue_count;
+    }
+
+    uint32_t estimate = bwc_estimator_update(&sim->est, sim->now);
+
+    if (sim->now - sim->lsu >= SIM_UPDATE_MS || (sim->now - sim->lsu >= 50 && estimate < sim->sent_rate * 0.95)) {
+        sim->update_arrival = sim->now + SIM_PROPAGATION_MS;
+        sim->update_lost = sim->lost;
+        sim->update_recv = sim->recv;
+        sim->update_rate = estimate;
+        sim->sent_rate = estimate;
+        sim->lost = sim->recv = 0;
+        sim->lsu = sim->now;
+    }
+
+    /* Sender, as on_update() */
+    if (sim->update_arrival && sim->update_arrival <= sim->now) {
+        float loss = sim->update_lost ? (float)sim->update_lost / (sim->update_lost + sim->update_recv) : 0;
+        uint32_t received = (uint64_t)sim->update_recv * 8000 / (sim->now - sim->lru);
+        uint32_t target = bwc_target_rate(sim->target, received, sim->update_rate, loss, false);
+
+        if (target)
+            sim->target = target;
+
+        sim->lru = sim->now;
+        sim->update_arrival = 0;
+    }
+
+    ++sim->now;
+
+    if (sim->now % 1000 == 0)
+        printf("%4us capacity %8u target %8u estimate %8u\n",
+               (uint32_t)(sim->now / 1000), sim->capacity, sim->target, sim->est.estimate);
+}
+
+/* Run for ms and return the average rate sent at, in bit/s, over the last half of it. */
+static uint32_t sim_run(Sim *sim, uint32_t ms, uint32_t *queue_delay)
+{
+    uint64_t end = sim->now + ms;
+
+    while (sim->now < end - ms / 2)
+        sim_step(sim);
+
+    sim->sent_bytes = 0;
+    sim->delay_sum = 0;
+    sim->delay_count = 0;
+
+    while (sim->now < end)
+        sim_step(sim);
+
+    *queue_delay = sim->delay_count ? sim->delay_sum / sim->delay_count : 0;
+    return sim->sent_bytes * 8000 / (ms / 2);
+}
+
+START_TEST(test_convergence)
+{
+    Sim sim;
+    uint32_t rate, delay;
+
+    srand(1);
+    sim_init(&sim, 1000000);
+
+    /* Starting far above capacity */
+    rate = sim_run(&sim, 30000, &delay);
+    printf("1 Mbit/s link: sent %u, queue delay %u ms\n", rate, delay);
+    ck_assert_msg(rate > 600000 && rate < 1050000, "Did not converge to 1 Mbit/s: %u", rate);
+    ck_assert_msg(delay < 200, "Queue kept growing: %u ms", delay);
+
+    /* Capacity halves */
+    sim.capacity = 500000;
+    rate = sim_run(&sim, 30000, &delay);
+    printf("500 kbit/s link: sent %u, queue delay %u ms\n", rate, delay);
+    ck_assert_msg(rate > 300000 && rate < 525000, "Did not follow capacity down: %u", rate);
+    ck_assert_msg(delay < 200, "Queue kept growing: %u ms", delay);
+
+    /* And triples */
+    sim.capacity = 1500000;
+    rate = sim_run(&sim, 40000, &delay);
+    printf("1.5 Mbit/s link: sent %u, queue delay %u ms\n", rate, delay);
+    ck_assert_msg(rate > 900000 && rate < 1575000, "Did not follow capacity up: %u", rate);
+    ck_assert_msg(delay < 200, "Queue kept growing: %u ms", delay);
+}
+END_TEST
+
+START_TEST(test_random_loss)
+{
+    Sim sim;
+    uint32_t rate, delay;
+
+    srand(2);
+    sim_init(&sim, 10000000);
+
+    /* A lossy link with room to spare, like bad wifi */
+    sim.loss = .2f;
+    rate = sim_run(&sim, 10000, &delay);
+    printf("20%% loss: sent %u\n", rate);
+    ck_assert_msg(rate < SIM_MAX_RATE / 2, "Did not back off on loss: %u", rate);
+
+    sim.loss = 0;
+    uint32_t recovered = sim_run(&sim, 40000, &delay);
+    printf("No loss: sent %u\n", recovered);
+    ck_assert_msg(recovered > SIM_MAX_RATE * 9 / 10, "Did not recover after loss: %u", recovered);
+}
+END_TEST
+
+/* The updates as bwcontroller.c sends them */
+#define OLD_UPDATE_ID 196
+#define EXT_UPDATE_ID 197
+#define OLD_UPDATE_SIZE (1 + 2 * 4)
+#define EXT_UPDATE_SIZE (1 + 4 * 4)
+#define KEY_FRAME_FLAG 1
+
+static void update_packet(uint8_t *packet, uint8_t id, uint32_t lost, uint32_t recv, uint32_t bit_rate, uint32_t flags)
+{
+    uint32_t fields[4] = {htonl(lost), htonl(recv), htonl(bit_rate), htonl(flags)};
+
+    packet[0] = id;
+    memcpy(packet + 1, fields, sizeof(fields));
+}
+
+static void count_key_frame(BWController *bwc, uint32_t friend_number, void *user_data)
+{
+    (void) bwc;
+    (void) friend_number;
+    ++*(int *)user_data;
+}
+
+START_TEST(test_old_updates)
+{
+    Tox *tox = tox_new(NULL, NULL);
+    Tox *peer = tox_new(NULL, NULL);
+    ck_assert_msg(tox && peer, "Failed to create toxes");
+
+    uint8_t public_key[TOX_PUBLIC_KEY_SIZE];
+    tox_self_get_public_key(peer, public_key);
+    ck_assert_msg(tox_friend_add_norequest(tox, public_key, NULL) == 0, "Failed to add friend");
+
+    int key_frames = 0;
+    BWController *bwc = bwc_new(tox->m, 0, NULL, count_key_frame, &key_frames);
+    ck_assert_msg(bwc != NULL, "Failed to create bwc");
+
+    uint8_t packet[EXT_UPDATE_SIZE];
+
+    /* Peers that don't know the extended update still get through */
+    update_packet(packet, OLD_UPDATE_ID, 1000, 9000, 0, 0);
+    ck_assert_msg(bwc_handle_data(tox, 0, packet, OLD_UPDATE_SIZE, bwc) == 0, "Old update rejected");
+    ck_assert_msg(bwc_handle_data(tox, 0, packet, EXT_UPDATE_SIZE, bwc) == -1, "Long old update accepted");
+    update_packet(packet, EXT_UPDATE_ID, 1000, 9000, 0, 0);
+    ck_assert_msg(bwc_handle_data(tox, 0, packet, OLD_UPDATE_SIZE, bwc) == -1, "Short extended update accepted");
+
+    c_sleep(60);
+    update_packet(packet, EXT_UPDATE_ID, 1000, 9000, 100000, KEY_FRAME_FLAG);
+    ck_assert_msg(bwc_handle_data(tox, 0, packet, EXT_UPDATE_SIZE, bwc) == 0, "Extended update rejected");
+    ck_assert_msg(key_frames == 1, "Key frame request lost");
+
+    /* Once the peer sent an extended update, the old one it sends along is ignored. Had it been
+     * taken, the next update would come too soon after it.
+     */
+    c_sleep(60);
+    update_packet(packet, OLD_UPDATE_ID, 1000, 9000, 0, 0);
+    ck_assert_msg(bwc_handle_data(tox, 0, packet, OLD_UPDATE_SIZE, bwc) == 0, "Old update rejected");
+    update_packet(packet, EXT_UPDATE_ID, 1000, 9000, 100000, KEY_FRAME_FLAG);
+    ck_assert_msg(bwc_handle_data(tox, 0, packet, EXT_UPDATE_SIZE, bwc) == 0, "Old update of extended peer taken");
+    ck_assert_msg(key_frames == 2, "Key frame request lost");
+
+    bwc_kill(bwc);
+    tox_kill(tox);
+    tox_kill(peer);
+}
+END_TEST
+
+
+#ifndef HAVE_LIBCHECK
+int main(int argc, char *argv[])
+{
+    (void) argc;
+    (void) argv;
+
+    test_convergence();
+    test_random_loss();
+    test_old_updates();
+    return 0;
+}
+#else
+Suite *toxav_bwc_suite(void)
+{
+    Suite *s = suite_create("ToxAV bwc");
+
+    DEFTESTCASE(convergence);
+    DEFTESTCASE(random_loss);
+    DEFTESTCASE(old_updates);
+    return s;
+}
+int main(int argc, char *argv[])
+{
+    (void) argc;
+    (void) argv;
+
+    Suite *bwc = toxav_bwc_suite();
+    SRunner *test_runner = srunner_create(bwc);
+
+    setbuf(stdout, NULL);
+
+    srunner_run_all(test_runner, CK_NORMAL);
+    int number_failed = srunner_ntests_failed(test_runner);
+
+    srunner_free(test_runner);
+
+    return number_failed;
+}
+#endif
@@ -0,0 +1,205 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifndef HAVE_LIBCHECK
+#   include <assert.h>
+
+#   define ck_assert(X) assert(X);
+#   define ck_assert_msg(X, ...) assert(X);
+#   define START_TEST(NAME) void NAME ()
+#   define END_TEST
+#else
+#   include "helpers.h"
+#endif
+
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "../toxav/dsp.h"
+#include "../toxcore/network.h"
+
+#define COUNT 1001 /* Not a multiple of any vector width */
+#define FRAME_SAMPLES 960 /* 20ms at 48kHz */
+
+static int16_t ref_saturate(int32_t value)
+{
+    return value > INT16_MAX ? INT16_MAX : (value < INT16_MIN ? INT16_MIN : value);
+}
+
+static void random_pcm(int16_t *pcm, size_t count)
+{
+    size_t i;
+
+    for (i = 0; i < count; ++i)
+        pcm[i] = rand() % 65536 - 32768;
+}
+
+START_TEST(test_mix)
+{
+    int16_t a[COUNT], b[COUNT], expected[COUNT];
+    size_t i;
+
+    srand(1);
+    random_pcm(a, COUNT);
+    random_pcm(b, COUNT);
+
+    for (i = 0; i < COUNT; ++i)
+        expected[i] = ref_saturate(a[i] + b[i]);
+
+    dsp_mix(a, b, COUNT);
+    ck_assert_msg(memcmp(a, expected, sizeof(a)) == 0, "Mix differs from plain C");
+}
+END_TEST
+
+START_TEST(test_gain)
+{
+    float gains[] = {0, 0.5f, 1, 1.5f, 8};
+    int16_t pcm[COUNT], expected[COUNT];
+    size_t g, i;
+
+    srand(2);
+
+    for (g = 0; g < sizeof(gains) / sizeof(gains[0]); ++g) {
+        int32_t q12 = gains[g] * 4096 > INT16_MAX ? INT16_MAX : gains[g] * 4096;
+        random_pcm(pcm, COUNT);
+
+        for (i = 0; i < COUNT; ++i)
+            expected[i] = ref_saturate((pcm[i] * q12 + 2048) >> 12);
+
+        dsp_gain(pcm, COUNT, gains[g]);
+        ck_assert_msg(memcmp(pcm, expected, sizeof(pcm)) == 0, "Gain %f differs from plain C", gains[g]);
+    }
+}
+END_TEST
+
+START_TEST(test_channels)
+{
+    int16_t mono[COUNT], stereo[COUNT * 2], expected[COUNT];
+    size_t i;
+
+    srand(3);
+    random_pcm(mono, COUNT);
+
+    dsp_mono_to_stereo(stereo, mono, COUNT);
+
+    for (i = 0; i < COUNT; ++i)
+        ck_assert_msg(stereo[i * 2] == mono[i] && stereo[i * 2 + 1] == mono[i], "Bad upmix at %u", (unsigned)i);
+
+    random_pcm(stereo, COUNT * 2);
+
+    for (i = 0; i < COUNT; ++i)
+        expected[i] = (stereo[i * 2] + stereo[i * 2 + 1]) >> 1;
+
+    dsp_stereo_to_mono(stereo, stereo, COUNT);
+    ck_assert_msg(memcmp(stereo, expected, sizeof(expected)) == 0, "In place downmix differs from plain C");
+}
+END_TEST
+
+START_TEST(test_resample)
+{
+    DSPResampler r;
+    int16_t in[FRAME_SAMPLES * 2], out[FRAME_SAMPLES * 4 + 2];
+    size_t i, n;
+
+    /* Doubling the rate puts a midpoint between every two samples */
+    ck_assert_msg(dsp_resampler_init(&r, 24000, 48000, 1) == 0, "Init failed");
+    random_pcm(in, 480);
+    ck_assert_msg(dsp_resample_size(&r, 480) == 960, "Wrong size");
+    n = dsp_resample(&r, out, in, 480);
+    ck_assert_msg(n == 960, "Got %u samples", (unsigned)n);
+
+    for (i = 1; i < 480; ++i) {
+        ck_assert_msg(out[i * 2] == in[i - 1], "Sample %u moved", (unsigned)i);
+        ck_assert_msg(out[i * 2 + 1] == (in[i - 1] + in[i] + 1) >> 1, "Bad midpoint at %u", (unsigned)i);
+    }
+
+    /* 20ms frames of 44.1kHz stereo give 20ms at 48kHz every time, and the same audio as one big frame */
+    int16_t *stream = malloc(882 * 10 * 2 * sizeof(int16_t));
+    int16_t *whole = malloc((9600 + 1) * 2 * sizeof(int16_t));
+    ck_assert_msg(stream && whole, "Allocation failed");
+
+    for (i = 0; i < 882 * 10; ++i)
+        stream[i * 2] = stream[i * 2 + 1] = 16000 * sin(2 * M_PI * 1000 * i / 44100.0);
+
+    ck_assert_msg(dsp_resampler_init(&r, 44100, 48000, 2) == 0, "Init failed");
+    n = dsp_resample(&r, whole, stream, 882 * 10);
+    ck_assert_msg(n == 9600, "Got %u samples", (unsigned)n);
+
+    ck_assert_msg(dsp_resampler_init(&r, 44100, 48000, 2) == 0, "Init failed");
+
+    for (i = 0; i < 10; ++i) {
+        ck_assert_msg(dsp_resample_size(&r, 882) == 960, "Wrong size");
+        n = dsp_resample(&r, out, stream + i * 882 * 2, 882);
+        ck_assert_msg(n == 960, "Frame %u gave %u samples", (unsigned)i, (unsigned)n);
+        ck_assert_msg(memcmp(out, whole + i * 960 * 2, 960 * 2 * sizeof(int16_t)) == 0, "Frame %u differs",
+                      (unsigned)i);
+    }
+
+    /* Still a 1kHz tone of the same level */
+    uint32_t crossings = 0;
+    int16_t peak = 0;
+
+    for (i = 1; i < 9600; ++i) {
+        if ((whole[i * 2 - 2] < 0) != (whole[i * 2] < 0))
+            ++crossings;
+
+        if (whole[i * 2] > peak)
+            peak = whole[i * 2];
+
+        ck_assert_msg(whole[i * 2] == whole[i * 2 + 1], "Channels mixed up");
+    }
+
+    ck_assert_msg(crossings >= 398 && crossings <= 400, "Tone changed pitch: %u crossings", crossings);
+    ck_assert_msg(peak > 15900 && peak <= 16000, "Tone changed level: %d", peak);
+
+    free(stream);
+    free(whole);
+}
+END_TEST
+
+
+#ifndef HAVE_LIBCHECK
+int main(int argc, char *argv[])
+{
+    (void) argc;
+    (void) argv;
+
+    test_mix();
+    test_gain();
+    test_channels();
+    test_resample();
+    return 0;
+}
+#else
+Suite *toxav_dsp_suite(void)
+{
+    Suite *s = suite_create("ToxAV dsp");
+
+    DEFTESTCASE(mix);
+    DEFTESTCASE(gain);
+    DEFTESTCASE(channels);
+    DEFTESTCASE(resample);
+    return s;
+}
+int main(int argc, char *argv[])
+{
+    (void) argc;
+    (void) argv;
+
+    Suite *dsp = toxav_dsp_suite();
+    SRunner *test_runner = srunner_create(dsp);
+
+    setbuf(stdout, NULL);
+
+    srunner_run_all(test_runner, CK_NORMAL);
+    int number_failed = srunner_ntests_failed(test_runner);
+
+    srunner_free(test_runner);
+
+    return number_failed;
+}
+#endif
@@ -0,0 +1,384 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifndef HAVE_LIBCHECK
+#   include <assert.h>
+
+#   define ck_assert(X) assert(X);
+#   define ck_assert_msg(X, ...) assert(X);
+#   define START_TEST(NAME) void NAME ()
+#   define END_TEST
+#else
+#   include "helpers.h"
+#endif
+
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/* The mixer is internal to the group code, count what it sends instead of sending it */
+#define send_group_lossy_packet count_group_lossy_packet
+#define send_group_lossy_packet_peer count_group_lossy_packet_peer
+#include "../toxav/group.c"
+
+#define TEST_PEERS 5
+#define TEST_FRAMES 10
+
+static unsigned int group_sends, peer_sends[TEST_PEERS];
+
+int count_group_lossy_packet(const Group_Chats *g_c, int groupnumber, const uint8_t *data, uint16_t length)
+{
+    ++group_sends;
+    return 0;
+}
+
+int count_group_lossy_packet_peer(const Group_Chats *g_c, int groupnumber, int peernumber, const uint8_t *data,
+                                  uint16_t length)
+{
+    if ((unsigned int)peernumber < TEST_PEERS && data[0] == GROUP_MIX_MINUS_PACKET_ID)
+        ++peer_sends[peernumber];
+
+    return 0;
+}
+
+static unsigned int audio_callbacks;
+
+static void count_audio(Tox *tox, int groupnumber, int peernumber, const int16_t *pcm, unsigned int samples,
+                        uint8_t channels, unsigned int sample_rate, void *userdata)
+{
+    ++audio_callbacks;
+}
+
+/* A group of TEST_PEERS peers with A/V objects and nothing else */
+static Group_AV *test_group_av(Group_Chats *g_c, Group_c *chat, Group_Peer *peers)
+{
+    unsigned int i;
+
+    memset(g_c, 0, sizeof(Group_Chats));
+    memset(chat, 0, sizeof(Group_c));
+    memset(peers, 0, sizeof(Group_Peer) * TEST_PEERS);
+
+    chat->status = GROUPCHAT_STATUS_CONNECTED;
+    chat->group = peers;
+    chat->numpeers = TEST_PEERS;
+    g_c->chats = chat;
+    g_c->num_chats = 1;
+
+    Group_AV *group_av = new_group_av(g_c, count_audio, NULL);
+    ck_assert_msg(group_av != NULL, "Out of memory.");
+    chat->object = group_av;
+
+    for (i = 0; i < TEST_PEERS; ++i) {
+        group_av_peer_new(group_av, 0, i);
+        ck_assert_msg(peers[i].object != NULL, "Out of memory.");
+    }
+
+    return group_av;
+}
+
+static void free_group_av(Group_AV *group_av, Group_Peer *peers)
+{
+    unsigned int i;
+
+    for (i = 0; i < TEST_PEERS; ++i)
+        group_av_peer_delete(group_av, 0, i, peers[i].object);
+
+    kill_group_av(group_av);
+}
+
+static int16_t sample_value(unsigned int i)
+{
+    return (int16_t)((i * 37) % 20000) - 10000;
+}
+
+static void fill_pcm(int16_t *pcm, unsigned int first, unsigned int count)
+{
+    unsigned int i;
+
+    for (i = 0; i < count; ++i)
+        pcm[i] = sample_value(first + i);
+}
+
+START_TEST(test_mix_inputs)
+{
+    Group_Mix_Input a = {0}, b = {0};
+    int16_t pcm[GROUP_MIX_FRAME_SAMPLES * 3];
+    int16_t mixed[GROUP_MIX_FRAME_SAMPLES];
+    unsigned int i;
+
+    fill_pcm(pcm, 0, GROUP_MIX_FRAME_SAMPLES * 3);
+    ck_assert_msg(mix_input_write(&a, 1, pcm, GROUP_MIX_FRAME_SAMPLES * 2, 1) == 0, "Write failed.");
+    ck_assert_msg(mix_input_write(&b, 1, pcm + GROUP_MIX_FRAME_SAMPLES, GROUP_MIX_FRAME_SAMPLES * 2, 1) == 0,
+                  "Write failed.");
+
+    /* A frame at a time, each input keeps the rest */
+    memset(mixed, 0, sizeof(mixed));
+    mix_input_read(&a, 1, mixed);
+    mix_input_read(&b, 1, mixed);
+    ck_assert_msg(a.samples == GROUP_MIX_FRAME_SAMPLES && b.samples == GROUP_MIX_FRAME_SAMPLES,
+                  "Reading took %u and %u samples.", GROUP_MIX_FRAME_SAMPLES * 2 - a.samples,
+                  GROUP_MIX_FRAME_SAMPLES * 2 - b.samples);
+
+    for (i = 0; i < GROUP_MIX_FRAME_SAMPLES; ++i)
+        ck_assert_msg(mixed[i] == sample_value(i) + sample_value(GROUP_MIX_FRAME_SAMPLES + i), "Bad mix at %u.", i);
+
+    memset(mixed, 0, sizeof(mixed));
+    mix_input_read(&a, 1, mixed);
+    mix_input_read(&b, 1, mixed);
+    ck_assert_msg(a.samples == 0 && b.samples == 0, "Audio left after the last frame.");
+
+    for (i = 0; i < GROUP_MIX_FRAME_SAMPLES; ++i)
+        ck_assert_msg(mixed[i] == sample_value(GROUP_MIX_FRAME_SAMPLES + i)
+                      + sample_value(GROUP_MIX_FRAME_SAMPLES * 2 + i), "Bad second mix at %u.", i);
+
+    free(a.pcm);
+    free(b.pcm);
+}
+END_TEST
+
+START_TEST(test_mix_clipping)
+{
+    Group_Mix_Input loud = {0};
+    int16_t pcm[GROUP_MIX_FRAME_SAMPLES];
+    int16_t mixed[GROUP_MIX_FRAME_SAMPLES];
+    unsigned int i;
+
+    for (i = 0; i < GROUP_MIX_FRAME_SAMPLES; ++i) {
+        pcm[i] = i % 2 ? INT16_MAX - 10 : INT16_MIN + 10;
+        mixed[i] = i % 2 ? 100 : -100;
+    }
+
+    ck_assert_msg(mix_input_write(&loud, 1, pcm, GROUP_MIX_FRAME_SAMPLES, 1) == 0, "Write failed.");
+    mix_input_read(&loud, 1, mixed);
+
+    for (i = 0; i < GROUP_MIX_FRAME_SAMPLES; ++i)
+        ck_assert_msg(mixed[i] == (i % 2 ? INT16_MAX : INT16_MIN), "Sample %u wrapped to %d.", i, mixed[i]);
+
+    free(loud.pcm);
+}
+END_TEST
+
+START_TEST(test_mix_underrun)
+{
+    Group_Mix_Input in = {0};
+    int16_t pcm[100];
+    int16_t mixed[GROUP_MIX_FRAME_SAMPLES * 2];
+    unsigned int i;
+
+    /* Less than a frame of stereo, only that much is mixed in */
+    fill_pcm(pcm, 0, 100);
+    ck_assert_msg(mix_input_write(&in, 2, pcm, 50, 2) == 0, "Write failed.");
+
+    for (i = 0; i < GROUP_MIX_FRAME_SAMPLES * 2; ++i)
+        mixed[i] = 7;
+
+    mix_input_read(&in, 2, mixed);
+    ck_assert_msg(in.samples == 0, "%u samples left.", in.samples);
+
+    for (i = 0; i < GROUP_MIX_FRAME_SAMPLES * 2; ++i)
+        ck_assert_msg(mixed[i] == (i < 100 ? sample_value(i) + 7 : 7), "Bad sample %u after an underrun.", i);
+
+    /* Nothing waiting leaves the mix alone */
+    mix_input_read(&in, 2, mixed);
+
+    for (i = 100; i < GROUP_MIX_FRAME_SAMPLES * 2; ++i)
+        ck_assert_msg(mixed[i] == 7, "Empty input changed sample %u.", i);
+
+    free(in.pcm);
+}
+END_TEST
+
+START_TEST(test_mix_overrun)
+{
+    Group_Mix_Input in = {0};
+    int16_t *pcm = malloc((GROUP_MIX_MAX_SAMPLES + 1) * sizeof(int16_t));
+    int16_t mixed[GROUP_MIX_FRAME_SAMPLES];
+    unsigned int i;
+
+    ck_assert_msg(pcm != NULL, "Out of memory.");
+
+    fill_pcm(pcm, 0, GROUP_MIX_MAX_SAMPLES + 1);
+    ck_assert_msg(mix_input_write(&in, 1, pcm, GROUP_MIX_MAX_SAMPLES + 1, 1) == -1, "Took more than fits.");
+    ck_assert_msg(in.samples == 0, "A failed write queued %u samples.", in.samples);
+
+    ck_assert_msg(mix_input_write(&in, 1, pcm, GROUP_MIX_MAX_SAMPLES, 1) == 0, "Write failed.");
+
+    /* One more frame pushes the oldest one out */
+    fill_pcm(pcm, GROUP_MIX_MAX_SAMPLES, GROUP_MIX_FRAME_SAMPLES);
+    ck_assert_msg(mix_input_write(&in, 1, pcm, GROUP_MIX_FRAME_SAMPLES, 1) == 0, "Write failed.");
+    ck_assert_msg(in.samples == GROUP_MIX_MAX_SAMPLES, "%u samples waiting.", in.samples);
+
+    memset(mixed, 0, sizeof(mixed));
+    mix_input_read(&in, 1, mixed);
+
+    for (i = 0; i < GROUP_MIX_FRAME_SAMPLES; ++i)
+        ck_assert_msg(mixed[i] == sample_value(GROUP_MIX_FRAME_SAMPLES + i), "Oldest audio kept at %u.", i);
+
+    free(in.pcm);
+    free(pcm);
+}
+END_TEST
+
+START_TEST(test_mix_channels)
+{
+    Group_Mix_Input stereo = {0}, mono = {0};
+    int16_t pcm[GROUP_MIX_FRAME_SAMPLES * 2];
+    int16_t mixed[GROUP_MIX_FRAME_SAMPLES * 2];
+    unsigned int i;
+
+    fill_pcm(pcm, 0, GROUP_MIX_FRAME_SAMPLES * 2);
+
+    /* Mono into a stereo mix goes to both sides */
+    ck_assert_msg(mix_input_write(&stereo, 2, pcm, GROUP_MIX_FRAME_SAMPLES, 1) == 0, "Write failed.");
+    memset(mixed, 0, sizeof(mixed));
+    mix_input_read(&stereo, 2, mixed);
+
+    for (i = 0; i < GROUP_MIX_FRAME_SAMPLES; ++i)
+        ck_assert_msg(mixed[i * 2] == pcm[i] && mixed[i * 2 + 1] == pcm[i], "Bad stereo sample %u.", i);
+
+    /* Stereo into a mono mix is averaged */
+    ck_assert_msg(mix_input_write(&mono, 1, pcm, GROUP_MIX_FRAME_SAMPLES, 2) == 0, "Write failed.");
+    memset(mixed, 0, sizeof(mixed));
+    mix_input_read(&mono, 1, mixed);
+
+    for (i = 0; i < GROUP_MIX_FRAME_SAMPLES; ++i)
+        ck_assert_msg(mixed[i] == (pcm[i * 2] + pcm[i * 2 + 1]) >> 1, "Bad mono sample %u.", i);
+
+    free(stereo.pcm);
+    free(mono.pcm);
+}
+END_TEST
+
+START_TEST(test_mix_streams_per_listener)
+{
+    Group_Chats g_c;
+    Group_c chat;
+    Group_Peer peers[TEST_PEERS];
+    Group_AV *group_av = test_group_av(&g_c, &chat, peers);
+    int16_t pcm[GROUP_MIX_FRAME_SAMPLES];
+    unsigned int i, frame;
+
+    fill_pcm(pcm, 0, GROUP_MIX_FRAME_SAMPLES);
+    ck_assert_msg(group_set_audio_mixer(&g_c, 0, 1) == 0, "Failed to turn the mixer on.");
+
+    group_sends = 0;
+    memset(peer_sends, 0, sizeof(peer_sends));
+
+    /* Peers 1 and 3 talk along with us, the rest listen */
+    for (frame = 0; frame < TEST_FRAMES; ++frame) {
+        Group_Peer_AV *talker = peers[1].object, *other = peers[3].object;
+        ck_assert_msg(mix_input_write(&talker->mix, 1, pcm, GROUP_MIX_FRAME_SAMPLES, 1) == 0, "Write failed.");
+        ck_assert_msg(mix_input_write(&other->mix, 1, pcm, GROUP_MIX_FRAME_SAMPLES, 1) == 0, "Write failed.");
+        ck_assert_msg(mix_input_write(&group_av->self_mix, 1, pcm, GROUP_MIX_FRAME_SAMPLES, 1) == 0, "Write failed.");
+
+        group_av->next_mix = current_time_monotonic();
+        mix_audio(group_av, 0);
+    }
+
+    /* What goes to the group reaches every peer, the mix-minus only its talker */
+    for (i = 0; i < TEST_PEERS; ++i) {
+        unsigned int expected = (i == 1 || i == 3) ? TEST_FRAMES * 2 : TEST_FRAMES;
+        ck_assert_msg(group_sends + peer_sends[i] == expected, "Peer %u got %u packets for %u frames.", i,
+                      group_sends + peer_sends[i], TEST_FRAMES);
+    }
+
+    free_group_av(group_av, peers);
+}
+END_TEST
+
+START_TEST(test_mix_minus_replaces_mix)
+{
+    Group_Chats g_c;
+    Group_c chat;
+    Group_Peer peers[TEST_PEERS];
+    Group_AV *group_av = test_group_av(&g_c, &chat, peers);
+    Group_Peer_AV *mixer = peers[0].object;
+    int16_t pcm[GROUP_MIX_FRAME_SAMPLES];
+    uint8_t packet[sizeof(uint16_t) + 1024];
+    unsigned int i;
+
+    fill_pcm(pcm, 0, GROUP_MIX_FRAME_SAMPLES);
+
+    /* Encoders of the mixer's full mix and of our mix-minus */
+    OpusEncoder *mix = create_encoder(GROUP_AUDIO_SAMPLE_RATE, 1, audio_bitrate(1));
+    OpusEncoder *minus = create_encoder(GROUP_AUDIO_SAMPLE_RATE, 1, audio_bitrate(1));
+    ck_assert_msg(mix && minus, "Failed to create encoders.");
+
+    audio_callbacks = 0;
+
+    for (i = 0; i < TEST_FRAMES; ++i) {
+        uint16_t sequnum = htons(i);
+        memcpy(packet, &sequnum, sizeof(sequnum));
+
+        int32_t size = opus_encode(minus, pcm, GROUP_MIX_FRAME_SAMPLES, packet + sizeof(sequnum),
+                                   sizeof(packet) - sizeof(sequnum));
+        ck_assert_msg(size > 0, "Encoding failed.");
+        ck_assert_msg(handle_group_mix_minus_packet(group_av, 0, 0, mixer, packet, sizeof(sequnum) + size) == -1,
+                      "A mix-minus was relayed.");
+
+        size = opus_encode(mix, pcm, GROUP_MIX_FRAME_SAMPLES, packet + sizeof(sequnum), sizeof(packet) - sizeof(sequnum));
+        ck_assert_msg(size > 0, "Encoding failed.");
+        ck_assert_msg(handle_group_audio_packet(group_av, 0, 0, mixer, packet, sizeof(sequnum) + size) == 0,
+                      "The full mix was not relayed.");
+    }
+
+    /* Only the mix-minus is played, and the full mix never touched its decoder */
+    ck_assert_msg(audio_callbacks == TEST_FRAMES, "%u frames played for %u sent.", audio_callbacks, TEST_FRAMES);
+    ck_assert_msg(mixer->audio.audio_decoder == NULL, "The full mix was decoded.");
+
+    opus_encoder_destroy(mix);
+    opus_encoder_destroy(minus);
+    free_group_av(group_av, peers);
+}
+END_TEST
+
+
+#ifndef HAVE_LIBCHECK
+int main(int argc, char *argv[])
+{
+    (void) argc;
+    (void) argv;
+
+    test_mix_inputs();
+    test_mix_clipping();
+    test_mix_underrun();
+    test_mix_overrun();
+    test_mix_channels();
+    test_mix_streams_per_listener();
+    test_mix_minus_replaces_mix();
+    return 0;
+}
+#else
+Suite *toxav_group_suite(void)
+{
+    Suite *s = suite_create("ToxAV group");
+
+    DEFTESTCASE(mix_inputs);
+    DEFTESTCASE(mix_clipping);
+    DEFTESTCASE(mix_underrun);
+    DEFTESTCASE(mix_overrun);
+    DEFTESTCASE(mix_channels);
+    DEFTESTCASE(mix_streams_per_listener);
+    DEFTESTCASE(mix_minus_replaces_mix);
+    return s;
+}
+int main(int argc, char *argv[])
+{
+    (void) argc;
+    (void) argv;
+
+    Suite *group = toxav_group_suite();
+    SRunner *test_runner = srunner_create(group);
+
+    setbuf(stdout, NULL);
+
+    srunner_run_all(test_runner, CK_NORMAL);
+    int number_failed = srunner_ntests_failed(test_runner);
+
+    srunner_free(test_runner);
+
+    return number_failed;
+}
+#endif
@@ -0,0 +1,209 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifndef HAVE_LIBCHECK
+#   include <assert.h>
+
+#   define ck_assert(X) assert(X);
+#   define ck_assert_msg(X, ...) assert(X);
+#   define START_TEST(NAME) void NAME ()
+#   define END_TEST
+#else
+#   include "helpers.h"
+#endif
+
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../toxav/rtp.h"
+#include "../toxcore/tox.h"
+#include "../toxcore/util.h"
+
+#if defined(_WIN32) || defined(__WIN32__) || defined (WIN32)
+#define c_sleep(x) Sleep(1*x)
+#else
+#include <unistd.h>
+#define c_sleep(x) usleep(1000*x)
+#endif
+
+int handle_rtp_packet (Tox *tox, uint32_t friendnumber, const uint8_t *data, uint16_t length, void *object);
+
+
+#define FRAME_SIZE (RTP_FRAGMENT_SIZE * 2 + 100) /* Three parts */
+#define MAX_RECEIVED 16
+
+typedef struct {
+    uint16_t sequnum[MAX_RECEIVED];
+    uint32_t count;
+    int corrupt;
+} Receiver;
+
+static uint8_t frame_byte(uint16_t sequnum, uint32_t i)
+{
+    return (uint8_t)(sequnum * 31 + i * 7);
+}
+
+static int receive_message(void *object, struct RTPMessage *msg)
+{
+    Receiver *r = object;
+    uint32_t i;
+
+    for (i = 0; i < msg->len; ++i)
+        if (msg->data[i] != frame_byte(msg->header.sequnum, i))
+            r->corrupt = 1;
+
+    if (msg->len != msg->header.tlen)
+        r->corrupt = 1;
+
+    if (r->count < MAX_RECEIVED)
+        r->sequnum[r->count] = msg->header.sequnum;
+
+    ++r->count;
+    rtp_free_msg(msg);
+    return 0;
+}
+
+/* Feed part `part` of message sequnum, built the way rtp_send_data builds it. */
+static void feed_part(Tox *tox, RTPSession *rtp, uint16_t sequnum, uint16_t length, uint16_t part)
+{
+    uint8_t packet[MAX_CRYPTO_DATA_SIZE];
+    struct RTPHeader *header = (struct RTPHeader *)(packet + 1);
+    uint16_t cpart = part * RTP_FRAGMENT_SIZE;
+    uint16_t piece = MIN(length - cpart, RTP_FRAGMENT_SIZE);
+    uint32_t i;
+
+    memset(packet, 0, sizeof(struct RTPHeader) + 1);
+    packet[0] = rtp_TypeVideo;
+    header->ve = 2;
+    header->pt = rtp_TypeVideo % 128;
+    header->sequnum = htons(sequnum);
+    header->timestamp = htonl(1000 + sequnum);
+    header->cpart = htons(cpart);
+    header->tlen = htons(length);
+
+    for (i = 0; i < piece; ++i)
+        packet[1 + sizeof(struct RTPHeader) + i] = frame_byte(sequnum, cpart + i);
+
+    ck_assert_msg(handle_rtp_packet(tox, 0, packet, 1 + sizeof(struct RTPHeader) + piece, rtp) == 0,
+                  "Part %u of %u rejected", part, sequnum);
+}
+
+START_TEST(test_reassembly)
+{
+    Tox *tox = tox_new(NULL, NULL);
+    Tox *peer = tox_new(NULL, NULL);
+    ck_assert_msg(tox && peer, "Failed to create toxes");
+
+    uint8_t public_key[TOX_PUBLIC_KEY_SIZE];
+    tox_self_get_public_key(peer, public_key);
+    ck_assert_msg(tox_friend_add_norequest(tox, public_key, NULL) == 0, "Failed to add friend");
+
+    Receiver r;
+    memset(&r, 0, sizeof(r));
+
+    BWController *bwc = bwc_new(tox->m, 0, NULL, NULL, NULL);
+    RTPSession *rtp = rtp_new(rtp_TypeVideo, tox->m, 0, bwc, &r, receive_message);
+    ck_assert_msg(bwc && rtp, "Failed to create rtp session");
+
+    /* Two messages with their parts interleaved, out of order and duplicated. */
+    feed_part(tox, rtp, 1, FRAME_SIZE, 0);
+    feed_part(tox, rtp, 2, FRAME_SIZE, 2);
+    feed_part(tox, rtp, 2, FRAME_SIZE, 0);
+    feed_part(tox, rtp, 1, FRAME_SIZE, 2);
+    feed_part(tox, rtp, 1, FRAME_SIZE, 0);
+    feed_part(tox, rtp, 2, FRAME_SIZE, 1);
+    ck_assert_msg(r.count == 0, "Newer message handed on before an older one");
+    feed_part(tox, rtp, 1, FRAME_SIZE, 1);
+    ck_assert_msg(r.count == 2 && r.sequnum[0] == 1 && r.sequnum[1] == 2, "Messages not reassembled in order");
+
+    /* Parts of messages handed on already are late. */
+    feed_part(tox, rtp, 1, FRAME_SIZE, 1);
+    ck_assert_msg(r.count == 2, "Late part handed on");
+
+    /* A message missing a part holds back newer ones for a while only. */
+    feed_part(tox, rtp, 3, FRAME_SIZE, 0);
+    feed_part(tox, rtp, 3, FRAME_SIZE, 2);
+    feed_part(tox, rtp, 4, 100, 0);
+    ck_assert_msg(r.count == 2, "Message handed on past an incomplete one");
+    rtp_iterate(rtp);
+    ck_assert_msg(r.count == 2, "Incomplete message given up on too soon");
+    c_sleep(80);
+
+    /* Even if no more packets arrive. */
+    rtp_iterate(rtp);
+    ck_assert_msg(r.count == 3 && r.sequnum[2] == 4, "Incomplete message held back others");
+    feed_part(tox, rtp, 5, 100, 0);
+    ck_assert_msg(r.count == 4 && r.sequnum[3] == 5, "Message after a given up one not handed on");
+
+    /* Or until its slot is needed. */
+    feed_part(tox, rtp, 6, FRAME_SIZE, 1);
+    uint16_t i;
+
+    for (i = 7; i < 7 + RTP_REASSEMBLY_SLOTS; ++i)
+        feed_part(tox, rtp, i, 100, 0);
+
+    ck_assert_msg(r.count == 4 + RTP_REASSEMBLY_SLOTS, "Messages held back by a full reassembly buffer");
+
+    for (i = 0; i < RTP_REASSEMBLY_SLOTS; ++i)
+        ck_assert_msg(r.sequnum[4 + i] == 7 + i, "Message %u out of order", 4 + i);
+
+    ck_assert_msg(!r.corrupt, "Corrupted message");
+
+    /* A message that never arrived at all */
+    feed_part(tox, rtp, 8 + RTP_REASSEMBLY_SLOTS, 100, 0);
+    ck_assert_msg(r.count == 5 + RTP_REASSEMBLY_SLOTS, "Message after a gap not handed on");
+
+    /* Every part counts, the two given up on and the one skipped were lost */
+    RTPStats sent, received;
+    rtp_get_stats(rtp, &sent, &received);
+    ck_assert_msg(received.packets == 14 + RTP_REASSEMBLY_SLOTS, "Counted %u packets", (unsigned)received.packets);
+    ck_assert_msg(received.messages == r.count, "Counted %u messages", received.messages);
+    ck_assert_msg(received.lost == 3, "Counted %u lost", received.lost);
+    ck_assert_msg(sent.packets == 0 && sent.messages == 0, "Counted packets never sent");
+
+    rtp_kill(rtp);
+    bwc_kill(bwc);
+    tox_kill(tox);
+    tox_kill(peer);
+}
+END_TEST
+
+
+#ifndef HAVE_LIBCHECK
+int main(int argc, char *argv[])
+{
+    (void) argc;
+    (void) argv;
+
+    test_reassembly();
+    return 0;
+}
+#else
+Suite *toxav_rtp_suite(void)
+{
+    Suite *s = suite_create("ToxAV rtp");
+
+    DEFTESTCASE(reassembly);
+    return s;
+}
+int main(int argc, char *argv[])
+{
+    (void) argc;
+    (void) argv;
+
+    Suite *rtp = toxav_rtp_suite();
+    SRunner *test_runner = srunner_create(rtp);
+
+    setbuf(stdout, NULL);
+
+    srunner_run_all(test_runner, CK_NORMAL);
+    int number_failed = srunner_ntests_failed(test_runner);
+
+    srunner_free(test_runner);
+
+    return number_failed;
+}
+#endif
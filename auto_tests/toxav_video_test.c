@@ -0,0 +1,414 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifndef HAVE_LIBCHECK
+#   include <assert.h>
+
+#   define ck_assert(X) assert(X);
+#   define ck_assert_msg(X, ...) assert(X);
+#   define START_TEST(NAME) void NAME ()
+#   define END_TEST
+#else
+#   include "helpers.h"
+#endif
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../toxav/rtp.h"
+#include "../toxav/video.h"
+
+#if defined(_WIN32) || defined(__WIN32__) || defined (WIN32)
+#define c_sleep(x) Sleep(1*x)
+#else
+#include <unistd.h>
+#define c_sleep(x) usleep(1000*x)
+#endif
+
+
+#define TEST_BIT_RATE 2500000
+
+/* Fill an I420 frame with a moving gradient so every frame differs. */
+static void fill_frame(uint8_t *y, uint8_t *u, uint8_t *v, int32_t ystride, int32_t ustride, int32_t vstride,
+                       uint16_t width, uint16_t height, uint32_t frame)
+{
+    uint16_t i, j;
+
+    for (i = 0; i < height; ++i)
+        for (j = 0; j < width; ++j)
+            y[i * ystride + j] = (uint8_t)(i + j + frame);
+
+    for (i = 0; i < height / 2; ++i)
+        for (j = 0; j < width / 2; ++j) {
+            u[i * ustride + j] = (uint8_t)(i + frame);
+            v[i * vstride + j] = (uint8_t)(j + frame);
+        }
+}
+
+static size_t drain_packets(VCSession *vc)
+{
+    vpx_codec_iter_t iter = NULL;
+    const vpx_codec_cx_pkt_t *pkt;
+    size_t size = 0;
+
+    while ((pkt = vpx_codec_get_cx_data(vc->encoder, &iter)))
+        if (pkt->kind == VPX_CODEC_CX_FRAME_PKT)
+            size += pkt->data.frame.sz;
+
+    return size;
+}
+
+START_TEST(test_frame_buffer)
+{
+    VCSession *vc = vc_new(NULL, 0, NULL, NULL);
+    ck_assert_msg(vc != NULL, "Failed to create video session");
+
+    ck_assert_msg(vc_frame_buffer(vc, 0, 480) == NULL, "Got a buffer for an empty frame");
+
+    vpx_image_t *img = vc_frame_buffer(vc, 640, 480);
+    ck_assert_msg(img != NULL, "Failed to get frame buffer");
+    ck_assert_msg(img->d_w == 640 && img->d_h == 480, "Bad frame buffer size");
+    ck_assert_msg(img->stride[VPX_PLANE_Y] >= 640 && img->stride[VPX_PLANE_U] >= 320, "Bad strides");
+
+    uint8_t *y = img->planes[VPX_PLANE_Y];
+    ck_assert_msg(vc_frame_buffer(vc, 640, 480) == img && img->planes[VPX_PLANE_Y] == y,
+                  "Frame buffer not reused");
+
+    img = vc_frame_buffer(vc, 1280, 720);
+    ck_assert_msg(img != NULL && img->d_w == 1280 && img->d_h == 720, "Frame buffer not resized");
+
+    fill_frame(img->planes[VPX_PLANE_Y], img->planes[VPX_PLANE_U], img->planes[VPX_PLANE_V],
+               img->stride[VPX_PLANE_Y], img->stride[VPX_PLANE_U], img->stride[VPX_PLANE_V], 1280, 720, 0);
+    ck_assert_msg(vc_reconfigure_encoder(vc, TEST_BIT_RATE, 1280, 720) == 0, "Failed to configure encoder");
+    ck_assert_msg(vc_encode_frame(vc, img) == 0, "Encode from frame buffer failed");
+    ck_assert_msg(drain_packets(vc) > 0, "No packet produced");
+
+    vc_kill(vc);
+}
+END_TEST
+
+/* Send sink for the encoder thread: holds the first frame until released, then decodes
+ * every frame to find out which ones made it through.
+ */
+typedef struct {
+    pthread_mutex_t mutex[1];
+    pthread_cond_t cond[1];
+    vpx_codec_ctx_t decoder[1];
+    int entered;
+    int released;
+    int sent;
+    uint16_t heights[16];
+} Overload_Sink;
+
+static int overload_send(void *object, const uint8_t *data, uint16_t length)
+{
+    Overload_Sink *sink = object;
+
+    pthread_mutex_lock(sink->mutex);
+    sink->entered = 1;
+    pthread_cond_broadcast(sink->cond);
+
+    while (!sink->released)
+        pthread_cond_wait(sink->cond, sink->mutex);
+
+    ck_assert_msg(vpx_codec_decode(sink->decoder, data, length, NULL, 0) == VPX_CODEC_OK, "Decode failed");
+
+    vpx_codec_iter_t iter = NULL;
+    vpx_image_t *img = vpx_codec_get_frame(sink->decoder, &iter);
+    ck_assert_msg(img != NULL && sink->sent < 16, "No frame decoded");
+    sink->heights[sink->sent++] = img->d_h;
+    pthread_cond_broadcast(sink->cond);
+    pthread_mutex_unlock(sink->mutex);
+    return 0;
+}
+
+START_TEST(test_encode_queue_overload)
+{
+    VCSession *vc = vc_new(NULL, 0, NULL, NULL);
+    ck_assert_msg(vc != NULL, "Failed to create video session");
+    ck_assert_msg(vc_set_encoder(vc, 7) == -1, "Accepted an invalid codec");
+
+    Overload_Sink sink;
+    memset(&sink, 0, sizeof(sink));
+    pthread_mutex_init(sink.mutex, NULL);
+    pthread_cond_init(sink.cond, NULL);
+    ck_assert_msg(vpx_codec_dec_init(sink.decoder, VIDEO_CODEC_DECODER_INTERFACE, NULL, 0) == VPX_CODEC_OK,
+                  "Failed to create decoder");
+
+    ck_assert_msg(vc_start_encoder_thread(vc, overload_send, &sink) == 0, "Failed to start encoder thread");
+
+    /* Every frame gets its own height, so each one is a key frame we can identify. */
+    uint16_t width = 64, height = 32;
+    uint32_t plane_size = width * (height + 2 * 8);
+    uint8_t *y = calloc(plane_size, 1), *u = calloc(plane_size, 1), *v = calloc(plane_size, 1);
+    ck_assert_msg(y && u && v, "Allocation failed");
+
+    ck_assert_msg(vc_queue_frame(vc, TEST_BIT_RATE, width, height, y, u, v, width, width / 2, width / 2) == 0,
+                  "Failed to queue frame");
+
+    pthread_mutex_lock(sink.mutex);
+
+    while (!sink.entered)
+        pthread_cond_wait(sink.cond, sink.mutex);
+
+    pthread_mutex_unlock(sink.mutex);
+
+    /* The encoder is stuck sending the first frame, only the newest frames may survive. */
+    int i, queued = 6;
+
+    for (i = 1; i < queued; ++i)
+        ck_assert_msg(vc_queue_frame(vc, TEST_BIT_RATE, width, height + 2 * i, y, u, v,
+                                     width, width / 2, width / 2) == 0, "Failed to queue frame");
+
+    ck_assert_msg(vc->frames_dropped == queued - 1 - VC_ENCODE_QUEUE_SIZE, "Dropped %u frames",
+                  vc->frames_dropped);
+
+    pthread_mutex_lock(sink.mutex);
+    sink.released = 1;
+    pthread_cond_broadcast(sink.cond);
+
+    while (sink.sent < 1 + VC_ENCODE_QUEUE_SIZE)
+        pthread_cond_wait(sink.cond, sink.mutex);
+
+    pthread_mutex_unlock(sink.mutex);
+    vc_stop_encoder_thread(vc);
+
+    ck_assert_msg(sink.sent == 1 + VC_ENCODE_QUEUE_SIZE, "Sent %d frames", sink.sent);
+    ck_assert_msg(sink.heights[0] == height, "First frame lost");
+
+    for (i = 1; i < sink.sent; ++i)
+        ck_assert_msg(sink.heights[i] == height + 2 * (queued - 1 - VC_ENCODE_QUEUE_SIZE + i),
+                      "Frame %d has height %u", i, sink.heights[i]);
+
+    /* Synchronous encoding works again once the thread is gone. */
+    ck_assert_msg(vc_queue_frame(vc, TEST_BIT_RATE, width, height, y, u, v, width, width / 2, width / 2) == -1,
+                  "Queued a frame without encoder thread");
+    ck_assert_msg(vc_set_encoder(vc, TOXAV_VIDEO_CODEC_VP9) == 0, "Failed to switch to VP9");
+    ck_assert_msg(vc_reconfigure_encoder(vc, TEST_BIT_RATE, width, height) == 0, "Failed to configure encoder");
+
+    vpx_image_t *img = vc_frame_buffer(vc, width, height);
+    ck_assert_msg(img != NULL && vc_encode_frame(vc, img) == 0, "VP9 encode failed");
+    ck_assert_msg(drain_packets(vc) > 0, "No packet produced");
+
+    free(y);
+    free(u);
+    free(v);
+    vpx_codec_destroy(sink.decoder);
+    pthread_cond_destroy(sink.cond);
+    pthread_mutex_destroy(sink.mutex);
+    vc_kill(vc);
+}
+END_TEST
+
+START_TEST(test_queue_odd_frame)
+{
+    VCSession *vc = vc_new(NULL, 0, NULL, NULL);
+    ck_assert_msg(vc != NULL, "Failed to create video session");
+
+    Overload_Sink sink;
+    memset(&sink, 0, sizeof(sink));
+    pthread_mutex_init(sink.mutex, NULL);
+    pthread_cond_init(sink.cond, NULL);
+    ck_assert_msg(vpx_codec_dec_init(sink.decoder, VIDEO_CODEC_DECODER_INTERFACE, NULL, 0) == VPX_CODEC_OK,
+                  "Failed to create decoder");
+    ck_assert_msg(vc_start_encoder_thread(vc, overload_send, &sink) == 0, "Failed to start encoder thread");
+
+    /* Odd sizes round the chroma planes up, the last column and row are real pixels. */
+    uint16_t width = 33, height = 17, cwidth = (width + 1) / 2, cheight = (height + 1) / 2;
+    uint8_t *y = calloc(width * height, 1), *u = malloc(cwidth * cheight), *v = malloc(cwidth * cheight);
+    ck_assert_msg(y && u && v, "Allocation failed");
+    memset(u, 0xAA, cwidth * cheight);
+    memset(v, 0x55, cwidth * cheight);
+
+    ck_assert_msg(vc_queue_frame(vc, TEST_BIT_RATE, width, height, y, u, v, width, cwidth, cwidth) == 0,
+                  "Failed to queue frame");
+
+    pthread_mutex_lock(sink.mutex);
+
+    while (!sink.entered)
+        pthread_cond_wait(sink.cond, sink.mutex);
+
+    pthread_mutex_unlock(sink.mutex);
+
+    /* With the encoder stuck on the first frame the second one stays queued for us to look at. */
+    ck_assert_msg(vc_queue_frame(vc, TEST_BIT_RATE, width, height, y, u, v, width, cwidth, cwidth) == 0,
+                  "Failed to queue frame");
+    const vpx_image_t *img = vc->enc_slots[vc->enc_queue[vc->enc_queue_start]].img;
+    const uint8_t *last_u = img->planes[VPX_PLANE_U] + (cheight - 1) * img->stride[VPX_PLANE_U] + cwidth - 1;
+    const uint8_t *last_v = img->planes[VPX_PLANE_V] + (cheight - 1) * img->stride[VPX_PLANE_V] + cwidth - 1;
+    ck_assert_msg(*last_u == 0xAA && *last_v == 0x55, "Last chroma pixel not copied");
+
+    pthread_mutex_lock(sink.mutex);
+    sink.released = 1;
+    pthread_cond_broadcast(sink.cond);
+
+    while (sink.sent < 2)
+        pthread_cond_wait(sink.cond, sink.mutex);
+
+    pthread_mutex_unlock(sink.mutex);
+    vc_stop_encoder_thread(vc);
+
+    free(y);
+    free(u);
+    free(v);
+    vpx_codec_destroy(sink.decoder);
+    pthread_cond_destroy(sink.cond);
+    pthread_mutex_destroy(sink.mutex);
+    vc_kill(vc);
+}
+END_TEST
+
+typedef struct {
+    pthread_t thread;
+    int received;
+    int wrong_thread;
+    uint16_t heights[16];
+} Receiver;
+
+static void receive_frame(ToxAV *av, uint32_t friend_number, uint16_t width, uint16_t height,
+                          const uint8_t *y, const uint8_t *u, const uint8_t *v,
+                          int32_t ystride, int32_t ustride, int32_t vstride, void *user_data)
+{
+    Receiver *r = user_data;
+
+    if (!pthread_equal(r->thread, pthread_self()))
+        r->wrong_thread = 1;
+
+    if (r->received < 16)
+        r->heights[r->received] = height;
+
+    ++r->received;
+}
+
+/* Encode a width x height frame with enc and queue it on dec like rtp would. */
+static void pass_frame(VCSession *enc, VCSession *dec, uint16_t width, uint16_t height)
+{
+    ck_assert_msg(vc_reconfigure_encoder(enc, TEST_BIT_RATE, width, height) == 0, "Failed to configure encoder");
+
+    vpx_image_t *img = vc_frame_buffer(enc, width, height);
+    ck_assert_msg(img != NULL, "Failed to get frame buffer");
+    fill_frame(img->planes[VPX_PLANE_Y], img->planes[VPX_PLANE_U], img->planes[VPX_PLANE_V],
+               img->stride[VPX_PLANE_Y], img->stride[VPX_PLANE_U], img->stride[VPX_PLANE_V], width, height, height);
+    ck_assert_msg(vc_encode_frame(enc, img) == 0, "Encode failed");
+
+    vpx_codec_iter_t iter = NULL;
+    const vpx_codec_cx_pkt_t *pkt;
+
+    while ((pkt = vpx_codec_get_cx_data(enc->encoder, &iter))) {
+        if (pkt->kind != VPX_CODEC_CX_FRAME_PKT)
+            continue;
+
+        struct RTPMessage *msg = rtp_new_message(pkt->data.frame.sz);
+        ck_assert_msg(msg != NULL, "Allocation failed");
+        msg->len = pkt->data.frame.sz;
+        msg->header.pt = rtp_TypeVideo % 128;
+        memcpy(msg->data, pkt->data.frame.buf, pkt->data.frame.sz);
+        ck_assert_msg(vc_queue_message(dec, msg) == 0, "Failed to queue message");
+    }
+}
+
+/* Wait for the decoder thread to have count frames ready or dropped. */
+static void wait_decoded(VCSession *vc, uint32_t count)
+{
+    int tries;
+
+    for (tries = 0; tries < 1000; ++tries) {
+        pthread_mutex_lock(vc->dec_mutex);
+        uint32_t done = vc->dec_ready_count + vc->decoded_dropped;
+        pthread_mutex_unlock(vc->dec_mutex);
+
+        if (done >= count)
+            return;
+
+        c_sleep(5);
+    }
+
+    ck_assert_msg(0, "Decoder thread did not catch up");
+}
+
+START_TEST(test_decode_thread)
+{
+    Receiver r;
+    memset(&r, 0, sizeof(r));
+    r.thread = pthread_self();
+
+    VCSession *enc = vc_new(NULL, 0, NULL, NULL);
+    VCSession *dec = vc_new(NULL, 0, receive_frame, &r);
+    ck_assert_msg(enc != NULL && dec != NULL, "Failed to create video sessions");
+
+    /* Frames arrive and are delivered one by one. */
+    uint16_t width = 64, height = 32;
+    pass_frame(enc, dec, width, height);
+    wait_decoded(dec, 1);
+    vc_iterate(dec);
+    ck_assert_msg(r.received == 1 && r.heights[0] == height, "Frame not delivered");
+
+    /* With iterate falling behind, the pool keeps the newest frames. */
+    uint32_t i, sent = VC_DECODE_POOL_SIZE + 3;
+
+    for (i = 0; i < sent; ++i) {
+        pass_frame(enc, dec, width, height + 2 * (i + 1));
+        wait_decoded(dec, i + 1);
+    }
+
+    ck_assert_msg(dec->decoded_dropped == sent - VC_DECODE_POOL_SIZE, "Dropped %u frames", dec->decoded_dropped);
+
+    vc_iterate(dec);
+    ck_assert_msg(r.received == 1 + VC_DECODE_POOL_SIZE, "Delivered %d frames", r.received);
+    ck_assert_msg(!r.wrong_thread, "Frame delivered outside of vc_iterate");
+
+    for (i = 1; i < (uint32_t)r.received; ++i)
+        ck_assert_msg(r.heights[i] == height + 2 * (sent - VC_DECODE_POOL_SIZE + i),
+                      "Frame %u has height %u", i, r.heights[i]);
+
+    vc_kill(enc);
+    vc_kill(dec);
+}
+END_TEST
+
+
+#ifndef HAVE_LIBCHECK
+int main(int argc, char *argv[])
+{
+    (void) argc;
+    (void) argv;
+
+    test_frame_buffer();
+    test_encode_queue_overload();
+    test_queue_odd_frame();
+    test_decode_thread();
+    return 0;
+}
+#else
+Suite *toxav_video_suite(void)
+{
+    Suite *s = suite_create("ToxAV video");
+
+    DEFTESTCASE(frame_buffer);
+    DEFTESTCASE(encode_queue_overload);
+    DEFTESTCASE(queue_odd_frame);
+    DEFTESTCASE(decode_thread);
+    return s;
+}
+int main(int argc, char *argv[])
+{
+    (void) argc;
+    (void) argv;
+
+    Suite *video = toxav_video_suite();
+    SRunner *test_runner = srunner_create(video);
+
+    setbuf(stdout, NULL);
+
+    srunner_run_all(test_runner, CK_NORMAL);
+    int number_failed = srunner_ntests_failed(test_runner);
+
+    srunner_free(test_runner);
+
+    return number_failed;
+}
+#endif
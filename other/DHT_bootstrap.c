@@ -121,7 +121,7 @@ int main(int argc, char *argv[])
 
     DHT *dht = new_DHT(new_networking(ip, PORT));
     Onion *onion = new_onion(dht);
-    Onion_Announce *onion_a = new_onion_announce(dht);
+    Onion_Announce *onion_a = new_onion_announce_ex(dht, ONION_ANNOUNCE_BOOTSTRAP_MAX_ENTRIES);
 
 #ifdef DHT_NODE_EXTRA_PACKETS
     bootstrap_set_callbacks(dht->net, DHT_VERSION_NUMBER, DHT_MOTD, sizeof(DHT_MOTD));
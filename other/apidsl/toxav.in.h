@@ -68,7 +68,8 @@ extern "C" {
  *
  * Tox thread has priority with mutex mechanisms. Any api function can
  * fail if mutexes are held by tox thread in which case they will set SYNC
- * error code.
+ * error code. The exception is audio sending, which never waits for or fails
+ * on a mutex, so it can be done from an audio thread.
  */
 
 /**
@@ -468,13 +469,15 @@ namespace bit_rate {
     event status {
         /**
          * The function type for the ${event status} callback. The event is triggered
-         * when the network becomes too saturated for current bit rates at which 
-         * point core suggests new bit rates.
+         * when the bandwidth estimate of the network path to the friend changes the
+         * bit rates the encoders run at. Core lowers them below the ones set with
+         * ${set} on its own and raises them back as the path allows; setting these
+         * as the new bit rates would keep them from recovering.
          * 
          * @param friend_number The friend number of the friend for which to set the
          * bit rate.
-         * @param audio_bit_rate Suggested maximum audio bit rate in Kb/sec.
-         * @param video_bit_rate Suggested maximum video bit rate in Kb/sec.
+         * @param audio_bit_rate Audio bit rate now in use in Kb/sec.
+         * @param video_bit_rate Video bit rate now in use in Kb/sec.
          */
         typedef void(uint32_t friend_number, uint32_t audio_bit_rate, uint32_t video_bit_rate);
     }
@@ -536,12 +539,31 @@ namespace audio {
    * 2.5, 5, 10, 20, 40 or 60 millseconds.
    * @param channels Number of audio channels. Supported values are 1 and 2.
    * @param sampling_rate Audio sampling rate used in this frame. Valid sampling
-   * rates are 8000, 12000, 16000, 24000, or 48000.
+   * rates are 8000, 12000, 16000, 24000, or 48000. Other rates from 8000 to
+   * 96000, such as 44100, are resampled to 48000 before encoding.
+   *
+   * The frame is encoded on the calling thread and sent from a ToxAV thread,
+   * neither of which ever blocks the other. Frames to one friend must come
+   * from one thread at a time; a concurrent call gives SYNC. If frames are sent
+   * faster than the network thread keeps up with, they are dropped and
+   * RTP_FAILED is set.
    */
   bool send_frame(uint32_t friend_number, const int16_t *pcm, size_t sample_count, 
                   uint8_t channels, uint32_t sampling_rate) with error for send_frame;
 }
 namespace video {
+  enum class CODEC {
+    /**
+     * VP8, understood by every ToxAV client. This is the default.
+     */
+    VP8,
+    /**
+     * VP9, better quality per bit at a higher CPU cost. Only send it to peers
+     * known to decode VP9; ToxAV receivers switch decoders on the first VP9
+     * key frame.
+     */
+    VP9,
+  }
   /**
    * Send a video frame to a friend.
    *
@@ -559,6 +581,85 @@ namespace video {
    */
   bool send_frame(uint32_t friend_number, uint16_t width, uint16_t height,
                   const uint8_t *y, const uint8_t *u, const uint8_t *v) with error for send_frame;
+  /**
+   * Send a video frame to a friend, encoding straight from the given planes.
+   *
+   * The planes are not copied: they are only read while this function runs
+   * and may be reused as soon as it returns. Strides are in bytes and may be
+   * negative for bottom-up images, in which case each plane pointer must still
+   * address the first displayed row, with the following rows at lower addresses.
+   *
+   * Y - plane should be of size: height * abs(ystride)
+   * U - plane should be of size: ((height+1)/2) * abs(ustride)
+   * V - plane should be of size: ((height+1)/2) * abs(vstride)
+   *
+   * @param friend_number The friend number of the friend to which to send a video
+   * frame.
+   * @param width Width of the frame in pixels.
+   * @param height Height of the frame in pixels.
+   * @param y Y (Luminance) plane data.
+   * @param u U (Chroma) plane data.
+   * @param v V (Chroma) plane data.
+   * @param ystride Y plane stride, at least width.
+   * @param ustride U plane stride, at least (width+1)/2.
+   * @param vstride V plane stride, at least (width+1)/2.
+   */
+  bool send_frame_stride(uint32_t friend_number, uint16_t width, uint16_t height,
+                         const uint8_t *y, const uint8_t *u, const uint8_t *v,
+                         int32_t ystride, int32_t ustride, int32_t vstride) with error for send_frame;
+  /**
+   * Get a frame buffer owned by the encoder of the call with a friend.
+   *
+   * For callers whose frames don't outlive their capture callback: render or
+   * convert the frame into these planes and pass them to ${send_frame_stride}
+   * with the returned strides. The buffer is reused for every frame of the
+   * same size and stays valid until the size changes or the call ends.
+   *
+   * @param friend_number The friend number of the friend in the call.
+   * @param width Width of the frame in pixels.
+   * @param height Height of the frame in pixels.
+   * @param y Receives the Y (Luminance) plane.
+   * @param u Receives the U (Chroma) plane.
+   * @param v Receives the V (Chroma) plane.
+   * @param ystride Receives the Y plane stride.
+   * @param ustride Receives the U plane stride.
+   * @param vstride Receives the V plane stride.
+   */
+  bool get_frame_buffer(uint32_t friend_number, uint16_t width, uint16_t height,
+                        uint8_t **y, uint8_t **u, uint8_t **v,
+                        int32_t *ystride, int32_t *ustride, int32_t *vstride) with error for send_frame;
+  /**
+   * Choose the video codec and encoding mode of the call with a friend.
+   *
+   * The encoder always uses as many threads as the frame width and the number
+   * of cores allow. In asynchronous mode frames are additionally encoded on a
+   * thread of their own: ${send_frame} and ${send_frame_stride} only copy the
+   * frame into a short queue and return. When the encoder falls behind, the
+   * oldest queued frame is dropped so latency stays bounded.
+   *
+   * @param friend_number The friend number of the friend in the call.
+   * @param codec The video codec to encode with.
+   * @param async Whether to encode on a separate thread.
+   */
+  bool set_encoder(uint32_t friend_number, CODEC codec, bool async) {
+    /**
+     * The friend_number passed did not designate a valid friend.
+     */
+    FRIEND_NOT_FOUND,
+    /**
+     * This client is currently not in a call with the friend.
+     */
+    FRIEND_NOT_IN_CALL,
+    /**
+     * Synchronization error occurred.
+     */
+    SYNC,
+    /**
+     * The codec was not valid, or the encoder or its thread could not be
+     * started.
+     */
+    INVALID,
+  }
 }
 /*******************************************************************************
  * 
@@ -615,6 +716,152 @@ namespace video {
 }
 
 %{
+/*******************************************************************************
+ *
+ * :: Call statistics
+ *
+ ******************************************************************************/
+
+
+
+/**
+ * Audio or video going one way in a call. Counts are since the call started.
+ */
+typedef struct ToxAV_Stream_Stats {
+
+    /**
+     * RTP packets. A frame too large for one packet is sent in several.
+     */
+    uint64_t packets;
+
+    /**
+     * Bytes in those packets, RTP headers included.
+     */
+    uint64_t bytes;
+
+    /**
+     * Frames encoded for sending, or decoded after receiving.
+     */
+    uint32_t frames;
+
+    /**
+     * Frames that never arrived complete. Only counted when receiving.
+     */
+    uint32_t frames_lost;
+
+    /**
+     * Frames dropped because the next step did not keep up: the network when
+     * sending audio, the encoder when sending video, playout when receiving
+     * audio that came too late, and the application when receiving video.
+     */
+    uint32_t frames_dropped;
+
+    /**
+     * Recent average time to encode or decode a frame, in microseconds.
+     */
+    uint32_t codec_time;
+
+} ToxAV_Stream_Stats;
+
+
+/**
+ * Statistics of a call, see toxav_call_get_stats. Bit rates are in bit/s.
+ */
+typedef struct ToxAV_Call_Stats {
+
+    ToxAV_Stream_Stats audio_sent;
+    ToxAV_Stream_Stats audio_received;
+    ToxAV_Stream_Stats video_sent;
+    ToxAV_Stream_Stats video_received;
+
+    /**
+     * Bit rates audio and video are encoded at: what was set, lowered to what
+     * the network allows.
+     */
+    uint32_t audio_bit_rate;
+    uint32_t video_bit_rate;
+
+    /**
+     * What the network is estimated to allow sending at, 0 while not known.
+     */
+    uint32_t send_bit_rate_limit;
+
+    /**
+     * Loss of what was sent, as last reported by the friend, per mille.
+     */
+    uint32_t send_loss;
+
+    /**
+     * Audio and video are received at together.
+     */
+    uint32_t receive_bit_rate;
+
+    /**
+     * What the friend was last told the network allows it to send at, 0 while
+     * not known.
+     */
+    uint32_t receive_bit_rate_limit;
+
+    /**
+     * Interarrival jitter of received audio, in milliseconds.
+     */
+    uint32_t audio_jitter;
+
+    /**
+     * How long received audio waits to be played, in milliseconds.
+     */
+    uint32_t audio_delay;
+
+    /**
+     * Shortest round trip time measured to the friend, in milliseconds. 0 if
+     * not known yet.
+     */
+    uint32_t rtt;
+
+} ToxAV_Call_Stats;
+
+
+typedef enum TOXAV_ERR_CALL_GET_STATS {
+
+    /**
+     * The function returned successfully.
+     */
+    TOXAV_ERR_CALL_GET_STATS_OK,
+
+    /**
+     * The stats pointer was NULL.
+     */
+    TOXAV_ERR_CALL_GET_STATS_NULL,
+
+    /**
+     * The friend_number passed did not designate a valid friend.
+     */
+    TOXAV_ERR_CALL_GET_STATS_FRIEND_NOT_FOUND,
+
+    /**
+     * This client is currently not in a call with the friend.
+     */
+    TOXAV_ERR_CALL_GET_STATS_FRIEND_NOT_IN_CALL,
+
+} TOXAV_ERR_CALL_GET_STATS;
+
+
+/**
+ * Get statistics of the call with a friend, to monitor its quality.
+ *
+ * The counters behind them are updated without locks by the threads sending,
+ * receiving and coding media, so this costs a call nothing and may be done as
+ * often as wanted.
+ *
+ * @param friend_number The friend number of the friend this client is in a call
+ * with.
+ * @param stats Where to write the statistics.
+ *
+ * @return true on success.
+ */
+bool toxav_call_get_stats(ToxAV *toxAV, uint32_t friend_number, ToxAV_Call_Stats *stats,
+                          TOXAV_ERR_CALL_GET_STATS *error);
+
 /**
  * NOTE Compatibility with old toxav group calls TODO remove
  */
@@ -653,13 +900,40 @@ int toxav_join_av_groupchat(Tox *tox, int32_t friendnumber, const uint8_t *data,
  *
  * Valid number of samples are ((sample rate) * (audio length (Valid ones are: 2.5, 5, 10, 20, 40 or 60 ms)) / 1000)
  * Valid number of channels are 1 or 2.
- * Valid sample rates are 8000, 12000, 16000, 24000, or 48000.
+ * Valid sample rates are 8000, 12000, 16000, 24000, or 48000. Other rates from 8000 to 96000
+ * are resampled to 48000.
  *
  * Recommended values are: samples = 960, channels = 1, sample_rate = 48000
  */
 int toxav_group_send_audio(Tox *tox, int groupnumber, const int16_t *pcm, unsigned int samples, uint8_t channels,
                            unsigned int sample_rate);
 
+/* Turn the audio mixer of an A/V group chat on (channels 1 or 2) or off (channels 0).
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ *
+ * With the mixer on, the audio of all peers is decoded and mixed with ours into one
+ * 48kHz stream of 20ms frames with the given number of channels, which is sent to the
+ * group in place of the individual streams, which are no longer relayed: peers that reach
+ * the group through us get a single stream however many are talking. This is meant for
+ * well connected nodes acting as a conference server.
+ *
+ * Nobody hears themselves in the mix. The audio callback is given the mix of the peers
+ * without our own audio, with peernumber -1. Each peer that is talking is also sent the
+ * mix without their audio over our direct connection to them, which their client plays
+ * in place of the full mix. Listeners only ever get the full mix from us. A talker we
+ * have no direct connection to gets no such mix and hears themselves.
+ *
+ * Peers that don't mix still relay the streams of others as before. A listener who
+ * reaches a talker through such peers gets that talker twice, on their own and in the
+ * mix, so the mixer is only of use when every path between peers goes through it.
+ *
+ * While it is on, audio sent with toxav_group_send_audio() is mixed in rather than
+ * sent on its own, and may be of any length.
+ */
+int toxav_group_set_audio_mixer(Tox *tox, int groupnumber, uint8_t channels);
+
 #ifdef __cplusplus
 }
 #endif
@@ -251,7 +251,7 @@ int main(int argc, char *argv[])
     }
 
     Onion *onion = new_onion(dht);
-    Onion_Announce *onion_a = new_onion_announce(dht);
+    Onion_Announce *onion_a = new_onion_announce_ex(dht, ONION_ANNOUNCE_BOOTSTRAP_MAX_ENTRIES);
 
     if (!(onion && onion_a)) {
         write_log(LOG_LEVEL_ERROR, "Couldn't initialize Tox Onion. Exiting.\n");
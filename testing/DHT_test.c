@@ -84,16 +84,17 @@ void print_hardening(Hardening *h)
 void print_assoc(IPPTsPng *assoc, uint8_t ours)
 {
     IP_Port *ipp = &assoc->ip_port;
-    printf("\nIP: %s Port: %u", ip_ntoa(&ipp->ip), ntohs(ipp->port));
+    char ip_str[IP_NTOA_LEN];
+    printf("\nIP: %s Port: %u", ip_ntoa(&ipp->ip, ip_str, sizeof(ip_str)), ntohs(ipp->port));
     printf("\nTimestamp: %llu", (long long unsigned int) assoc->timestamp);
     printf("\nLast pinged: %llu\n", (long long unsigned int) assoc->last_pinged);
 
     ipp = &assoc->ret_ip_port;
 
     if (ours)
-        printf("OUR IP: %s Port: %u\n", ip_ntoa(&ipp->ip), ntohs(ipp->port));
+        printf("OUR IP: %s Port: %u\n", ip_ntoa(&ipp->ip, ip_str, sizeof(ip_str)), ntohs(ipp->port));
     else
-        printf("RET IP: %s Port: %u\n", ip_ntoa(&ipp->ip), ntohs(ipp->port));
+        printf("RET IP: %s Port: %u\n", ip_ntoa(&ipp->ip, ip_str, sizeof(ip_str)), ntohs(ipp->port));
 
     printf("Timestamp: %llu\n", (long long unsigned int) assoc->ret_timestamp);
     print_hardening(&assoc->hardening);
@@ -123,6 +124,7 @@ void print_friendlist(DHT *dht)
 {
     uint32_t i, k;
     IP_Port p_ip;
+    char ip_str[IP_NTOA_LEN];
     printf("_________________FRIENDS__________________________________\n");
 
     for (k = 0; k < dht->num_friends; k++) {
@@ -132,7 +134,7 @@ void print_friendlist(DHT *dht)
         print_client_id(dht->friends_list[k].public_key);
 
         int friendok = DHT_getfriendip(dht, dht->friends_list[k].public_key, &p_ip);
-        printf("\nIP: %s:%u (%d)", ip_ntoa(&p_ip.ip), ntohs(p_ip.port), friendok);
+        printf("\nIP: %s:%u (%d)", ip_ntoa(&p_ip.ip, ip_str, sizeof(ip_str)), ntohs(p_ip.port), friendok);
 
         printf("\nCLIENTS IN LIST:\n\n");
 
@@ -0,0 +1,251 @@
+/* Toxcore benchmarks
+ *
+ * Times the hot paths that have had performance work: batched symmetric
+ * encryption, the ping array, building onion packets and relaying them.
+ * The numbers depend on the machine so they are printed here instead of
+ * being checked in the auto tests.
+ *
+ *  Copyright (C) 2013 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../toxcore/onion.h"
+#include "../toxcore/ping_array.h"
+#include "../toxcore/util.h"
+
+#if defined(_WIN32) || defined(__WIN32__) || defined (WIN32)
+#define c_sleep(x) Sleep(1*x)
+#else
+#include <unistd.h>
+#define c_sleep(x) usleep(1000*x)
+#endif
+
+#define BATCH_NUM 32
+#define THROUGHPUT_PACKETS (1 << 16)
+#define THROUGHPUT_PACKET_SIZE 1024
+
+static void bench_symmetric(void)
+{
+    static uint8_t m[BATCH_NUM][THROUGHPUT_PACKET_SIZE];
+    static uint8_t c[BATCH_NUM][THROUGHPUT_PACKET_SIZE + crypto_box_MACBYTES];
+    uint8_t k[crypto_box_KEYBYTES];
+    uint8_t n[crypto_box_NONCEBYTES];
+    Crypto_Batch_Entry entries[BATCH_NUM];
+    uint32_t i;
+
+    new_symmetric_key(k);
+    random_nonce(n);
+
+    for (i = 0; i < BATCH_NUM; ++i) {
+        randombytes(m[i], sizeof(m[i]));
+        entries[i].shared_key = k;
+        entries[i].nonce = n;
+        entries[i].in = m[i];
+        entries[i].length = THROUGHPUT_PACKET_SIZE;
+        entries[i].out = c[i];
+    }
+
+    uint64_t start = current_time_monotonic();
+
+    for (i = 0; i < THROUGHPUT_PACKETS; ++i)
+        encrypt_data_symmetric(k, n, m[i % BATCH_NUM], THROUGHPUT_PACKET_SIZE, c[i % BATCH_NUM]);
+
+    uint64_t single_time = current_time_monotonic() - start;
+    start = current_time_monotonic();
+
+    for (i = 0; i < THROUGHPUT_PACKETS; i += BATCH_NUM)
+        encrypt_data_symmetric_batch(entries, BATCH_NUM);
+
+    uint64_t batch_time = current_time_monotonic() - start;
+
+    printf("Encrypted %u packets of %u bytes: single %llu ms, batch %llu ms\n", THROUGHPUT_PACKETS,
+           THROUGHPUT_PACKET_SIZE, (unsigned long long)single_time, (unsigned long long)batch_time);
+}
+
+#define PING_ARRAY_SIZE 512
+#define PING_ARRAY_OPS (1 << 20)
+
+static void bench_ping_array(void)
+{
+    static uint64_t ids[PING_ARRAY_SIZE];
+    Ping_Array array;
+    uint8_t data[sizeof(Node_format) * 2], out[sizeof(data)];
+    uint32_t i;
+
+    if (ping_array_init(&array, PING_ARRAY_SIZE, 5) != 0) {
+        printf("Failed to init ping array\n");
+        exit(1);
+    }
+
+    randombytes(data, sizeof(data));
+    uint64_t start = current_time_monotonic();
+
+    for (i = 0; i < PING_ARRAY_OPS; ++i)
+        ids[i % PING_ARRAY_SIZE] = ping_array_add(&array, data, sizeof(data));
+
+    uint64_t add_time = current_time_monotonic() - start;
+    start = current_time_monotonic();
+
+    for (i = 0; i < PING_ARRAY_OPS; ++i) {
+        uint64_t id = ids[i % PING_ARRAY_SIZE];
+
+        if (ping_array_check(out, sizeof(out), &array, id) == sizeof(data))
+            ids[i % PING_ARRAY_SIZE] = ping_array_add(&array, data, sizeof(data));
+    }
+
+    uint64_t check_time = current_time_monotonic() - start;
+    printf("Ping array: %u adds in %llu ms, %u checks with re-add in %llu ms\n", PING_ARRAY_OPS,
+           (unsigned long long)add_time, PING_ARRAY_OPS, (unsigned long long)check_time);
+
+    ping_array_free_all(&array);
+}
+
+#define ONION_PACKETS 20000
+#define RELAY_DATA_ID 200
+
+static uint8_t relay_captured[256][ONION_MAX_PACKET_SIZE];
+static uint16_t relay_captured_length[256];
+static int relay_capture(void *object, IP_Port source, const uint8_t *packet, uint16_t length)
+{
+    memcpy(relay_captured[packet[0]], packet, length);
+    relay_captured_length[packet[0]] = length;
+    return 0;
+}
+
+/* Hand packet to the relay and return the length of what it forwarded to the sink, 0 on failure. */
+static uint16_t relay_step(Onion *relay, Networking_Core *sink, IP_Port source, const uint8_t *packet,
+                           uint16_t length, uint8_t expected_id, uint8_t *out)
+{
+    Packet_Handles *handler = &relay->net->packethandlers[packet[0]];
+    relay_captured_length[expected_id] = 0;
+
+    if (handler->function(handler->object, source, packet, length) != 0)
+        return 0;
+
+    uint32_t i;
+
+    for (i = 0; i < 100 && relay_captured_length[expected_id] == 0; ++i) {
+        networking_poll(sink);
+        c_sleep(10);
+    }
+
+    memcpy(out, relay_captured[expected_id], relay_captured_length[expected_id]);
+    return relay_captured_length[expected_id];
+}
+
+/* Run the relay handler ONION_PACKETS times on packet, in packets per second. */
+static unsigned long long relay_rate(Onion *relay, IP_Port source, const uint8_t *packet, uint16_t length)
+{
+    Packet_Handles *handler = &relay->net->packethandlers[packet[0]];
+    uint64_t start = current_time_monotonic();
+    uint32_t i;
+
+    for (i = 0; i < ONION_PACKETS; ++i)
+        handler->function(handler->object, source, packet, length);
+
+    uint64_t time = current_time_monotonic() - start;
+    return (ONION_PACKETS * 1000ULL) / (time ? time : 1);
+}
+
+static void bench_onion(void)
+{
+    IP ip;
+    ip_init(&ip, 1);
+    ip.ip6.uint8[15] = 1;
+    Onion *relay = new_onion(new_DHT(new_networking(ip, 34590)));
+    Networking_Core *sink = new_networking(ip, 34591);
+
+    if (!relay || !sink) {
+        printf("Onion failed to initialize\n");
+        exit(1);
+    }
+
+    networking_registerhandler(sink, NET_PACKET_ONION_SEND_1, &relay_capture, 0);
+    networking_registerhandler(sink, NET_PACKET_ONION_SEND_2, &relay_capture, 0);
+
+    /* Every hop of the path is the relay, every hop forwards to the sink. */
+    Node_format nodes[3];
+    uint32_t i;
+
+    for (i = 0; i < 3; ++i) {
+        memcpy(nodes[i].public_key, relay->dht->self_public_key, crypto_box_PUBLICKEYBYTES);
+        nodes[i].ip_port.ip = ip;
+        nodes[i].ip_port.port = sink->port;
+    }
+
+    Onion_Path path;
+    uint8_t data[400];
+    uint8_t packet[ONION_MAX_PACKET_SIZE], send_1[ONION_MAX_PACKET_SIZE], send_2[ONION_MAX_PACKET_SIZE];
+
+    if (create_onion_path(relay->dht, &path, nodes) != 0) {
+        printf("Failed to create onion path\n");
+        exit(1);
+    }
+
+    randombytes(data, sizeof(data));
+    data[0] = RELAY_DATA_ID;
+    uint64_t start = current_time_monotonic();
+
+    for (i = 0; i < ONION_PACKETS; ++i)
+        create_onion_packet(packet, sizeof(packet), &path, nodes[2].ip_port, data, 256);
+
+    printf("Built %u onion packets of 256 bytes in %llu ms\n", ONION_PACKETS,
+           (unsigned long long)(current_time_monotonic() - start));
+
+    int len = create_onion_packet(packet, sizeof(packet), &path, nodes[2].ip_port, data, sizeof(data));
+    uint16_t len_1 = relay_step(relay, sink, nodes[0].ip_port, packet, len, NET_PACKET_ONION_SEND_1, send_1);
+    uint16_t len_2 = relay_step(relay, sink, nodes[0].ip_port, send_1, len_1, NET_PACKET_ONION_SEND_2, send_2);
+
+    if (len == -1 || len_1 == 0 || len_2 == 0) {
+        printf("Onion packet was not relayed\n");
+        exit(1);
+    }
+
+    unsigned long long rate_initial = relay_rate(relay, nodes[0].ip_port, packet, len);
+    unsigned long long rate_1 = relay_rate(relay, nodes[0].ip_port, send_1, len_1);
+    unsigned long long rate_2 = relay_rate(relay, nodes[0].ip_port, send_2, len_2);
+    printf("Relayed onion packets of %u bytes: %llu/s initial, %llu/s send_1, %llu/s send_2\n",
+           (unsigned int)sizeof(data), rate_initial, rate_1, rate_2);
+
+    Networking_Core *net = relay->net;
+    DHT *dht = relay->dht;
+    kill_onion(relay);
+    kill_DHT(dht);
+    kill_networking(net);
+    kill_networking(sink);
+}
+
+int main(int argc, char *argv[])
+{
+    (void) argc;
+    (void) argv;
+
+    bench_symmetric();
+    bench_ping_array();
+    bench_onion();
+    return 0;
+}
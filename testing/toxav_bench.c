@@ -0,0 +1,257 @@
+/* ToxAV benchmarks
+ *
+ * Times the audio dsp kernels against plain C loops, and sending video frames
+ * with the planes copied into a fresh image against wrapping the caller's
+ * planes. The numbers depend on the machine so they are printed here instead
+ * of being checked in the auto tests.
+ *
+ *  Copyright (C) 2013 Tox project All Rights Reserved.
+ *
+ *  This file is part of Tox.
+ *
+ *  Tox is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Tox is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../toxav/dsp.h"
+#include "../toxav/video.h"
+#include "../toxcore/network.h"
+
+#define FRAME_SAMPLES 960 /* 20ms at 48kHz */
+#define DSP_FRAMES 20000
+
+static int16_t ref_saturate(int32_t value)
+{
+    return value > INT16_MAX ? INT16_MAX : (value < INT16_MIN ? INT16_MIN : value);
+}
+
+static void random_pcm(int16_t *pcm, size_t count)
+{
+    size_t i;
+
+    for (i = 0; i < count; ++i)
+        pcm[i] = rand() % 65536 - 32768;
+}
+
+/* Plain loops the compiler is free to vectorise as it can. */
+static void ref_mix(int16_t *dst, const int16_t *src, size_t count)
+{
+    size_t i;
+
+    for (i = 0; i < count; ++i)
+        dst[i] = ref_saturate(dst[i] + src[i]);
+}
+
+static void ref_gain(int16_t *pcm, size_t count, float gain)
+{
+    int32_t g = gain * 4096;
+    size_t i;
+
+    for (i = 0; i < count; ++i)
+        pcm[i] = ref_saturate((pcm[i] * g + 2048) >> 12);
+}
+
+static void ref_mono_to_stereo(int16_t *dst, const int16_t *src, size_t samples)
+{
+    size_t i;
+
+    for (i = 0; i < samples; ++i)
+        dst[i * 2] = dst[i * 2 + 1] = src[i];
+}
+
+static void ref_stereo_to_mono(int16_t *dst, const int16_t *src, size_t samples)
+{
+    size_t i;
+
+    for (i = 0; i < samples; ++i)
+        dst[i] = (src[i * 2] + src[i * 2 + 1]) >> 1;
+}
+
+/* Time of CALL in ns per 20ms frame */
+#define BENCH(NS, CALL) do { \
+    uint64_t start_ = current_time_monotonic(); \
+    uint32_t f_; \
+    for (f_ = 0; f_ < DSP_FRAMES; ++f_) { CALL; } \
+    NS = (current_time_monotonic() - start_) * 1000000 / DSP_FRAMES; \
+} while (0)
+
+static void bench_dsp(void)
+{
+    static int16_t a[FRAME_SAMPLES * 2], b[FRAME_SAMPLES * 2], out[FRAME_SAMPLES * 4];
+    DSPResampler r;
+    uint32_t ns, plain;
+
+    random_pcm(a, FRAME_SAMPLES * 2);
+    random_pcm(b, FRAME_SAMPLES * 2);
+    dsp_resampler_init(&r, 44100, 48000, 2);
+
+    printf("dsp kernels built for %s, ns per 20ms 48kHz stereo frame:\n", dsp_simd());
+
+    BENCH(ns, dsp_mix(a, b, FRAME_SAMPLES * 2));
+    BENCH(plain, ref_mix(a, b, FRAME_SAMPLES * 2));
+    printf("mix             %6u plain %6u\n", ns, plain);
+
+    BENCH(ns, dsp_gain(a, FRAME_SAMPLES * 2, 0.5f));
+    BENCH(plain, ref_gain(a, FRAME_SAMPLES * 2, 0.5f));
+    printf("gain            %6u plain %6u\n", ns, plain);
+
+    BENCH(ns, dsp_mono_to_stereo(out, a, FRAME_SAMPLES));
+    BENCH(plain, ref_mono_to_stereo(out, a, FRAME_SAMPLES));
+    printf("mono to stereo  %6u plain %6u\n", ns, plain);
+
+    BENCH(ns, dsp_stereo_to_mono(out, a, FRAME_SAMPLES));
+    BENCH(plain, ref_stereo_to_mono(out, a, FRAME_SAMPLES));
+    printf("stereo to mono  %6u plain %6u\n", ns, plain);
+
+    BENCH(ns, dsp_resample(&r, out, a, 882));
+    printf("44.1 to 48kHz   %6u\n", ns);
+}
+
+#define VIDEO_FRAMES 60
+#define VIDEO_BIT_RATE 2500000
+
+/* Fill an I420 frame with a moving gradient so every frame differs. */
+static void fill_frame(uint8_t *y, uint8_t *u, uint8_t *v, int32_t ystride, int32_t cstride,
+                       uint16_t width, uint16_t height, uint32_t frame)
+{
+    uint16_t i, j;
+
+    for (i = 0; i < height; ++i)
+        for (j = 0; j < width; ++j)
+            y[i * ystride + j] = (uint8_t)(i + j + frame);
+
+    for (i = 0; i < height / 2; ++i)
+        for (j = 0; j < width / 2; ++j) {
+            u[i * cstride + j] = (uint8_t)(i + frame);
+            v[i * cstride + j] = (uint8_t)(j + frame);
+        }
+}
+
+/* return 0 if the encoder produced a frame, -1 if not. */
+static int drain_packets(VCSession *vc)
+{
+    vpx_codec_iter_t iter = NULL;
+    const vpx_codec_cx_pkt_t *pkt;
+    int rc = -1;
+
+    while ((pkt = vpx_codec_get_cx_data(vc->encoder, &iter)))
+        if (pkt->kind == VPX_CODEC_CX_FRAME_PKT)
+            rc = 0;
+
+    return rc;
+}
+
+/* Time VIDEO_FRAMES encodes of width x height frames, both the way frames used to be sent
+ * (fresh image, copy of the planes) and wrapping the caller's planes, and print the CPU
+ * time per frame.
+ */
+static void bench_video(uint16_t width, uint16_t height)
+{
+    VCSession *vc = vc_new(NULL, 0, NULL, NULL);
+
+    if (!vc || vc_reconfigure_encoder(vc, VIDEO_BIT_RATE, width, height) != 0) {
+        printf("Failed to create video session\n");
+        exit(1);
+    }
+
+    /* Padded rows, like most capture APIs hand out. */
+    int32_t ystride = width + 32, cstride = width / 2 + 16;
+    uint8_t *y = malloc(ystride * height);
+    uint8_t *u = malloc(cstride * (height / 2));
+    uint8_t *v = malloc(cstride * (height / 2));
+    uint8_t *packed = malloc(width * height * 3 / 2);
+
+    if (!y || !u || !v || !packed) {
+        printf("Allocation failed\n");
+        exit(1);
+    }
+
+    uint32_t i, k;
+    clock_t copy_time = 0, wrap_time = 0;
+
+    for (i = 0; i < VIDEO_FRAMES; ++i) {
+        fill_frame(y, u, v, ystride, cstride, width, height, i);
+
+        /* The old API took packed planes, so the caller had to pack first. */
+        for (k = 0; k < height; ++k)
+            memcpy(packed + k * width, y + k * ystride, width);
+
+        for (k = 0; k < height / 2; ++k) {
+            memcpy(packed + width * height + k * (width / 2), u + k * cstride, width / 2);
+            memcpy(packed + width * height * 5 / 4 + k * (width / 2), v + k * cstride, width / 2);
+        }
+
+        clock_t start = clock();
+        vpx_image_t img;
+        vpx_img_alloc(&img, VPX_IMG_FMT_I420, width, height, 0);
+        memcpy(img.planes[VPX_PLANE_Y], packed, width * height);
+        memcpy(img.planes[VPX_PLANE_U], packed + width * height, (width / 2) * (height / 2));
+        memcpy(img.planes[VPX_PLANE_V], packed + width * height * 5 / 4, (width / 2) * (height / 2));
+
+        if (vc_encode_frame(vc, &img) != 0 || drain_packets(vc) != 0) {
+            printf("Encode failed\n");
+            exit(1);
+        }
+
+        vpx_img_free(&img);
+        copy_time += clock() - start;
+
+        start = clock();
+        vpx_img_wrap(&img, VPX_IMG_FMT_I420, width, height, 1, y);
+        img.planes[VPX_PLANE_Y] = y;
+        img.planes[VPX_PLANE_U] = u;
+        img.planes[VPX_PLANE_V] = v;
+        img.stride[VPX_PLANE_Y] = ystride;
+        img.stride[VPX_PLANE_U] = cstride;
+        img.stride[VPX_PLANE_V] = cstride;
+
+        if (vc_encode_frame(vc, &img) != 0 || drain_packets(vc) != 0) {
+            printf("Encode failed\n");
+            exit(1);
+        }
+
+        wrap_time += clock() - start;
+    }
+
+    printf("%ux%u: %.3f ms CPU per frame copied, %.3f ms wrapped\n", width, height,
+           (double)copy_time * 1000 / CLOCKS_PER_SEC / VIDEO_FRAMES,
+           (double)wrap_time * 1000 / CLOCKS_PER_SEC / VIDEO_FRAMES);
+
+    free(y);
+    free(u);
+    free(v);
+    free(packed);
+    vc_kill(vc);
+}
+
+int main(int argc, char *argv[])
+{
+    (void) argc;
+    (void) argv;
+
+    bench_dsp();
+    bench_video(1280, 720);
+    bench_video(1920, 1080);
+    return 0;
+}
@@ -24,22 +24,57 @@
 #endif /* HAVE_CONFIG_H */
 
 #include <stdlib.h>
+#include <math.h>
 
 #include "audio.h"
 #include "rtp.h"
 
 #include "../toxcore/logger.h"
 
+/* Frames the jitter buffer can hold, 1.28s of 20ms frames */
+#define JITTER_BUFFER_CAPACITY 64
+/* Upper bound of the playout delay in ms */
+#define JITTER_DELAY_MAX 400
+/* Playout delay in units of measured jitter, on top of one frame */
+#define JITTER_DELAY_FACTOR 3
+
+struct JitterBuffer {
+    struct RTPMessage **queue;
+    uint32_t size;
+    uint32_t capacity;
+    uint16_t bottom;
+    uint16_t top;
+    bool started;
+
+    /* Playout schedule: a frame with sender time stamp ts plays at local time ts + offset.
+     * Transit is local arrival time minus sender time stamp, a smoothed transit plus the
+     * target delay gives the wanted offset; tracking it follows clock drift as well.
+     */
+    int32_t offset;
+    int32_t transit_base; /* Transit of the first packet, transit_avg is relative to it */
+    int32_t last_transit;
+    float transit_avg;
+    float jitter; /* Interarrival jitter in ms as in RFC 3550 */
+    uint32_t next_ts; /* Expected time stamp of the frame at bottom */
+
+    /* For ac_get_jitter_stats(), which takes no lock. __atomic */
+    uint32_t late;
+    uint32_t lost;
+    uint32_t concealed;
+    uint32_t jitter_ms;
+    int32_t delay_ms;
+};
+
 static struct JitterBuffer *jbuf_new(uint32_t capacity);
 static void jbuf_clear(struct JitterBuffer *q);
 static void jbuf_free(struct JitterBuffer *q);
-static int jbuf_write(struct JitterBuffer *q, struct RTPMessage *m);
-static struct RTPMessage *jbuf_read(struct JitterBuffer *q, int32_t *success);
+static int jbuf_write(struct JitterBuffer *q, struct RTPMessage *m, uint64_t arrival, int32_t frame_duration);
+static struct RTPMessage *jbuf_read(struct JitterBuffer *q, uint64_t now, int32_t frame_duration, int32_t *success);
+static struct RTPMessage *jbuf_peek(struct JitterBuffer *q);
 OpusEncoder *create_audio_encoder (int32_t bit_rate, int32_t sampling_rate, int32_t channel_count);
 bool reconfigure_audio_encoder(OpusEncoder **e, int32_t new_br, int32_t new_sr, uint8_t new_ch,
                                int32_t *old_br, int32_t *old_sr, int32_t *old_ch);
-bool reconfigure_audio_decoder(ACSession *ac, int32_t sampling_rate, int8_t channels);
-
+bool reconfigure_audio_output(ACSession *ac, int32_t sampling_rate, int8_t channels);
 
 
 ACSession *ac_new(ToxAV *av, uint32_t friend_number, toxav_audio_receive_frame_cb *cb, void *cb_data)
@@ -65,7 +100,7 @@ ACSession *ac_new(ToxAV *av, uint32_t friend_number, toxav_audio_receive_frame_c
         goto BASE_CLEANUP;
     }
 
-    if (!(ac->j_buf = jbuf_new(3))) {
+    if (!(ac->j_buf = jbuf_new(JITTER_BUFFER_CAPACITY))) {
         LOGGER_WARNING("Jitter buffer creaton failed!");
         opus_decoder_destroy(ac->decoder);
         goto BASE_CLEANUP;
@@ -83,7 +118,6 @@ ACSession *ac_new(ToxAV *av, uint32_t friend_number, toxav_audio_receive_frame_c
 
     ac->ld_channel_count = 2;
     ac->ld_sample_rate = 48000;
-    ac->ldrts = 0; /* Make it possible to reconfigure straight away */
 
     /* These need to be set in order to properly
      * do error correction with opus */
@@ -125,24 +159,46 @@ void ac_iterate(ACSession *ac)
     if (!ac)
         return;
 
-    /* TODO fix this and jitter buffering */
-
     /* Enough space for the maximum frame size (120 ms 48 KHz stereo audio) */
     int16_t tmp[5760 * 2];
+    int16_t resampled[5760 * 2];
 
     struct RTPMessage *msg;
     int rc = 0;
+    uint64_t now = current_time_monotonic();
 
     pthread_mutex_lock(ac->queue_mutex);
 
-    while ((msg = jbuf_read(ac->j_buf, &rc)) || rc == 2) {
-        pthread_mutex_unlock(ac->queue_mutex);
+    /* Play out every frame that is due, so a late iterate catches up */
+    while ((msg = jbuf_read(ac->j_buf, now, ac->lp_frame_duration, &rc)) || rc == 2) {
+        uint64_t start = current_time_monotonic_us();
+        bool lost = (rc == 2);
+
+        if (lost) {
+            /* The frame never arrived: recover it from the FEC data carried by the
+             * next one if that is here, otherwise let opus conceal it. The next frame
+             * stays in the buffer, decode a copy of it so the receiving side isn't
+             * held up.
+             */
+            struct RTPMessage *next = jbuf_peek(ac->j_buf);
+            uint8_t fec[AC_SEND_FRAME_SIZE];
+            uint32_t fec_length = 0;
+            int fs = (48000 * ac->lp_frame_duration) / 1000;
+
+            if (next && next->len > 4 && next->len - 4 <= sizeof(fec)) {
+                fec_length = next->len - 4;
+                memcpy(fec, next->data + 4, fec_length);
+            }
+
+            pthread_mutex_unlock(ac->queue_mutex);
 
-        if (rc == 2) {
-            LOGGER_DEBUG("OPUS correction");
-            int fs = (ac->lp_sampling_rate * ac->lp_frame_duration) / 1000;
-            rc = opus_decode(ac->decoder, NULL, 0, tmp, fs, 1);
+            if (fec_length)
+                rc = opus_decode(ac->decoder, fec, fec_length, tmp, fs, 1);
+            else
+                rc = opus_decode(ac->decoder, NULL, 0, tmp, fs, 0);
         } else {
+            pthread_mutex_unlock(ac->queue_mutex);
+
             /* Get values from packet and decode. */
             /* NOTE: This didn't work very well
             rc = convert_bw_to_sampling_rate(opus_packet_get_bandwidth(msg->data));
@@ -161,29 +217,50 @@ void ac_iterate(ACSession *ac)
 
             ac->lp_channel_count = opus_packet_get_nb_channels(msg->data + 4);
 
-            /** NOTE: even though OPUS supports decoding mono frames with stereo decoder and vice versa,
-              * it didn't work quite well.
-              */
-            if (!reconfigure_audio_decoder(ac, ac->lp_sampling_rate, ac->lp_channel_count)) {
-                LOGGER_WARNING("Failed to reconfigure decoder!");
-                free(msg);
+            if (!reconfigure_audio_output(ac, ac->lp_sampling_rate, ac->lp_channel_count)) {
+                LOGGER_WARNING("Failed to reconfigure decoder output!");
+                rtp_free_msg(msg);
+                pthread_mutex_lock(ac->queue_mutex);
                 continue;
             }
 
             rc = opus_decode(ac->decoder, msg->data + 4, msg->len - 4, tmp, 5760, 0);
-            free(msg);
+            rtp_free_msg(msg);
         }
 
+        int decoded = rc;
+
         if (rc < 0) {
             LOGGER_WARNING("Decoding error: %s", opus_strerror(rc));
-        } else if (ac->acb.first) {
-            ac->lp_frame_duration = (rc * 1000) / ac->lp_sampling_rate;
+        } else {
+            average_add(&ac->decode_time, current_time_monotonic_us() - start);
+            __atomic_add_fetch(&ac->frames_decoded, 1, __ATOMIC_RELAXED);
+
+            int16_t *pcm = tmp;
 
-            ac->acb.first(ac->av, ac->friend_number, tmp, rc, ac->lp_channel_count,
-                          ac->lp_sampling_rate, ac->acb.second);
+            if (ac->ld_channel_count == 1)
+                dsp_stereo_to_mono(tmp, tmp, rc);
+
+            if (ac->ld_sample_rate != 48000) {
+                rc = dsp_resample(&ac->ld_resampler, resampled, tmp, rc);
+                pcm = resampled;
+            }
+
+            if (ac->acb.first)
+                ac->acb.first(ac->av, ac->friend_number, pcm, rc, ac->ld_channel_count,
+                              ac->ld_sample_rate, ac->acb.second);
         }
 
-        return;
+        if (lost && decoded > 0) {
+            struct JitterBuffer *q = ac->j_buf;
+            __atomic_add_fetch(&q->concealed, 1, __ATOMIC_RELAXED);
+        }
+
+        pthread_mutex_lock(ac->queue_mutex);
+
+        /* Read by ac_queue_message() for the jitter estimate */
+        if (decoded > 0)
+            ac->lp_frame_duration = (decoded * 1000) / 48000;
     }
 
     pthread_mutex_unlock(ac->queue_mutex);
@@ -195,25 +272,25 @@ int ac_queue_message(void *acp, struct RTPMessage *msg)
 
     if ((msg->header.pt & 0x7f) == (rtp_TypeAudio + 2) % 128) {
         LOGGER_WARNING("Got dummy!");
-        free(msg);
+        rtp_free_msg(msg);
         return 0;
     }
 
     if ((msg->header.pt & 0x7f) != rtp_TypeAudio % 128) {
         LOGGER_WARNING("Invalid payload type!");
-        free(msg);
+        rtp_free_msg(msg);
         return -1;
     }
 
     ACSession *ac = acp;
 
     pthread_mutex_lock(ac->queue_mutex);
-    int rc = jbuf_write(ac->j_buf, msg);
+    int rc = jbuf_write(ac->j_buf, msg, current_time_monotonic(), ac->lp_frame_duration);
     pthread_mutex_unlock(ac->queue_mutex);
 
     if (rc == -1) {
         LOGGER_WARNING("Could not queue the message!");
-        free(msg);
+        rtp_free_msg(msg);
         return -1;
     }
 
@@ -230,22 +307,148 @@ int ac_reconfigure_encoder(ACSession *ac, int32_t bit_rate, int32_t sampling_rat
 
     return 0;
 }
+/* Audio at a rate opus doesn't take, from 8 to 96kHz, is resampled to 48kHz for encoding.
+ *
+ * return the audio to encode, with sample_count and sampling_rate changed to match.
+ * return NULL if it can't be encoded.
+ */
+const int16_t *ac_resample_input(ACSession *ac, const int16_t *pcm, size_t *sample_count, uint8_t channels,
+                                 uint32_t *sampling_rate)
+{
+    uint32_t rate = *sampling_rate;
+
+    if (rate == 8000 || rate == 12000 || rate == 16000 || rate == 24000 || rate == 48000)
+        return pcm;
+
+    if (rate < 8000 || rate > 96000)
+        return NULL;
+
+    /* Must still come out as a whole opus frame */
+    if ((uint64_t)*sample_count * 48000 % rate != 0)
+        return NULL;
+
+    if (rate != ac->le_input_rate || channels != ac->le_input_channels) {
+        if (dsp_resampler_init(&ac->le_resampler, rate, 48000, channels) != 0)
+            return NULL;
+
+        ac->le_input_rate = rate;
+        ac->le_input_channels = channels;
+    }
+
+    if (dsp_resample_size(&ac->le_resampler, *sample_count) > 5760)
+        return NULL;
+
+    *sample_count = dsp_resample(&ac->le_resampler, ac->le_resampled, pcm, *sample_count);
+    *sampling_rate = 48000;
+    return ac->le_resampled;
+}
+/* Encode a frame and queue it for ac_send_queued(). Never waits, so it can be called from
+ * an audio thread, but only from one thread at a time.
+ *
+ * return 0 on success.
+ * return -1 if the frame can't be encoded.
+ * return -2 if the queue is full and the frame was dropped.
+ */
+int ac_send_frame(ACSession *ac, const int16_t *pcm, size_t sample_count, uint8_t channels,
+                  uint32_t sampling_rate, int32_t bit_rate)
+{
+    if (!ac || !pcm)
+        return -1;
 
+    pcm = ac_resample_input(ac, pcm, &sample_count, channels, &sampling_rate);
+
+    if (pcm == NULL || ac_reconfigure_encoder(ac, bit_rate, sampling_rate, channels) != 0)
+        return -1;
+
+    uint32_t head = ac->send_head;
+
+    if (head - __atomic_load_n(&ac->send_tail, __ATOMIC_ACQUIRE) == AC_SEND_QUEUE_SIZE) {
+        __atomic_add_fetch(&ac->send_dropped, 1, __ATOMIC_RELAXED);
+        return -2;
+    }
+
+    ACSendFrame *frame = &ac->send_queue[head % AC_SEND_QUEUE_SIZE];
+    uint64_t start = current_time_monotonic_us();
+
+    sampling_rate = htonl(sampling_rate);
+    memcpy(frame->data, &sampling_rate, sizeof(sampling_rate));
+    int vrc = opus_encode(ac->encoder, pcm, sample_count, frame->data + sizeof(sampling_rate),
+                          sizeof(frame->data) - sizeof(sampling_rate));
+
+    if (vrc < 0) {
+        LOGGER_WARNING("Failed to encode frame %s", opus_strerror(vrc));
+        return -1;
+    }
+
+    average_add(&ac->encode_time, current_time_monotonic_us() - start);
+    __atomic_add_fetch(&ac->frames_encoded, 1, __ATOMIC_RELAXED);
+
+    frame->length = vrc + sizeof(sampling_rate);
+    frame->timestamp = current_time_monotonic();
+    __atomic_store_n(&ac->send_head, head + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* Hand the frames ac_send_frame() queued to send, oldest first. Only one thread at a time
+ * may do this.
+ *
+ * return the number of frames sent.
+ */
+int ac_send_queued(ACSession *ac, ac_send_cb *send, void *send_object)
+{
+    if (!ac || !send)
+        return 0;
+
+    uint32_t tail = ac->send_tail;
+    uint32_t head = __atomic_load_n(&ac->send_head, __ATOMIC_ACQUIRE);
+    int sent = 0;
+
+    for (; tail != head; ++tail, ++sent) {
+        const ACSendFrame *frame = &ac->send_queue[tail % AC_SEND_QUEUE_SIZE];
+
+        if (send(send_object, frame->data, frame->length, frame->timestamp) != 0)
+            LOGGER_WARNING("Failed to send audio packet");
+
+        /* The slot is free for ac_send_frame() once this is seen */
+        __atomic_store_n(&ac->send_tail, tail + 1, __ATOMIC_RELEASE);
+    }
+
+    return sent;
+}
+/* Fill in the codec part of the stream stats. */
+void ac_get_stats(const ACSession *ac, ToxAV_Stream_Stats *sent, ToxAV_Stream_Stats *received)
+{
+    if (!ac)
+        return;
+
+    sent->frames = __atomic_load_n(&ac->frames_encoded, __ATOMIC_RELAXED);
+    sent->frames_dropped = __atomic_load_n(&ac->send_dropped, __ATOMIC_RELAXED);
+    sent->codec_time = __atomic_load_n(&ac->encode_time, __ATOMIC_RELAXED);
+    received->frames = __atomic_load_n(&ac->frames_decoded, __ATOMIC_RELAXED);
+    received->codec_time = __atomic_load_n(&ac->decode_time, __ATOMIC_RELAXED);
+}
+/* Takes no lock, so it can be called while the call is in use. */
+void ac_get_jitter_stats(const ACSession *ac, ACJitterStats *stats)
+{
+    if (!ac || !stats)
+        return;
+
+    const struct JitterBuffer *q = ac->j_buf;
+
+    stats->late = __atomic_load_n(&q->late, __ATOMIC_RELAXED);
+    stats->lost = __atomic_load_n(&q->lost, __ATOMIC_RELAXED);
+    stats->concealed = __atomic_load_n(&q->concealed, __ATOMIC_RELAXED);
+    stats->jitter = __atomic_load_n(&q->jitter_ms, __ATOMIC_RELAXED);
+    stats->delay = __atomic_load_n(&q->delay_ms, __ATOMIC_RELAXED);
+}
 
 
-struct JitterBuffer {
-    struct RTPMessage **queue;
-    uint32_t size;
-    uint32_t capacity;
-    uint16_t bottom;
-    uint16_t top;
-};
 
 static struct JitterBuffer *jbuf_new(uint32_t capacity)
 {
     unsigned int size = 1;
 
-    while (size <= (capacity * 4)) {
+    while (size < capacity) {
         size *= 2;
     }
 
@@ -266,7 +469,7 @@ static void jbuf_clear(struct JitterBuffer *q)
 {
     for (; q->bottom != q->top; ++q->bottom) {
         if (q->queue[q->bottom % q->size]) {
-            free(q->queue[q->bottom % q->size]);
+            rtp_free_msg(q->queue[q->bottom % q->size]);
             q->queue[q->bottom % q->size] = NULL;
         }
     }
@@ -279,19 +482,76 @@ static void jbuf_free(struct JitterBuffer *q)
     free(q->queue);
     free(q);
 }
-static int jbuf_write(struct JitterBuffer *q, struct RTPMessage *m)
+/* Update the jitter estimate with a packet that took transit to arrive and move the
+ * playout offset towards the smoothed transit plus the target delay. Growing is done at
+ * once, so no more packets come late; shrinking slowly, so one quiet moment doesn't undo it.
+ */
+static void jbuf_update_delay(struct JitterBuffer *q, int32_t transit, int32_t frame_duration)
+{
+    float d = transit - q->last_transit;
+    int32_t delay;
+    q->last_transit = transit;
+    q->jitter += (fabsf(d) - q->jitter) / 16;
+    q->transit_avg += ((transit - q->transit_base) - q->transit_avg) / 16;
+
+    float target = frame_duration + JITTER_DELAY_FACTOR * q->jitter;
+
+    if (target > JITTER_DELAY_MAX)
+        target = JITTER_DELAY_MAX;
+
+    int32_t wanted = q->transit_base + lroundf(q->transit_avg + target);
+
+    if (transit - q->offset > 0) {
+        __atomic_add_fetch(&q->late, 1, __ATOMIC_RELAXED);
+        q->offset = transit - wanted > 0 ? transit : wanted;
+    } else if (wanted - q->offset > 0) {
+        q->offset = wanted;
+    } else {
+        q->offset -= (q->offset - wanted + 15) / 16;
+    }
+
+    delay = q->offset - q->transit_base - lroundf(q->transit_avg);
+    __atomic_store_n(&q->jitter_ms, lroundf(q->jitter), __ATOMIC_RELAXED);
+    __atomic_store_n(&q->delay_ms, delay > 0 ? delay : 0, __ATOMIC_RELAXED);
+}
+static int jbuf_write(struct JitterBuffer *q, struct RTPMessage *m, uint64_t arrival, int32_t frame_duration)
 {
     uint16_t sequnum = m->header.sequnum;
+    int32_t transit = (uint32_t)arrival - m->header.timestamp;
 
     unsigned int num = sequnum % q->size;
 
-    if ((uint32_t)(sequnum - q->bottom) > q->size) {
+    if (!q->started) {
+        /* Start out expecting as much jitter as a frame lasts */
+        q->started = true;
+        q->transit_base = transit;
+        q->last_transit = transit;
+        q->jitter = frame_duration;
+        q->offset = transit + frame_duration + JITTER_DELAY_FACTOR * frame_duration;
+        q->next_ts = m->header.timestamp;
+        __atomic_store_n(&q->jitter_ms, frame_duration, __ATOMIC_RELAXED);
+        __atomic_store_n(&q->delay_ms, q->offset - transit, __ATOMIC_RELAXED);
+        q->bottom = sequnum;
+        q->top = sequnum + 1;
+        q->queue[num] = m;
+        return 0;
+    }
+
+    if ((int16_t)(sequnum - q->bottom) < 0) {
+        /* Its turn has passed and it was concealed already */
+        __atomic_add_fetch(&q->late, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+
+    if ((uint32_t)(uint16_t)(sequnum - q->bottom) >= q->size) {
         LOGGER_DEBUG("Clearing filled jitter buffer: %p", q);
 
         jbuf_clear(q);
-        q->bottom = sequnum - q->capacity;
-        q->queue[num] = m;
+        q->bottom = sequnum;
         q->top = sequnum + 1;
+        q->next_ts = m->header.timestamp;
+        q->queue[num] = m;
+        jbuf_update_delay(q, transit, frame_duration);
         return 0;
     }
 
@@ -300,37 +560,50 @@ static int jbuf_write(struct JitterBuffer *q, struct RTPMessage *m)
 
     q->queue[num] = m;
 
-    if ((sequnum - q->bottom) >= (q->top - q->bottom))
+    if ((uint16_t)(sequnum - q->bottom) >= (uint16_t)(q->top - q->bottom))
         q->top = sequnum + 1;
 
+    jbuf_update_delay(q, transit, frame_duration);
     return 0;
 }
-static struct RTPMessage *jbuf_read(struct JitterBuffer *q, int32_t *success)
+/* Take the frame at the bottom of the buffer if its playout time has come.
+ *
+ * return the message and set success to 1 if it is here.
+ * return NULL and set success to 2 if it is missing while later ones are not.
+ * return NULL and set success to 0 if nothing is due.
+ */
+static struct RTPMessage *jbuf_read(struct JitterBuffer *q, uint64_t now, int32_t frame_duration, int32_t *success)
 {
-    if (q->top == q->bottom) {
-        *success = 0;
+    *success = 0;
+
+    if (!q->started || q->top == q->bottom)
         return NULL;
-    }
 
     unsigned int num = q->bottom % q->size;
+    struct RTPMessage *ret = q->queue[num];
+    uint32_t ts = ret ? ret->header.timestamp : q->next_ts;
+
+    if ((int32_t)(ts + q->offset - (uint32_t)now) > 0)
+        return NULL;
+
+    ++q->bottom;
+    q->next_ts = ts + frame_duration;
 
-    if (q->queue[num]) {
-        struct RTPMessage *ret = q->queue[num];
+    if (ret) {
         q->queue[num] = NULL;
-        ++q->bottom;
         *success = 1;
         return ret;
     }
 
-    if ((uint32_t)(q->top - q->bottom) > q->capacity) {
-        ++q->bottom;
-        *success = 2;
-        return NULL;
-    }
-
-    *success = 0;
+    __atomic_add_fetch(&q->lost, 1, __ATOMIC_RELAXED);
+    *success = 2;
     return NULL;
 }
+/* return the frame at the bottom of the buffer without taking it, NULL if missing. */
+static struct RTPMessage *jbuf_peek(struct JitterBuffer *q)
+{
+    return q->top == q->bottom ? NULL : q->queue[q->bottom % q->size];
+}
 OpusEncoder *create_audio_encoder (int32_t bit_rate, int32_t sampling_rate, int32_t channel_count)
 {
     int status = OPUS_OK;
@@ -411,28 +684,20 @@ bool reconfigure_audio_encoder(OpusEncoder **e, int32_t new_br, int32_t new_sr,
     LOGGER_DEBUG ("Reconfigured audio encoder br: %d sr: %d cc:%d", new_br, new_sr, new_ch);
     return true;
 }
-bool reconfigure_audio_decoder(ACSession *ac, int32_t sampling_rate, int8_t channels)
+bool reconfigure_audio_output(ACSession *ac, int32_t sampling_rate, int8_t channels)
 {
     if (sampling_rate != ac->ld_sample_rate || channels != ac->ld_channel_count) {
-        if (current_time_monotonic() - ac->ldrts < 500)
+        if (sampling_rate < 8000 || sampling_rate > 48000 || (channels != 1 && channels != 2))
             return false;
 
-        int status;
-        OpusDecoder *new_dec = opus_decoder_create(sampling_rate, channels, &status);
-
-        if (status != OPUS_OK) {
-            LOGGER_ERROR("Error while starting audio decoder(%d %d): %s", sampling_rate, channels, opus_strerror(status));
+        /* The decoder stays as it is, only what its output is converted to changes */
+        if (sampling_rate != 48000 && dsp_resampler_init(&ac->ld_resampler, 48000, sampling_rate, channels) != 0)
             return false;
-        }
 
         ac->ld_sample_rate = sampling_rate;
         ac->ld_channel_count = channels;
-        ac->ldrts = current_time_monotonic();
-
-        opus_decoder_destroy(ac->decoder);
-        ac->decoder = new_dec;
 
-        LOGGER_DEBUG("Reconfigured audio decoder sr: %d cc: %d", sampling_rate, channels);
+        LOGGER_DEBUG("Reconfigured audio decoder output sr: %d cc: %d", sampling_rate, channels);
     }
 
     return true;
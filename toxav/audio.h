@@ -26,26 +26,64 @@
 #include <pthread.h>
 
 #include "toxav.h"
+#include "dsp.h"
 
 #include "../toxcore/util.h"
 
 struct RTPMessage;
 
+#define AC_SEND_QUEUE_SIZE 16 /* A power of 2 */
+#define AC_SEND_FRAME_SIZE 1400 /* Encoded frame and the sample rate in front of it */
+
+typedef int ac_send_cb(void *object, const uint8_t *data, uint16_t length, uint32_t timestamp);
+
+typedef struct {
+    uint32_t timestamp; /* When it was encoded */
+    uint16_t length;
+    uint8_t data[AC_SEND_FRAME_SIZE];
+} ACSendFrame;
+
+typedef struct {
+    uint32_t late; /* Packets that arrived after their playout time */
+    uint32_t lost; /* Frames that were not there when due */
+    uint32_t concealed; /* Lost frames recovered with FEC or concealment */
+    uint32_t jitter; /* Interarrival jitter in ms */
+    int32_t delay; /* Current playout delay in ms */
+} ACJitterStats;
+
 typedef struct ACSession_s {
     /* encoding */
     OpusEncoder *encoder;
     int32_t le_sample_rate; /* Last encoder sample rate */
     int32_t le_channel_count; /* Last encoder channel count */
     int32_t le_bit_rate; /* Last encoder bit rate */
+    DSPResampler le_resampler; /* Takes audio at rates opus doesn't to 48kHz */
+    int32_t le_input_rate; /* Last resampled sample rate */
+    int32_t le_input_channels; /* Last resampled channel count */
+    int16_t le_resampled[5760 * 2];
+
+    /* Encoded frames from ac_send_frame() to ac_send_queued(). Each end only writes its own
+     * index, so one thread can queue while another sends without either of them waiting.
+     */
+    ACSendFrame send_queue[AC_SEND_QUEUE_SIZE];
+    uint32_t send_head; /* Next to queue, written by ac_send_frame() */
+    uint32_t send_tail; /* Next to send, written by ac_send_queued() */
+    uint32_t send_dropped; /* Frames the queue had no room for */
+
+    /* For ac_get_stats(), kept with __atomic builtins by the encoding and decoding threads */
+    uint32_t frames_encoded;
+    uint32_t encode_time; /* Recent average in us */
+    uint32_t frames_decoded;
+    uint32_t decode_time;
 
-    /* decoding */
+    /* decoding, always at 48kHz stereo and converted to what the packet was sent as */
     OpusDecoder *decoder;
     int32_t lp_channel_count; /* Last packet channel count */
     int32_t lp_sampling_rate; /* Last packet sample rate */
     int32_t lp_frame_duration; /* Last packet frame duration */
-    int32_t ld_sample_rate; /* Last decoder sample rate */
-    int32_t ld_channel_count; /* Last decoder channel count */
-    uint64_t ldrts; /* Last decoder reconfiguration time stamp */
+    DSPResampler ld_resampler; /* Takes decoded audio to ld_sample_rate */
+    int32_t ld_sample_rate; /* Last output sample rate */
+    int32_t ld_channel_count; /* Last output channel count */
     void *j_buf;
 
     pthread_mutex_t queue_mutex[1];
@@ -60,5 +98,12 @@ void ac_kill(ACSession *ac);
 void ac_iterate(ACSession *ac);
 int ac_queue_message(void *acp, struct RTPMessage *msg);
 int ac_reconfigure_encoder(ACSession *ac, int32_t bit_rate, int32_t sampling_rate, uint8_t channels);
+const int16_t *ac_resample_input(ACSession *ac, const int16_t *pcm, size_t *sample_count, uint8_t channels,
+                                 uint32_t *sampling_rate);
+int ac_send_frame(ACSession *ac, const int16_t *pcm, size_t sample_count, uint8_t channels,
+                  uint32_t sampling_rate, int32_t bit_rate);
+int ac_send_queued(ACSession *ac, ac_send_cb *send, void *send_object);
+void ac_get_jitter_stats(const ACSession *ac, ACJitterStats *stats);
+void ac_get_stats(const ACSession *ac, ToxAV_Stream_Stats *sent, ToxAV_Stream_Stats *received);
 
 #endif /* AUDIO_H */
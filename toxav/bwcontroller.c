@@ -24,35 +24,60 @@
 #endif /* HAVE_CONFIG_H */
 
 #include <assert.h>
+#include <pthread.h>
 #include "bwcontroller.h"
 #include "../toxcore/logger.h"
 #include "../toxcore/util.h"
 
-#define BWC_PACKET_ID 196
-#define BWC_SEND_INTERVAL_MS 1000
-#define BWC_REFRESH_INTERVAL_MS 10000
+#define BWC_PACKET_ID 196 /* Received and lost bytes, understood by every ToxAV */
+#define BWC_EXT_PACKET_ID 197 /* The above, the rate estimate and key frame requests */
+#define BWC_SEND_INTERVAL_MS 200
+#define BWC_MIN_SEND_INTERVAL_MS 50
+#define BWC_KEY_FRAME_INTERVAL_MS 1000
 #define BWC_AVG_PKT_COUNT 20
 
+#define BWC_GROUP_SPAN_MS 5 /* Packets sent this close together form one group */
+#define BWC_TREND_SMOOTHING 0.9f
+#define BWC_TREND_GAIN 4.0f
+#define BWC_THRESHOLD_INITIAL 12.5f
+#define BWC_THRESHOLD_MIN 6.0f
+#define BWC_THRESHOLD_MAX 600.0f
+#define BWC_OVERUSE_TIME_MS 10
+#define BWC_RATE_WINDOW_MS 500
+#define BWC_DECREASE_INTERVAL_MS 300
+#define BWC_MIN_BIT_RATE 32000
+
 /**
  *
  */
 
 struct BWController_s {
-    void (*mcb) (BWController *, uint32_t, float, void *);
+    void (*mcb) (BWController *, uint32_t, uint32_t, void *);
+    void (*kcb) (BWController *, uint32_t, void *);
     void *mcb_data;
 
     Messenger *m;
     uint32_t friend_number;
 
+    /* The audio and video sessions feed us from the tox thread and from toxav_iterate() */
+    pthread_mutex_t mutex[1];
+
     struct {
         uint32_t lru; /* Last recv update time stamp */
         uint32_t lsu; /* Last sent update time stamp */
-        uint32_t lfu; /* Last refresh time stamp */
+        uint32_t lkr; /* Last key frame request time stamp */
 
         uint32_t lost;
         uint32_t recv;
+        uint32_t sent_rate; /* Estimate in the last update sent */
+        bool key_frame; /* Key frame request pending */
+        bool peer_extended; /* The peer sent BWC_EXT_PACKET_ID, so it knows it */
     } cycle;
 
+    BWCEstimator est; /* Of what the peer sends us */
+    uint32_t target; /* Rate we send at, 0 until the peer tells */
+    BWCStats stats; /* Copied out of the above with __atomic builtins, read by other threads */
+
     struct {
         uint32_t rb_s[BWC_AVG_PKT_COUNT];
         RingBuffer *rb;
@@ -63,17 +88,28 @@ int bwc_handle_data(Tox *tox, uint32_t friendnumber, const uint8_t *data, uint16
 void send_update(BWController *bwc);
 
 BWController *bwc_new(Messenger *m, uint32_t friendnumber,
-                      void (*mcb) (BWController *, uint32_t, float, void *),
+                      void (*mcb) (BWController *, uint32_t, uint32_t, void *),
+                      void (*kcb) (BWController *, uint32_t, void *),
                       void *udata)
 {
     BWController *retu = calloc(sizeof(struct BWController_s), 1);
 
+    if (!retu)
+        return NULL;
+
+    if (pthread_mutex_init(retu->mutex, NULL) != 0) {
+        free(retu);
+        return NULL;
+    }
+
     retu->mcb = mcb;
+    retu->kcb = kcb;
     retu->mcb_data = udata;
     retu->m = m;
     retu->friend_number = friendnumber;
-    retu->cycle.lsu = retu->cycle.lfu = current_time_monotonic();
+    retu->cycle.lsu = current_time_monotonic();
     retu->rcvpkt.rb = rb_new(BWC_AVG_PKT_COUNT);
+    bwc_estimator_init(&retu->est);
 
     /* Fill with zeros */
     int i = 0;
@@ -82,6 +118,7 @@ BWController *bwc_new(Messenger *m, uint32_t friendnumber,
         rb_write(retu->rcvpkt.rb, retu->rcvpkt.rb_s + i);
 
     m_callback_rtp_packet(m->tox, friendnumber, BWC_PACKET_ID, bwc_handle_data, retu);
+    m_callback_rtp_packet(m->tox, friendnumber, BWC_EXT_PACKET_ID, bwc_handle_data, retu);
 
     return retu;
 }
@@ -91,24 +128,30 @@ void bwc_kill(BWController *bwc)
         return;
 
     m_callback_rtp_packet(bwc->m->tox, bwc->friend_number, BWC_PACKET_ID, NULL, NULL);
+    m_callback_rtp_packet(bwc->m->tox, bwc->friend_number, BWC_EXT_PACKET_ID, NULL, NULL);
 
     rb_kill(bwc->rcvpkt.rb);
+    pthread_mutex_destroy(bwc->mutex);
     free(bwc);
 }
 void bwc_feed_avg(BWController *bwc, uint32_t bytes)
 {
     uint32_t *p;
 
+    pthread_mutex_lock(bwc->mutex);
     rb_read(bwc->rcvpkt.rb, (void **) &p);
     rb_write(bwc->rcvpkt.rb, p);
 
     *p = bytes;
+    pthread_mutex_unlock(bwc->mutex);
 }
 void bwc_add_lost(BWController *bwc, uint32_t bytes)
 {
     if (!bwc)
         return;
 
+    pthread_mutex_lock(bwc->mutex);
+
     if (!bytes) {
         uint32_t *t_avg[BWC_AVG_PKT_COUNT], c = 1;
 
@@ -128,78 +171,372 @@ void bwc_add_lost(BWController *bwc, uint32_t bytes)
 
     bwc->cycle.lost += bytes;
     send_update(bwc);
+    pthread_mutex_unlock(bwc->mutex);
 }
-void bwc_add_recv(BWController *bwc, uint32_t bytes)
+void bwc_add_recv(BWController *bwc, uint32_t timestamp, uint32_t bytes)
 {
     if (!bwc || !bytes)
         return;
 
+    pthread_mutex_lock(bwc->mutex);
     bwc->cycle.recv += bytes;
+    bwc_estimator_packet(&bwc->est, timestamp, bytes, current_time_monotonic());
     send_update(bwc);
+    pthread_mutex_unlock(bwc->mutex);
+}
+void bwc_request_key_frame(BWController *bwc)
+{
+    if (!bwc)
+        return;
+
+    uint32_t now = current_time_monotonic();
+    pthread_mutex_lock(bwc->mutex);
+
+    if (!bwc->cycle.lkr || now - bwc->cycle.lkr >= BWC_KEY_FRAME_INTERVAL_MS) {
+        bwc->cycle.lkr = now;
+        bwc->cycle.key_frame = true;
+        send_update(bwc);
+    }
+
+    pthread_mutex_unlock(bwc->mutex);
+}
+
+
+void bwc_get_stats(const BWController *bwc, BWCStats *stats)
+{
+    if (!bwc)
+        return;
+
+    stats->target = __atomic_load_n(&bwc->stats.target, __ATOMIC_RELAXED);
+    stats->loss = __atomic_load_n(&bwc->stats.loss, __ATOMIC_RELAXED);
+    stats->incoming = __atomic_load_n(&bwc->stats.incoming, __ATOMIC_RELAXED);
+    stats->estimate = __atomic_load_n(&bwc->stats.estimate, __ATOMIC_RELAXED);
+    stats->rtt = __atomic_load_n(&bwc->stats.rtt, __ATOMIC_RELAXED);
+}
+
+
+void bwc_estimator_init(BWCEstimator *est)
+{
+    memset(est, 0, sizeof(BWCEstimator));
+    est->threshold = BWC_THRESHOLD_INITIAL;
+}
+/* Slope of the smoothed accumulated delay over the last BWC_TREND_WINDOW groups. */
+static float trend_slope(const BWCEstimator *est)
+{
+    float x_avg = 0, y_avg = 0, num = 0, den = 0;
+    int i;
+
+    for (i = 0; i < BWC_TREND_WINDOW; ++i) {
+        x_avg += est->trend_x[i];
+        y_avg += est->trend_y[i];
+    }
+
+    x_avg /= BWC_TREND_WINDOW;
+    y_avg /= BWC_TREND_WINDOW;
+
+    for (i = 0; i < BWC_TREND_WINDOW; ++i) {
+        num += (est->trend_x[i] - x_avg) * (est->trend_y[i] - y_avg);
+        den += (est->trend_x[i] - x_avg) * (est->trend_x[i] - x_avg);
+    }
+
+    return den > 0 ? num / den : 0;
+}
+static void detect_usage(BWCEstimator *est, float trend, uint32_t delta_ms, uint64_t now)
+{
+    if (trend > est->threshold) {
+        est->overuse_time += delta_ms;
+        ++est->overuse_count;
+
+        /* Overuse only once the queue kept on growing for a while */
+        if (est->overuse_time >= BWC_OVERUSE_TIME_MS && est->overuse_count > 1 && trend >= est->trend) {
+            est->overuse_time = 0;
+            est->overuse_count = 0;
+            est->usage = bwc_Overuse;
+        }
+    } else {
+        est->overuse_time = 0;
+        est->overuse_count = 0;
+        est->usage = trend < -est->threshold ? bwc_Underuse : bwc_Normal;
+    }
+
+    est->trend = trend;
+
+    /* The threshold follows the trend, so delay from competing traffic is not taken for
+     * overuse, but not spikes far above it.
+     */
+    float magnitude = trend < 0 ? -trend : trend;
+
+    if (est->last_threshold_update && magnitude < est->threshold + 15) {
+        float k = magnitude < est->threshold ? 0.039f : 0.0087f;
+        uint32_t elapsed = MIN(now - est->last_threshold_update, 100);
+
+        est->threshold += k * (magnitude - est->threshold) * elapsed;
+
+        if (est->threshold < BWC_THRESHOLD_MIN)
+            est->threshold = BWC_THRESHOLD_MIN;
+        else if (est->threshold > BWC_THRESHOLD_MAX)
+            est->threshold = BWC_THRESHOLD_MAX;
+    }
+
+    est->last_threshold_update = now;
+}
+/* Feed the delay variation between the group that just completed and the one before. */
+static void group_delay(BWCEstimator *est, float delta)
+{
+    est->acc_delay += delta;
+    est->smoothed_delay = BWC_TREND_SMOOTHING * est->smoothed_delay + (1 - BWC_TREND_SMOOTHING) * est->acc_delay;
+
+    if (est->trend_count == 0)
+        est->first_arrival = est->group_arrival;
+
+    uint32_t i = est->trend_count % BWC_TREND_WINDOW;
+    est->trend_x[i] = est->group_arrival - est->first_arrival;
+    est->trend_y[i] = est->smoothed_delay;
+    ++est->trend_count;
+
+    if (est->trend_count < BWC_TREND_WINDOW)
+        return;
+
+    float trend = trend_slope(est) * MIN(est->trend_count, 60) * BWC_TREND_GAIN;
+    detect_usage(est, trend, est->group_arrival - est->prev_arrival, est->group_arrival);
+}
+void bwc_estimator_packet(BWCEstimator *est, uint32_t timestamp, uint32_t bytes, uint64_t now)
+{
+    est->window_bytes += bytes;
+
+    if (!est->started) {
+        est->started = true;
+        est->group_first_ts = est->group_ts = timestamp;
+        est->group_arrival = now;
+        est->window_start = est->last_update = now;
+        return;
+    }
+
+    if ((int32_t)(timestamp - est->group_first_ts) < 0)
+        return; /* Reordered, sent before the current group */
+
+    if ((int32_t)(timestamp - est->group_first_ts) < BWC_GROUP_SPAN_MS) {
+        if ((int32_t)(timestamp - est->group_ts) > 0)
+            est->group_ts = timestamp;
+
+        est->group_arrival = now;
+        return;
+    }
+
+    /* A new group begins, the current one is complete */
+    if (est->have_prev)
+        group_delay(est, (float)(int64_t)(est->group_arrival - est->prev_arrival) -
+                    (float)(int32_t)(est->group_ts - est->prev_ts));
+
+    est->prev_ts = est->group_ts;
+    est->prev_arrival = est->group_arrival;
+    est->have_prev = true;
+
+    est->group_first_ts = est->group_ts = timestamp;
+    est->group_arrival = now;
+}
+uint32_t bwc_estimator_update(BWCEstimator *est, uint64_t now)
+{
+    if (!est->started)
+        return 0;
+
+    if (now - est->window_start >= BWC_RATE_WINDOW_MS) {
+        est->incoming = (uint64_t)est->window_bytes * 8000 / (now - est->window_start);
+        est->window_bytes = 0;
+        est->window_start = now;
+    }
+
+    if (!est->incoming)
+        return est->estimate;
+
+    uint32_t elapsed = MIN(now - est->last_update, 1000);
+    est->last_update = now;
+
+    switch (est->usage) {
+        case bwc_Overuse:
+            /* Back off below what gets through, so the queue drains */
+            if (now - est->last_decrease >= BWC_DECREASE_INTERVAL_MS) {
+                uint32_t backoff = est->incoming * 0.85f;
+                est->estimate = est->estimate ? MIN(est->estimate, backoff) : backoff;
+                est->last_decrease = now;
+            }
+
+            break;
+
+        case bwc_Underuse:
+            /* The queue is draining, hold */
+            break;
+
+        case bwc_Normal:
+            /* Probe for more, 8% per second, but not far past what the peer really sends.
+             * Until the path first showed a limit there is nothing to probe for.
+             */
+            if (est->estimate) {
+                uint64_t estimate = est->estimate + (uint64_t)est->estimate * 8 * elapsed / 100000;
+                est->estimate = MIN(estimate, est->incoming * 3 / 2 + 10000);
+            }
+
+            break;
+    }
+
+    if (est->estimate && est->estimate < BWC_MIN_BIT_RATE)
+        est->estimate = BWC_MIN_BIT_RATE;
+
+    return est->estimate;
+}
+uint32_t bwc_target_rate(uint32_t current, uint32_t received, uint32_t estimate, float loss, bool congested)
+{
+    uint64_t target = current;
+
+    /* The first limit starts from what gets through */
+    if (!target && (estimate || loss > .1f))
+        target = received ? received : estimate;
+
+    if (!target)
+        return 0;
+
+    if (loss > .1f)
+        target *= 1 - loss / 2;
+    else if (loss < .02f && !congested && target < (uint64_t) received * 3 / 2 + 10000)
+        target = MIN(target * 105 / 100 + 1000, (uint64_t) received * 3 / 2 + 10000); /* Not far past what gets sent */
+
+    if (congested && current && target > current)
+        target = current;
+
+    if (estimate && target > estimate)
+        target = estimate;
+
+    return target > BWC_MIN_BIT_RATE ? target : BWC_MIN_BIT_RATE;
 }
 
 
 struct BWCMessage {
     uint32_t lost;
     uint32_t recv;
+    /* BWC_EXT_PACKET_ID only */
+    uint32_t bit_rate; /* What the peer can send at, 0 if not known yet */
+    uint32_t flags;
 };
 
+#define BWC_MESSAGE_SIZE (sizeof(uint32_t) * 2) /* Of the BWC_PACKET_ID part */
+
+#define BWC_FLAG_KEY_FRAME 1
+
 void send_update(BWController *bwc)
 {
-    if (current_time_monotonic() - bwc->cycle.lfu > BWC_REFRESH_INTERVAL_MS) {
+    uint32_t now = current_time_monotonic();
+    uint32_t rate = bwc_estimator_update(&bwc->est, now);
 
-        bwc->cycle.lost /= 10;
-        bwc->cycle.recv /= 10;
-        bwc->cycle.lfu = current_time_monotonic();
-    } else if (current_time_monotonic() - bwc->cycle.lsu > BWC_SEND_INTERVAL_MS) {
+    __atomic_store_n(&bwc->stats.incoming, bwc->est.incoming, __ATOMIC_RELAXED);
 
-        if (bwc->cycle.lost) {
-            LOGGER_DEBUG ("%p Sent update rcv: %u lost: %u",
-                          bwc, bwc->cycle.recv, bwc->cycle.lost);
+    if (now - bwc->cycle.lsu < BWC_MIN_SEND_INTERVAL_MS)
+        return;
 
-            uint8_t p_msg[sizeof(struct BWCMessage) + 1];
-            struct BWCMessage *b_msg = (struct BWCMessage *)(p_msg + 1);
+    /* Drops in the estimate and key frame requests don't wait for the next interval */
+    if (now - bwc->cycle.lsu < BWC_SEND_INTERVAL_MS && !bwc->cycle.key_frame &&
+            (uint64_t)rate * 100 >= (uint64_t)bwc->cycle.sent_rate * 95)
+        return;
 
-            p_msg[0] = BWC_PACKET_ID;
-            b_msg->lost = htonl(bwc->cycle.lost);
-            b_msg->recv = htonl(bwc->cycle.recv);
+    if (bwc->cycle.lost || bwc->cycle.recv || bwc->cycle.key_frame) {
+        LOGGER_DEBUG ("%p Sent update rcv: %u lost: %u rate: %u", bwc, bwc->cycle.recv, bwc->cycle.lost, rate);
 
-            if (-1 == send_custom_lossy_packet(bwc->m->tox, bwc->friend_number, p_msg, sizeof(p_msg)))
-                LOGGER_WARNING("BWC send failed (len: %d)! std error: %s", sizeof(p_msg), strerror(errno));
-        }
+        uint8_t p_msg[sizeof(struct BWCMessage) + 1];
+        struct BWCMessage b_msg;
+
+        b_msg.lost = htonl(bwc->cycle.lost);
+        b_msg.recv = htonl(bwc->cycle.recv);
+        b_msg.bit_rate = htonl(rate);
+        b_msg.flags = htonl(bwc->cycle.key_frame ? BWC_FLAG_KEY_FRAME : 0);
+        memcpy(p_msg + 1, &b_msg, sizeof(b_msg));
+
+        p_msg[0] = BWC_EXT_PACKET_ID;
+
+        if (-1 == send_custom_lossy_packet(bwc->m->tox, bwc->friend_number, p_msg, sizeof(p_msg)))
+            LOGGER_WARNING("BWC send failed (len: %d)! std error: %s", sizeof(p_msg), strerror(errno));
+
+        /* Until the peer shows it knows the extended update it gets the old one too, second so
+         * that a peer that does know it has the extended one first.
+         */
+        p_msg[0] = BWC_PACKET_ID;
+
+        if (!bwc->cycle.peer_extended &&
+                -1 == send_custom_lossy_packet(bwc->m->tox, bwc->friend_number, p_msg, BWC_MESSAGE_SIZE + 1))
+            LOGGER_WARNING("BWC send failed (len: %d)! std error: %s", BWC_MESSAGE_SIZE + 1, strerror(errno));
 
-        bwc->cycle.lsu = current_time_monotonic();
+        bwc->cycle.lost = 0;
+        bwc->cycle.recv = 0;
+        bwc->cycle.sent_rate = rate;
+        bwc->cycle.key_frame = false;
+
+        __atomic_store_n(&bwc->stats.estimate, rate, __ATOMIC_RELAXED);
     }
+
+    bwc->cycle.lsu = now;
 }
 int on_update (BWController *bwc, struct BWCMessage *msg)
 {
     LOGGER_DEBUG ("%p Got update from peer", bwc);
 
     /* Peer must respect time boundary */
-    if (current_time_monotonic() < bwc->cycle.lru + BWC_SEND_INTERVAL_MS) {
+    if (current_time_monotonic() < bwc->cycle.lru + BWC_MIN_SEND_INTERVAL_MS / 2) {
         LOGGER_DEBUG("%p Rejecting extra update", bwc);
         return -1;
     }
 
+    uint32_t elapsed = current_time_monotonic() - bwc->cycle.lru;
     bwc->cycle.lru = current_time_monotonic();
 
     msg->recv = ntohl(msg->recv);
     msg->lost = ntohl(msg->lost);
+    msg->bit_rate = ntohl(msg->bit_rate);
+    msg->flags = ntohl(msg->flags);
+
+    LOGGER_DEBUG ("recved: %u lost: %u rate: %u", msg->recv, msg->lost, msg->bit_rate);
+
+    float loss = msg->lost ? (float) msg->lost / ((uint64_t) msg->recv + msg->lost) : 0;
+    bool congested = m_friend_congested(bwc->m->tox, bwc->friend_number) == 1;
+    uint32_t received = elapsed < BWC_SEND_INTERVAL_MS * 5 ? (uint64_t) msg->recv * 8000 / elapsed : 0;
+    uint32_t target = bwc_target_rate(bwc->target, received, msg->bit_rate, loss, congested);
+    int rtt = m_friend_rtt(bwc->m->tox, bwc->friend_number);
+
+    __atomic_store_n(&bwc->stats.loss, (uint32_t)(loss * 1000), __ATOMIC_RELAXED);
+    __atomic_store_n(&bwc->stats.rtt, rtt > 0 ? rtt : 0, __ATOMIC_RELAXED);
+
+    if (target && target != bwc->target) {
+        bwc->target = target;
+        __atomic_store_n(&bwc->stats.target, target, __ATOMIC_RELAXED);
 
-    LOGGER_DEBUG ("recved: %u lost: %u", msg->recv, msg->lost);
+        if (bwc->mcb)
+            bwc->mcb(bwc, bwc->friend_number, target, bwc->mcb_data);
+    }
 
-    if (msg->lost && bwc->mcb)
-        bwc->mcb(bwc, bwc->friend_number,
-                 ((float) (msg->lost) / (msg->recv + msg->lost)),
-                 bwc->mcb_data);
+    if ((msg->flags & BWC_FLAG_KEY_FRAME) && bwc->kcb)
+        bwc->kcb(bwc, bwc->friend_number, bwc->mcb_data);
 
     return 0;
 }
 int bwc_handle_data(Tox *tox, uint32_t friendnumber, const uint8_t *data, uint16_t length, void *object)
 {
-    if (length - 1 != sizeof(struct BWCMessage))
+    bool extended = data[0] == BWC_EXT_PACKET_ID;
+
+    if (length - 1 != (extended ? sizeof(struct BWCMessage) : BWC_MESSAGE_SIZE))
         return -1;
 
-    /* NOTE the data is mutable */
-    return on_update(object, (struct BWCMessage *) (data + 1));
+    BWController *bwc = object;
+    struct BWCMessage msg;
+    memset(&msg, 0, sizeof(msg));
+    memcpy(&msg, data + 1, length - 1);
+
+    pthread_mutex_lock(bwc->mutex);
+    int rc = 0;
+
+    if (extended)
+        bwc->cycle.peer_extended = true;
+
+    /* The old update of an extended peer repeats its extended one */
+    if (extended || !bwc->cycle.peer_extended)
+        rc = on_update(bwc, &msg);
+
+    pthread_mutex_unlock(bwc->mutex);
+    return rc;
 }
@@ -25,13 +25,86 @@
 
 typedef struct BWController_s BWController;
 
+#define BWC_TREND_WINDOW 20
+
+typedef enum {
+    bwc_Normal,
+    bwc_Overuse,
+    bwc_Underuse,
+} BWCUsage;
+
+/**
+ * Delay based estimate of the rate the peer can send at, kept by the receiving side.
+ * Packets are grouped by send time stamp; a growing gap between how far apart groups
+ * were sent and how far apart they arrived means a queue is building up on the path.
+ * All times are in ms, rates in bit/s.
+ */
+typedef struct {
+    bool started;
+    bool have_prev;
+
+    uint32_t group_first_ts; /* Send time of the first packet of the current group */
+    uint32_t group_ts; /* Send time of its latest packet */
+    uint64_t group_arrival; /* Arrival of its latest packet */
+    uint32_t prev_ts;
+    uint64_t prev_arrival;
+
+    float acc_delay; /* Accumulated delay variation */
+    float smoothed_delay;
+    uint64_t first_arrival;
+    float trend_x[BWC_TREND_WINDOW];
+    float trend_y[BWC_TREND_WINDOW];
+    uint32_t trend_count;
+
+    float trend;
+    float threshold;
+    uint64_t last_threshold_update;
+    uint32_t overuse_time;
+    uint32_t overuse_count;
+    BWCUsage usage;
+
+    uint64_t window_start;
+    uint32_t window_bytes;
+    uint32_t incoming; /* Measured incoming rate */
+
+    uint32_t estimate;
+    uint64_t last_update;
+    uint64_t last_decrease;
+} BWCEstimator;
+
+void bwc_estimator_init(BWCEstimator *est);
+/* Feed a packet of bytes sent at timestamp, by the peer's clock, that arrived now. */
+void bwc_estimator_packet(BWCEstimator *est, uint32_t timestamp, uint32_t bytes, uint64_t now);
+/* Update and return the estimate, 0 until enough was received to tell. */
+uint32_t bwc_estimator_update(BWCEstimator *est, uint64_t now);
+
+/* Rate to send at next given the current one, 0 while no limit is known, the rate the peer
+ * received at, its estimate and the fraction of data lost. Holds instead of increasing
+ * while the connection is congested.
+ */
+uint32_t bwc_target_rate(uint32_t current, uint32_t received, uint32_t estimate, float loss, bool congested);
+
+/* What the controller knows of the connection, for bwc_get_stats(). Rates in bit/s. */
+typedef struct {
+    uint32_t target; /* Rate we may send at, 0 while no limit is known */
+    uint32_t loss; /* Per mille of what we send that the peer last reported lost */
+    uint32_t incoming; /* Rate we receive at */
+    uint32_t estimate; /* Rate we last told the peer it may send at */
+    uint32_t rtt; /* Shortest round trip time of the connection in ms, 0 if not known */
+} BWCStats;
+
 BWController *bwc_new(Messenger *m, uint32_t friendnumber,
-                      void (*mcb) (BWController *, uint32_t, float, void *),
+                      void (*mcb) (BWController *, uint32_t, uint32_t, void *),
+                      void (*kcb) (BWController *, uint32_t, void *),
                       void *udata);
 void bwc_kill(BWController *bwc);
 
 void bwc_feed_avg(BWController *bwc, uint32_t bytes);
 void bwc_add_lost(BWController *bwc, uint32_t bytes);
-void bwc_add_recv(BWController *bwc, uint32_t bytes);
+void bwc_add_recv(BWController *bwc, uint32_t timestamp, uint32_t bytes);
+/* Ask the peer for a key frame, at most once per BWC_KEY_FRAME_INTERVAL_MS. */
+void bwc_request_key_frame(BWController *bwc);
+/* Safe to call from any thread while the controller is in use. */
+void bwc_get_stats(const BWController *bwc, BWCStats *stats);
 
 #endif /* BWCONROLER_H */
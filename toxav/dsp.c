@@ -0,0 +1,357 @@
+/**  dsp.c
+ *
+ *   Copyright (C) 2013-2015 Tox project All Rights Reserved.
+ *
+ *   This file is part of Tox.
+ *
+ *   Tox is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Tox is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Tox. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <math.h>
+#include <string.h>
+
+#include "dsp.h"
+
+#if defined(__AVX2__)
+#define DSP_AVX2
+#include <immintrin.h>
+#endif
+
+#if defined(__SSE2__)
+#define DSP_SSE2
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define DSP_NEON
+#include <arm_neon.h>
+#endif
+
+#define GAIN_SHIFT 12
+#define WEIGHT_SHIFT 14 /* Interpolation weights, 1 << WEIGHT_SHIFT must fit an int16_t */
+#define RESAMPLE_BLOCK 64 /* Values interpolated at a time */
+
+static int16_t saturate(int32_t value)
+{
+    return value > INT16_MAX ? INT16_MAX : (value < INT16_MIN ? INT16_MIN : value);
+}
+
+const char *dsp_simd(void)
+{
+#if defined(DSP_AVX2)
+    return "avx2";
+#elif defined(DSP_SSE2)
+    return "sse2";
+#elif defined(DSP_NEON)
+    return "neon";
+#else
+    return "none";
+#endif
+}
+
+void dsp_mix(int16_t *dst, const int16_t *src, size_t count)
+{
+    size_t i = 0;
+
+#ifdef DSP_AVX2
+
+    for (; i + 16 <= count; i += 16) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(dst + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(src + i));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_adds_epi16(a, b));
+    }
+
+#endif
+#ifdef DSP_SSE2
+
+    for (; i + 8 <= count; i += 8) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(dst + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_adds_epi16(a, b));
+    }
+
+#endif
+#ifdef DSP_NEON
+
+    for (; i + 8 <= count; i += 8)
+        vst1q_s16(dst + i, vqaddq_s16(vld1q_s16(dst + i), vld1q_s16(src + i)));
+
+#endif
+
+    for (; i < count; ++i)
+        dst[i] = saturate(dst[i] + src[i]);
+}
+
+void dsp_gain(int16_t *pcm, size_t count, float gain)
+{
+    int16_t g;
+
+    if (!(gain > 0))
+        g = 0;
+    else if (gain * (1 << GAIN_SHIFT) >= INT16_MAX)
+        g = INT16_MAX;
+    else
+        g = lroundf(gain * (1 << GAIN_SHIFT));
+
+    if (g == 1 << GAIN_SHIFT)
+        return;
+
+    size_t i = 0;
+
+    /* 32 bit products from the low and high halves, rounded back to 16 bits */
+#ifdef DSP_AVX2
+    __m256i g16 = _mm256_set1_epi16(g);
+    __m256i round16 = _mm256_set1_epi32(1 << (GAIN_SHIFT - 1));
+
+    for (; i + 16 <= count; i += 16) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(pcm + i));
+        __m256i lo = _mm256_mullo_epi16(x, g16);
+        __m256i hi = _mm256_mulhi_epi16(x, g16);
+        __m256i p0 = _mm256_srai_epi32(_mm256_add_epi32(_mm256_unpacklo_epi16(lo, hi), round16), GAIN_SHIFT);
+        __m256i p1 = _mm256_srai_epi32(_mm256_add_epi32(_mm256_unpackhi_epi16(lo, hi), round16), GAIN_SHIFT);
+        _mm256_storeu_si256((__m256i *)(pcm + i), _mm256_packs_epi32(p0, p1));
+    }
+
+#endif
+#ifdef DSP_SSE2
+    __m128i g8 = _mm_set1_epi16(g);
+    __m128i round8 = _mm_set1_epi32(1 << (GAIN_SHIFT - 1));
+
+    for (; i + 8 <= count; i += 8) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(pcm + i));
+        __m128i lo = _mm_mullo_epi16(x, g8);
+        __m128i hi = _mm_mulhi_epi16(x, g8);
+        __m128i p0 = _mm_srai_epi32(_mm_add_epi32(_mm_unpacklo_epi16(lo, hi), round8), GAIN_SHIFT);
+        __m128i p1 = _mm_srai_epi32(_mm_add_epi32(_mm_unpackhi_epi16(lo, hi), round8), GAIN_SHIFT);
+        _mm_storeu_si128((__m128i *)(pcm + i), _mm_packs_epi32(p0, p1));
+    }
+
+#endif
+#ifdef DSP_NEON
+
+    for (; i + 8 <= count; i += 8) {
+        int16x8_t x = vld1q_s16(pcm + i);
+        int16x4_t p0 = vqrshrn_n_s32(vmull_n_s16(vget_low_s16(x), g), GAIN_SHIFT);
+        int16x4_t p1 = vqrshrn_n_s32(vmull_n_s16(vget_high_s16(x), g), GAIN_SHIFT);
+        vst1q_s16(pcm + i, vcombine_s16(p0, p1));
+    }
+
+#endif
+
+    for (; i < count; ++i)
+        pcm[i] = saturate((pcm[i] * g + (1 << (GAIN_SHIFT - 1))) >> GAIN_SHIFT);
+}
+
+void dsp_mono_to_stereo(int16_t *dst, const int16_t *src, size_t samples)
+{
+    size_t i = 0;
+
+#ifdef DSP_AVX2
+
+    for (; i + 16 <= samples; i += 16) {
+        /* Unpacking works within 128 bit lanes, put the first 8 samples in the low halves */
+        __m256i x = _mm256_permute4x64_epi64(_mm256_loadu_si256((const __m256i *)(src + i)), 0xd8);
+        _mm256_storeu_si256((__m256i *)(dst + i * 2), _mm256_unpacklo_epi16(x, x));
+        _mm256_storeu_si256((__m256i *)(dst + i * 2 + 16), _mm256_unpackhi_epi16(x, x));
+    }
+
+#endif
+#ifdef DSP_SSE2
+
+    for (; i + 8 <= samples; i += 8) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_si128((__m128i *)(dst + i * 2), _mm_unpacklo_epi16(x, x));
+        _mm_storeu_si128((__m128i *)(dst + i * 2 + 8), _mm_unpackhi_epi16(x, x));
+    }
+
+#endif
+#ifdef DSP_NEON
+
+    for (; i + 8 <= samples; i += 8) {
+        int16x8x2_t x;
+        x.val[0] = x.val[1] = vld1q_s16(src + i);
+        vst2q_s16(dst + i * 2, x);
+    }
+
+#endif
+
+    for (; i < samples; ++i)
+        dst[i * 2] = dst[i * 2 + 1] = src[i];
+}
+
+void dsp_stereo_to_mono(int16_t *dst, const int16_t *src, size_t samples)
+{
+    size_t i = 0;
+
+    /* Everything is loaded before it is stored, which keeps working in place */
+#ifdef DSP_AVX2
+    __m256i ones16 = _mm256_set1_epi16(1);
+
+    for (; i + 16 <= samples; i += 16) {
+        __m256i a = _mm256_madd_epi16(_mm256_loadu_si256((const __m256i *)(src + i * 2)), ones16);
+        __m256i b = _mm256_madd_epi16(_mm256_loadu_si256((const __m256i *)(src + i * 2 + 16)), ones16);
+        __m256i m = _mm256_packs_epi32(_mm256_srai_epi32(a, 1), _mm256_srai_epi32(b, 1));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_permute4x64_epi64(m, 0xd8));
+    }
+
+#endif
+#ifdef DSP_SSE2
+    __m128i ones8 = _mm_set1_epi16(1);
+
+    for (; i + 8 <= samples; i += 8) {
+        __m128i a = _mm_madd_epi16(_mm_loadu_si128((const __m128i *)(src + i * 2)), ones8);
+        __m128i b = _mm_madd_epi16(_mm_loadu_si128((const __m128i *)(src + i * 2 + 8)), ones8);
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_packs_epi32(_mm_srai_epi32(a, 1), _mm_srai_epi32(b, 1)));
+    }
+
+#endif
+#ifdef DSP_NEON
+
+    for (; i + 8 <= samples; i += 8) {
+        int16x8x2_t x = vld2q_s16(src + i * 2);
+        vst1q_s16(dst + i, vhaddq_s16(x.val[0], x.val[1]));
+    }
+
+#endif
+
+    for (; i < samples; ++i)
+        dst[i] = (src[i * 2] + src[i * 2 + 1]) >> 1;
+}
+
+/* out[k] = pairs[2k] * weights[2k] + pairs[2k + 1] * weights[2k + 1], rounded */
+static void interpolate(int16_t *out, const int16_t *pairs, const int16_t *weights, unsigned int count)
+{
+    unsigned int i = 0;
+
+#ifdef DSP_AVX2
+    __m256i round16 = _mm256_set1_epi32(1 << (WEIGHT_SHIFT - 1));
+
+    for (; i + 8 <= count; i += 8) {
+        __m256i p = _mm256_loadu_si256((const __m256i *)(pairs + i * 2));
+        __m256i w = _mm256_loadu_si256((const __m256i *)(weights + i * 2));
+        __m256i s = _mm256_srai_epi32(_mm256_add_epi32(_mm256_madd_epi16(p, w), round16), WEIGHT_SHIFT);
+        s = _mm256_permute4x64_epi64(_mm256_packs_epi32(s, s), 0xd8);
+        _mm_storeu_si128((__m128i *)(out + i), _mm256_castsi256_si128(s));
+    }
+
+#endif
+#ifdef DSP_SSE2
+    __m128i round8 = _mm_set1_epi32(1 << (WEIGHT_SHIFT - 1));
+
+    for (; i + 8 <= count; i += 8) {
+        __m128i p0 = _mm_loadu_si128((const __m128i *)(pairs + i * 2));
+        __m128i w0 = _mm_loadu_si128((const __m128i *)(weights + i * 2));
+        __m128i p1 = _mm_loadu_si128((const __m128i *)(pairs + i * 2 + 8));
+        __m128i w1 = _mm_loadu_si128((const __m128i *)(weights + i * 2 + 8));
+        __m128i s0 = _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(p0, w0), round8), WEIGHT_SHIFT);
+        __m128i s1 = _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(p1, w1), round8), WEIGHT_SHIFT);
+        _mm_storeu_si128((__m128i *)(out + i), _mm_packs_epi32(s0, s1));
+    }
+
+#endif
+#ifdef DSP_NEON
+
+    for (; i + 8 <= count; i += 8) {
+        int16x8x2_t p = vld2q_s16(pairs + i * 2);
+        int16x8x2_t w = vld2q_s16(weights + i * 2);
+        int32x4_t lo = vmlal_s16(vmull_s16(vget_low_s16(p.val[0]), vget_low_s16(w.val[0])),
+                                 vget_low_s16(p.val[1]), vget_low_s16(w.val[1]));
+        int32x4_t hi = vmlal_s16(vmull_s16(vget_high_s16(p.val[0]), vget_high_s16(w.val[0])),
+                                 vget_high_s16(p.val[1]), vget_high_s16(w.val[1]));
+        vst1q_s16(out + i, vcombine_s16(vqrshrn_n_s32(lo, WEIGHT_SHIFT), vqrshrn_n_s32(hi, WEIGHT_SHIFT)));
+    }
+
+#endif
+
+    for (; i < count; ++i)
+        out[i] = saturate((pairs[i * 2] * weights[i * 2] + pairs[i * 2 + 1] * weights[i * 2 + 1]
+                           + (1 << (WEIGHT_SHIFT - 1))) >> WEIGHT_SHIFT);
+}
+
+int dsp_resampler_init(DSPResampler *r, uint32_t in_rate, uint32_t out_rate, uint8_t channels)
+{
+    if (!r || !in_rate || !out_rate || (channels != 1 && channels != 2))
+        return -1;
+
+    uint32_t a = in_rate, b = out_rate;
+
+    while (b) {
+        uint32_t t = a % b;
+        a = b;
+        b = t;
+    }
+
+    memset(r, 0, sizeof(DSPResampler));
+    r->in_rate = in_rate / a;
+    r->out_rate = out_rate / a;
+    r->channels = channels;
+    return 0;
+}
+
+size_t dsp_resample_size(const DSPResampler *r, size_t samples)
+{
+    if (r->pos >= samples)
+        return 0;
+
+    /* Outputs j with pos + (phase + j * in_rate) / out_rate < samples */
+    uint64_t room = (uint64_t)(samples - r->pos) * r->out_rate - r->phase;
+    return (room + r->in_rate - 1) / r->in_rate;
+}
+
+size_t dsp_resample(DSPResampler *r, int16_t *out, const int16_t *in, size_t samples)
+{
+    int16_t pairs[RESAMPLE_BLOCK * 2], weights[RESAMPLE_BLOCK * 2];
+    uint32_t step = r->in_rate / r->out_rate;
+    uint32_t step_phase = r->in_rate % r->out_rate;
+    unsigned int channels = r->channels;
+    size_t written = 0;
+
+    if (!samples)
+        return 0;
+
+    /* Gather the two samples around each output and their weights, then interpolate a block at once */
+    while (r->pos < samples) {
+        unsigned int n = 0;
+
+        while (n + channels <= RESAMPLE_BLOCK && r->pos < samples) {
+            int16_t w = ((uint64_t)r->phase << WEIGHT_SHIFT) / r->out_rate;
+            unsigned int c;
+
+            for (c = 0; c < channels; ++c, ++n) {
+                pairs[n * 2] = r->pos ? in[(r->pos - 1) * channels + c] : r->prev[c];
+                pairs[n * 2 + 1] = in[r->pos * channels + c];
+                weights[n * 2] = (1 << WEIGHT_SHIFT) - w;
+                weights[n * 2 + 1] = w;
+            }
+
+            r->pos += step;
+            r->phase += step_phase;
+
+            if (r->phase >= r->out_rate) {
+                r->phase -= r->out_rate;
+                ++r->pos;
+            }
+        }
+
+        interpolate(out + written, pairs, weights, n);
+        written += n;
+    }
+
+    memcpy(r->prev, in + (samples - 1) * channels, channels * sizeof(int16_t));
+    r->pos -= samples;
+    return written / channels;
+}
@@ -0,0 +1,76 @@
+/**  dsp.h
+ *
+ *   Copyright (C) 2013-2015 Tox project All Rights Reserved.
+ *
+ *   This file is part of Tox.
+ *
+ *   Tox is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Tox is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Tox. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef DSP_H
+#define DSP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* 16 bit PCM kernels. Stereo audio is interleaved, sample counts are per channel.
+ *
+ * They use AVX2, SSE2 or NEON when the compiler targets them and give the same
+ * results as the plain C they fall back to.
+ */
+
+/* Name of the instruction set the kernels were built for. */
+const char *dsp_simd(void);
+
+/* dst[i] += src[i], saturating instead of wrapping around on overflow. */
+void dsp_mix(int16_t *dst, const int16_t *src, size_t count);
+
+/* Scale pcm by gain, between 0 and 8 in steps of 1/4096. */
+void dsp_gain(int16_t *pcm, size_t count, float gain);
+
+/* Duplicate mono audio into both channels. dst must not overlap src. */
+void dsp_mono_to_stereo(int16_t *dst, const int16_t *src, size_t samples);
+
+/* Average the channels of stereo audio. dst may be src. */
+void dsp_stereo_to_mono(int16_t *dst, const int16_t *src, size_t samples);
+
+/* Linear interpolating resampler. It keeps its position between calls, so a stream
+ * can be resampled a frame at a time, and steps by the exact ratio of the rates:
+ * a frame of a length both rates divide evenly always gives the same number of
+ * samples out. Output lags input by one input sample.
+ */
+typedef struct {
+    uint32_t in_rate, out_rate; /* Divided by their greatest common divisor */
+    uint8_t channels;
+    size_t pos; /* Input sample right of the next output, 0 being the last one of the previous call */
+    uint32_t phase; /* Distance of the next output from the sample left of it, in 1/out_rate */
+    int16_t prev[2]; /* Last input sample of the previous call */
+} DSPResampler;
+
+/* return 0 on success.
+ * return -1 on failure.
+ */
+int dsp_resampler_init(DSPResampler *r, uint32_t in_rate, uint32_t out_rate, uint8_t channels);
+
+/* return the number of samples dsp_resample() will give for samples of input. */
+size_t dsp_resample_size(const DSPResampler *r, size_t samples);
+
+/* Resample samples of in into out, which must hold dsp_resample_size() of them.
+ *
+ * return the number of samples written to out.
+ */
+size_t dsp_resample(DSPResampler *r, int16_t *out, const int16_t *in, size_t samples);
+
+#endif /* DSP_H */
@@ -23,12 +23,21 @@
 #endif /* HAVE_CONFIG_H */
 
 #include "group.h"
+#include "dsp.h"
 #include "../toxcore/util.h"
 #include "../toxcore/logger.h"
 
 #define GROUP_JBUF_SIZE 6
 #define GROUP_JBUF_DEAD_SECONDS 4
 
+#define GROUP_AUDIO_SAMPLE_RATE 48000
+#define GROUP_AUDIO_MAX_SAMPLES 5760 /* 120ms, the longest opus frame */
+
+#define GROUP_MIX_FRAME_MS 20
+#define GROUP_MIX_FRAME_SAMPLES (GROUP_AUDIO_SAMPLE_RATE / 1000 * GROUP_MIX_FRAME_MS)
+#define GROUP_MIX_MAX_DELAY_MS 60 /* Audio of a peer waiting to be mixed beyond this is dropped */
+#define GROUP_MIX_MAX_SAMPLES (GROUP_AUDIO_SAMPLE_RATE / 1000 * GROUP_MIX_MAX_DELAY_MS + GROUP_AUDIO_MAX_SAMPLES)
+
 typedef struct {
     uint16_t sequnum;
     uint16_t length;
@@ -149,6 +158,12 @@ static Group_Audio_Packet *dequeue(Group_JitterBuffer *q, int *success)
     return NULL;
 }
 
+/* Audio waiting to be mixed, 48kHz in the mixer's channel count */
+typedef struct {
+    int16_t *pcm;
+    unsigned int samples; /* Per channel */
+} Group_Mix_Input;
+
 typedef struct {
     Group_Chats *g_c;
     OpusEncoder *audio_encoder;
@@ -160,14 +175,43 @@ typedef struct {
     void (*audio_data)(Tox *tox, int groupnumber, int peernumber, const int16_t *pcm, unsigned int samples,
                        uint8_t channels, unsigned int sample_rate, void *userdata);
     void *userdata;
+
+    int16_t decoded[GROUP_AUDIO_MAX_SAMPLES * 2];
+
+    /* Audio sent at a rate opus doesn't take is resampled to 48kHz */
+    DSPResampler resampler;
+    unsigned int resampler_rate;
+    uint8_t resampler_channels;
+    int16_t resampled[GROUP_AUDIO_MAX_SAMPLES * 2];
+
+    /* Mixer mode, see group_set_audio_mixer() */
+    uint8_t mix_channels; /* 0 when off */
+    uint64_t next_mix; /* When the next mixed frame is due */
+    Group_Mix_Input self_mix; /* Our own audio */
+    int16_t mixed[GROUP_MIX_FRAME_SAMPLES * 2];
+    int16_t mix_minus[GROUP_MIX_FRAME_SAMPLES * 2];
 } Group_AV;
 
+/* An opus stream from a peer */
 typedef struct {
     Group_JitterBuffer *buffer;
 
     OpusDecoder *audio_decoder;
-    int decoder_channels;
+    int decoder_channels; /* Of the last packet, the decoder itself is stereo */
     unsigned int last_packet_samples;
+} Group_Audio_Stream;
+
+typedef struct {
+    Group_Audio_Stream audio;
+
+    /* Mixer mode, see group_set_audio_mixer() */
+    Group_Mix_Input mix;
+    OpusEncoder *mix_encoder; /* Of the mix-minus sent back to them */
+    uint8_t mix_encoder_channels;
+
+    /* Their mix without us, played in place of their full mix while it comes */
+    Group_Audio_Stream mix_minus;
+    uint64_t last_mix_minus;
 } Group_Peer_AV;
 
 static void kill_group_av(Group_AV *group_av)
@@ -176,44 +220,124 @@ static void kill_group_av(Group_AV *group_av)
         opus_encoder_destroy(group_av->audio_encoder);
     }
 
+    free(group_av->self_mix.pcm);
     free(group_av);
 }
 
-static int recreate_encoder(Group_AV *group_av)
+/* Queue samples of pcm for the next mixed frames, converting to the mixer's channel count.
+ * The oldest audio is dropped when more than GROUP_MIX_MAX_DELAY_MS is waiting.
+ */
+static int mix_input_write(Group_Mix_Input *in, uint8_t mix_channels, const int16_t *pcm, unsigned int samples,
+                           uint8_t channels)
 {
-    if (group_av->audio_encoder) {
-        opus_encoder_destroy(group_av->audio_encoder);
-        group_av->audio_encoder = NULL;
+    if (!in->pcm && !(in->pcm = malloc(GROUP_MIX_MAX_SAMPLES * 2 * sizeof(int16_t))))
+        return -1;
+
+    if (samples > GROUP_MIX_MAX_SAMPLES)
+        return -1;
+
+    if (in->samples + samples > GROUP_MIX_MAX_SAMPLES) {
+        unsigned int drop = in->samples + samples - GROUP_MIX_MAX_SAMPLES;
+        memmove(in->pcm, in->pcm + drop * mix_channels, (in->samples - drop) * mix_channels * sizeof(int16_t));
+        in->samples -= drop;
     }
 
+    int16_t *dst = in->pcm + in->samples * mix_channels;
+
+    if (channels == mix_channels) {
+        memcpy(dst, pcm, samples * channels * sizeof(int16_t));
+    } else if (channels == 1) {
+        dsp_mono_to_stereo(dst, pcm, samples);
+    } else {
+        dsp_stereo_to_mono(dst, pcm, samples);
+    }
+
+    in->samples += samples;
+    return 0;
+}
+
+/* Add up to a frame of what in has waiting to be mixed, leaving it waiting. */
+static void mix_input_add(const Group_Mix_Input *in, uint8_t mix_channels, int16_t *mixed)
+{
+    unsigned int samples = MIN(in->samples, GROUP_MIX_FRAME_SAMPLES);
+
+    if (samples)
+        dsp_mix(mixed, in->pcm, samples * mix_channels);
+}
+
+/* Drop up to a frame of what in has waiting to be mixed. */
+static void mix_input_skip(Group_Mix_Input *in, uint8_t mix_channels)
+{
+    unsigned int samples = MIN(in->samples, GROUP_MIX_FRAME_SAMPLES);
+
+    if (!samples)
+        return;
+
+    in->samples -= samples;
+    memmove(in->pcm, in->pcm + samples * mix_channels, in->samples * mix_channels * sizeof(int16_t));
+}
+
+/* Add up to a frame of what in has waiting to be mixed. */
+static void mix_input_read(Group_Mix_Input *in, uint8_t mix_channels, int16_t *mixed)
+{
+    mix_input_add(in, mix_channels, mixed);
+    mix_input_skip(in, mix_channels);
+}
+
+static unsigned int audio_bitrate(unsigned int channels)
+{
+    if (channels == 1) {
+        return 32000; //TODO: add way of adjusting bitrate
+    } else {
+        return 64000; //TODO: add way of adjusting bitrate
+    }
+}
+
+/* return a new encoder on success.
+ * return NULL on failure.
+ */
+static OpusEncoder *create_encoder(unsigned int sample_rate, unsigned int channels, unsigned int bitrate)
+{
     int rc = OPUS_OK;
-    group_av->audio_encoder = opus_encoder_create(group_av->audio_sample_rate, group_av->audio_channels,
-                              OPUS_APPLICATION_AUDIO, &rc);
+    OpusEncoder *encoder = opus_encoder_create(sample_rate, channels, OPUS_APPLICATION_AUDIO, &rc);
 
     if (rc != OPUS_OK) {
         LOGGER_ERROR("Error while starting audio encoder: %s", opus_strerror(rc));
-        group_av->audio_encoder = NULL;
-        return -1;
+        return NULL;
     }
 
-    rc = opus_encoder_ctl(group_av->audio_encoder, OPUS_SET_BITRATE(group_av->audio_bitrate));
+    rc = opus_encoder_ctl(encoder, OPUS_SET_BITRATE(bitrate));
 
     if (rc != OPUS_OK) {
         LOGGER_ERROR("Error while setting encoder ctl: %s", opus_strerror(rc));
-        opus_encoder_destroy(group_av->audio_encoder);
-        group_av->audio_encoder = NULL;
-        return -1;
+        opus_encoder_destroy(encoder);
+        return NULL;
     }
 
-    rc = opus_encoder_ctl(group_av->audio_encoder, OPUS_SET_COMPLEXITY(10));
+    rc = opus_encoder_ctl(encoder, OPUS_SET_COMPLEXITY(10));
 
     if (rc != OPUS_OK) {
         LOGGER_ERROR("Error while setting encoder ctl: %s", opus_strerror(rc));
+        opus_encoder_destroy(encoder);
+        return NULL;
+    }
+
+    return encoder;
+}
+
+static int recreate_encoder(Group_AV *group_av)
+{
+    if (group_av->audio_encoder) {
         opus_encoder_destroy(group_av->audio_encoder);
         group_av->audio_encoder = NULL;
-        return -1;
     }
 
+    group_av->audio_encoder = create_encoder(group_av->audio_sample_rate, group_av->audio_channels,
+                              group_av->audio_bitrate);
+
+    if (!group_av->audio_encoder)
+        return -1;
+
     return 0;
 }
 
@@ -244,10 +368,19 @@ static void group_av_peer_new(void *object, int groupnumber, int friendgroupnumb
     if (!peer_av)
         return;
 
-    peer_av->buffer = create_queue(GROUP_JBUF_SIZE);
+    peer_av->audio.buffer = create_queue(GROUP_JBUF_SIZE);
+    peer_av->mix_minus.buffer = create_queue(GROUP_JBUF_SIZE);
     group_peer_set_object(group_av->g_c, groupnumber, friendgroupnumber, peer_av);
 }
 
+static void close_audio_stream(Group_Audio_Stream *stream)
+{
+    if (stream->audio_decoder)
+        opus_decoder_destroy(stream->audio_decoder);
+
+    terminate_queue(stream->buffer);
+}
+
 static void group_av_peer_delete(void *object, int groupnumber, int friendgroupnumber, void *peer_object)
 {
     Group_Peer_AV *peer_av = peer_object;
@@ -255,10 +388,12 @@ static void group_av_peer_delete(void *object, int groupnumber, int friendgroupn
     if (!peer_av)
         return;
 
-    if (peer_av->audio_decoder)
-        opus_decoder_destroy(peer_av->audio_decoder);
+    if (peer_av->mix_encoder)
+        opus_encoder_destroy(peer_av->mix_encoder);
 
-    terminate_queue(peer_av->buffer);
+    close_audio_stream(&peer_av->audio);
+    close_audio_stream(&peer_av->mix_minus);
+    free(peer_av->mix.pcm);
     free(peer_object);
 }
 
@@ -268,21 +403,21 @@ static void group_av_groupchat_delete(void *object, int groupnumber)
         kill_group_av(object);
 }
 
-static int decode_audio_packet(Group_AV *group_av, Group_Peer_AV *peer_av, int groupnumber, int friendgroupnumber)
+static int decode_audio_packet(Group_AV *group_av, Group_Peer_AV *peer_av, Group_Audio_Stream *stream, int groupnumber,
+                               int friendgroupnumber)
 {
     if (!group_av || !peer_av)
         return -1;
 
     int success;
-    Group_Audio_Packet *pk = dequeue(peer_av->buffer, &success);
+    Group_Audio_Packet *pk = dequeue(stream->buffer, &success);
 
     if (success == 0)
         return -1;
 
-    int16_t *out_audio = NULL;
     int out_audio_samples = 0;
 
-    unsigned int sample_rate = 48000;
+    unsigned int sample_rate = GROUP_AUDIO_SAMPLE_RATE;
 
     if (success == 1) {
         int channels = opus_packet_get_nb_channels(pk->data);
@@ -297,72 +432,173 @@ static int decode_audio_packet(Group_AV *group_av, Group_Peer_AV *peer_av, int g
             return -1;
         }
 
-        if (channels != peer_av->decoder_channels) {
-            if (peer_av->audio_decoder) {
-                opus_decoder_destroy(peer_av->audio_decoder);
-                peer_av->audio_decoder = NULL;
-            }
-
+        if (!stream->audio_decoder) {
+            /* A stereo decoder takes mono packets too, so peers can switch without a new one */
             int rc;
-            peer_av->audio_decoder = opus_decoder_create(sample_rate, channels, &rc);
+            stream->audio_decoder = opus_decoder_create(sample_rate, 2, &rc);
 
             if (rc != OPUS_OK) {
                 LOGGER_ERROR("Error while starting audio decoder: %s", opus_strerror(rc));
+                stream->audio_decoder = NULL;
                 free(pk);
                 return -1;
             }
-
-            peer_av->decoder_channels = channels;
         }
 
-        int num_samples = opus_decoder_get_nb_samples(peer_av->audio_decoder, pk->data, pk->length);
+        stream->decoder_channels = channels;
 
-        out_audio = malloc(num_samples * peer_av->decoder_channels * sizeof(int16_t));
+        int num_samples = opus_decoder_get_nb_samples(stream->audio_decoder, pk->data, pk->length);
 
-        if (!out_audio) {
+        if (num_samples <= 0 || num_samples > GROUP_AUDIO_MAX_SAMPLES) {
             free(pk);
             return -1;
         }
 
-        out_audio_samples = opus_decode(peer_av->audio_decoder, pk->data, pk->length, out_audio, num_samples, 0);
+        out_audio_samples = opus_decode(stream->audio_decoder, pk->data, pk->length, group_av->decoded, num_samples, 0);
         free(pk);
 
         if (out_audio_samples <= 0)
             return -1;
 
-        peer_av->last_packet_samples = out_audio_samples;
+        stream->last_packet_samples = out_audio_samples;
     } else {
-        if (!peer_av->audio_decoder)
+        if (!stream->audio_decoder)
             return -1;
 
-        if (!peer_av->last_packet_samples)
+        if (!stream->last_packet_samples)
             return -1;
 
-        out_audio = malloc(peer_av->last_packet_samples * peer_av->decoder_channels * sizeof(int16_t));
+        out_audio_samples = opus_decode(stream->audio_decoder, NULL, 0, group_av->decoded, stream->last_packet_samples, 1);
 
-        if (!out_audio) {
-            free(pk);
+        if (out_audio_samples <= 0)
             return -1;
+
+    }
+
+    if (stream->decoder_channels == 1)
+        dsp_stereo_to_mono(group_av->decoded, group_av->decoded, out_audio_samples);
+
+    if (group_av->mix_channels)
+        return mix_input_write(&peer_av->mix, group_av->mix_channels, group_av->decoded, out_audio_samples,
+                               stream->decoder_channels);
+
+    if (group_av->audio_data)
+        group_av->audio_data(group_av->g_c->tox, groupnumber, friendgroupnumber, group_av->decoded, out_audio_samples,
+                             stream->decoder_channels, sample_rate, group_av->userdata);
+
+    return 0;
+}
+
+static int send_audio(Group_AV *group_av, int groupnumber, const int16_t *pcm, unsigned int samples,
+                      uint8_t channels, unsigned int sample_rate);
+static int send_mix_minus(Group_AV *group_av, int groupnumber, int peernumber, Group_Peer_AV *peer_av,
+                          const int16_t *pcm);
+
+/* Mix the frames that are due, hand them to the app and send them to the group.
+ *
+ * Nobody gets their own audio back: the app is given the mix of the peers and each peer
+ * that is talking is sent the mix without them over our direct connection to them. The
+ * full mix goes to the group, so every listener gets one stream however many talk.
+ */
+static void mix_audio(Group_AV *group_av, int groupnumber)
+{
+    uint64_t now = current_time_monotonic();
+
+    if (!group_av->next_mix)
+        group_av->next_mix = now + GROUP_MIX_FRAME_MS; /* One frame for the others to arrive */
+
+    /* Nothing was heard for a while, start over rather than catch up */
+    if (now > group_av->next_mix + GROUP_MIX_MAX_DELAY_MS)
+        group_av->next_mix = now;
+
+    uint8_t channels = group_av->mix_channels;
+
+    while (group_av->next_mix <= now) {
+        int num_peers = group_number_peers(group_av->g_c, groupnumber);
+        bool heard = false;
+        int i, j;
+
+        memset(group_av->mixed, 0, sizeof(group_av->mixed));
+
+        for (i = 0; i < num_peers; ++i) {
+            Group_Peer_AV *peer_av = group_peer_get_object(group_av->g_c, groupnumber, i);
+
+            if (peer_av && peer_av->mix.samples) {
+                mix_input_add(&peer_av->mix, channels, group_av->mixed);
+                heard = true;
+            }
         }
 
-        out_audio_samples = opus_decode(peer_av->audio_decoder, NULL, 0, out_audio, peer_av->last_packet_samples, 1);
+        group_av->next_mix += GROUP_MIX_FRAME_MS;
 
-        if (out_audio_samples <= 0)
-            return -1;
+        if (heard && group_av->audio_data)
+            group_av->audio_data(group_av->g_c->tox, groupnumber, -1, group_av->mixed, GROUP_MIX_FRAME_SAMPLES,
+                                 channels, GROUP_AUDIO_SAMPLE_RATE, group_av->userdata);
+
+        if (!heard && !group_av->self_mix.samples)
+            continue;
+
+        /* Sent ahead of the full mix, so the talker has it when the full mix of the frame comes */
+        for (i = 0; i < num_peers; ++i) {
+            Group_Peer_AV *peer_av = group_peer_get_object(group_av->g_c, groupnumber, i);
+
+            if (!peer_av || !peer_av->mix.samples)
+                continue;
+
+            memset(group_av->mix_minus, 0, sizeof(group_av->mix_minus));
+            mix_input_add(&group_av->self_mix, channels, group_av->mix_minus);
+
+            for (j = 0; j < num_peers; ++j) {
+                Group_Peer_AV *other_av = group_peer_get_object(group_av->g_c, groupnumber, j);
 
+                if (j != i && other_av)
+                    mix_input_add(&other_av->mix, channels, group_av->mix_minus);
+            }
+
+            send_mix_minus(group_av, groupnumber, i, peer_av, group_av->mix_minus);
+        }
+
+        for (i = 0; i < num_peers; ++i) {
+            Group_Peer_AV *peer_av = group_peer_get_object(group_av->g_c, groupnumber, i);
+
+            if (peer_av)
+                mix_input_skip(&peer_av->mix, channels);
+        }
+
+        mix_input_read(&group_av->self_mix, channels, group_av->mixed);
+        send_audio(group_av, groupnumber, group_av->mixed, GROUP_MIX_FRAME_SAMPLES, channels, GROUP_AUDIO_SAMPLE_RATE);
     }
+}
 
-    if (out_audio) {
+/* Queue an audio packet of a stream of peer_av and decode what can be.
+ *
+ * return 0 if it was queued.
+ * return -1 if it wasn't.
+ */
+static int queue_audio_packet(Group_AV *group_av, Group_Peer_AV *peer_av, Group_Audio_Stream *stream, int groupnumber,
+                              int friendgroupnumber, uint16_t sequnum, const uint8_t *data, uint16_t length)
+{
+    Group_Audio_Packet *pk = calloc(1, sizeof(Group_Audio_Packet) + length);
 
-        if (group_av->audio_data)
-            group_av->audio_data(group_av->g_c->tox, groupnumber, friendgroupnumber, out_audio, out_audio_samples,
-                                 peer_av->decoder_channels, sample_rate, group_av->userdata);
+    if (!pk) {
+        return -1;
+    }
 
-        free(out_audio);
-        return 0;
+    pk->sequnum = sequnum;
+    pk->length = length;
+    memcpy(pk->data, data, length);
+
+    if (queue(stream->buffer, pk) == -1) {
+        free(pk);
+        return -1;
     }
 
-    return -1;
+    while (decode_audio_packet(group_av, peer_av, stream, groupnumber, friendgroupnumber) == 0);
+
+    if (group_av->mix_channels)
+        mix_audio(group_av, groupnumber);
+
+    return 0;
 }
 
 static int handle_group_audio_packet(void *object, int groupnumber, int friendgroupnumber, void *peer_object,
@@ -372,28 +608,45 @@ static int handle_group_audio_packet(void *object, int groupnumber, int friendgr
         return -1;
     }
 
+    Group_AV *group_av = object;
     Group_Peer_AV *peer_av = peer_object;
 
-    Group_Audio_Packet *pk = calloc(1, sizeof(Group_Audio_Packet) + (length - sizeof(uint16_t)));
+    uint16_t sequnum;
+    memcpy(&sequnum, packet, sizeof(sequnum));
 
-    if (!pk) {
+    /* While they send us a mix without us their full mix is only relayed */
+    if (!peer_av->last_mix_minus || current_time_monotonic() - peer_av->last_mix_minus > GROUP_MIX_MAX_DELAY_MS)
+        queue_audio_packet(group_av, peer_av, &peer_av->audio, groupnumber, friendgroupnumber, ntohs(sequnum),
+                           packet + sizeof(uint16_t), length - sizeof(uint16_t));
+
+    if (group_av->mix_channels)
+        return -1; /* The mix goes out instead */
+
+    return 0;
+}
+
+static int handle_group_mix_minus_packet(void *object, int groupnumber, int friendgroupnumber, void *peer_object,
+        const uint8_t *packet, uint16_t length)
+{
+    if (!peer_object || !object || length <= sizeof(uint16_t)) {
         return -1;
     }
 
-    uint16_t sequnum;
-    memcpy(&sequnum, packet, sizeof(sequnum));
-    pk->sequnum = ntohs(sequnum);
-    pk->length = length - sizeof(uint16_t);
-    memcpy(pk->data, packet + sizeof(uint16_t), length - sizeof(uint16_t));
+    Group_AV *group_av = object;
+    Group_Peer_AV *peer_av = peer_object;
 
-    if (queue(peer_av->buffer, pk) == -1) {
-        free(pk);
+    /* Our own mix already leaves us out */
+    if (group_av->mix_channels)
         return -1;
-    }
 
-    while (decode_audio_packet(object, peer_av, groupnumber, friendgroupnumber) == 0);
+    uint16_t sequnum;
+    memcpy(&sequnum, packet, sizeof(sequnum));
 
-    return 0;
+    if (queue_audio_packet(group_av, peer_av, &peer_av->mix_minus, groupnumber, friendgroupnumber, ntohs(sequnum),
+                           packet + sizeof(uint16_t), length - sizeof(uint16_t)) == 0)
+        peer_av->last_mix_minus = current_time_monotonic();
+
+    return -1; /* It was sent to us alone */
 }
 
 /* Convert groupchat to an A/V groupchat.
@@ -421,6 +674,7 @@ static int groupchat_enable_av(Group_Chats *g_c, int groupnumber, void (*audio_c
     }
 
     group_lossy_packet_registerhandler(g_c, GROUP_AUDIO_PACKET_ID, &handle_group_audio_packet);
+    group_lossy_packet_registerhandler(g_c, GROUP_MIX_MINUS_PACKET_ID, &handle_group_mix_minus_packet);
     return 0;
 }
 
@@ -492,6 +746,93 @@ static int send_audio_packet(Group_Chats *g_c, int groupnumber, uint8_t *packet,
     return 0;
 }
 
+/* Encode audio and send it to the group chat.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+static int send_audio(Group_AV *group_av, int groupnumber, const int16_t *pcm, unsigned int samples,
+                      uint8_t channels, unsigned int sample_rate)
+{
+    if (!group_av->audio_encoder || group_av->audio_channels != channels || group_av->audio_sample_rate != sample_rate) {
+        group_av->audio_channels = channels;
+        group_av->audio_sample_rate = sample_rate;
+
+        group_av->audio_bitrate = audio_bitrate(channels);
+
+        if (recreate_encoder(group_av) == -1)
+            return -1;
+    }
+
+    uint8_t encoded[1024];
+    int32_t size = opus_encode(group_av->audio_encoder, pcm, samples, encoded, sizeof(encoded));
+
+    if (size <= 0)
+        return -1;
+
+    return send_audio_packet(group_av->g_c, groupnumber, encoded, size);
+}
+
+/* Encode the mix-minus of a talker and send it to them alone, over our direct connection.
+ * It has its own encoder, so they decode it apart from the full mix.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+static int send_mix_minus(Group_AV *group_av, int groupnumber, int peernumber, Group_Peer_AV *peer_av,
+                          const int16_t *pcm)
+{
+    uint8_t channels = group_av->mix_channels;
+
+    if (!peer_av->mix_encoder || peer_av->mix_encoder_channels != channels) {
+        if (peer_av->mix_encoder)
+            opus_encoder_destroy(peer_av->mix_encoder);
+
+        peer_av->mix_encoder = create_encoder(GROUP_AUDIO_SAMPLE_RATE, channels, audio_bitrate(channels));
+        peer_av->mix_encoder_channels = channels;
+
+        if (!peer_av->mix_encoder)
+            return -1;
+    }
+
+    uint8_t data[1 + sizeof(uint16_t) + 1024];
+    unsigned int header = 1 + sizeof(uint16_t);
+    data[0] = GROUP_MIX_MINUS_PACKET_ID;
+
+    uint16_t sequnum = htons(group_av->audio_sequnum);
+    memcpy(data + 1, &sequnum, sizeof(sequnum));
+
+    int32_t size = opus_encode(peer_av->mix_encoder, pcm, GROUP_MIX_FRAME_SAMPLES, data + header, sizeof(data) - header);
+
+    if (size <= 0)
+        return -1;
+
+    return send_group_lossy_packet_peer(group_av->g_c, groupnumber, peernumber, data, header + size);
+}
+
+/* Resample audio to 48kHz.
+ *
+ * return the resampled audio and set samples to its length on success.
+ * return NULL on failure.
+ */
+static const int16_t *resample_audio(Group_AV *group_av, const int16_t *pcm, unsigned int *samples, uint8_t channels,
+                                     unsigned int sample_rate)
+{
+    if (group_av->resampler_rate != sample_rate || group_av->resampler_channels != channels) {
+        if (dsp_resampler_init(&group_av->resampler, sample_rate, GROUP_AUDIO_SAMPLE_RATE, channels) == -1)
+            return NULL;
+
+        group_av->resampler_rate = sample_rate;
+        group_av->resampler_channels = channels;
+    }
+
+    if (dsp_resample_size(&group_av->resampler, *samples) > GROUP_AUDIO_MAX_SAMPLES)
+        return NULL;
+
+    *samples = dsp_resample(&group_av->resampler, group_av->resampled, pcm, *samples);
+    return group_av->resampled;
+}
+
 /* Send audio to the group chat.
  *
  * return 0 on success.
@@ -508,28 +849,68 @@ int group_send_audio(Group_Chats *g_c, int groupnumber, const int16_t *pcm, unsi
     if (channels != 1 && channels != 2)
         return -1;
 
-    if (sample_rate != 8000 && sample_rate != 12000 && sample_rate != 16000 && sample_rate != 24000 && sample_rate != 48000)
+    if (sample_rate < 8000 || sample_rate > 96000)
         return -1;
 
-    if (!group_av->audio_encoder || group_av->audio_channels != channels || group_av->audio_sample_rate != sample_rate) {
-        group_av->audio_channels = channels;
-        group_av->audio_sample_rate = sample_rate;
-
-        if (channels == 1) {
-            group_av->audio_bitrate = 32000; //TODO: add way of adjusting bitrate
-        } else {
-            group_av->audio_bitrate = 64000; //TODO: add way of adjusting bitrate
+    if (group_av->mix_channels) {
+        /* Our audio goes into the mix */
+        if (sample_rate != GROUP_AUDIO_SAMPLE_RATE) {
+            if (!(pcm = resample_audio(group_av, pcm, &samples, channels, sample_rate)))
+                return -1;
         }
 
-        if (recreate_encoder(group_av) == -1)
+        if (mix_input_write(&group_av->self_mix, group_av->mix_channels, pcm, samples, channels) == -1)
             return -1;
+
+        mix_audio(group_av, groupnumber);
+        return 0;
     }
 
-    uint8_t encoded[1024];
-    int32_t size = opus_encode(group_av->audio_encoder, pcm, samples, encoded, sizeof(encoded));
+    if (sample_rate != 8000 && sample_rate != 12000 && sample_rate != 16000 && sample_rate != 24000 && sample_rate != 48000) {
+        /* Must still come out as a whole opus frame */
+        if ((uint64_t)samples * GROUP_AUDIO_SAMPLE_RATE % sample_rate != 0)
+            return -1;
 
-    if (size <= 0)
+        if (!(pcm = resample_audio(group_av, pcm, &samples, channels, sample_rate)))
+            return -1;
+
+        sample_rate = GROUP_AUDIO_SAMPLE_RATE;
+    }
+
+    return send_audio(group_av, groupnumber, pcm, samples, channels, sample_rate);
+}
+
+/* Turn the audio mixer of an A/V group chat on or off.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+int group_set_audio_mixer(Group_Chats *g_c, int groupnumber, uint8_t channels)
+{
+    Group_AV *group_av = group_get_object(g_c, groupnumber);
+
+    if (!group_av)
+        return -1;
+
+    if (channels > 2)
         return -1;
 
-    return send_audio_packet(g_c, groupnumber, encoded, size);
+    if (channels == group_av->mix_channels)
+        return 0;
+
+    /* Audio waiting in the old channel count is of no use */
+    int num_peers = group_number_peers(g_c, groupnumber);
+    int i;
+
+    for (i = 0; i < num_peers; ++i) {
+        Group_Peer_AV *peer_av = group_peer_get_object(g_c, groupnumber, i);
+
+        if (peer_av)
+            peer_av->mix.samples = 0;
+    }
+
+    group_av->self_mix.samples = 0;
+    group_av->next_mix = 0;
+    group_av->mix_channels = channels;
+    return 0;
 }
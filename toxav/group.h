@@ -24,6 +24,7 @@
 #include "../toxcore/group.h"
 
 #define GROUP_AUDIO_PACKET_ID 192
+#define GROUP_MIX_MINUS_PACKET_ID 193
 
 typedef void (*audio_callback_t)(Tox *, int, int, const int16_t *, unsigned int, uint8_t, unsigned int, void *);
 
@@ -51,3 +52,13 @@ int join_av_groupchat(Group_Chats *g_c, int32_t friendnumber, const uint8_t *dat
 int group_send_audio(Group_Chats *g_c, int groupnumber, const int16_t *pcm, unsigned int samples,
                      uint8_t channels, unsigned int sample_rate);
 
+/* Turn the audio mixer of an A/V group chat on (channels 1 or 2) or off (channels 0).
+ *
+ * In mixer mode incoming audio is mixed with ours and sent on as one stream instead of
+ * being relayed. Each talker we are connected to directly is also sent the mix without
+ * their own audio, over that connection alone.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+int group_set_audio_mixer(Group_Chats *g_c, int groupnumber, uint8_t channels);
@@ -31,9 +31,34 @@
 
 #include <stdlib.h>
 #include <assert.h>
+#include <pthread.h>
 
+/* Spare message buffers kept per session */
+#define RTP_MESSAGE_POOL_SIZE 8
+/* How long an incomplete message may hold back newer complete ones, in ms */
+#define RTP_REASSEMBLY_WAIT 50
+
+/* Message buffers are handed to the session's consumer and come back through
+ * rtp_free_msg(), possibly after the session is gone; the pool lives until
+ * the session and every buffer have let go of it.
+ */
+struct RTPMessagePool {
+    pthread_mutex_t mutex[1];
+    struct RTPBuffer *spare;
+    uint32_t spare_count;
+    uint32_t refs;
+};
+
+struct RTPBuffer {
+    struct RTPMessagePool *pool; /* NULL if not pooled */
+    struct RTPBuffer *next;
+    uint32_t capacity; /* Payload bytes that fit */
+};
 
 int handle_rtp_packet (Tox *tox, uint32_t friendnumber, const uint8_t *data, uint16_t length, void *object);
+static struct RTPMessagePool *pool_new(void);
+static void pool_release(struct RTPMessagePool *pool);
+static struct RTPMessage *pool_get(struct RTPMessagePool *pool, uint16_t length);
 
 
 RTPSession *rtp_new (int payload_type, Messenger *m, uint32_t friendnumber,
@@ -51,6 +76,18 @@ RTPSession *rtp_new (int payload_type, Messenger *m, uint32_t friendnumber,
         return NULL;
     }
 
+    if (!(retu->pool = pool_new())) {
+        LOGGER_WARNING("Alloc failed! Program might misbehave!");
+        free(retu);
+        return NULL;
+    }
+
+    if (pthread_mutex_init(retu->frames_mutex, NULL) != 0) {
+        pool_release(retu->pool);
+        free(retu);
+        return NULL;
+    }
+
     retu->ssrc = random_int();
     retu->payload_type = payload_type;
 
@@ -65,6 +102,8 @@ RTPSession *rtp_new (int payload_type, Messenger *m, uint32_t friendnumber,
 
     if (-1 == rtp_allow_receiving(retu)) {
         LOGGER_WARNING("Failed to start rtp receiving mode");
+        pthread_mutex_destroy(retu->frames_mutex);
+        pool_release(retu->pool);
         free(retu);
         return NULL;
     }
@@ -79,6 +118,14 @@ void rtp_kill (RTPSession *session)
     LOGGER_DEBUG("Terminated RTP session: %p", session);
 
     rtp_stop_receiving (session);
+
+    int i;
+
+    for (i = 0; i < RTP_REASSEMBLY_SLOTS; ++i)
+        rtp_free_msg(session->frames[i].msg);
+
+    pthread_mutex_destroy(session->frames_mutex);
+    pool_release(session->pool);
     free (session);
 }
 int rtp_allow_receiving(RTPSession *session)
@@ -106,14 +153,20 @@ int rtp_stop_receiving(RTPSession *session)
     return 0;
 }
 int rtp_send_data (RTPSession *session, const uint8_t *data, uint16_t length)
+{
+    return rtp_send_data_at(session, data, length, current_time_monotonic());
+}
+/* As rtp_send_data(), for data captured at timestamp rather than now. */
+int rtp_send_data_at (RTPSession *session, const uint8_t *data, uint16_t length, uint32_t timestamp)
 {
     if (!session) {
         LOGGER_WARNING("No session!");
         return -1;
     }
 
-    uint8_t rdata[length + sizeof(struct RTPHeader) + 1];
-    memset(rdata, 0, sizeof(rdata));
+    /* Parts are built one at a time in a single packet sized buffer */
+    uint8_t rdata[MAX_CRYPTO_DATA_SIZE];
+    memset(rdata, 0, sizeof(struct RTPHeader) + 1);
 
     rdata[0] = session->payload_type;
 
@@ -128,101 +181,306 @@ int rtp_send_data (RTPSession *session, const uint8_t *data, uint16_t length)
     header->pt = session->payload_type % 128;
 
     header->sequnum = htons(session->sequnum);
-    header->timestamp = htonl(current_time_monotonic());
+    header->timestamp = htonl(timestamp);
     header->ssrc = htonl(session->ssrc);
 
-    header->cpart = 0;
     header->tlen = htons(length);
 
-    if (MAX_CRYPTO_DATA_SIZE > length + sizeof(struct RTPHeader) + 1) {
+    /**
+     * Messages longer than a packet allows are sent in multiple parts of
+     * RTP_FRAGMENT_SIZE bytes, cpart telling where each one goes.
+     */
+    uint16_t sent = 0;
+
+    do {
+        uint16_t piece = MIN(length - sent, RTP_FRAGMENT_SIZE);
+
+        header->cpart = htons(sent);
+        memcpy(rdata + 1 + sizeof(struct RTPHeader), data + sent, piece);
+
+        if (-1 == send_custom_lossy_packet(session->m->tox, session->friend_number,
+                                           rdata, piece + sizeof(struct RTPHeader) + 1)) {
+            LOGGER_WARNING("RTP send failed (len: %d)! std error: %s",
+                           piece + sizeof(struct RTPHeader) + 1, strerror(errno));
+        } else {
+            __atomic_add_fetch(&session->sent.packets, 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&session->sent.bytes, piece + sizeof(struct RTPHeader) + 1, __ATOMIC_RELAXED);
+        }
+
+        sent += piece;
+    } while (sent < length);
+
+    __atomic_add_fetch(&session->sent.messages, 1, __ATOMIC_RELAXED);
+    session->sequnum ++;
+    return 0;
+}
+static void stats_load(const RTPStats *stats, RTPStats *out)
+{
+    out->packets = __atomic_load_n(&stats->packets, __ATOMIC_RELAXED);
+    out->bytes = __atomic_load_n(&stats->bytes, __ATOMIC_RELAXED);
+    out->messages = __atomic_load_n(&stats->messages, __ATOMIC_RELAXED);
+    out->lost = __atomic_load_n(&stats->lost, __ATOMIC_RELAXED);
+}
+void rtp_get_stats (const RTPSession *session, RTPStats *sent, RTPStats *received)
+{
+    if (!session)
+        return;
+
+    stats_load(&session->sent, sent);
+    stats_load(&session->received, received);
+}
+struct RTPMessage *rtp_new_message (uint16_t length)
+{
+    return pool_get(NULL, length);
+}
+void rtp_free_msg (struct RTPMessage *msg)
+{
+    if (!msg)
+        return;
+
+    struct RTPBuffer *buf = (struct RTPBuffer *)msg - 1;
+    struct RTPMessagePool *pool = buf->pool;
 
-        /**
-         * The lenght is lesser than the maximum allowed lenght (including header)
-         * Send the packet in single piece.
-         */
+    if (!pool) {
+        free(buf);
+        return;
+    }
 
-        memcpy(rdata + 1 + sizeof(struct RTPHeader), data, length);
+    pthread_mutex_lock(pool->mutex);
 
-        if (-1 == send_custom_lossy_packet(session->m->tox, session->friend_number, rdata, sizeof(rdata)))
-            LOGGER_WARNING("RTP send failed (len: %d)! std error: %s", sizeof(rdata), strerror(errno));
-    } else {
+    if (pool->spare_count < RTP_MESSAGE_POOL_SIZE) {
+        buf->next = pool->spare;
+        pool->spare = buf;
+        ++pool->spare_count;
+        buf = NULL;
+    }
+
+    pthread_mutex_unlock(pool->mutex);
+
+    free(buf);
+    pool_release(pool);
+}
+
+
+static struct RTPMessagePool *pool_new(void)
+{
+    struct RTPMessagePool *pool = calloc(1, sizeof(struct RTPMessagePool));
+
+    if (!pool)
+        return NULL;
+
+    if (pthread_mutex_init(pool->mutex, NULL) != 0) {
+        free(pool);
+        return NULL;
+    }
+
+    pool->refs = 1;
+    return pool;
+}
+static void pool_release(struct RTPMessagePool *pool)
+{
+    pthread_mutex_lock(pool->mutex);
+    uint32_t refs = --pool->refs;
+    pthread_mutex_unlock(pool->mutex);
 
-        /**
-         * The lenght is greater than the maximum allowed lenght (including header)
-         * Send the packet in multiple pieces.
-         */
+    if (refs)
+        return;
 
-        uint16_t sent = 0;
-        uint16_t piece = MAX_CRYPTO_DATA_SIZE - (sizeof(struct RTPHeader) + 1);
+    while (pool->spare) {
+        struct RTPBuffer *next = pool->spare->next;
+        free(pool->spare);
+        pool->spare = next;
+    }
 
-        while ((length - sent) + sizeof(struct RTPHeader) + 1 > MAX_CRYPTO_DATA_SIZE) {
-            memcpy(rdata + 1 + sizeof(struct RTPHeader), data + sent, piece);
+    pthread_mutex_destroy(pool->mutex);
+    free(pool);
+}
+/* Get a message with room for length payload bytes, its header zeroed.
+ *
+ * return NULL on allocation failure.
+ */
+static struct RTPMessage *pool_get(struct RTPMessagePool *pool, uint16_t length)
+{
+    struct RTPBuffer *buf = NULL;
 
-            if (-1 == send_custom_lossy_packet(session->m->tox, session->friend_number,
-                                               rdata, piece + sizeof(struct RTPHeader) + 1))
-                LOGGER_WARNING("RTP send failed (len: %d)! std error: %s",
-                               piece + sizeof(struct RTPHeader) + 1, strerror(errno));
+    if (pool) {
+        pthread_mutex_lock(pool->mutex);
 
-            sent += piece;
-            header->cpart = htons(sent);
+        if ((buf = pool->spare)) {
+            pool->spare = buf->next;
+            --pool->spare_count;
         }
 
-        /* Send remaining */
-        piece = length - sent;
+        ++pool->refs;
+        pthread_mutex_unlock(pool->mutex);
+    }
+
+    if (!buf || buf->capacity < length) {
+        struct RTPBuffer *grown = realloc(buf, sizeof(struct RTPBuffer) + sizeof(struct RTPMessage) + length);
 
-        if (piece) {
-            memcpy(rdata + 1 + sizeof(struct RTPHeader), data + sent, piece);
+        if (!grown) {
+            free(buf);
 
-            if (-1 == send_custom_lossy_packet(session->m->tox, session->friend_number, rdata,
-                                               piece + sizeof(struct RTPHeader) + 1))
-                LOGGER_WARNING("RTP send failed (len: %d)! std error: %s",
-                               piece + sizeof(struct RTPHeader) + 1, strerror(errno));
+            if (pool)
+                pool_release(pool);
+
+            return NULL;
         }
+
+        buf = grown;
+        buf->capacity = length;
     }
 
-    session->sequnum ++;
-    return 0;
+    buf->pool = pool;
+    buf->next = NULL;
+
+    struct RTPMessage *msg = (struct RTPMessage *)(buf + 1);
+    memset(msg, 0, sizeof(struct RTPMessage));
+    return msg;
 }
+/* Move on to msg, counting the messages skipped on the way as lost. */
+static void advance_to(RTPSession *session, const struct RTPMessage *msg)
+{
+    int16_t gap = msg->header.sequnum - session->rsequnum;
+
+    if (session->rstarted && gap > 1)
+        __atomic_add_fetch(&session->received.lost, gap - 1, __ATOMIC_RELAXED);
+
+    session->rsequnum = msg->header.sequnum;
+    session->rtimestamp = msg->header.timestamp;
+    session->rstarted = true;
+}
+/* Give up on a message that is missing parts. */
+static void drop_frame(RTPSession *session, RTPReassembly *frame)
+{
+    struct RTPMessage *msg = frame->msg;
+
+    /* Measure missing parts, rtp headers included */
+    bwc_add_lost(session->bwc, (msg->header.tlen - msg->len) +
+                 ((msg->header.tlen - msg->len) / RTP_FRAGMENT_SIZE + 1) * sizeof(struct RTPHeader));
+    __atomic_add_fetch(&session->received.lost, 1, __ATOMIC_RELAXED);
 
+    if (!session->rstarted || (int16_t)(msg->header.sequnum - session->rsequnum) > 0)
+        advance_to(session, msg);
 
-bool chloss (const RTPSession *session, const struct RTPHeader *header)
+    /* Whatever references the lost frame can't be decoded until the next key frame */
+    if (session->payload_type == rtp_TypeVideo)
+        bwc_request_key_frame(session->bwc);
+
+    rtp_free_msg(msg);
+    memset(frame, 0, sizeof(RTPReassembly));
+}
+static RTPReassembly *oldest_frame(RTPSession *session)
+{
+    RTPReassembly *oldest = NULL;
+    int i;
+
+    for (i = 0; i < RTP_REASSEMBLY_SLOTS; ++i)
+        if (session->frames[i].msg && (!oldest ||
+                                       (int16_t)(session->frames[i].msg->header.sequnum - oldest->msg->header.sequnum) < 0))
+            oldest = &session->frames[i];
+
+    return oldest;
+}
+/* Find the message a part belongs to, starting a new one if needed.
+ *
+ * return NULL if the part is to be dropped.
+ */
+static RTPReassembly *get_frame(RTPSession *session, const struct RTPHeader *header)
 {
-    if (ntohl(header->timestamp) < session->rtimestamp) {
-        uint16_t hosq, lost = 0;
+    uint16_t sequnum = ntohs(header->sequnum);
+    uint32_t timestamp = ntohl(header->timestamp);
+    uint16_t tlen = ntohs(header->tlen);
+    RTPReassembly *free_frame = NULL;
+    int i;
+
+    for (i = 0; i < RTP_REASSEMBLY_SLOTS; ++i) {
+        RTPReassembly *frame = &session->frames[i];
+
+        if (!frame->msg) {
+            free_frame = free_frame ? free_frame : frame;
+        } else if (frame->msg->header.sequnum == sequnum) {
+            if (frame->msg->header.timestamp != timestamp || frame->msg->header.tlen != tlen)
+                return NULL; /* Corrupted */
+
+            return frame;
+        }
+    }
 
-        hosq = ntohs(header->sequnum);
+    if (!free_frame) {
+        /* All busy: the oldest message makes room, unless this one is older still */
+        free_frame = oldest_frame(session);
 
-        lost = (hosq > session->rsequnum) ?
-               (session->rsequnum + 65535) - hosq :
-               session->rsequnum - hosq;
+        if ((int16_t)(sequnum - free_frame->msg->header.sequnum) < 0)
+            return NULL;
 
-        fprintf (stderr, "Lost packet\n");
+        LOGGER_DEBUG("Dropping incomplete message %u on session %p", free_frame->msg->header.sequnum, session);
+        drop_frame(session, free_frame);
+    }
 
-        while (lost --)
-            bwc_add_lost(session->bwc , 0);
+    struct RTPMessage *msg = pool_get(session->pool, tlen);
 
-        return true;
+    if (!msg) {
+        LOGGER_WARNING("Alloc failed! Program might misbehave!");
+        return NULL;
     }
 
-    return false;
+    memcpy(&msg->header, header, sizeof(struct RTPHeader));
+    msg->header.sequnum = sequnum;
+    msg->header.timestamp = timestamp;
+    msg->header.ssrc = ntohl(header->ssrc);
+    msg->header.cpart = 0;
+    msg->header.tlen = tlen;
+
+    free_frame->msg = msg;
+    free_frame->received = 0;
+    free_frame->start = current_time_monotonic();
+    return free_frame;
 }
-struct RTPMessage *new_message (size_t allocate_len, const uint8_t *data, uint16_t data_length)
+/* Hand on complete messages in order. A message that is missing parts holds back newer
+ * ones for at most RTP_REASSEMBLY_WAIT ms.
+ */
+static void deliver_frames(RTPSession *session)
 {
-    assert(allocate_len >= data_length);
+    RTPReassembly *oldest;
 
-    struct RTPMessage *msg = calloc(sizeof(struct RTPMessage) + (allocate_len - sizeof(struct RTPHeader)), 1);
+    while ((oldest = oldest_frame(session))) {
+        struct RTPMessage *msg = oldest->msg;
 
-    msg->len = data_length - sizeof(struct RTPHeader);
-    memcpy(&msg->header, data, data_length);
+        if (msg->len != msg->header.tlen) {
+            bool newer_complete = false;
+            int i;
 
-    msg->header.sequnum = ntohs(msg->header.sequnum);
-    msg->header.timestamp = ntohl(msg->header.timestamp);
-    msg->header.ssrc = ntohl(msg->header.ssrc);
+            for (i = 0; i < RTP_REASSEMBLY_SLOTS; ++i)
+                if (session->frames[i].msg && session->frames[i].msg->len == session->frames[i].msg->header.tlen)
+                    newer_complete = true;
 
-    msg->header.cpart = ntohs(msg->header.cpart);
-    msg->header.tlen = ntohs(msg->header.tlen);
+            if (!newer_complete || current_time_monotonic() - oldest->start < RTP_REASSEMBLY_WAIT)
+                return;
 
-    return msg;
+            drop_frame(session, oldest);
+            continue;
+        }
+
+        advance_to(session, msg);
+        __atomic_add_fetch(&session->received.messages, 1, __ATOMIC_RELAXED);
+        memset(oldest, 0, sizeof(RTPReassembly));
+
+        if (session->mcb)
+            session->mcb (session->cs, msg);
+        else
+            rtp_free_msg(msg);
+    }
+}
+/* Give up on messages that held back newer ones for too long, even if no more packets arrive. */
+void rtp_iterate (RTPSession *session)
+{
+    if (!session)
+        return;
+
+    pthread_mutex_lock(session->frames_mutex);
+    deliver_frames(session);
+    pthread_mutex_unlock(session->frames_mutex);
 }
 int handle_rtp_packet (Tox *tox, uint32_t friendnumber, const uint8_t *data, uint16_t length, void *object)
 {
@@ -246,148 +504,42 @@ int handle_rtp_packet (Tox *tox, uint32_t friendnumber, const uint8_t *data, uin
         return -1;
     }
 
-    if (ntohs(header->cpart) >= ntohs(header->tlen)) {
+    uint16_t cpart = ntohs(header->cpart);
+    uint16_t tlen = ntohs(header->tlen);
+    uint16_t part_length = length - sizeof(struct RTPHeader);
+
+    if (cpart >= tlen || part_length > tlen - cpart || cpart % RTP_FRAGMENT_SIZE != 0) {
         /* Never allow this case to happen */
         return -1;
     }
 
     bwc_feed_avg(session->bwc, length);
+    __atomic_add_fetch(&session->received.packets, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&session->received.bytes, length + 1, __ATOMIC_RELAXED);
 
-    if (ntohs(header->tlen) == length - sizeof (struct RTPHeader)) {
-        /* The message is sent in single part */
+    pthread_mutex_lock(session->frames_mutex);
 
-        /* Only allow messages which have arrived in order;
-         * drop late messages
-         */
-        if (chloss(session, header)) {
-            return 0;
-        } else {
-            /* Message is not late; pick up the latest parameters */
-            session->rsequnum = ntohs(header->sequnum);
-            session->rtimestamp = ntohl(header->timestamp);
-        }
+    /* Parts of messages that were handed on or given up on already are late */
+    if (session->rstarted && (int16_t)(ntohs(header->sequnum) - session->rsequnum) <= 0) {
+        pthread_mutex_unlock(session->frames_mutex);
+        return 0;
+    }
 
-        bwc_add_recv(session->bwc, length);
+    RTPReassembly *frame = get_frame(session, header);
+    uint64_t part = 1ULL << (cpart / RTP_FRAGMENT_SIZE);
 
-        /* Invoke processing of active multiparted message */
-        if (session->mp) {
-            if (session->mcb)
-                session->mcb (session->cs, session->mp);
-            else
-                free(session->mp);
+    if (!frame || (frame->received & part)) { /* Dropped or duplicate */
+        pthread_mutex_unlock(session->frames_mutex);
+        return 0;
+    }
 
-            session->mp = NULL;
-        }
+    memcpy(frame->msg->data + cpart, data + sizeof(struct RTPHeader), part_length);
+    frame->msg->len += part_length;
+    frame->received |= part;
 
-        /* The message came in the allowed time;
-         * process it only if handler for the session is present.
-         */
-
-        if (!session->mcb)
-            return 0;
-
-        return session->mcb (session->cs, new_message(length, data, length));
-    } else {
-        /* The message is sent in multiple parts */
-
-        if (session->mp) {
-            /* There are 2 possible situations in this case:
-             *      1) being that we got the part of already processing message.
-             *      2) being that we got the part of a new/old message.
-             *
-             * We handle them differently as we only allow a single multiparted
-             * processing message
-             */
-
-            if (session->mp->header.sequnum == ntohs(header->sequnum) &&
-                    session->mp->header.timestamp == ntohl(header->timestamp)) {
-                /* First case */
-
-                /* Make sure we have enough allocated memory */
-                if (session->mp->header.tlen - session->mp->len < length - sizeof(struct RTPHeader) ||
-                        session->mp->header.tlen <= ntohs(header->cpart)) {
-                    /* There happened to be some corruption on the stream;
-                     * continue wihtout this part
-                     */
-                    return 0;
-                }
-
-                memcpy(session->mp->data + ntohs(header->cpart), data + sizeof(struct RTPHeader),
-                       length - sizeof(struct RTPHeader));
-
-                session->mp->len += length - sizeof(struct RTPHeader);
-
-                bwc_add_recv(session->bwc, length);
-
-                if (session->mp->len == session->mp->header.tlen) {
-                    /* Received a full message; now push it for the further
-                     * processing.
-                     */
-                    if (session->mcb)
-                        session->mcb (session->cs, session->mp);
-                    else
-                        free(session->mp);
-
-                    session->mp = NULL;
-                }
-            } else {
-                /* Second case */
-
-                if (session->mp->header.timestamp > ntohl(header->timestamp))
-                    /* The received message part is from the old message;
-                     * discard it.
-                     */
-                    return 0;
-
-                /* Measure missing parts of the old message */
-                bwc_add_lost(session->bwc,
-                             (session->mp->header.tlen - session->mp->len) +
-
-                             /* Must account sizes of rtp headers too */
-                             ((session->mp->header.tlen - session->mp->len) /
-                              MAX_CRYPTO_DATA_SIZE) * sizeof(struct RTPHeader) );
-
-                /* Push the previous message for processing */
-                if (session->mcb)
-                    session->mcb (session->cs, session->mp);
-                else
-                    free(session->mp);
-
-                session->mp = NULL;
-                goto NEW_MULTIPARTED;
-            }
-        } else {
-            /* In this case threat the message as if it was received in order
-             */
-
-            /* This is also a point for new multiparted messages */
-NEW_MULTIPARTED:
-
-            /* Only allow messages which have arrived in order;
-             * drop late messages
-             */
-            if (chloss(session, header)) {
-                return 0;
-            } else {
-                /* Message is not late; pick up the latest parameters */
-                session->rsequnum = ntohs(header->sequnum);
-                session->rtimestamp = ntohl(header->timestamp);
-            }
-
-            bwc_add_recv(session->bwc, length);
-
-            /* Again, only store message if handler is present
-             */
-            if (session->mcb) {
-                session->mp = new_message(ntohs(header->tlen) + sizeof(struct RTPHeader), data, length);
-
-                /* Reposition data if necessary */
-                if (ntohs(header->cpart));
-
-                memmove(session->mp->data + ntohs(header->cpart), session->mp->data, session->mp->len);
-            }
-        }
-    }
+    bwc_add_recv(session->bwc, ntohl(header->timestamp), length);
 
+    deliver_frames(session);
+    pthread_mutex_unlock(session->frames_mutex);
     return 0;
 }
@@ -26,6 +26,8 @@
 #include "../toxcore/Messenger.h"
 #include "stdbool.h"
 
+#include <pthread.h>
+
 /**
  * Payload type identifier. Also used as rtp callback prefix.
  */
@@ -77,21 +79,60 @@ struct RTPMessage {
 /* Check alignment */
 typedef char __fail_if_misaligned_2 [ sizeof(struct RTPMessage) == 82 ? 1 : -1 ];
 
+/* Payload bytes carried by each part of a multipart message */
+#define RTP_FRAGMENT_SIZE (MAX_CRYPTO_DATA_SIZE - (sizeof(struct RTPHeader) + 1))
+
+/* Frames being reassembled at once */
+#define RTP_REASSEMBLY_SLOTS 4
+
+/* Every part of the largest message must fit in the reassembly bitmap */
+typedef char __fail_if_too_many_parts [ 65535 / RTP_FRAGMENT_SIZE < 64 ? 1 : -1 ];
+
+/**
+ * A message being reassembled from its parts.
+ */
+typedef struct {
+    struct RTPMessage *msg; /* NULL if unused, len counts the bytes received so far */
+    uint64_t received; /* Bitmap of received parts, by cpart / RTP_FRAGMENT_SIZE */
+    uint64_t start; /* Arrival time of the first part */
+} RTPReassembly;
+
+struct RTPMessagePool;
+
+/**
+ * Traffic of one direction of a session, for rtp_get_stats(). Kept with __atomic
+ * builtins, so it can be read while the session is in use. The 64 bit counters are
+ * not lock free on every 32 bit target; there the builtins are calls into libatomic,
+ * which configure adds when it is needed.
+ */
+typedef struct {
+    uint64_t packets; /* Parts of messages */
+    uint64_t bytes; /* Of those, rtp headers included */
+    uint32_t messages;
+    uint32_t lost; /* Messages that never arrived complete, receiving only */
+} RTPStats;
+
 /**
  * RTP control session.
  */
 typedef struct {
     uint8_t  payload_type;
     uint16_t sequnum;      /* Sending sequence number */
-    uint16_t rsequnum;     /* Receiving sequence number */
+    uint16_t rsequnum;     /* Sequence number of the last message handed on */
     uint32_t rtimestamp;
+    bool     rstarted;     /* Whether rsequnum is set */
     uint32_t ssrc;
 
-    struct RTPMessage *mp; /* Expected parted message */
+    RTPReassembly frames[RTP_REASSEMBLY_SLOTS]; /* Messages still missing parts */
+    pthread_mutex_t frames_mutex[1]; /* For the receiving state, used by rtp_iterate() too */
+    struct RTPMessagePool *pool;
 
     Messenger *m;
     uint32_t friend_number;
 
+    RTPStats sent;
+    RTPStats received;
+
     BWController *bwc;
     void *cs;
     int (*mcb) (void *, struct RTPMessage *msg);
@@ -104,6 +145,11 @@ RTPSession *rtp_new (int payload_type, Messenger *m, uint32_t friend_num,
 void rtp_kill (RTPSession *session);
 int rtp_allow_receiving (RTPSession *session);
 int rtp_stop_receiving (RTPSession *session);
+void rtp_iterate (RTPSession *session);
 int rtp_send_data (RTPSession *session, const uint8_t *data, uint16_t length);
+int rtp_send_data_at (RTPSession *session, const uint8_t *data, uint16_t length, uint32_t timestamp);
+void rtp_get_stats (const RTPSession *session, RTPStats *sent, RTPStats *received);
+struct RTPMessage *rtp_new_message (uint16_t length);
+void rtp_free_msg (struct RTPMessage *msg);
 
 #endif /* RTP_H */
@@ -32,10 +32,32 @@
 #include "../toxcore/util.h"
 
 #include <assert.h>
+#include <sched.h>
 #include <stdlib.h>
 #include <string.h>
 
-#define MAX_ENCODE_TIME_US ((1000 / 24) * 1000)
+/* Waking the audio sender thread must not block the audio thread doing it, which rules
+ * out condition variables. OS X only has unnamed semaphores as dispatch semaphores.
+ */
+#ifdef __APPLE__
+#include <dispatch/dispatch.h>
+typedef dispatch_semaphore_t wake_sem_t;
+#define wake_sem_init(sem) ((*(sem) = dispatch_semaphore_create(0)) ? 0 : -1)
+#define wake_sem_post(sem) dispatch_semaphore_signal(*(sem))
+#define wake_sem_wait(sem) dispatch_semaphore_wait(*(sem), DISPATCH_TIME_FOREVER)
+#define wake_sem_destroy(sem) dispatch_release(*(sem))
+#else
+#include <semaphore.h>
+typedef sem_t wake_sem_t;
+#define wake_sem_init(sem) sem_init(sem, 0, 0)
+#define wake_sem_post(sem) sem_post(sem)
+#define wake_sem_wait(sem) sem_wait(sem)
+#define wake_sem_destroy(sem) sem_destroy(sem)
+#endif
+
+/* Kb/sec taken by rtp headers of 20ms audio frames */
+#define AUDIO_RTP_OVERHEAD (1000 / 20 * (sizeof(struct RTPHeader) + 1) * 8 / 1000)
+#define VIDEO_BIT_RATE_MIN 64
 
 typedef struct ToxAVCall_s {
     ToxAV *av;
@@ -52,18 +74,30 @@ typedef struct ToxAVCall_s {
     MSICall *msi_call;
     uint32_t friend_number;
 
-    uint32_t audio_bit_rate; /* Sending audio bit rate */
-    uint32_t video_bit_rate; /* Sending video bit rate */
+    uint32_t audio_bit_rate; /* Sending audio bit rate, set under av->mutex. __atomic */
+    uint32_t video_bit_rate; /* Sending video bit rate, set under av->mutex. __atomic */
+    uint32_t bwc_bit_rate; /* What the network allows in b/sec, 0 if no limit is known. __atomic */
+    uint32_t reported_audio_bit_rate; /* Last passed to bcb */
+    uint32_t reported_video_bit_rate;
 
     /** Required for monitoring changes in states */
     uint8_t previous_self_capabilities;
 
+    bool audio_sending; /* A thread is in toxav_audio_send_frame() for this call */
+    bool audio_allowed; /* What msi allows, for toxav_audio_send_frame(); see call_update_audio_allowed() */
+
     pthread_mutex_t mutex[1];
 
     struct ToxAVCall_s *prev;
     struct ToxAVCall_s *next;
 } ToxAVCall;
 
+/* Active calls, never changed once published; see audio_calls_update() */
+typedef struct {
+    uint32_t count;
+    ToxAVCall *calls[];
+} ToxAVAudioCalls;
+
 struct ToxAV {
     Messenger *m;
     MSISession *msi;
@@ -74,6 +108,16 @@ struct ToxAV {
     uint32_t calls_head;
     pthread_mutex_t mutex[1];
 
+    /* Audio is sent without av->mutex: toxav_audio_send_frame() finds the call in
+     * audio_calls and queues frames in its ACSession, the sender thread sends them.
+     */
+    ToxAVAudioCalls *audio_calls;
+    uint32_t audio_epoch; /* Readers count themselves in audio_readers[audio_epoch] */
+    uint32_t audio_readers[2]; /* Threads using audio_calls, by the epoch they came in */
+    bool audio_sender_stop;
+    pthread_t audio_sender;
+    wake_sem_t audio_sender_wake[1];
+
     PAIR(toxav_call_cb *, void *) ccb; /* Call callback */
     PAIR(toxav_call_state_cb *, void *) scb; /* Call state callback */
     PAIR(toxav_audio_receive_frame_cb *, void *) acb; /* Audio frame receive callback */
@@ -88,7 +132,8 @@ struct ToxAV {
     uint32_t interval; /** Calculated interval */
 };
 
-void callback_bwc (BWController *bwc, uint32_t friend_number, float loss, void *user_data);
+void callback_bwc (BWController *bwc, uint32_t friend_number, uint32_t bit_rate, void *user_data);
+void callback_bwc_key_frame (BWController *bwc, uint32_t friend_number, void *user_data);
 
 int callback_invite(void *toxav_inst, MSICall *call);
 int callback_start(void *toxav_inst, MSICall *call);
@@ -98,12 +143,19 @@ int callback_capabilites(void *toxav_inst, MSICall *call);
 
 bool audio_bit_rate_invalid(uint32_t bit_rate);
 bool video_bit_rate_invalid(uint32_t bit_rate);
+uint32_t call_audio_bit_rate(const ToxAVCall *call);
+uint32_t call_video_bit_rate(const ToxAVCall *call);
 bool invoke_call_state_callback(ToxAV *av, uint32_t friend_number, uint32_t state);
 ToxAVCall *call_new(ToxAV *av, uint32_t friend_number, TOXAV_ERR_CALL *error);
 ToxAVCall *call_get(ToxAV *av, uint32_t friend_number);
 ToxAVCall *call_remove(ToxAVCall *call);
 bool call_prepare_transmission(ToxAVCall *call);
 void call_kill_transmission(ToxAVCall *call);
+static ToxAVCall *audio_call_acquire(ToxAV *av, uint32_t friend_number, uint32_t *epoch);
+static void audio_calls_release(ToxAV *av, uint32_t epoch);
+static bool audio_calls_update(ToxAV *av);
+static void call_update_audio_allowed(ToxAVCall *call);
+static void *audio_sender_thread(void *arg);
 
 uint32_t toxav_version_major(void)
 {
@@ -167,6 +219,22 @@ ToxAV *toxav_new(Tox *tox, TOXAV_ERR_NEW *error)
         goto END;
     }
 
+    if (wake_sem_init(av->audio_sender_wake) != 0) {
+        msi_kill(av->msi);
+        pthread_mutex_destroy(av->mutex);
+        rc = TOXAV_ERR_NEW_MALLOC;
+        goto END;
+    }
+
+    if (pthread_create(&av->audio_sender, NULL, audio_sender_thread, av) != 0) {
+        LOGGER_WARNING("Failed to start audio sender thread");
+        wake_sem_destroy(av->audio_sender_wake);
+        msi_kill(av->msi);
+        pthread_mutex_destroy(av->mutex);
+        rc = TOXAV_ERR_NEW_MALLOC;
+        goto END;
+    }
+
     av->interval = 200;
     av->msi->av  = av;
     tox->av      = av;
@@ -216,6 +284,13 @@ void toxav_kill(ToxAV *av)
     }
 
     pthread_mutex_unlock(av->mutex);
+
+    __atomic_store_n(&av->audio_sender_stop, true, __ATOMIC_RELEASE);
+    wake_sem_post(av->audio_sender_wake);
+    pthread_join(av->audio_sender, NULL);
+    wake_sem_destroy(av->audio_sender_wake);
+    free(av->audio_calls);
+
     pthread_mutex_destroy(av->mutex);
 
     free(av);
@@ -245,9 +320,13 @@ void toxav_iterate(ToxAV *av)
 
     for (; i; i = i->next) {
         if (i->active) {
+            call_update_audio_allowed(i);
+
             pthread_mutex_lock(i->mutex);
             pthread_mutex_unlock(av->mutex);
 
+            rtp_iterate(i->audio.first);
+            rtp_iterate(i->video.first);
             ac_iterate(i->audio.second);
             vc_iterate(i->video.second);
 
@@ -582,7 +661,7 @@ bool toxav_bit_rate_set(ToxAV *av, uint32_t friend_number, int32_t audio_bit_rat
             }
 
             /* Audio sending is turned off; notify peer */
-            call->audio_bit_rate = 0;
+            __atomic_store_n(&call->audio_bit_rate, 0, __ATOMIC_RELAXED);
         } else {
             pthread_mutex_lock(call->mutex);
 
@@ -600,9 +679,11 @@ bool toxav_bit_rate_set(ToxAV *av, uint32_t friend_number, int32_t audio_bit_rat
             } else
                 LOGGER_DEBUG("Set new audio bit rate %d", audio_bit_rate);
 
-            call->audio_bit_rate = audio_bit_rate;
+            __atomic_store_n(&call->audio_bit_rate, audio_bit_rate, __ATOMIC_RELAXED);
             pthread_mutex_unlock(call->mutex);
         }
+
+        call_update_audio_allowed(call);
     }
 
     if (video_bit_rate >= 0) {
@@ -621,7 +702,7 @@ bool toxav_bit_rate_set(ToxAV *av, uint32_t friend_number, int32_t audio_bit_rat
                 goto END;
             }
 
-            call->video_bit_rate = 0;
+            __atomic_store_n(&call->video_bit_rate, 0, __ATOMIC_RELAXED);
         } else {
             pthread_mutex_lock(call->mutex);
 
@@ -639,7 +720,7 @@ bool toxav_bit_rate_set(ToxAV *av, uint32_t friend_number, int32_t audio_bit_rat
             } else
                 LOGGER_DEBUG("Set new video bit rate %d", video_bit_rate);
 
-            call->video_bit_rate = video_bit_rate;
+            __atomic_store_n(&call->video_bit_rate, video_bit_rate, __ATOMIC_RELAXED);
             pthread_mutex_unlock(call->mutex);
         }
     }
@@ -662,121 +743,180 @@ void toxav_callback_bit_rate_status(ToxAV *av, toxav_bit_rate_status_cb *functio
 bool toxav_audio_send_frame(ToxAV *av, uint32_t friend_number, const int16_t *pcm, size_t sample_count,
                             uint8_t channels, uint32_t sampling_rate, TOXAV_ERR_SEND_FRAME *error)
 {
+    /* This takes no locks, audio threads call it */
     TOXAV_ERR_SEND_FRAME rc = TOXAV_ERR_SEND_FRAME_OK;
-    ToxAVCall *call;
-
-    if (m_friend_exists(av->m->tox, friend_number) == 0) {
-        rc = TOXAV_ERR_SEND_FRAME_FRIEND_NOT_FOUND;
-        goto END;
-    }
-
-    if (pthread_mutex_trylock(av->mutex) != 0) {
-        rc = TOXAV_ERR_SEND_FRAME_SYNC;
-        goto END;
-    }
+    uint32_t epoch;
+    ToxAVCall *call = audio_call_acquire(av, friend_number, &epoch);
 
-    call = call_get(av, friend_number);
+    if (call == NULL) {
+        if (m_friend_exists(av->m->tox, friend_number) == 0)
+            rc = TOXAV_ERR_SEND_FRAME_FRIEND_NOT_FOUND;
+        else
+            rc = TOXAV_ERR_SEND_FRAME_FRIEND_NOT_IN_CALL;
 
-    if (call == NULL || !call->active || call->msi_call->state != msi_CallActive) {
-        pthread_mutex_unlock(av->mutex);
-        rc = TOXAV_ERR_SEND_FRAME_FRIEND_NOT_IN_CALL;
         goto END;
     }
 
-    if (call->audio_bit_rate == 0 ||
-            !(call->msi_call->self_capabilities & msi_CapSAudio) ||
-            !(call->msi_call->peer_capabilities & msi_CapRAudio)) {
-        pthread_mutex_unlock(av->mutex);
+    /* msi_call may go away at any time without av->mutex, so what it allows is read from a copy */
+    if (!__atomic_load_n(&call->audio_allowed, __ATOMIC_RELAXED)) {
         rc = TOXAV_ERR_SEND_FRAME_PAYLOAD_TYPE_DISABLED;
         goto END;
     }
 
-    pthread_mutex_lock(call->mutex_audio);
-    pthread_mutex_unlock(av->mutex);
-
     if (pcm == NULL) {
-        pthread_mutex_unlock(call->mutex_audio);
         rc = TOXAV_ERR_SEND_FRAME_NULL;
         goto END;
     }
 
     if (channels > 2) {
-        pthread_mutex_unlock(call->mutex_audio);
         rc = TOXAV_ERR_SEND_FRAME_INVALID;
         goto END;
     }
 
-    { /* Encode and send */
-        if (ac_reconfigure_encoder(call->audio.second, call->audio_bit_rate * 1000, sampling_rate, channels) != 0) {
-            pthread_mutex_unlock(call->mutex_audio);
-            rc = TOXAV_ERR_SEND_FRAME_INVALID;
-            goto END;
-        }
+    /* The encoder is the sending thread's alone */
+    if (__atomic_exchange_n(&call->audio_sending, true, __ATOMIC_ACQUIRE)) {
+        rc = TOXAV_ERR_SEND_FRAME_SYNC;
+        goto END;
+    }
 
-        uint8_t dest[sample_count + sizeof(sampling_rate)]; /* This is more than enough always */
+    switch (ac_send_frame(call->audio.second, pcm, sample_count, channels, sampling_rate,
+                          call_audio_bit_rate(call) * 1000)) {
+        case 0:
+            break;
 
-        sampling_rate = htonl(sampling_rate);
-        memcpy(dest, &sampling_rate, sizeof(sampling_rate));
-        int vrc = opus_encode(call->audio.second->encoder, pcm, sample_count,
-                              dest + sizeof(sampling_rate), sizeof(dest) - sizeof(sampling_rate));
+        case -2:
+            /* The sender thread is more than AC_SEND_QUEUE_SIZE frames behind */
+            LOGGER_WARNING("Audio send queue full, frame dropped");
+            rc = TOXAV_ERR_SEND_FRAME_RTP_FAILED;
+            break;
 
-        if (vrc < 0) {
-            LOGGER_WARNING("Failed to encode frame %s", opus_strerror(vrc));
-            pthread_mutex_unlock(call->mutex_audio);
+        default:
             rc = TOXAV_ERR_SEND_FRAME_INVALID;
-            goto END;
-        }
-
-        if (rtp_send_data(call->audio.first, dest, vrc + sizeof(sampling_rate)) != 0) {
-            LOGGER_WARNING("Failed to send audio packet");
-            rc = TOXAV_ERR_SEND_FRAME_RTP_FAILED;
-        }
     }
 
-
-    pthread_mutex_unlock(call->mutex_audio);
+    __atomic_store_n(&call->audio_sending, false, __ATOMIC_RELEASE);
 
 END:
 
+    if (call)
+        audio_calls_release(av, epoch);
+
+    if (rc == TOXAV_ERR_SEND_FRAME_OK)
+        wake_sem_post(av->audio_sender_wake);
+
     if (error)
         *error = rc;
 
     return rc == TOXAV_ERR_SEND_FRAME_OK;
 }
-bool toxav_video_send_frame(ToxAV *av, uint32_t friend_number, uint16_t width, uint16_t height, const uint8_t *y,
-                            const uint8_t *u, const uint8_t *v, TOXAV_ERR_SEND_FRAME *error)
+/* Look up the call for sending video to friend_number.
+ *
+ * return the call with its video mutex locked on success.
+ * return NULL and set rc on failure.
+ */
+static ToxAVCall *video_send_call_lock(ToxAV *av, uint32_t friend_number, TOXAV_ERR_SEND_FRAME *rc)
 {
-    TOXAV_ERR_SEND_FRAME rc = TOXAV_ERR_SEND_FRAME_OK;
     ToxAVCall *call;
 
     if (m_friend_exists(av->m->tox, friend_number) == 0) {
-        rc = TOXAV_ERR_SEND_FRAME_FRIEND_NOT_FOUND;
-        goto END;
+        *rc = TOXAV_ERR_SEND_FRAME_FRIEND_NOT_FOUND;
+        return NULL;
     }
 
     if (pthread_mutex_trylock(av->mutex) != 0) {
-        rc = TOXAV_ERR_SEND_FRAME_SYNC;
-        goto END;
+        *rc = TOXAV_ERR_SEND_FRAME_SYNC;
+        return NULL;
     }
 
     call = call_get(av, friend_number);
 
     if (call == NULL || !call->active || call->msi_call->state != msi_CallActive) {
         pthread_mutex_unlock(av->mutex);
-        rc = TOXAV_ERR_SEND_FRAME_FRIEND_NOT_IN_CALL;
-        goto END;
+        *rc = TOXAV_ERR_SEND_FRAME_FRIEND_NOT_IN_CALL;
+        return NULL;
     }
 
     if (call->video_bit_rate == 0 ||
             !(call->msi_call->self_capabilities & msi_CapSVideo) ||
             !(call->msi_call->peer_capabilities & msi_CapRVideo)) {
         pthread_mutex_unlock(av->mutex);
-        rc = TOXAV_ERR_SEND_FRAME_PAYLOAD_TYPE_DISABLED;
-        goto END;
+        *rc = TOXAV_ERR_SEND_FRAME_PAYLOAD_TYPE_DISABLED;
+        return NULL;
     }
 
     pthread_mutex_lock(call->mutex_video);
     pthread_mutex_unlock(av->mutex);
+    return call;
+}
+/* Copy a (width/2) x (height/2) chroma plane into one rounded up for an odd
+ * sized frame, repeating the last column and row.
+ */
+static void copy_legacy_chroma(uint8_t *dst, int32_t dst_stride, const uint8_t *src, uint16_t width, uint16_t height)
+{
+    uint16_t cwidth = width / 2, cheight = height / 2, i;
+
+    if (cwidth == 0 || cheight == 0) {
+        /* Nothing to repeat, send neutral chroma */
+        for (i = 0; i < (height + 1) / 2; ++i)
+            memset(dst + i * dst_stride, 128, (width + 1) / 2);
+
+        return;
+    }
+
+    for (i = 0; i < (height + 1) / 2; ++i) {
+        uint8_t *row = dst + i * dst_stride;
+        const uint8_t *src_row = src + (i < cheight ? i : cheight - 1) * cwidth;
+
+        memcpy(row, src_row, cwidth);
+
+        if (width % 2)
+            row[cwidth] = src_row[cwidth - 1];
+    }
+}
+bool toxav_video_send_frame(ToxAV *av, uint32_t friend_number, uint16_t width, uint16_t height, const uint8_t *y,
+                            const uint8_t *u, const uint8_t *v, TOXAV_ERR_SEND_FRAME *error)
+{
+    if (width % 2 == 0 && height % 2 == 0)
+        return toxav_video_send_frame_stride(av, friend_number, width, height, y, u, v, width, width / 2, width / 2,
+                                             error);
+
+    if (y == NULL || u == NULL || v == NULL) {
+        if (error)
+            *error = TOXAV_ERR_SEND_FRAME_NULL;
+
+        return false;
+    }
+
+    /* The chroma planes of an odd sized frame are a column or row short of
+     * what the encoder reads, fill them out in the encoder's own buffer.
+     */
+    uint8_t *buf_y, *buf_u, *buf_v;
+    int32_t ystride, ustride, vstride;
+
+    if (!toxav_video_get_frame_buffer(av, friend_number, width, height, &buf_y, &buf_u, &buf_v,
+                                      &ystride, &ustride, &vstride, error))
+        return false;
+
+    uint16_t i;
+
+    for (i = 0; i < height; ++i)
+        memcpy(buf_y + i * ystride, y + i * width, width);
+
+    copy_legacy_chroma(buf_u, ustride, u, width, height);
+    copy_legacy_chroma(buf_v, vstride, v, width, height);
+
+    return toxav_video_send_frame_stride(av, friend_number, width, height, buf_y, buf_u, buf_v,
+                                         ystride, ustride, vstride, error);
+}
+bool toxav_video_send_frame_stride(ToxAV *av, uint32_t friend_number, uint16_t width, uint16_t height,
+                                   const uint8_t *y, const uint8_t *u, const uint8_t *v,
+                                   int32_t ystride, int32_t ustride, int32_t vstride, TOXAV_ERR_SEND_FRAME *error)
+{
+    TOXAV_ERR_SEND_FRAME rc = TOXAV_ERR_SEND_FRAME_OK;
+    ToxAVCall *call = video_send_call_lock(av, friend_number, &rc);
+
+    if (call == NULL)
+        goto END;
 
     if (y == NULL || u == NULL || v == NULL) {
         pthread_mutex_unlock(call->mutex_video);
@@ -784,55 +924,66 @@ bool toxav_video_send_frame(ToxAV *av, uint32_t friend_number, uint16_t width, u
         goto END;
     }
 
-    if (vc_reconfigure_encoder(call->video.second, call->video_bit_rate * 1000, width, height) != 0) {
+    /* Negative strides are allowed for bottom-up images. */
+    if (abs(ystride) < width || abs(ustride) < (width + 1) / 2 || abs(vstride) < (width + 1) / 2) {
         pthread_mutex_unlock(call->mutex_video);
         rc = TOXAV_ERR_SEND_FRAME_INVALID;
         goto END;
     }
 
-    { /* Encode */
-        vpx_image_t img;
-        img.w = img.h = img.d_w = img.d_h = 0;
-        vpx_img_alloc(&img, VPX_IMG_FMT_I420, width, height, 0);
+    VCSession *vc = call->video.second;
+
+    if (__atomic_load_n(&vc->enc_running, __ATOMIC_RELAXED)) {
+        /* The encoder thread takes it from here */
+        if (vc_queue_frame(vc, call_video_bit_rate(call) * 1000, width, height, y, u, v,
+                           ystride, ustride, vstride) != 0)
+            rc = TOXAV_ERR_SEND_FRAME_INVALID;
 
-        /* I420 "It comprises an NxM Y plane followed by (N/2)x(M/2) V and U planes."
-         * http://fourcc.org/yuv.php#IYUV
-         */
-        memcpy(img.planes[VPX_PLANE_Y], y, width * height);
-        memcpy(img.planes[VPX_PLANE_U], u, (width / 2) * (height / 2));
-        memcpy(img.planes[VPX_PLANE_V], v, (width / 2) * (height / 2));
+        pthread_mutex_unlock(call->mutex_video);
+        goto END;
+    }
 
-        int vrc = vpx_codec_encode(call->video.second->encoder, &img,
-                                   call->video.second->frame_counter, 1, 0, MAX_ENCODE_TIME_US);
+    pthread_mutex_lock(vc->encoder_mutex);
 
-        vpx_img_free(&img);
+    if (vc_reconfigure_encoder(vc, call_video_bit_rate(call) * 1000, width, height) != 0) {
+        rc = TOXAV_ERR_SEND_FRAME_INVALID;
+        goto UNLOCK;
+    }
 
-        if (vrc != VPX_CODEC_OK) {
-            pthread_mutex_unlock(call->mutex_video);
-            LOGGER_ERROR("Could not encode video frame: %s\n", vpx_codec_err_to_string(vrc));
+    { /* Encode straight from the caller's planes, libvpx only reads them during the call */
+        vpx_image_t img;
+        vpx_img_wrap(&img, VPX_IMG_FMT_I420, width, height, 1, (unsigned char *)y);
+
+        img.planes[VPX_PLANE_Y] = (unsigned char *)y;
+        img.planes[VPX_PLANE_U] = (unsigned char *)u;
+        img.planes[VPX_PLANE_V] = (unsigned char *)v;
+        img.stride[VPX_PLANE_Y] = ystride;
+        img.stride[VPX_PLANE_U] = ustride;
+        img.stride[VPX_PLANE_V] = vstride;
+
+        if (vc_encode_frame(vc, &img) != 0) {
             rc = TOXAV_ERR_SEND_FRAME_INVALID;
-            goto END;
+            goto UNLOCK;
         }
     }
 
-    ++call->video.second->frame_counter;
-
     { /* Send frames */
         vpx_codec_iter_t iter = NULL;
         const vpx_codec_cx_pkt_t *pkt;
 
-        while ((pkt = vpx_codec_get_cx_data(call->video.second->encoder, &iter))) {
+        while ((pkt = vpx_codec_get_cx_data(vc->encoder, &iter))) {
             if (pkt->kind == VPX_CODEC_CX_FRAME_PKT &&
                     rtp_send_data(call->video.first, pkt->data.frame.buf, pkt->data.frame.sz) < 0) {
 
-                pthread_mutex_unlock(call->mutex_video);
                 LOGGER_WARNING("Could not send video frame: %s\n", strerror(errno));
                 rc = TOXAV_ERR_SEND_FRAME_RTP_FAILED;
-                goto END;
+                goto UNLOCK;
             }
         }
     }
 
+UNLOCK:
+    pthread_mutex_unlock(vc->encoder_mutex);
     pthread_mutex_unlock(call->mutex_video);
 
 END:
@@ -842,6 +993,101 @@ END:
 
     return rc == TOXAV_ERR_SEND_FRAME_OK;
 }
+bool toxav_video_get_frame_buffer(ToxAV *av, uint32_t friend_number, uint16_t width, uint16_t height,
+                                  uint8_t **y, uint8_t **u, uint8_t **v,
+                                  int32_t *ystride, int32_t *ustride, int32_t *vstride, TOXAV_ERR_SEND_FRAME *error)
+{
+    TOXAV_ERR_SEND_FRAME rc = TOXAV_ERR_SEND_FRAME_OK;
+    ToxAVCall *call = video_send_call_lock(av, friend_number, &rc);
+
+    if (call == NULL)
+        goto END;
+
+    if (y == NULL || u == NULL || v == NULL || ystride == NULL || ustride == NULL || vstride == NULL) {
+        pthread_mutex_unlock(call->mutex_video);
+        rc = TOXAV_ERR_SEND_FRAME_NULL;
+        goto END;
+    }
+
+    vpx_image_t *img = vc_frame_buffer(call->video.second, width, height);
+
+    if (img == NULL) {
+        pthread_mutex_unlock(call->mutex_video);
+        rc = TOXAV_ERR_SEND_FRAME_INVALID;
+        goto END;
+    }
+
+    *y = img->planes[VPX_PLANE_Y];
+    *u = img->planes[VPX_PLANE_U];
+    *v = img->planes[VPX_PLANE_V];
+    *ystride = img->stride[VPX_PLANE_Y];
+    *ustride = img->stride[VPX_PLANE_U];
+    *vstride = img->stride[VPX_PLANE_V];
+
+    pthread_mutex_unlock(call->mutex_video);
+
+END:
+
+    if (error)
+        *error = rc;
+
+    return rc == TOXAV_ERR_SEND_FRAME_OK;
+}
+static int video_send_packet(void *rtp, const uint8_t *data, uint16_t length)
+{
+    return rtp_send_data(rtp, data, length);
+}
+bool toxav_video_set_encoder(ToxAV *av, uint32_t friend_number, TOXAV_VIDEO_CODEC codec, bool async,
+                             TOXAV_ERR_VIDEO_SET_ENCODER *error)
+{
+    TOXAV_ERR_VIDEO_SET_ENCODER rc = TOXAV_ERR_VIDEO_SET_ENCODER_OK;
+    ToxAVCall *call;
+
+    if (m_friend_exists(av->m->tox, friend_number) == 0) {
+        rc = TOXAV_ERR_VIDEO_SET_ENCODER_FRIEND_NOT_FOUND;
+        goto END;
+    }
+
+    if (pthread_mutex_trylock(av->mutex) != 0) {
+        rc = TOXAV_ERR_VIDEO_SET_ENCODER_SYNC;
+        goto END;
+    }
+
+    call = call_get(av, friend_number);
+
+    if (call == NULL || !call->active || call->msi_call->state != msi_CallActive) {
+        pthread_mutex_unlock(av->mutex);
+        rc = TOXAV_ERR_VIDEO_SET_ENCODER_FRIEND_NOT_IN_CALL;
+        goto END;
+    }
+
+    pthread_mutex_lock(call->mutex_video);
+    pthread_mutex_unlock(av->mutex);
+
+    /* Restarted below in the mode asked for */
+    bool was_async = __atomic_load_n(&call->video.second->enc_running, __ATOMIC_RELAXED);
+    vc_stop_encoder_thread(call->video.second);
+
+    pthread_mutex_lock(call->video.second->encoder_mutex);
+
+    if (vc_set_encoder(call->video.second, codec) != 0)
+        rc = TOXAV_ERR_VIDEO_SET_ENCODER_INVALID;
+
+    pthread_mutex_unlock(call->video.second->encoder_mutex);
+
+    if ((rc == TOXAV_ERR_VIDEO_SET_ENCODER_OK ? async : was_async) &&
+            vc_start_encoder_thread(call->video.second, video_send_packet, call->video.first) != 0)
+        rc = TOXAV_ERR_VIDEO_SET_ENCODER_INVALID;
+
+    pthread_mutex_unlock(call->mutex_video);
+
+END:
+
+    if (error)
+        *error = rc;
+
+    return rc == TOXAV_ERR_VIDEO_SET_ENCODER_OK;
+}
 void toxav_callback_audio_receive_frame(ToxAV *av, toxav_audio_receive_frame_cb *function, void *user_data)
 {
     pthread_mutex_lock(av->mutex);
@@ -856,6 +1102,82 @@ void toxav_callback_video_receive_frame(ToxAV *av, toxav_video_receive_frame_cb
     av->vcb.second = user_data;
     pthread_mutex_unlock(av->mutex);
 }
+static void stream_stats_set(ToxAV_Stream_Stats *stats, const RTPStats *rtp)
+{
+    stats->packets = rtp->packets;
+    stats->bytes = rtp->bytes;
+}
+bool toxav_call_get_stats(ToxAV *av, uint32_t friend_number, ToxAV_Call_Stats *stats,
+                          TOXAV_ERR_CALL_GET_STATS *error)
+{
+    TOXAV_ERR_CALL_GET_STATS rc = TOXAV_ERR_CALL_GET_STATS_OK;
+    ToxAVCall *call = NULL;
+    uint32_t epoch;
+
+    if (stats == NULL) {
+        rc = TOXAV_ERR_CALL_GET_STATS_NULL;
+        goto END;
+    }
+
+    /* Looked up as for audio sending, so this never waits for the ToxAV threads */
+    call = audio_call_acquire(av, friend_number, &epoch);
+
+    if (call == NULL) {
+        if (m_friend_exists(av->m->tox, friend_number) == 0)
+            rc = TOXAV_ERR_CALL_GET_STATS_FRIEND_NOT_FOUND;
+        else
+            rc = TOXAV_ERR_CALL_GET_STATS_FRIEND_NOT_IN_CALL;
+
+        goto END;
+    }
+
+    RTPStats sent, received;
+    ACJitterStats jitter;
+    BWCStats bwc;
+
+    memset(stats, 0, sizeof(ToxAV_Call_Stats));
+    memset(&bwc, 0, sizeof(BWCStats));
+
+    memset(&sent, 0, sizeof(RTPStats));
+    memset(&received, 0, sizeof(RTPStats));
+    rtp_get_stats(call->audio.first, &sent, &received);
+    stream_stats_set(&stats->audio_sent, &sent);
+    stream_stats_set(&stats->audio_received, &received);
+    ac_get_stats(call->audio.second, &stats->audio_sent, &stats->audio_received);
+
+    /* The jitter buffer knows better than rtp when audio frames are missing */
+    ac_get_jitter_stats(call->audio.second, &jitter);
+    stats->audio_received.frames_lost = jitter.lost;
+    stats->audio_received.frames_dropped = jitter.late;
+    stats->audio_jitter = jitter.jitter;
+    stats->audio_delay = jitter.delay > 0 ? jitter.delay : 0;
+
+    memset(&sent, 0, sizeof(RTPStats));
+    memset(&received, 0, sizeof(RTPStats));
+    rtp_get_stats(call->video.first, &sent, &received);
+    stream_stats_set(&stats->video_sent, &sent);
+    stream_stats_set(&stats->video_received, &received);
+    stats->video_received.frames_lost = received.lost;
+    vc_get_stats(call->video.second, &stats->video_sent, &stats->video_received);
+
+    bwc_get_stats(call->bwc, &bwc);
+    stats->audio_bit_rate = call_audio_bit_rate(call) * 1000;
+    stats->video_bit_rate = call_video_bit_rate(call) * 1000;
+    stats->send_bit_rate_limit = bwc.target;
+    stats->send_loss = bwc.loss;
+    stats->receive_bit_rate = bwc.incoming;
+    stats->receive_bit_rate_limit = bwc.estimate;
+    stats->rtt = bwc.rtt;
+
+    audio_calls_release(av, epoch);
+
+END:
+
+    if (error)
+        *error = rc;
+
+    return rc == TOXAV_ERR_CALL_GET_STATS_OK;
+}
 
 
 /*******************************************************************************
@@ -863,42 +1185,45 @@ void toxav_callback_video_receive_frame(ToxAV *av, toxav_video_receive_frame_cb
  * :: Internal
  *
  ******************************************************************************/
-void callback_bwc(BWController *bwc, uint32_t friend_number, float loss, void *user_data)
+void callback_bwc(BWController *bwc, uint32_t friend_number, uint32_t bit_rate, void *user_data)
 {
-    /* Callback which is called when the internal measure mechanism reported packet loss.
-     * We report suggested lowered bitrate to an app. If app is sending both audio and video,
-     * we will report lowered bitrate for video only because in that case video probably
-     * takes more than 90% bandwidth. Otherwise, we report lowered bitrate on audio.
-     * The application may choose to disable video totally if the stream is too bad.
+    /* Callback which is called when the bandwidth estimate of the peer changed. The encoders
+     * follow it from the next frame on, see call_audio_bit_rate(). The app is told when the
+     * rates they end up at change noticeably; it may choose to disable video totally if the
+     * stream is too bad.
      */
 
     ToxAVCall *call = user_data;
     assert(call);
 
-    LOGGER_DEBUG("Reported loss of %f%%", loss * 100);
-
-    if (loss < .01f)
-        return;
+    LOGGER_DEBUG("Estimated bandwidth %u b/sec", bit_rate);
 
     pthread_mutex_lock(call->av->mutex);
+    __atomic_store_n(&call->bwc_bit_rate, bit_rate, __ATOMIC_RELAXED);
 
-    if (!call->av->bcb.first) {
-        pthread_mutex_unlock(call->av->mutex);
-        LOGGER_WARNING("No callback to report loss on");
-        return;
-    }
+    uint32_t audio_bit_rate = call_audio_bit_rate(call);
+    uint32_t video_bit_rate = call_video_bit_rate(call);
 
-    if (call->video_bit_rate)
-        (*call->av->bcb.first) (call->av, friend_number, call->audio_bit_rate,
-                                call->video_bit_rate - (call->video_bit_rate * loss),
-                                call->av->bcb.second);
-    else if (call->audio_bit_rate)
-        (*call->av->bcb.first) (call->av, friend_number,
-                                call->audio_bit_rate - (call->audio_bit_rate * loss),
-                                0, call->av->bcb.second);
+    /* Changes under 10% are noise to the app */
+    if (audio_bit_rate * 10 < call->reported_audio_bit_rate * 9 || audio_bit_rate * 10 > call->reported_audio_bit_rate * 11 ||
+            video_bit_rate * 10 < call->reported_video_bit_rate * 9 || video_bit_rate * 10 > call->reported_video_bit_rate * 11) {
+        call->reported_audio_bit_rate = audio_bit_rate;
+        call->reported_video_bit_rate = video_bit_rate;
+
+        if (call->av->bcb.first)
+            (*call->av->bcb.first) (call->av, friend_number, audio_bit_rate, video_bit_rate, call->av->bcb.second);
+    }
 
     pthread_mutex_unlock(call->av->mutex);
 }
+void callback_bwc_key_frame(BWController *bwc, uint32_t friend_number, void *user_data)
+{
+    ToxAVCall *call = user_data;
+    assert(call);
+
+    LOGGER_DEBUG("Peer of %u asked for a key frame", friend_number);
+    vc_request_key_frame(call->video.second);
+}
 int callback_invite(void *toxav_inst, MSICall *call)
 {
     ToxAV *toxav = toxav_inst;
@@ -1000,6 +1325,7 @@ int callback_capabilites(void *toxav_inst, MSICall *call)
     else
         rtp_stop_receiving(((ToxAVCall *)call->av_call)->video.first);
 
+    call_update_audio_allowed(call->av_call);
     invoke_call_state_callback(toxav, call->friend_number, call->peer_capabilities);
 
     pthread_mutex_unlock(toxav->mutex);
@@ -1012,6 +1338,39 @@ bool audio_bit_rate_invalid(uint32_t bit_rate)
      */
     return bit_rate < 6 || bit_rate > 510;
 }
+/* Audio bit rate to encode at: what the app set, lowered to what the network allows.
+ * Audio is sent without av->mutex, so this takes none.
+ */
+uint32_t call_audio_bit_rate(const ToxAVCall *call)
+{
+    uint32_t set = __atomic_load_n(&call->audio_bit_rate, __ATOMIC_RELAXED);
+    uint32_t available = __atomic_load_n(&call->bwc_bit_rate, __ATOMIC_RELAXED) / 1000;
+
+    if (!available || !set || set + AUDIO_RTP_OVERHEAD <= available)
+        return set;
+
+    return available > AUDIO_RTP_OVERHEAD + 6 ? available - AUDIO_RTP_OVERHEAD : 6;
+}
+/* Video bit rate to encode at: what the app set, lowered to what the network allows once
+ * audio is sent. Headers take about one in sixteen bytes of a video frame.
+ */
+uint32_t call_video_bit_rate(const ToxAVCall *call)
+{
+    uint32_t set = __atomic_load_n(&call->video_bit_rate, __ATOMIC_RELAXED);
+    uint32_t available = __atomic_load_n(&call->bwc_bit_rate, __ATOMIC_RELAXED) / 1000;
+
+    if (!available || !set)
+        return set;
+
+    uint32_t audio = call_audio_bit_rate(call);
+    audio = audio ? audio + AUDIO_RTP_OVERHEAD : 0;
+    available = available > audio ? (available - audio) * 15 / 16 : 0;
+
+    if (available < VIDEO_BIT_RATE_MIN)
+        available = VIDEO_BIT_RATE_MIN;
+
+    return MIN(set, available);
+}
 bool video_bit_rate_invalid(uint32_t bit_rate)
 {
     (void) bit_rate;
@@ -1187,7 +1546,12 @@ bool call_prepare_transmission(ToxAVCall *call)
         goto FAILURE_2;
 
     /* Prepare bwc */
-    call->bwc = bwc_new(av->m, call->friend_number, callback_bwc, call);
+    call->bwc = bwc_new(av->m, call->friend_number, callback_bwc, callback_bwc_key_frame, call);
+
+    if (!call->bwc) {
+        LOGGER_ERROR("Failed to create bandwidth controller");
+        goto FAILURE;
+    }
 
     { /* Prepare audio */
         call->audio.second = ac_new(av, call->friend_number, av->acb.first, av->acb.second);
@@ -1223,6 +1587,13 @@ bool call_prepare_transmission(ToxAVCall *call)
     }
 
     call->active = 1;
+    call_update_audio_allowed(call);
+
+    if (!audio_calls_update(av)) {
+        call->active = 0;
+        goto FAILURE;
+    }
+
     return true;
 
 FAILURE:
@@ -1249,9 +1620,15 @@ void call_kill_transmission(ToxAVCall *call)
 
     call->active = 0;
 
+    /* No audio thread uses the call once this returns */
+    if (!audio_calls_update(call->av))
+        LOGGER_ERROR("No memory for the calls to send audio to, audio stops for all of them");
+
     pthread_mutex_lock(call->mutex_audio);
     pthread_mutex_unlock(call->mutex_audio);
+    /* The encoder thread sends through the video rtp session */
     pthread_mutex_lock(call->mutex_video);
+    vc_stop_encoder_thread(call->video.second);
     pthread_mutex_unlock(call->mutex_video);
     pthread_mutex_lock(call->mutex);
     pthread_mutex_unlock(call->mutex);
@@ -1272,3 +1649,130 @@ void call_kill_transmission(ToxAVCall *call)
     pthread_mutex_destroy(call->mutex_video);
     pthread_mutex_destroy(call->mutex);
 }
+/* Find the call to send audio to friend_number, in a way that never waits, and keep it
+ * from being freed until audio_calls_release() with the epoch it sets.
+ *
+ * return NULL, with nothing to release, if friend_number is not in a call.
+ */
+static ToxAVCall *audio_call_acquire(ToxAV *av, uint32_t friend_number, uint32_t *epoch)
+{
+    /* Sequentially consistent, so audio_calls_update() sees the reader in the epoch it waits
+     * for or the reader sees the new calls. A reader that counted itself in an epoch that
+     * has just ended tries again rather than hold up the update.
+     */
+    for (;;) {
+        *epoch = __atomic_load_n(&av->audio_epoch, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&av->audio_readers[*epoch], 1, __ATOMIC_SEQ_CST);
+
+        if (__atomic_load_n(&av->audio_epoch, __ATOMIC_SEQ_CST) == *epoch)
+            break;
+
+        audio_calls_release(av, *epoch);
+    }
+
+    const ToxAVAudioCalls *calls = __atomic_load_n(&av->audio_calls, __ATOMIC_SEQ_CST);
+    uint32_t i;
+
+    for (i = 0; calls && i < calls->count; ++i)
+        if (calls->calls[i]->friend_number == friend_number)
+            return calls->calls[i];
+
+    audio_calls_release(av, *epoch);
+    return NULL;
+}
+static void audio_calls_release(ToxAV *av, uint32_t epoch)
+{
+    __atomic_sub_fetch(&av->audio_readers[epoch], 1, __ATOMIC_SEQ_CST);
+}
+/* Publish the active calls to audio_call_acquire() and wait until no reader has the old
+ * ones. Readers that come in meanwhile count in the next epoch, so only the readers of the
+ * old calls are waited for, and they are only ever in for one frame.
+ * Assumes mutex locked.
+ *
+ * return false, and publish no calls at all, if out of memory.
+ */
+static bool audio_calls_update(ToxAV *av)
+{
+    ToxAVAudioCalls *calls = NULL;
+    ToxAVCall *it;
+    uint32_t count = 0;
+
+    for (it = av->calls ? av->calls[av->calls_head] : NULL; it; it = it->next)
+        count += it->active;
+
+    if (count) {
+        calls = malloc(sizeof(ToxAVAudioCalls) + count * sizeof(ToxAVCall *));
+
+        if (calls) {
+            calls->count = 0;
+
+            for (it = av->calls[av->calls_head]; it; it = it->next)
+                if (it->active)
+                    calls->calls[calls->count++] = it;
+        }
+    }
+
+    ToxAVAudioCalls *old = __atomic_exchange_n(&av->audio_calls, calls, __ATOMIC_SEQ_CST);
+    uint32_t epoch = __atomic_load_n(&av->audio_epoch, __ATOMIC_RELAXED);
+    __atomic_store_n(&av->audio_epoch, !epoch, __ATOMIC_SEQ_CST);
+
+    while (__atomic_load_n(&av->audio_readers[epoch], __ATOMIC_SEQ_CST) != 0)
+        sched_yield();
+
+    free(old);
+    return calls || !count;
+}
+/* Copy what msi allows for audio sending where toxav_audio_send_frame() can see it.
+ * Assumes mutex locked.
+ */
+static void call_update_audio_allowed(ToxAVCall *call)
+{
+    bool allowed = call && call->msi_call && call->msi_call->state == msi_CallActive && call->audio_bit_rate &&
+                   (call->msi_call->self_capabilities & msi_CapSAudio) &&
+                   (call->msi_call->peer_capabilities & msi_CapRAudio);
+
+    if (call)
+        __atomic_store_n(&call->audio_allowed, allowed, __ATOMIC_RELAXED);
+}
+static int audio_send_packet(void *rtp, const uint8_t *data, uint16_t length, uint32_t timestamp)
+{
+    return rtp_send_data_at(rtp, data, length, timestamp);
+}
+static int audio_drop_packet(void *rtp, const uint8_t *data, uint16_t length, uint32_t timestamp)
+{
+    (void)rtp;
+    (void)data;
+    (void)length;
+    (void)timestamp;
+    return 0;
+}
+/* Sends what toxav_audio_send_frame() queued, woken by it for every frame. Frames msi no
+ * longer allows are dropped.
+ */
+static void *audio_sender_thread(void *arg)
+{
+    ToxAV *av = arg;
+
+    while (1) {
+        wake_sem_wait(av->audio_sender_wake);
+
+        if (__atomic_load_n(&av->audio_sender_stop, __ATOMIC_ACQUIRE))
+            break;
+
+        pthread_mutex_lock(av->mutex);
+        ToxAVCall *i = av->calls ? av->calls[av->calls_head] : NULL;
+
+        for (; i; i = i->next) {
+            if (!i->active)
+                continue;
+
+            call_update_audio_allowed(i);
+            ac_send_queued(i->audio.second, i->audio_allowed ? audio_send_packet : audio_drop_packet,
+                           i->audio.first);
+        }
+
+        pthread_mutex_unlock(av->mutex);
+    }
+
+    return NULL;
+}
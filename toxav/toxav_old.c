@@ -70,7 +70,8 @@ int toxav_join_av_groupchat(struct Tox *tox, int32_t friendnumber, const uint8_t
  *
  * Valid number of samples are ((sample rate) * (audio length (Valid ones are: 2.5, 5, 10, 20, 40 or 60 ms)) / 1000)
  * Valid number of channels are 1 or 2.
- * Valid sample rates are 8000, 12000, 16000, 24000, or 48000.
+ * Valid sample rates are 8000, 12000, 16000, 24000, or 48000. Other rates from 8000 to 96000
+ * are resampled to 48000.
  *
  * Recommended values are: samples = 960, channels = 1, sample_rate = 48000
  */
@@ -80,3 +81,24 @@ int toxav_group_send_audio(struct Tox *tox, int groupnumber, const int16_t *pcm,
     Group_Chats *gc = tox->gc;
     return group_send_audio(gc, groupnumber, pcm, samples, channels, sample_rate);
 }
+
+/* Turn the audio mixer of an A/V group chat on (channels 1 or 2) or off (channels 0).
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ *
+ * With the mixer on, the audio of all peers is decoded and mixed with ours into one
+ * 48kHz stream of 20ms frames with the given number of channels. Each mixed frame is
+ * given to the audio callback with peernumber -1 and sent to the group in place of the
+ * individual streams, which are no longer relayed: peers that reach the group through
+ * us get a single stream however many are talking. This is meant for well connected
+ * nodes acting as a conference server.
+ *
+ * While it is on, audio sent with toxav_group_send_audio() is mixed in rather than
+ * sent on its own, and may be of any length.
+ */
+int toxav_group_set_audio_mixer(struct Tox *tox, int groupnumber, uint8_t channels)
+{
+    Group_Chats *gc = tox->gc;
+    return group_set_audio_mixer(gc, groupnumber, channels);
+}
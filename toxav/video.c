@@ -33,9 +33,273 @@
 #include "../toxcore/logger.h"
 #include "../toxcore/network.h"
 
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
 #define MAX_DECODE_TIME_US 0 /* Good quality encode. */
+#define MAX_ENCODE_TIME_US ((1000 / 24) * 1000)
 #define VIDEO_DECODE_BUFFER_SIZE 20
 
+/* Frames are split between encoder threads in columns (VP9 tiles) or rows, slices narrower
+ * than this cost more in synchronisation than they save.
+ */
+#define VIDEO_ENCODER_MIN_THREAD_WIDTH 320
+#define VIDEO_ENCODER_MAX_THREADS 8
+
+static unsigned int log2_floor(unsigned int n)
+{
+    unsigned int r = 0;
+
+    while (n >>= 1)
+        ++r;
+
+    return r;
+}
+static unsigned int vc_encoder_threads(uint16_t width)
+{
+#if defined(_WIN32) || defined(__WIN32__) || defined (WIN32)
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    long cores = info.dwNumberOfProcessors;
+#else
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    long threads = width / VIDEO_ENCODER_MIN_THREAD_WIDTH;
+
+    if (threads > cores)
+        threads = cores;
+
+    if (threads > VIDEO_ENCODER_MAX_THREADS)
+        threads = VIDEO_ENCODER_MAX_THREADS;
+
+    return threads < 1 ? 1 : threads;
+}
+/* Initialize enc as a realtime encoder for codec, using as many threads as the frame width
+ * and the machine allow.
+ *
+ * return 0 on success.
+ * return -1 on failure.
+ */
+static int vc_init_encoder(vpx_codec_ctx_t *enc, TOXAV_VIDEO_CODEC codec, uint32_t bit_rate,
+                           uint16_t width, uint16_t height)
+{
+    vpx_codec_iface_t *iface = codec == TOXAV_VIDEO_CODEC_VP9 ?
+                               VIDEO_CODEC_VP9_ENCODER_INTERFACE : VIDEO_CODEC_ENCODER_INTERFACE;
+    vpx_codec_enc_cfg_t cfg;
+    int rc = vpx_codec_enc_config_default(iface, &cfg, 0);
+
+    if (rc != VPX_CODEC_OK) {
+        LOGGER_ERROR("Failed to get config: %s", vpx_codec_err_to_string(rc));
+        return -1;
+    }
+
+    cfg.rc_target_bitrate = bit_rate;
+    cfg.g_w = width;
+    cfg.g_h = height;
+    cfg.g_pass = VPX_RC_ONE_PASS;
+    /* FIXME If we set error resilience the app will crash due to bug in vp8.
+             Perhaps vp9 has solved it?*/
+//     cfg.g_error_resilient = VPX_ERROR_RESILIENT_DEFAULT | VPX_ERROR_RESILIENT_PARTITIONS;
+    cfg.g_lag_in_frames = 0;
+    cfg.kf_min_dist = 0;
+    cfg.kf_max_dist = 48;
+    cfg.kf_mode = VPX_KF_AUTO;
+    cfg.g_threads = vc_encoder_threads(width);
+
+    rc = vpx_codec_enc_init(enc, iface, &cfg, 0);
+
+    if (rc != VPX_CODEC_OK) {
+        LOGGER_ERROR("Failed to initialize encoder: %s", vpx_codec_err_to_string(rc));
+        return -1;
+    }
+
+    rc = vpx_codec_control(enc, VP8E_SET_CPUUSED, 8);
+
+    if (rc == VPX_CODEC_OK) {
+        if (codec == TOXAV_VIDEO_CODEC_VP9) {
+            /* Row based multithreading keeps all threads busy even with few tile columns */
+            rc = vpx_codec_control(enc, VP9E_SET_ROW_MT, 1);
+
+            if (rc == VPX_CODEC_OK)
+                rc = vpx_codec_control(enc, VP9E_SET_TILE_COLUMNS, log2_floor(cfg.g_threads));
+        } else {
+            /* One token partition per thread lets the decoding side use threads as well */
+            rc = vpx_codec_control(enc, VP8E_SET_TOKEN_PARTITIONS, log2_floor(cfg.g_threads));
+        }
+    }
+
+    if (rc != VPX_CODEC_OK) {
+        LOGGER_ERROR("Failed to set encoder control setting: %s", vpx_codec_err_to_string(rc));
+        vpx_codec_destroy(enc);
+        return -1;
+    }
+
+    return 0;
+}
+static int vc_init_decoder(vpx_codec_ctx_t *dec, TOXAV_VIDEO_CODEC codec)
+{
+    int rc = vpx_codec_dec_init(dec, codec == TOXAV_VIDEO_CODEC_VP9 ?
+                                VIDEO_CODEC_VP9_DECODER_INTERFACE : VIDEO_CODEC_DECODER_INTERFACE, NULL, 0);
+
+    if (rc != VPX_CODEC_OK) {
+        LOGGER_ERROR("Init video_decoder failed: %s", vpx_codec_err_to_string(rc));
+        return -1;
+    }
+
+    return 0;
+}
+/* Tell the codec of a key frame from its header, peers switch codec with a key frame.
+ *
+ * return true and set codec if data is a VP8 or VP9 key frame.
+ */
+static bool vc_key_frame_codec(const uint8_t *data, uint32_t length, TOXAV_VIDEO_CODEC *codec)
+{
+    /* VP8: key frame bit clear in the 3 byte frame tag, then the start code 9d 01 2a */
+    if (length >= 6 && !(data[0] & 1) && data[3] == 0x9d && data[4] == 0x01 && data[5] == 0x2a) {
+        *codec = TOXAV_VIDEO_CODEC_VP8;
+        return true;
+    }
+
+    /* VP9 profiles 0-2: frame marker 10, profile, show_existing_frame and frame_type both 0,
+     * then the sync code 49 83 42 */
+    if (length >= 4 && (data[0] & 0xc0) == 0x80 && (data[0] & 0x30) != 0x30 && !(data[0] & 0x0c) &&
+            data[1] == 0x49 && data[2] == 0x83 && data[3] == 0x42) {
+        *codec = TOXAV_VIDEO_CODEC_VP9;
+        return true;
+    }
+
+    return false;
+}
+static void copy_plane(uint8_t *dst, int dst_stride, const uint8_t *src, int32_t src_stride,
+                       uint16_t width, uint16_t height)
+{
+    uint16_t i;
+
+    for (i = 0; i < height; ++i)
+        memcpy(dst + i * dst_stride, src + i * src_stride, width);
+}
+/* Copy a decoded frame into the pool for vc_iterate() to deliver. */
+static void vc_pool_frame(VCSession *vc, const vpx_image_t *frame)
+{
+    uint8_t i;
+
+    pthread_mutex_lock(vc->dec_mutex);
+
+    if (vc->dec_free_count) {
+        i = vc->dec_free[--vc->dec_free_count];
+    } else {
+        /* The iterate thread is behind, only the newest frames are worth showing */
+        i = vc->dec_ready[vc->dec_ready_start];
+        vc->dec_ready_start = (vc->dec_ready_start + 1) % VC_DECODE_POOL_SIZE;
+        --vc->dec_ready_count;
+        __atomic_add_fetch(&vc->decoded_dropped, 1, __ATOMIC_RELAXED);
+    }
+
+    pthread_mutex_unlock(vc->dec_mutex);
+
+    vpx_image_t *img = &vc->dec_pool[i];
+
+    if (img->img_data && (img->d_w != frame->d_w || img->d_h != frame->d_h)) {
+        vpx_img_free(img);
+        memset(img, 0, sizeof(vpx_image_t));
+    }
+
+    if (!img->img_data && !vpx_img_alloc(img, VPX_IMG_FMT_I420, frame->d_w, frame->d_h, 1)) {
+        LOGGER_WARNING("Allocation failed! Application might misbehave!");
+        memset(img, 0, sizeof(vpx_image_t));
+
+        pthread_mutex_lock(vc->dec_mutex);
+        vc->dec_free[vc->dec_free_count++] = i;
+        pthread_mutex_unlock(vc->dec_mutex);
+        return;
+    }
+
+    uint16_t cw = (frame->d_w + 1) / 2, ch = (frame->d_h + 1) / 2;
+    copy_plane(img->planes[VPX_PLANE_Y], img->stride[VPX_PLANE_Y], frame->planes[VPX_PLANE_Y],
+               frame->stride[VPX_PLANE_Y], frame->d_w, frame->d_h);
+    copy_plane(img->planes[VPX_PLANE_U], img->stride[VPX_PLANE_U], frame->planes[VPX_PLANE_U],
+               frame->stride[VPX_PLANE_U], cw, ch);
+    copy_plane(img->planes[VPX_PLANE_V], img->stride[VPX_PLANE_V], frame->planes[VPX_PLANE_V],
+               frame->stride[VPX_PLANE_V], cw, ch);
+
+    pthread_mutex_lock(vc->dec_mutex);
+    vc->dec_ready[(vc->dec_ready_start + vc->dec_ready_count) % VC_DECODE_POOL_SIZE] = i;
+    ++vc->dec_ready_count;
+    pthread_mutex_unlock(vc->dec_mutex);
+}
+static void vc_decode_message(VCSession *vc, struct RTPMessage *p)
+{
+    TOXAV_VIDEO_CODEC codec;
+
+    if (vc_key_frame_codec(p->data, p->len, &codec) && codec != vc->decoder_codec) {
+        LOGGER_DEBUG("Peer switched video codec on session %p", vc);
+        vpx_codec_destroy(vc->decoder);
+
+        if (vc_init_decoder(vc->decoder, codec) != 0) {
+            /* Stay usable for a switch back */
+            codec = vc->decoder_codec;
+            vc_init_decoder(vc->decoder, codec);
+        }
+
+        vc->decoder_codec = codec;
+    }
+
+    uint64_t start = current_time_monotonic_us();
+    int rc = vpx_codec_decode(vc->decoder, p->data, p->len, NULL, MAX_DECODE_TIME_US);
+    rtp_free_msg(p);
+
+    if (rc != VPX_CODEC_OK) {
+        LOGGER_ERROR("Error decoding video: %s", vpx_codec_err_to_string(rc));
+        return;
+    }
+
+    average_add(&vc->decode_time, current_time_monotonic_us() - start);
+    __atomic_add_fetch(&vc->frames_decoded, 1, __ATOMIC_RELAXED);
+
+    vpx_codec_iter_t iter = NULL;
+    vpx_image_t *dest;
+
+    while ((dest = vpx_codec_get_frame(vc->decoder, &iter)))
+        vc_pool_frame(vc, dest);
+}
+/* Decode everything vc_queue_message() receives, so that a slow decode never holds up
+ * toxav_iterate() and audio with it.
+ */
+static void *vc_decoder_thread(void *arg)
+{
+    VCSession *vc = arg;
+    struct RTPMessage *p;
+
+    pthread_mutex_lock(vc->dec_mutex);
+
+    while (1) {
+        while (!vc->dec_stop && !vc->dec_pending)
+            pthread_cond_wait(vc->dec_cond, vc->dec_mutex);
+
+        if (vc->dec_stop)
+            break;
+
+        vc->dec_pending = false;
+        pthread_mutex_unlock(vc->dec_mutex);
+
+        while (1) {
+            pthread_mutex_lock(vc->queue_mutex);
+            bool have = rb_read(vc->vbuf_raw, (void **)&p);
+            pthread_mutex_unlock(vc->queue_mutex);
+
+            if (!have)
+                break;
+
+            vc_decode_message(vc, p);
+        }
+
+        pthread_mutex_lock(vc->dec_mutex);
+    }
+
+    pthread_mutex_unlock(vc->dec_mutex);
+    return NULL;
+}
 VCSession *vc_new(ToxAV *av, uint32_t friend_number, toxav_video_receive_frame_cb *cb, void *cb_data)
 {
     VCSession *vc = calloc(sizeof(VCSession), 1);
@@ -51,53 +315,71 @@ VCSession *vc_new(ToxAV *av, uint32_t friend_number, toxav_video_receive_frame_c
         return NULL;
     }
 
+    if (pthread_mutex_init(vc->enc_mutex, NULL) != 0) {
+        pthread_mutex_destroy(vc->queue_mutex);
+        free(vc);
+        return NULL;
+    }
+
+    if (pthread_cond_init(vc->enc_cond, NULL) != 0) {
+        pthread_mutex_destroy(vc->enc_mutex);
+        pthread_mutex_destroy(vc->queue_mutex);
+        free(vc);
+        return NULL;
+    }
+
+    if (pthread_mutex_init(vc->dec_mutex, NULL) != 0) {
+        pthread_cond_destroy(vc->enc_cond);
+        pthread_mutex_destroy(vc->enc_mutex);
+        pthread_mutex_destroy(vc->queue_mutex);
+        free(vc);
+        return NULL;
+    }
+
+    if (pthread_cond_init(vc->dec_cond, NULL) != 0) {
+        pthread_mutex_destroy(vc->dec_mutex);
+        pthread_cond_destroy(vc->enc_cond);
+        pthread_mutex_destroy(vc->enc_mutex);
+        pthread_mutex_destroy(vc->queue_mutex);
+        free(vc);
+        return NULL;
+    }
+
+    if (pthread_mutex_init(vc->encoder_mutex, NULL) != 0) {
+        pthread_cond_destroy(vc->dec_cond);
+        pthread_mutex_destroy(vc->dec_mutex);
+        pthread_cond_destroy(vc->enc_cond);
+        pthread_mutex_destroy(vc->enc_mutex);
+        pthread_mutex_destroy(vc->queue_mutex);
+        free(vc);
+        return NULL;
+    }
+
     if (!(vc->vbuf_raw = rb_new(VIDEO_DECODE_BUFFER_SIZE)))
         goto BASE_CLEANUP;
 
-    int rc = vpx_codec_dec_init(vc->decoder, VIDEO_CODEC_DECODER_INTERFACE, NULL, 0);
-
-    if (rc != VPX_CODEC_OK) {
-        LOGGER_ERROR("Init video_decoder failed: %s", vpx_codec_err_to_string(rc));
+    if (vc_init_decoder(vc->decoder, TOXAV_VIDEO_CODEC_VP8) != 0)
         goto BASE_CLEANUP;
-    }
 
     /* Set encoder to some initial values
      */
-    vpx_codec_enc_cfg_t  cfg;
-    rc = vpx_codec_enc_config_default(VIDEO_CODEC_ENCODER_INTERFACE, &cfg, 0);
-
-    if (rc != VPX_CODEC_OK) {
-        LOGGER_ERROR("Failed to get config: %s", vpx_codec_err_to_string(rc));
+    if (vc_init_encoder(vc->encoder, TOXAV_VIDEO_CODEC_VP8, 500000, 800, 600) != 0)
         goto BASE_CLEANUP_1;
-    }
 
-    cfg.rc_target_bitrate = 500000;
-    cfg.g_w = 800;
-    cfg.g_h = 600;
-    cfg.g_pass = VPX_RC_ONE_PASS;
-    /* FIXME If we set error resilience the app will crash due to bug in vp8.
-             Perhaps vp9 has solved it?*/
-//     cfg.g_error_resilient = VPX_ERROR_RESILIENT_DEFAULT | VPX_ERROR_RESILIENT_PARTITIONS;
-    cfg.g_lag_in_frames = 0;
-    cfg.kf_min_dist = 0;
-    cfg.kf_max_dist = 48;
-    cfg.kf_mode = VPX_KF_AUTO;
+    uint8_t i;
 
-    rc = vpx_codec_enc_init(vc->encoder, VIDEO_CODEC_ENCODER_INTERFACE, &cfg, 0);
+    for (i = 0; i < VC_ENCODE_QUEUE_SIZE + 1; ++i)
+        vc->enc_free[i] = i;
 
-    if (rc != VPX_CODEC_OK) {
-        LOGGER_ERROR("Failed to initialize encoder: %s", vpx_codec_err_to_string(rc));
-        goto BASE_CLEANUP_1;
-    }
+    vc->enc_free_count = VC_ENCODE_QUEUE_SIZE + 1;
 
-    rc = vpx_codec_control(vc->encoder, VP8E_SET_CPUUSED, 8);
+    for (i = 0; i < VC_DECODE_POOL_SIZE; ++i)
+        vc->dec_free[i] = i;
 
-    if (rc != VPX_CODEC_OK) {
-        LOGGER_ERROR("Failed to set encoder control setting: %s", vpx_codec_err_to_string(rc));
-        vpx_codec_destroy(vc->encoder);
-        goto BASE_CLEANUP_1;
-    }
+    vc->dec_free_count = VC_DECODE_POOL_SIZE;
 
+    vc->encoder_codec = TOXAV_VIDEO_CODEC_VP8;
+    vc->decoder_codec = TOXAV_VIDEO_CODEC_VP8;
     vc->linfts = current_time_monotonic();
     vc->lcfd = 60;
     vc->vcb.first = cb;
@@ -105,11 +387,22 @@ VCSession *vc_new(ToxAV *av, uint32_t friend_number, toxav_video_receive_frame_c
     vc->friend_number = friend_number;
     vc->av = av;
 
+    if (pthread_create(&vc->dec_thread, NULL, vc_decoder_thread, vc) != 0) {
+        LOGGER_ERROR("Failed to start video decoder thread");
+        vpx_codec_destroy(vc->encoder);
+        goto BASE_CLEANUP_1;
+    }
+
     return vc;
 
 BASE_CLEANUP_1:
     vpx_codec_destroy(vc->decoder);
 BASE_CLEANUP:
+    pthread_mutex_destroy(vc->encoder_mutex);
+    pthread_cond_destroy(vc->dec_cond);
+    pthread_mutex_destroy(vc->dec_mutex);
+    pthread_cond_destroy(vc->enc_cond);
+    pthread_mutex_destroy(vc->enc_mutex);
     pthread_mutex_destroy(vc->queue_mutex);
     rb_kill(vc->vbuf_raw);
     free(vc);
@@ -120,16 +413,42 @@ void vc_kill(VCSession *vc)
     if (!vc)
         return;
 
+    vc_stop_encoder_thread(vc);
+
+    pthread_mutex_lock(vc->dec_mutex);
+    vc->dec_stop = true;
+    pthread_cond_signal(vc->dec_cond);
+    pthread_mutex_unlock(vc->dec_mutex);
+    pthread_join(vc->dec_thread, NULL);
+
     vpx_codec_destroy(vc->encoder);
     vpx_codec_destroy(vc->decoder);
 
+    if (vc->send_img->img_data)
+        vpx_img_free(vc->send_img);
+
+    uint8_t i;
+
+    for (i = 0; i < VC_ENCODE_QUEUE_SIZE + 1; ++i)
+        if (vc->enc_slots[i].img->img_data)
+            vpx_img_free(vc->enc_slots[i].img);
+
+    for (i = 0; i < VC_DECODE_POOL_SIZE; ++i)
+        if (vc->dec_pool[i].img_data)
+            vpx_img_free(&vc->dec_pool[i]);
+
     void *p;
 
     while (rb_read(vc->vbuf_raw, (void **)&p))
-        free(p);
+        rtp_free_msg(p);
 
     rb_kill(vc->vbuf_raw);
 
+    pthread_mutex_destroy(vc->encoder_mutex);
+    pthread_cond_destroy(vc->dec_cond);
+    pthread_mutex_destroy(vc->dec_mutex);
+    pthread_cond_destroy(vc->enc_cond);
+    pthread_mutex_destroy(vc->enc_mutex);
     pthread_mutex_destroy(vc->queue_mutex);
 
     LOGGER_DEBUG("Terminated video handler: %p", vc);
@@ -140,38 +459,27 @@ void vc_iterate(VCSession *vc)
     if (!vc)
         return;
 
-    struct RTPMessage *p;
-    int rc;
-
-    pthread_mutex_lock(vc->queue_mutex);
-
-    if (rb_read(vc->vbuf_raw, (void **)&p)) {
-        pthread_mutex_unlock(vc->queue_mutex);
+    pthread_mutex_lock(vc->dec_mutex);
 
-        rc = vpx_codec_decode(vc->decoder, p->data, p->len, NULL, MAX_DECODE_TIME_US);
-        free(p);
+    while (vc->dec_ready_count) {
+        uint8_t i = vc->dec_ready[vc->dec_ready_start];
+        vc->dec_ready_start = (vc->dec_ready_start + 1) % VC_DECODE_POOL_SIZE;
+        --vc->dec_ready_count;
+        pthread_mutex_unlock(vc->dec_mutex);
 
-        if (rc != VPX_CODEC_OK)
-            LOGGER_ERROR("Error decoding video: %s", vpx_codec_err_to_string(rc));
-        else {
-            vpx_codec_iter_t iter = NULL;
-            vpx_image_t *dest = vpx_codec_get_frame(vc->decoder, &iter);
+        /* Play decoded images, the pool frame is ours until it is put back */
+        const vpx_image_t *dest = &vc->dec_pool[i];
 
-            /* Play decoded images */
-            for (; dest; dest = vpx_codec_get_frame(vc->decoder, &iter)) {
-                if (vc->vcb.first)
-                    vc->vcb.first(vc->av, vc->friend_number, dest->d_w, dest->d_h,
-                                  (const uint8_t *)dest->planes[0], (const uint8_t *)dest->planes[1], (const uint8_t *)dest->planes[2],
-                                  dest->stride[0], dest->stride[1], dest->stride[2], vc->vcb.second);
+        if (vc->vcb.first)
+            vc->vcb.first(vc->av, vc->friend_number, dest->d_w, dest->d_h,
+                          (const uint8_t *)dest->planes[0], (const uint8_t *)dest->planes[1], (const uint8_t *)dest->planes[2],
+                          dest->stride[0], dest->stride[1], dest->stride[2], vc->vcb.second);
 
-                vpx_img_free(dest);
-            }
-        }
-
-        return;
+        pthread_mutex_lock(vc->dec_mutex);
+        vc->dec_free[vc->dec_free_count++] = i;
     }
 
-    pthread_mutex_unlock(vc->queue_mutex);
+    pthread_mutex_unlock(vc->dec_mutex);
 }
 int vc_queue_message(void *vcp, struct RTPMessage *msg)
 {
@@ -183,20 +491,20 @@ int vc_queue_message(void *vcp, struct RTPMessage *msg)
 
     if (msg->header.pt == (rtp_TypeVideo + 2) % 128) {
         LOGGER_WARNING("Got dummy!");
-        free(msg);
+        rtp_free_msg(msg);
         return 0;
     }
 
     if (msg->header.pt != rtp_TypeVideo % 128) {
         LOGGER_WARNING("Invalid payload type!");
-        free(msg);
+        rtp_free_msg(msg);
         return -1;
     }
 
     VCSession *vc = vcp;
 
     pthread_mutex_lock(vc->queue_mutex);
-    free(rb_write(vc->vbuf_raw, msg));
+    rtp_free_msg(rb_write(vc->vbuf_raw, msg));
     {
         /* Calculate time took for peer to send us this frame */
         uint32_t t_lcfd = current_time_monotonic() - vc->linfts;
@@ -205,6 +513,11 @@ int vc_queue_message(void *vcp, struct RTPMessage *msg)
     }
     pthread_mutex_unlock(vc->queue_mutex);
 
+    pthread_mutex_lock(vc->dec_mutex);
+    vc->dec_pending = true;
+    pthread_cond_signal(vc->dec_cond);
+    pthread_mutex_unlock(vc->dec_mutex);
+
     return 0;
 }
 int vc_reconfigure_encoder(VCSession *vc, uint32_t bit_rate, uint16_t width, uint16_t height)
@@ -235,30 +548,241 @@ int vc_reconfigure_encoder(VCSession *vc, uint32_t bit_rate, uint16_t width, uin
 
         LOGGER_DEBUG("Have to reinitialize vpx encoder on session %p", vc);
 
-        cfg.rc_target_bitrate = bit_rate;
-        cfg.g_w = width;
-        cfg.g_h = height;
-
         vpx_codec_ctx_t new_c;
 
-        rc = vpx_codec_enc_init(&new_c, VIDEO_CODEC_ENCODER_INTERFACE, &cfg, 0);
-
-        if (rc != VPX_CODEC_OK) {
-            LOGGER_ERROR("Failed to initialize encoder: %s", vpx_codec_err_to_string(rc));
+        if (vc_init_encoder(&new_c, vc->encoder_codec, bit_rate, width, height) != 0)
             return -1;
-        }
 
-        rc = vpx_codec_control(&new_c, VP8E_SET_CPUUSED, 8);
+        vpx_codec_destroy(vc->encoder);
+        memcpy(vc->encoder, &new_c, sizeof(new_c));
+    }
 
-        if (rc != VPX_CODEC_OK) {
-            LOGGER_ERROR("Failed to set encoder control setting: %s", vpx_codec_err_to_string(rc));
-            vpx_codec_destroy(&new_c);
-            return -1;
+    return 0;
+}
+int vc_encode_frame(VCSession *vc, const vpx_image_t *img)
+{
+    if (!vc || !img)
+        return -1;
+
+    vpx_enc_frame_flags_t flags = 0;
+
+    pthread_mutex_lock(vc->enc_mutex);
+
+    if (vc->key_frame_requested) {
+        flags |= VPX_EFLAG_FORCE_KF;
+        vc->key_frame_requested = false;
+    }
+
+    pthread_mutex_unlock(vc->enc_mutex);
+
+    uint64_t start = current_time_monotonic_us();
+    int rc = vpx_codec_encode(vc->encoder, img, vc->frame_counter, 1, flags, MAX_ENCODE_TIME_US);
+
+    if (rc != VPX_CODEC_OK) {
+        LOGGER_ERROR("Could not encode video frame: %s\n", vpx_codec_err_to_string(rc));
+        return -1;
+    }
+
+    average_add(&vc->encode_time, current_time_monotonic_us() - start);
+    __atomic_add_fetch(&vc->frames_encoded, 1, __ATOMIC_RELAXED);
+    ++vc->frame_counter;
+    return 0;
+}
+vpx_image_t *vc_frame_buffer(VCSession *vc, uint16_t width, uint16_t height)
+{
+    if (!vc || width == 0 || height == 0)
+        return NULL;
+
+    if (vc->send_img->img_data) {
+        if (vc->send_img->d_w == width && vc->send_img->d_h == height)
+            return vc->send_img;
+
+        vpx_img_free(vc->send_img);
+    }
+
+    if (!vpx_img_alloc(vc->send_img, VPX_IMG_FMT_I420, width, height, 1)) {
+        LOGGER_WARNING("Allocation failed! Application might misbehave!");
+        memset(vc->send_img, 0, sizeof(vpx_image_t));
+        return NULL;
+    }
+
+    return vc->send_img;
+}
+int vc_set_encoder(VCSession *vc, TOXAV_VIDEO_CODEC codec)
+{
+    if (!vc || (codec != TOXAV_VIDEO_CODEC_VP8 && codec != TOXAV_VIDEO_CODEC_VP9))
+        return -1;
+
+    if (codec == vc->encoder_codec)
+        return 0;
+
+    const vpx_codec_enc_cfg_t *cfg = vc->encoder->config.enc;
+    vpx_codec_ctx_t new_c;
+
+    if (vc_init_encoder(&new_c, codec, cfg->rc_target_bitrate, cfg->g_w, cfg->g_h) != 0)
+        return -1;
+
+    /* A fresh encoder starts with a key frame, which is what the peer switches decoders on */
+    vpx_codec_destroy(vc->encoder);
+    memcpy(vc->encoder, &new_c, sizeof(new_c));
+    vc->encoder_codec = codec;
+    return 0;
+}
+void vc_request_key_frame(VCSession *vc)
+{
+    if (!vc)
+        return;
+
+    pthread_mutex_lock(vc->enc_mutex);
+    vc->key_frame_requested = true;
+    pthread_mutex_unlock(vc->enc_mutex);
+}
+static void *vc_encoder_thread(void *arg)
+{
+    VCSession *vc = arg;
+
+    pthread_mutex_lock(vc->enc_mutex);
+
+    while (1) {
+        while (!vc->enc_stop && vc->enc_queue_count == 0)
+            pthread_cond_wait(vc->enc_cond, vc->enc_mutex);
+
+        if (vc->enc_stop)
+            break;
+
+        uint8_t i = vc->enc_queue[vc->enc_queue_start];
+        vc->enc_queue_start = (vc->enc_queue_start + 1) % VC_ENCODE_QUEUE_SIZE;
+        --vc->enc_queue_count;
+        pthread_mutex_unlock(vc->enc_mutex);
+
+        VCEncodeSlot *slot = &vc->enc_slots[i];
+        pthread_mutex_lock(vc->encoder_mutex);
+
+        if (vc_reconfigure_encoder(vc, slot->bit_rate, slot->img->d_w, slot->img->d_h) == 0 &&
+                vc_encode_frame(vc, slot->img) == 0) {
+            vpx_codec_iter_t iter = NULL;
+            const vpx_codec_cx_pkt_t *pkt;
+
+            while ((pkt = vpx_codec_get_cx_data(vc->encoder, &iter)))
+                if (pkt->kind == VPX_CODEC_CX_FRAME_PKT &&
+                        vc->enc_send.first(vc->enc_send.second, pkt->data.frame.buf, pkt->data.frame.sz) < 0)
+                    LOGGER_WARNING("Could not send video frame on session %p", vc);
         }
 
-        vpx_codec_destroy(vc->encoder);
-        memcpy(vc->encoder, &new_c, sizeof(new_c));
+        pthread_mutex_unlock(vc->encoder_mutex);
+        pthread_mutex_lock(vc->enc_mutex);
+        vc->enc_free[vc->enc_free_count++] = i;
+    }
+
+    pthread_mutex_unlock(vc->enc_mutex);
+    return NULL;
+}
+int vc_start_encoder_thread(VCSession *vc, vc_send_cb *send, void *send_object)
+{
+    if (!vc || !send)
+        return -1;
+
+    if (__atomic_load_n(&vc->enc_running, __ATOMIC_RELAXED))
+        return 0;
+
+    vc->enc_send.first = send;
+    vc->enc_send.second = send_object;
+    vc->enc_stop = false;
+
+    if (pthread_create(&vc->enc_thread, NULL, vc_encoder_thread, vc) != 0) {
+        LOGGER_ERROR("Failed to start video encoder thread");
+        return -1;
+    }
+
+    __atomic_store_n(&vc->enc_running, true, __ATOMIC_RELAXED);
+    return 0;
+}
+void vc_stop_encoder_thread(VCSession *vc)
+{
+    if (!vc || !__atomic_load_n(&vc->enc_running, __ATOMIC_RELAXED))
+        return;
+
+    pthread_mutex_lock(vc->enc_mutex);
+    vc->enc_stop = true;
+    pthread_cond_signal(vc->enc_cond);
+    pthread_mutex_unlock(vc->enc_mutex);
+
+    pthread_join(vc->enc_thread, NULL);
+    __atomic_store_n(&vc->enc_running, false, __ATOMIC_RELAXED);
+
+    /* Frames still queued are dropped */
+    while (vc->enc_queue_count) {
+        vc->enc_free[vc->enc_free_count++] = vc->enc_queue[vc->enc_queue_start];
+        vc->enc_queue_start = (vc->enc_queue_start + 1) % VC_ENCODE_QUEUE_SIZE;
+        --vc->enc_queue_count;
+    }
+}
+int vc_queue_frame(VCSession *vc, uint32_t bit_rate, uint16_t width, uint16_t height,
+                   const uint8_t *y, const uint8_t *u, const uint8_t *v,
+                   int32_t ystride, int32_t ustride, int32_t vstride)
+{
+    if (!vc || !__atomic_load_n(&vc->enc_running, __ATOMIC_RELAXED) || width == 0 || height == 0)
+        return -1;
+
+    uint8_t i;
+
+    pthread_mutex_lock(vc->enc_mutex);
+
+    if (vc->enc_free_count) {
+        i = vc->enc_free[--vc->enc_free_count];
+    } else {
+        /* The encoder can't keep up, replace the oldest frame so latency stays bounded */
+        i = vc->enc_queue[vc->enc_queue_start];
+        vc->enc_queue_start = (vc->enc_queue_start + 1) % VC_ENCODE_QUEUE_SIZE;
+        --vc->enc_queue_count;
+        __atomic_add_fetch(&vc->frames_dropped, 1, __ATOMIC_RELAXED);
+    }
+
+    pthread_mutex_unlock(vc->enc_mutex);
+
+    /* The slot is ours until it is queued, copy outside of the lock */
+    VCEncodeSlot *slot = &vc->enc_slots[i];
+
+    if (slot->img->img_data && (slot->img->d_w != width || slot->img->d_h != height)) {
+        vpx_img_free(slot->img);
+        memset(slot->img, 0, sizeof(vpx_image_t));
+    }
+
+    if (!slot->img->img_data && !vpx_img_alloc(slot->img, VPX_IMG_FMT_I420, width, height, 1)) {
+        LOGGER_WARNING("Allocation failed! Application might misbehave!");
+        memset(slot->img, 0, sizeof(vpx_image_t));
+
+        pthread_mutex_lock(vc->enc_mutex);
+        vc->enc_free[vc->enc_free_count++] = i;
+        pthread_mutex_unlock(vc->enc_mutex);
+        return -1;
     }
 
+    copy_plane(slot->img->planes[VPX_PLANE_Y], slot->img->stride[VPX_PLANE_Y], y, ystride, width, height);
+    copy_plane(slot->img->planes[VPX_PLANE_U], slot->img->stride[VPX_PLANE_U], u, ustride, (width + 1) / 2,
+               (height + 1) / 2);
+    copy_plane(slot->img->planes[VPX_PLANE_V], slot->img->stride[VPX_PLANE_V], v, vstride, (width + 1) / 2,
+               (height + 1) / 2);
+    slot->bit_rate = bit_rate;
+
+    pthread_mutex_lock(vc->enc_mutex);
+    vc->enc_queue[(vc->enc_queue_start + vc->enc_queue_count) % VC_ENCODE_QUEUE_SIZE] = i;
+    ++vc->enc_queue_count;
+    pthread_cond_signal(vc->enc_cond);
+    pthread_mutex_unlock(vc->enc_mutex);
+
     return 0;
 }
+/* Fill in the codec part of the stream stats. */
+void vc_get_stats(const VCSession *vc, ToxAV_Stream_Stats *sent, ToxAV_Stream_Stats *received)
+{
+    if (!vc)
+        return;
+
+    sent->frames = __atomic_load_n(&vc->frames_encoded, __ATOMIC_RELAXED);
+    sent->frames_dropped = __atomic_load_n(&vc->frames_dropped, __ATOMIC_RELAXED);
+    sent->codec_time = __atomic_load_n(&vc->encode_time, __ATOMIC_RELAXED);
+    received->frames = __atomic_load_n(&vc->frames_decoded, __ATOMIC_RELAXED);
+    received->frames_dropped = __atomic_load_n(&vc->decoded_dropped, __ATOMIC_RELAXED);
+    received->codec_time = __atomic_load_n(&vc->decode_time, __ATOMIC_RELAXED);
+}
@@ -29,6 +29,13 @@
 #include <vpx/vpx_image.h>
 #define VIDEO_CODEC_DECODER_INTERFACE (vpx_codec_vp8_dx())
 #define VIDEO_CODEC_ENCODER_INTERFACE (vpx_codec_vp8_cx())
+#define VIDEO_CODEC_VP9_DECODER_INTERFACE (vpx_codec_vp9_dx())
+#define VIDEO_CODEC_VP9_ENCODER_INTERFACE (vpx_codec_vp9_cx())
+
+/* Frames waiting for the encoder thread, the oldest is dropped when full. */
+#define VC_ENCODE_QUEUE_SIZE 2
+/* Decoded frames waiting for vc_iterate(), the oldest is dropped when full. */
+#define VC_DECODE_POOL_SIZE 4
 
 #include <pthread.h>
 
@@ -38,15 +45,65 @@
 
 struct RTPMessage;
 
+/* Sink for encoded frames produced by the encoder thread. */
+typedef int vc_send_cb(void *object, const uint8_t *data, uint16_t length);
+
+typedef struct {
+    vpx_image_t img[1];
+    uint32_t bit_rate;
+} VCEncodeSlot;
+
 typedef struct VCSession_s {
-    /* encoding */
+    /* encoding, held while using the encoder */
+    pthread_mutex_t encoder_mutex[1];
     vpx_codec_ctx_t encoder[1];
+    TOXAV_VIDEO_CODEC encoder_codec;
     uint32_t frame_counter;
+    bool key_frame_requested; /* By the peer, under enc_mutex */
+    vpx_image_t send_img[1]; /* Encoder owned frame handed out by vc_frame_buffer() */
+
+    /* asynchronous encoding, see vc_start_encoder_thread() */
+    VCEncodeSlot enc_slots[VC_ENCODE_QUEUE_SIZE + 1];
+    uint8_t enc_queue[VC_ENCODE_QUEUE_SIZE]; /* Slot indices, oldest first */
+    uint8_t enc_queue_start;
+    uint8_t enc_queue_count;
+    uint8_t enc_free[VC_ENCODE_QUEUE_SIZE + 1];
+    uint8_t enc_free_count;
+    uint32_t frames_dropped;
 
-    /* decoding */
+    bool enc_running; /* Read with __atomic builtins, changed under the call's video mutex */
+    bool enc_stop;
+    pthread_t enc_thread;
+    pthread_mutex_t enc_mutex[1];
+    pthread_cond_t enc_cond[1];
+    PAIR(vc_send_cb *, void *) enc_send;
+
+    /* decoding, done by the decoder thread */
     vpx_codec_ctx_t decoder[1];
+    TOXAV_VIDEO_CODEC decoder_codec;
     void *vbuf_raw; /* Un-decoded data */
 
+    /* decoded frames, delivered to vcb by vc_iterate() */
+    vpx_image_t dec_pool[VC_DECODE_POOL_SIZE];
+    uint8_t dec_ready[VC_DECODE_POOL_SIZE]; /* Pool indices, oldest first */
+    uint8_t dec_ready_start;
+    uint8_t dec_ready_count;
+    uint8_t dec_free[VC_DECODE_POOL_SIZE];
+    uint8_t dec_free_count;
+    uint32_t decoded_dropped;
+
+    bool dec_pending;
+    bool dec_stop;
+    pthread_t dec_thread;
+    pthread_mutex_t dec_mutex[1];
+    pthread_cond_t dec_cond[1];
+
+    /* For vc_get_stats(), kept with __atomic builtins by the encoding and decoding threads */
+    uint32_t frames_encoded;
+    uint32_t encode_time; /* Recent average in us */
+    uint32_t frames_decoded;
+    uint32_t decode_time;
+
     uint64_t linfts; /* Last received frame time stamp */
     uint32_t lcfd; /* Last calculated frame duration for incoming video payload */
 
@@ -62,6 +119,17 @@ VCSession *vc_new(ToxAV *av, uint32_t friend_number, toxav_video_receive_frame_c
 void vc_kill(VCSession *vc);
 void vc_iterate(VCSession *vc);
 int vc_queue_message(void *vcp, struct RTPMessage *msg);
+/* Callers of the encoder functions below hold encoder_mutex. */
 int vc_reconfigure_encoder(VCSession *vc, uint32_t bit_rate, uint16_t width, uint16_t height);
+int vc_encode_frame(VCSession *vc, const vpx_image_t *img);
+vpx_image_t *vc_frame_buffer(VCSession *vc, uint16_t width, uint16_t height);
+int vc_set_encoder(VCSession *vc, TOXAV_VIDEO_CODEC codec);
+void vc_request_key_frame(VCSession *vc);
+int vc_start_encoder_thread(VCSession *vc, vc_send_cb *send, void *send_object);
+void vc_stop_encoder_thread(VCSession *vc);
+int vc_queue_frame(VCSession *vc, uint32_t bit_rate, uint16_t width, uint16_t height,
+                   const uint8_t *y, const uint8_t *u, const uint8_t *v,
+                   int32_t ystride, int32_t ustride, int32_t vstride);
+void vc_get_stats(const VCSession *vc, ToxAV_Stream_Stats *sent, ToxAV_Stream_Stats *received);
 
 #endif /* VIDEO_H */
@@ -354,6 +354,12 @@ static int unset_bit_at(uint8_t *pk, unsigned int index)
     return 0;
 }
 
+/* A node goes bad when it missed PINGS_MISSED_NODE_GOES_BAD retries after its ping interval. */
+static _Bool client_is_bad(const Client_data *client)
+{
+    return is_timeout(client->timestamp, client->ping_interval + PING_ANSWER_TIMEOUT);
+}
+
 static int alloc_buckets(DHT_Bucket *bucket)
 {
     DHT_Bucket *b0 = calloc(1, sizeof(DHT_Bucket));
@@ -369,7 +375,7 @@ static int alloc_buckets(DHT_Bucket *bucket)
         unsigned int i, b0_ind = 0, b1_ind = 0;
 
         for (i = 0; i < DHT_BUCKET_NODES; ++i) {
-            if (!is_timeout(bucket->client_list[i].timestamp, BAD_NODE_TIMEOUT)) {
+            if (!client_is_bad(&bucket->client_list[i])) {
                 int bit = get_bit_at(bucket->client_list[i].public_key, bucket->deepness);
 
                 if (bit == 0) {
@@ -474,7 +480,7 @@ static int recursive_DHT_bucket_add_node(DHT_Bucket *bucket, const uint8_t *publ
         for (i = 0; i < DHT_BUCKET_NODES; ++i) {
             Client_data *client = &bucket->client_list[i];
 
-            if (is_timeout(client->timestamp, BAD_NODE_TIMEOUT)) {
+            if (client_is_bad(client)) {
                 store_index = i;
             } else {
                 if (id_equal(client->public_key, public_key)) {
@@ -482,6 +488,27 @@ static int recursive_DHT_bucket_add_node(DHT_Bucket *bucket, const uint8_t *publ
                         return -1;
                     }
 
+                    /* Answer to a ping: stable nodes get pinged less often, flaky ones more. */
+                    if (client->last_pinged > client->timestamp) {
+                        uint64_t rtt = current_time_monotonic() - client->ping_sent_ms;
+
+                        if (rtt > UINT16_MAX)
+                            rtt = UINT16_MAX;
+
+                        client->rtt = client->rtt ? (client->rtt * 3 + rtt) / 4 : rtt;
+
+                        if (client->pings_missed) {
+                            client->ping_interval /= 2;
+
+                            if (client->ping_interval < PING_INTERVAL_MIN)
+                                client->ping_interval = PING_INTERVAL_MIN;
+                        } else {
+                            client->ping_interval = MIN(client->ping_interval * 2, PING_INTERVAL_MAX);
+                        }
+
+                        client->pings_missed = 0;
+                    }
+
                     client->ip_port = ip_port;
                     client->timestamp = unix_time();
                     return 0;
@@ -498,7 +525,8 @@ static int recursive_DHT_bucket_add_node(DHT_Bucket *bucket, const uint8_t *publ
             memset(client, 0, sizeof(Client_data));
             id_copy(client->public_key, public_key);
             client->ip_port = ip_port;
-            client->last_pinged = client->timestamp = unix_time();
+            client->first_seen = client->last_pinged = client->timestamp = unix_time();
+            client->ping_interval = PING_INTERVAL_MIN;
 
             return 0;
         }
@@ -570,7 +598,7 @@ static int recursive_DHT_bucket_set_node_ret_ip_port(DHT_Bucket *bucket, const u
         for (i = 0; (i < DHT_BUCKET_NODES); ++i) {
             Client_data *client = &bucket->client_list[i];
 
-            if (!is_timeout(client->timestamp, BAD_NODE_TIMEOUT)) {
+            if (!client_is_bad(client)) {
                 if (id_equal(client->public_key, node_public_key)) {
                     uint64_t smallest_timestamp = ~0;
                     unsigned int index_dht = DHT_BUCKET_NODES;
@@ -643,7 +671,7 @@ static int recursive_DHT_bucket_get_nodes(const DHT_Bucket *bucket, Client_data
         unsigned int i, counter = 0;
 
         for (i = 0; (i < DHT_BUCKET_NODES) && (counter < number); ++i) {
-            if (!is_timeout(bucket->client_list[i].timestamp, BAD_NODE_TIMEOUT)) {
+            if (!client_is_bad(&bucket->client_list[i])) {
                 memcpy(&nodes[number - (counter + 1)], &bucket->client_list[i], sizeof(Client_data));
                 ++counter;
             }
@@ -749,12 +777,23 @@ static int recursive_do_ping_nodes(DHT *dht, DHT_Bucket *bucket, uint8_t *key)
         for (i = 0; i < DHT_BUCKET_NODES; ++i) {
             Client_data *client = &bucket->client_list[i];
 
-            if (!is_timeout(client->timestamp, BAD_NODE_TIMEOUT)) {
-                if (is_timeout(client->last_pinged, PING_INTERVAL)) {
-                    getnodes(dht, client->ip_port, client->public_key, search_key, NULL);
-                    client->last_pinged = unix_time();
-                }
+            if (client_is_bad(client))
+                continue;
+
+            /* Nodes we heard from recently don't need a ping. */
+            if (client->last_pinged <= client->timestamp) {
+                if (!is_timeout(client->timestamp, client->ping_interval))
+                    continue;
+            } else {
+                if (!is_timeout(client->last_pinged, PING_RETRY_INTERVAL))
+                    continue;
+
+                ++client->pings_missed;
             }
+
+            getnodes(dht, client->ip_port, client->public_key, search_key, NULL);
+            client->last_pinged = unix_time();
+            client->ping_sent_ms = current_time_monotonic();
         }
 
         return 0;
@@ -877,6 +916,60 @@ int get_close_nodes(const DHT *dht, const uint8_t *public_key, Node_format *node
     return num_nodes;
 }
 
+/* return the good client with public_key in bucket, NULL if there is none.
+ */
+static Client_data *bucket_get_client(DHT_Bucket *bucket, const uint8_t *public_key)
+{
+    int bit = get_bit_at(public_key, bucket->deepness);
+
+    if (bit == -1)
+        return NULL;
+
+    if (bucket->empty)
+        return bucket_get_client(bucket->buckets[bit], public_key);
+
+    unsigned int i;
+
+    for (i = 0; i < DHT_BUCKET_NODES; ++i) {
+        Client_data *client = &bucket->client_list[i];
+
+        if (!client_is_bad(client) && id_equal(client->public_key, public_key))
+            return client;
+    }
+
+    return NULL;
+}
+
+/* Give the node with public_key just added to bucket the uptime it had in the loaded node cache,
+ * counting from now as we don't know how long it was up while we were not running.
+ */
+static void restore_uptime(DHT *dht, DHT_Bucket *bucket, const uint8_t *public_key)
+{
+    unsigned int i;
+
+    for (i = 0; i < dht->loaded_num_uptimes; ++i) {
+        if (id_equal(dht->loaded_uptimes[i].public_key, public_key))
+            break;
+    }
+
+    if (i == dht->loaded_num_uptimes)
+        return;
+
+    Client_data *client = bucket_get_client(bucket, public_key);
+    uint32_t uptime = dht->loaded_uptimes[i].uptime;
+
+    if (client && client->timestamp - uptime < client->first_seen)
+        client->first_seen = client->timestamp - uptime;
+
+    dht->loaded_uptimes[i] = dht->loaded_uptimes[dht->loaded_num_uptimes - 1];
+    --dht->loaded_num_uptimes;
+
+    if (dht->loaded_num_uptimes == 0) {
+        free(dht->loaded_uptimes);
+        dht->loaded_uptimes = NULL;
+    }
+}
+
 static DHT_Bucket *ip_bucket(DHT *dht, IP_Port ip_port)
 {
     if (LAN_ip(ip_port.ip) == 0) {
@@ -901,10 +994,13 @@ static _Bool add_to_close(DHT *dht, const uint8_t *public_key, IP_Port ip_port,
 {
     DHT_Bucket *bucket = ip_bucket(dht, ip_port);
 
-    if (bucket)
-        return (DHT_bucket_add_node(bucket, public_key, ip_port, simulate) == 0);
+    if (!bucket || DHT_bucket_add_node(bucket, public_key, ip_port, simulate) != 0)
+        return 0;
+
+    if (!simulate && dht->loaded_num_uptimes)
+        restore_uptime(dht, bucket, public_key);
 
-    return 0;
+    return 1;
 }
 
 /* Return 1 if node can be added to close list, 0 if it can't.
@@ -914,6 +1010,147 @@ _Bool node_addable_to_close_list(DHT *dht, const uint8_t *public_key, IP_Port ip
     return add_to_close(dht, public_key, ip_port, 1);
 }
 
+/* Add node to the shortlist of lookup for target, keeping it sorted by distance.
+ *
+ * return -1 if the node was not added.
+ * return its position in the shortlist if it was.
+ */
+static int lookup_add_node(DHT_Lookup *lookup, const uint8_t *target, const uint8_t *public_key, IP_Port ip_port)
+{
+    unsigned int i, pos = lookup->num_nodes;
+
+    for (i = 0; i < lookup->num_nodes; ++i) {
+        if (id_equal(lookup->nodes[i].node.public_key, public_key))
+            return -1;
+
+        if (pos == lookup->num_nodes && id_closest(target, public_key, lookup->nodes[i].node.public_key) == 1)
+            pos = i;
+    }
+
+    if (pos == DHT_LOOKUP_NODES)
+        return -1;
+
+    if (lookup->num_nodes == DHT_LOOKUP_NODES) {
+        if (lookup->nodes[DHT_LOOKUP_NODES - 1].state == DHT_LOOKUP_NODE_SENT)
+            --lookup->in_flight;
+    } else {
+        ++lookup->num_nodes;
+    }
+
+    memmove(&lookup->nodes[pos + 1], &lookup->nodes[pos], sizeof(DHT_Lookup_Node) * (lookup->num_nodes - pos - 1));
+    memset(&lookup->nodes[pos], 0, sizeof(DHT_Lookup_Node));
+    id_copy(lookup->nodes[pos].node.public_key, public_key);
+    lookup->nodes[pos].node.ip_port = ip_port;
+    return pos;
+}
+
+/* Expire timed out requests of a running lookup and send requests to the closest nodes
+ * not asked yet, keeping DHT_LOOKUP_ALPHA in flight. The lookup is done once the
+ * DHT_LOOKUP_K closest nodes that did not fail have all answered.
+ */
+static void lookup_step(DHT *dht, DHT_Lookup *lookup, const uint8_t *target)
+{
+    if (lookup->start_time == 0)
+        return;
+
+    uint64_t now = current_time_monotonic();
+    unsigned int i, responded = 0;
+    _Bool pending = 0;
+
+    for (i = 0; i < lookup->num_nodes && responded < DHT_LOOKUP_K; ++i) {
+        DHT_Lookup_Node *node = &lookup->nodes[i];
+
+        if (node->state == DHT_LOOKUP_NODE_SENT && node->sent_time + DHT_LOOKUP_QUERY_TIMEOUT <= now) {
+            node->state = DHT_LOOKUP_NODE_FAILED;
+            --lookup->in_flight;
+        }
+
+        if (node->state == DHT_LOOKUP_NODE_NEW && lookup->in_flight < DHT_LOOKUP_ALPHA) {
+            if (getnodes(dht, node->node.ip_port, node->node.public_key, target, NULL) > 0) {
+                node->state = DHT_LOOKUP_NODE_SENT;
+                node->sent_time = now;
+                ++lookup->in_flight;
+            } else {
+                node->state = DHT_LOOKUP_NODE_FAILED;
+            }
+        }
+
+        if (node->state == DHT_LOOKUP_NODE_RESPONDED) {
+            ++responded;
+        } else if (node->state != DHT_LOOKUP_NODE_FAILED) {
+            pending = 1;
+        }
+    }
+
+    if (pending)
+        return;
+
+    lookup->last_duration = now - lookup->start_time;
+    lookup->last_done = unix_time();
+    lookup->start_time = 0;
+}
+
+/* Start a new lookup for target from the closest nodes we know, or from the
+ * nodes of the saved node cache while we are not connected yet.
+ */
+static void lookup_start(DHT *dht, DHT_Lookup *lookup, const uint8_t *target)
+{
+    Node_format close_nodes[MAX_SENT_NODES];
+    const Node_format *nodes = close_nodes;
+    unsigned int i, num_nodes = get_close_nodes(dht, target, close_nodes, 0, 1, 0);
+
+    if (num_nodes == 0 && dht->loaded_nodes_list) {
+        nodes = dht->loaded_nodes_list;
+        num_nodes = dht->loaded_num_nodes;
+    }
+
+    if (num_nodes == 0)
+        return;
+
+    memset(lookup->nodes, 0, sizeof(lookup->nodes));
+    lookup->num_nodes = lookup->in_flight = 0;
+
+    for (i = 0; i < num_nodes; ++i) {
+        lookup_add_node(lookup, target, nodes[i].public_key, nodes[i].ip_port);
+    }
+
+    lookup->start_time = current_time_monotonic();
+    lookup_step(dht, lookup, target);
+}
+
+/* Handle the nodes returned by public_key to a get_nodes request of lookup about target.
+ */
+static void lookup_handle_response(DHT *dht, DHT_Lookup *lookup, const uint8_t *target, const uint8_t *public_key,
+                                   const Node_format *nodes, unsigned int num_nodes)
+{
+    if (lookup->start_time == 0)
+        return;
+
+    unsigned int i;
+
+    for (i = 0; i < lookup->num_nodes; ++i) {
+        DHT_Lookup_Node *node = &lookup->nodes[i];
+
+        if (node->state == DHT_LOOKUP_NODE_SENT && id_equal(node->node.public_key, public_key)) {
+            uint32_t rtt = current_time_monotonic() - node->sent_time;
+            lookup->rtt = lookup->rtt ? (lookup->rtt * 7 + rtt) / 8 : rtt;
+            node->state = DHT_LOOKUP_NODE_RESPONDED;
+            --lookup->in_flight;
+            break;
+        }
+    }
+
+    if (i == lookup->num_nodes)
+        return;
+
+    for (i = 0; i < num_nodes; ++i) {
+        if (ipport_isset(&nodes[i].ip_port) && !id_equal(nodes[i].public_key, dht->self_public_key))
+            lookup_add_node(lookup, target, nodes[i].public_key, nodes[i].ip_port);
+    }
+
+    lookup_step(dht, lookup, target);
+}
+
 /* Check if the node obtained with a get_nodes with public_key should be pinged.
  * NOTE: for best results call it after addto_lists;
  *
@@ -922,6 +1159,10 @@ _Bool node_addable_to_close_list(DHT *dht, const uint8_t *public_key, IP_Port ip
  */
 static unsigned int ping_node_from_getnodes_ok(DHT *dht, const uint8_t *public_key, IP_Port ip_port)
 {
+    /* Other nodes return us too, we must not end up in our own lookups. */
+    if (id_equal(public_key, dht->self_public_key))
+        return 0;
+
     if (add_to_close(dht, public_key, ip_port, 1)) {
         //TODO: make less wasteful.
         if (client_in_nodelist(dht->to_bootstrap, dht->num_to_bootstrap, public_key)) {
@@ -937,17 +1178,14 @@ static unsigned int ping_node_from_getnodes_ok(DHT *dht, const uint8_t *public_k
 
         unsigned int i;
 
+        /* A node among the closest to a friend resumes its lookup. */
         for (i = 0; i < dht->num_friends; ++i) {
             DHT_Friend *friend = &dht->friends_list[i];
+            int pos = lookup_add_node(&friend->lookup, friend->public_key, public_key, ip_port);
 
-            if (!client_in_nodelist(friend->to_bootstrap, friend->num_to_bootstrap, public_key)) {
-                if (friend->num_to_bootstrap < MAX_SENT_NODES) {
-                    memcpy(friend->to_bootstrap[friend->num_to_bootstrap].public_key, public_key, crypto_box_PUBLICKEYBYTES);
-                    friend->to_bootstrap[friend->num_to_bootstrap].ip_port = ip_port;
-                    ++friend->num_to_bootstrap;
-                } else {
-                    add_to_list(friend->to_bootstrap, MAX_SENT_NODES, public_key, ip_port, friend->public_key);
-                }
+            if (pos != -1 && pos < DHT_LOOKUP_K && friend->lookup.start_time == 0) {
+                friend->lookup.start_time = current_time_monotonic();
+                lookup_step(dht, &friend->lookup, friend->public_key);
             }
         }
 
@@ -1040,7 +1278,9 @@ static int getnodes(DHT *dht, IP_Port ip_port, const uint8_t *public_key, const
         memcpy(plain_message + sizeof(receiver), sendback_node, sizeof(Node_format));
         ping_id = ping_array_add(&dht->dht_harden_ping_array, plain_message, sizeof(plain_message));
     } else {
-        ping_id = ping_array_add(&dht->dht_ping_array, plain_message, sizeof(receiver));
+        /* Keep the target so that the response only advances the lookup for it. */
+        memcpy(plain_message + sizeof(receiver), client_id, crypto_box_PUBLICKEYBYTES);
+        ping_id = ping_array_add(&dht->dht_ping_array, plain_message, sizeof(receiver) + crypto_box_PUBLICKEYBYTES);
     }
 
     if (ping_id == 0)
@@ -1158,17 +1398,21 @@ static int handle_getnodes(void *object, IP_Port source, const uint8_t *packet,
 
     return 0;
 }
-/* return 0 if no
+/* target is set to the key the request asked about, or to zeroes for hardening requests.
+   return 0 if no
    return 1 if yes */
 static uint8_t sent_getnode_to_node(DHT *dht, const uint8_t *public_key, IP_Port node_ip_port, uint64_t ping_id,
-                                    Node_format *sendback_node)
+                                    Node_format *sendback_node, uint8_t *target)
 {
     uint8_t data[sizeof(Node_format) * 2];
 
-    if (ping_array_check(data, sizeof(data), &dht->dht_ping_array, ping_id) == sizeof(Node_format)) {
+    if (ping_array_check(data, sizeof(data), &dht->dht_ping_array, ping_id) == sizeof(Node_format) +
+            crypto_box_PUBLICKEYBYTES) {
         memset(sendback_node, 0, sizeof(Node_format));
+        memcpy(target, data + sizeof(Node_format), crypto_box_PUBLICKEYBYTES);
     } else if (ping_array_check(data, sizeof(data), &dht->dht_harden_ping_array, ping_id) == sizeof(data)) {
         memcpy(sendback_node, data + sizeof(Node_format), sizeof(Node_format));
+        memset(target, 0, crypto_box_PUBLICKEYBYTES);
     } else {
         return 0;
     }
@@ -1183,7 +1427,8 @@ static uint8_t sent_getnode_to_node(DHT *dht, const uint8_t *public_key, IP_Port
 }
 
 static int handle_sendnodes_core(void *object, IP_Port source, const uint8_t *packet, uint16_t length,
-                                 Node_format *plain_nodes, uint16_t size_plain_nodes, uint32_t *num_nodes_out)
+                                 Node_format *plain_nodes, uint16_t size_plain_nodes, uint32_t *num_nodes_out,
+                                 uint8_t *target)
 {
     DHT *dht = object;
     uint32_t cid_size = 1 + crypto_box_PUBLICKEYBYTES + crypto_box_NONCEBYTES + 1 + sizeof(uint64_t) + crypto_box_MACBYTES;
@@ -1220,7 +1465,7 @@ static int handle_sendnodes_core(void *object, IP_Port source, const uint8_t *pa
     uint64_t ping_id;
     memcpy(&ping_id, plain + 1 + data_size, sizeof(ping_id));
 
-    if (!sent_getnode_to_node(dht, packet + 1, source, ping_id, &sendback_node))
+    if (!sent_getnode_to_node(dht, packet + 1, source, ping_id, &sendback_node, target))
         return 1;
 
     uint16_t length_nodes = 0;
@@ -1248,15 +1493,23 @@ static int handle_sendnodes_ipv6(void *object, IP_Port source, const uint8_t *pa
     DHT *dht = object;
     Node_format plain_nodes[MAX_SENT_NODES];
     uint32_t num_nodes;
+    uint8_t target[crypto_box_PUBLICKEYBYTES];
 
-    if (handle_sendnodes_core(object, source, packet, length, plain_nodes, MAX_SENT_NODES, &num_nodes))
+    if (handle_sendnodes_core(object, source, packet, length, plain_nodes, MAX_SENT_NODES, &num_nodes, target))
         return 1;
 
-    if (num_nodes == 0)
-        return 0;
+    int friend_num = friend_number(dht, target);
+
+    if (friend_num != -1) {
+        DHT_Friend *friend = &dht->friends_list[friend_num];
+        lookup_handle_response(dht, &friend->lookup, friend->public_key, packet + 1, plain_nodes, num_nodes);
+    }
 
     uint32_t i;
 
+    if (num_nodes == 0)
+        return 0;
+
     for (i = 0; i < num_nodes; i++) {
 
         if (ipport_isset(&plain_nodes[i].ip_port)) {
@@ -1351,7 +1604,7 @@ int DHT_addfriend(DHT *dht, const uint8_t *public_key, void (*ip_callback)(void
     if (lock_count)
         *lock_count = lock_num + 1;
 
-    friend->num_to_bootstrap = get_close_nodes(dht, friend->public_key, friend->to_bootstrap, 0, 1, 0);
+    lookup_start(dht, &friend->lookup, friend->public_key);
 
     return 0;
 }
@@ -1432,6 +1685,16 @@ int DHT_getfriendip(const DHT *dht, const uint8_t *public_key, IP_Port *ip_port)
     return 0;
 }
 
+int32_t DHT_friend_lookup_time(const DHT *dht, const uint8_t *public_key)
+{
+    int friend_num = friend_number(dht, public_key);
+
+    if (friend_num == -1 || dht->friends_list[friend_num].lookup.last_done == 0)
+        return -1;
+
+    return dht->friends_list[friend_num].lookup.last_duration;
+}
+
 void DHT_getnodes(DHT *dht, const IP_Port *from_ipp, const uint8_t *from_id, const uint8_t *which_id)
 {
     getnodes(dht, *from_ipp, from_id, which_id, NULL);
@@ -1981,19 +2244,19 @@ static void do_DHT_pings(DHT *dht)
  */
 static void do_DHT_friends(DHT *dht)
 {
-    unsigned int i, j;
+    unsigned int i;
 
     for (i = 0; i < dht->num_friends; ++i) {
         DHT_Friend *friend = &dht->friends_list[i];
+        IP_Port ip_port;
 
-        for (j = 0; j < friend->num_to_bootstrap; ++j) {
-            if (add_to_close(dht, friend->to_bootstrap[j].public_key, friend->to_bootstrap[j].ip_port, 1)) {
-                getnodes(dht, friend->to_bootstrap[j].ip_port, friend->to_bootstrap[j].public_key, friend->public_key, NULL);
-            }
+        if (friend->lookup.start_time) {
+            lookup_step(dht, &friend->lookup, friend->public_key);
+        } else if (is_timeout(friend->lookup.last_done, DHT_LOOKUP_INTERVAL)
+                   && DHT_getfriendip(dht, friend->public_key, &ip_port) == 0) {
+            lookup_start(dht, &friend->lookup, friend->public_key);
         }
 
-        friend->num_to_bootstrap = 0;
-
         if (is_timeout(friend->lastgetnode, GET_NODE_INTERVAL)) {
             Node_format node;
 
@@ -2118,6 +2381,8 @@ void kill_DHT(DHT *dht)
     kill_ping(dht->ping);
     free(dht->friends_list);
     free(dht->loaded_nodes_list);
+    free(dht->loaded_uptimes);
+    free(dht->broadcast);
     free(dht);
 }
 
@@ -2128,26 +2393,206 @@ void kill_DHT(DHT *dht)
 #define DHT_STATE_COOKIE_TYPE      0x11ce
 #define DHT_STATE_TYPE_NODES       4
 
+#define DHT_STATE_TYPE_NODE_CACHE  5
+
 #define MAX_SAVED_V4_DHT_NODES (DHT_BUCKET_NODES * DHT_FAKE_FRIEND_NUMBER)
 #define MAX_SAVED_V6_DHT_NODES (DHT_BUCKET_NODES * DHT_FAKE_FRIEND_NUMBER)
 
+/* The node cache stores the best nodes of our lists, each packed node followed by
+ * its uptime in seconds, round trip time in ms and the unix time it was last seen.
+ */
+#define MAX_SAVED_CACHE_NODES 64
+#define NODE_CACHE_STATS_SIZE (sizeof(uint32_t) + sizeof(uint16_t) + sizeof(uint64_t))
 
-/* Get the size of the DHT (for saving). */
-uint32_t DHT_size(const DHT *dht)
+/* Uptime above this many seconds does not make a node any better. */
+#define NODE_CACHE_MAX_UPTIME (60 * 60 * 24)
+
+typedef struct {
+    Node_format node;
+    uint32_t uptime;
+    uint16_t rtt;
+    uint64_t last_seen;
+    int64_t score;
+} Cached_Node;
+
+/* Higher is better: long uptime, low round trip time and seen recently.
+ * Each ms of round trip time costs as much as 10 seconds of uptime.
+ */
+static int64_t node_cache_score(uint32_t uptime, uint16_t rtt, uint64_t last_seen)
 {
-    uint8_t data[(packed_node_size(AF_INET) * MAX_SAVED_V4_DHT_NODES) + (packed_node_size(
-                     AF_INET6) * MAX_SAVED_V6_DHT_NODES)];
+    int64_t score = MIN(uptime, NODE_CACHE_MAX_UPTIME) - (int64_t)rtt * 10;
 
-    uint32_t size32 = sizeof(uint32_t), sizesubhead = size32 * 2;
-    Node_format clients[MAX_SAVED_V4_DHT_NODES + MAX_SAVED_V6_DHT_NODES];
-    unsigned int num = randfriends_nodes(dht, clients, MAX_SAVED_V4_DHT_NODES + MAX_SAVED_V6_DHT_NODES);
+    if (unix_time() > last_seen)
+        score -= unix_time() - last_seen;
+
+    return score;
+}
+
+/* Add the good nodes of bucket to the best max_num nodes in cache, kept sorted best first.
+ *
+ * return the new number of nodes in cache.
+ */
+static unsigned int node_cache_collect(const DHT_Bucket *bucket, Cached_Node *cache, unsigned int num,
+                                       unsigned int max_num)
+{
+    if (bucket->empty) {
+        num = node_cache_collect(bucket->buckets[0], cache, num, max_num);
+        return node_cache_collect(bucket->buckets[1], cache, num, max_num);
+    }
+
+    unsigned int i;
+
+    for (i = 0; i < DHT_BUCKET_NODES; ++i) {
+        const Client_data *client = &bucket->client_list[i];
+
+        if (client_is_bad(client))
+            continue;
+
+        Cached_Node node;
+        id_copy(node.node.public_key, client->public_key);
+        node.node.ip_port = client->ip_port;
+        node.uptime = client->timestamp - client->first_seen;
+        node.rtt = client->rtt;
+        node.last_seen = client->timestamp;
+        node.score = node_cache_score(node.uptime, node.rtt, node.last_seen);
+
+        unsigned int pos = num;
 
-    return size32 + sizesubhead + pack_nodes(data, sizeof(Node_format) * num, clients, num);
+        while (pos > 0 && cache[pos - 1].score < node.score)
+            --pos;
+
+        if (pos == max_num)
+            continue;
+
+        if (num < max_num)
+            ++num;
+
+        memmove(&cache[pos + 1], &cache[pos], sizeof(Cached_Node) * (num - pos - 1));
+        cache[pos] = node;
+    }
+
+    return num;
 }
 
-/* Save the DHT in data where data is an array of size DHT_size(). */
-void DHT_save(DHT *dht, uint8_t *data)
+/* Pack the node cache into data of length.
+ *
+ * return length of the packed cache.
+ */
+static uint32_t node_cache_pack(const DHT *dht, uint8_t *data, uint32_t length)
 {
+    Cached_Node cache[MAX_SAVED_CACHE_NODES];
+    unsigned int i, num = 0;
+    uint32_t len = 0;
+
+    num = node_cache_collect(&dht->bucket_v4, cache, num, MAX_SAVED_CACHE_NODES);
+    num = node_cache_collect(&dht->bucket_v6, cache, num, MAX_SAVED_CACHE_NODES);
+    num = node_cache_collect(&dht->bucket_lan, cache, num, MAX_SAVED_CACHE_NODES);
+
+    for (i = 0; i < num; ++i) {
+        int node_len = pack_nodes(data + len, length - len, &cache[i].node, 1);
+
+        if (node_len == -1 || len + node_len + NODE_CACHE_STATS_SIZE > length)
+            break;
+
+        len += node_len;
+        host_to_lendian32(data + len, cache[i].uptime);
+        len += sizeof(uint32_t);
+        uint16_t rtt = host_tolendian16(cache[i].rtt);
+        memcpy(data + len, &rtt, sizeof(uint16_t));
+        len += sizeof(uint16_t);
+        host_to_lendian32(data + len, cache[i].last_seen);
+        host_to_lendian32(data + len + sizeof(uint32_t), cache[i].last_seen >> 32);
+        len += sizeof(uint64_t);
+    }
+
+    return len;
+}
+
+/* Unpack the node cache in data and store its nodes, best first, as the nodes to bootstrap from.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int node_cache_unpack(DHT *dht, const uint8_t *data, uint32_t length)
+{
+    Cached_Node cache[MAX_SAVED_CACHE_NODES];
+    unsigned int i, num = 0;
+    uint32_t len = 0;
+
+    while (len < length && num < MAX_SAVED_CACHE_NODES) {
+        Cached_Node node;
+        uint16_t node_len;
+
+        if (unpack_nodes(&node.node, 1, &node_len, data + len, length - len, 0) != 1)
+            return -1;
+
+        len += node_len;
+
+        if (len + NODE_CACHE_STATS_SIZE > length)
+            return -1;
+
+        lendian_to_host32(&node.uptime, data + len);
+        len += sizeof(uint32_t);
+        memcpy(&node.rtt, data + len, sizeof(uint16_t));
+        node.rtt = lendian_to_host16(node.rtt);
+        len += sizeof(uint16_t);
+        uint32_t last_seen_low, last_seen_high;
+        lendian_to_host32(&last_seen_low, data + len);
+        lendian_to_host32(&last_seen_high, data + len + sizeof(uint32_t));
+        node.last_seen = ((uint64_t)last_seen_high << 32) | last_seen_low;
+        len += sizeof(uint64_t);
+        node.score = node_cache_score(node.uptime, node.rtt, node.last_seen);
+
+        unsigned int pos = num;
+
+        while (pos > 0 && cache[pos - 1].score < node.score)
+            --pos;
+
+        memmove(&cache[pos + 1], &cache[pos], sizeof(Cached_Node) * (num - pos));
+        cache[pos] = node;
+        ++num;
+    }
+
+    if (num == 0)
+        return -1;
+
+    Node_format *nodes = calloc(num, sizeof(Node_format));
+    DHT_Node_Uptime *uptimes = calloc(num, sizeof(DHT_Node_Uptime));
+
+    if (nodes == NULL || uptimes == NULL) {
+        free(nodes);
+        free(uptimes);
+        return -1;
+    }
+
+    for (i = 0; i < num; ++i) {
+        nodes[i] = cache[i].node;
+        id_copy(uptimes[i].public_key, cache[i].node.public_key);
+        uptimes[i].uptime = cache[i].uptime;
+    }
+
+    free(dht->loaded_nodes_list);
+    dht->loaded_nodes_list = nodes;
+    dht->loaded_num_nodes = num;
+    dht->loaded_nodes_index = 0;
+    free(dht->loaded_uptimes);
+    dht->loaded_uptimes = uptimes;
+    dht->loaded_num_uptimes = num;
+    return 0;
+}
+
+
+#define DHT_MAX_SAVE_SIZE (sizeof(uint32_t) + sizeof(uint32_t) * 2 \
+        + packed_node_size(AF_INET6) * (MAX_SAVED_V4_DHT_NODES + MAX_SAVED_V6_DHT_NODES) \
+        + sizeof(uint32_t) * 2 + MAX_SAVED_CACHE_NODES * (packed_node_size(AF_INET6) + NODE_CACHE_STATS_SIZE))
+
+/* Pack the DHT in data where data is an array of size DHT_MAX_SAVE_SIZE.
+ *
+ * return the length of the packed DHT.
+ */
+static uint32_t dht_pack(const DHT *dht, uint8_t *data)
+{
+    uint8_t *start = data;
     host_to_lendian32(data,  DHT_STATE_COOKIE_GLOBAL);
     data += sizeof(uint32_t);
 
@@ -2161,13 +2606,41 @@ void DHT_save(DHT *dht, uint8_t *data)
     Node_format clients[MAX_SAVED_V4_DHT_NODES + MAX_SAVED_V6_DHT_NODES];
 
     num = randfriends_nodes(dht, clients, MAX_SAVED_V4_DHT_NODES + MAX_SAVED_V6_DHT_NODES);
-    save_write_subheader(old_data, pack_nodes(data, sizeof(Node_format) * num, clients, num),
-                         DHT_STATE_TYPE_NODES, DHT_STATE_COOKIE_TYPE);
+    int len = pack_nodes(data, sizeof(Node_format) * num, clients, num);
+    save_write_subheader(old_data, len, DHT_STATE_TYPE_NODES, DHT_STATE_COOKIE_TYPE);
+    data += len;
+
+    /* Older versions skip the node cache and only load the nodes above. */
+    old_data = data;
+    data = save_write_subheader(data, 0, 0, DHT_STATE_COOKIE_TYPE);
+    len = node_cache_pack(dht, data, MAX_SAVED_CACHE_NODES * (packed_node_size(AF_INET6) + NODE_CACHE_STATS_SIZE));
+    save_write_subheader(old_data, len, DHT_STATE_TYPE_NODE_CACHE, DHT_STATE_COOKIE_TYPE);
+    data += len;
+
+    return data - start;
+}
+
+/* Get the size of the DHT (for saving). */
+uint32_t DHT_size(const DHT *dht)
+{
+    return DHT_MAX_SAVE_SIZE;
+}
+
+/* Save the DHT in data where data is an array of size DHT_size().
+ *
+ * return the length of the saved DHT.
+ */
+uint32_t DHT_save(const DHT *dht, uint8_t *data)
+{
+    return dht_pack(dht, data);
 }
 
 /* Bootstrap from this number of nodes every time DHT_connect_after_load() is called */
 #define SAVE_BOOTSTAP_FREQUENCY 8
 
+/* Number of the best loaded nodes asked at once the first time DHT_connect_after_load() is called. */
+#define SAVE_BOOTSTRAP_BURST 32
+
 /* Start sending packets after DHT loaded_friends_list and loaded_clients_list are set */
 int DHT_connect_after_load(DHT *dht)
 {
@@ -2185,9 +2658,13 @@ int DHT_connect_after_load(DHT *dht)
         return 0;
     }
 
-    unsigned int i;
+    unsigned int i, num = SAVE_BOOTSTAP_FREQUENCY;
+
+    /* Loaded nodes are sorted best first, ask the best ones in parallel right away. */
+    if (dht->loaded_nodes_index == 0)
+        num = SAVE_BOOTSTRAP_BURST;
 
-    for (i = 0; i < dht->loaded_num_nodes && i < SAVE_BOOTSTAP_FREQUENCY; ++i) {
+    for (i = 0; i < dht->loaded_num_nodes && i < num; ++i) {
         unsigned int index = dht->loaded_nodes_index % dht->loaded_num_nodes;
         DHT_bootstrap(dht, dht->loaded_nodes_list[index].ip_port, dht->loaded_nodes_list[index].public_key);
         ++dht->loaded_nodes_index;
@@ -2222,6 +2699,13 @@ static int dht_load_state_callback(void *outer, const uint8_t *data, uint32_t le
 
             break;
 
+        case DHT_STATE_TYPE_NODE_CACHE:
+            if (length == 0)
+                break;
+
+            node_cache_unpack(dht, data, length);
+            break;
+
 #ifdef DEBUG
 
         default:
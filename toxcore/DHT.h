@@ -47,6 +47,23 @@
 /* Ping interval in seconds for each node in our lists. */
 #define PING_INTERVAL 60
 
+/* Nodes in our lists start being pinged every PING_INTERVAL_MIN seconds. The interval doubles
+ * each time a node answers a ping right away, up to PING_INTERVAL_MAX, and is halved when it
+ * needed a retry. Any response from a node postpones its next ping.
+ *
+ * PING_INTERVAL_MAX is capped so that a node still goes bad within BAD_NODE_TIMEOUT.
+ */
+#define PING_INTERVAL_MIN 15
+#define PING_INTERVAL_MAX (BAD_NODE_TIMEOUT - PING_ANSWER_TIMEOUT)
+
+/* Seconds after which an unanswered ping is retried. */
+#define PING_RETRY_INTERVAL 10
+
+/* Seconds a node has to answer once its ping interval is over: the ping and each retry
+ * get PING_RETRY_INTERVAL.
+ */
+#define PING_ANSWER_TIMEOUT ((PINGS_MISSED_NODE_GOES_BAD + 1) * PING_RETRY_INTERVAL)
+
 /* The number of seconds for a non responsive node to become bad. */
 #define PINGS_MISSED_NODE_GOES_BAD 1
 #define PING_ROUNDTRIP 2
@@ -74,6 +91,16 @@ typedef struct {
     uint64_t    timestamp;
     uint64_t    last_pinged;
 
+    /* Current ping interval in seconds and pings retried since the last response. */
+    uint16_t    ping_interval;
+    uint8_t     pings_missed;
+
+    /* Time the node was added to our lists, time in ms of the last ping and
+     * smoothed round trip time of pings in ms, used to rank nodes for the saved node cache. */
+    uint64_t    first_seen;
+    uint64_t    ping_sent_ms;
+    uint16_t    rtt;
+
     struct {
         uint8_t     pk[crypto_box_PUBLICKEYBYTES];
         IP_Port     ip_port;
@@ -103,6 +130,12 @@ typedef struct {
 }
 Node_format;
 
+/* Uptime in seconds of a node of the loaded node cache. */
+typedef struct {
+    uint8_t     public_key[crypto_box_PUBLICKEYBYTES];
+    uint32_t    uptime;
+} DHT_Node_Uptime;
+
 typedef struct DHT_Bucket {
     unsigned int deepness;
     _Bool empty;
@@ -114,6 +147,42 @@ typedef struct DHT_Bucket {
     struct DHT_Bucket *buckets[2];
 } DHT_Bucket;
 
+/* Iterative lookups: get_nodes requests kept in flight per lookup, size of the
+ * shortlist and number of closest nodes that must have answered for a lookup to be done.
+ */
+#define DHT_LOOKUP_ALPHA 3
+#define DHT_LOOKUP_NODES 16
+#define DHT_LOOKUP_K DHT_BUCKET_NODES
+
+/* Milliseconds after which a get_nodes request of a lookup counts as failed. */
+#define DHT_LOOKUP_QUERY_TIMEOUT 1000
+
+/* Seconds between lookups for a friend we have not found. */
+#define DHT_LOOKUP_INTERVAL 30
+
+#define DHT_LOOKUP_NODE_NEW 0
+#define DHT_LOOKUP_NODE_SENT 1
+#define DHT_LOOKUP_NODE_RESPONDED 2
+#define DHT_LOOKUP_NODE_FAILED 3
+
+typedef struct {
+    Node_format node;
+    uint64_t    sent_time; /* in ms */
+    uint8_t     state;
+} DHT_Lookup_Node;
+
+typedef struct {
+    /* Sorted by distance to the target, closest first. */
+    DHT_Lookup_Node nodes[DHT_LOOKUP_NODES];
+    unsigned int num_nodes;
+    unsigned int in_flight;
+
+    uint64_t start_time; /* time in ms the running lookup started, 0 if none is running. */
+    uint64_t last_done; /* unix time the last lookup converged. */
+    uint32_t last_duration; /* time in ms the last lookup took to converge. */
+    uint32_t rtt; /* smoothed round trip time in ms of the get_nodes requests. */
+} DHT_Lookup;
+
 typedef struct {
     uint8_t     public_key[crypto_box_PUBLICKEYBYTES];
 
@@ -137,8 +206,7 @@ typedef struct {
         int32_t number;
     } callbacks[DHT_FRIEND_MAX_LOCKS];
 
-    Node_format to_bootstrap[MAX_SENT_NODES];
-    unsigned int num_to_bootstrap;
+    DHT_Lookup lookup;
 } DHT_Friend;
 
 /* Return packet size of packed node with ip_family on success.
@@ -210,9 +278,16 @@ struct DHT {
     uint32_t       loaded_num_nodes;
     unsigned int   loaded_nodes_index;
 
+    /* Uptimes of the nodes of the loaded node cache, given back to them when they are added to our lists. */
+    DHT_Node_Uptime *loaded_uptimes;
+    uint32_t       loaded_num_uptimes;
+
     Shared_Keys shared_keys_recv;
     Shared_Keys shared_keys_sent;
 
+    /* LAN discovery broadcast targets, fetched on first use. */
+    struct Broadcast_Info *broadcast;
+
     struct PING   *ping;
     Ping_Array    dht_ping_array;
     Ping_Array    dht_harden_ping_array;
@@ -287,6 +362,13 @@ int DHT_delfriend(DHT *dht, const uint8_t *public_key, uint16_t lock_count);
  */
 int DHT_getfriendip(const DHT *dht, const uint8_t *public_key, IP_Port *ip_port);
 
+/* Get how long the last lookup for friend with public_key took to converge.
+ *
+ *  return -1 if public_key does not refer to a friend or no lookup converged yet.
+ *  return time in ms otherwise.
+ */
+int32_t DHT_friend_lookup_time(const DHT *dht, const uint8_t *public_key);
+
 /* Compares pk1 and pk2 with pk.
  *
  *  return 0 if both are same distance.
@@ -382,11 +464,17 @@ void cryptopacket_registerhandler(DHT *dht, uint8_t byte, cryptopacket_handler_c
 
 /* SAVE/LOAD functions */
 
-/* Get the size of the DHT (for saving). */
+/* Get the size of the DHT (for saving).
+ *
+ * This is the most DHT_save() can write, which may be more than it does.
+ */
 uint32_t DHT_size(const DHT *dht);
 
-/* Save the DHT in data where data is an array of size DHT_size(). */
-void DHT_save(DHT *dht, uint8_t *data);
+/* Save the DHT in data where data is an array of size DHT_size().
+ *
+ * return the length of the saved DHT.
+ */
+uint32_t DHT_save(const DHT *dht, uint8_t *data);
 
 /* Load the DHT from data of size size.
  *
@@ -38,22 +38,30 @@
 #define MAX_INTERFACES 16
 
 
-static int     broadcast_count = -1;
-static IP_Port broadcast_ip_port[MAX_INTERFACES];
+/* Kept per DHT instance: the targets carry the port of the instance that
+ * fetched them. */
+typedef struct Broadcast_Info {
+    uint32_t count;
+    IP_Port  ip_ports[MAX_INTERFACES];
+} Broadcast_Info;
 
 #if defined(_WIN32) || defined(__WIN32__) || defined (WIN32)
 
 #include <iphlpapi.h>
 
-static void fetch_broadcast_info(uint16_t port)
+static Broadcast_Info *fetch_broadcast_info(uint16_t port)
 {
-    broadcast_count = 0;
+    Broadcast_Info *broadcast = calloc(1, sizeof(Broadcast_Info));
+
+    if (broadcast == NULL) {
+        return NULL;
+    }
 
     IP_ADAPTER_INFO *pAdapterInfo = malloc(sizeof(pAdapterInfo));
     unsigned long ulOutBufLen = sizeof(pAdapterInfo);
 
     if (pAdapterInfo == NULL) {
-        return;
+        return broadcast;
     }
 
     if (GetAdaptersInfo(pAdapterInfo, &ulOutBufLen) == ERROR_BUFFER_OVERFLOW) {
@@ -61,7 +69,7 @@ static void fetch_broadcast_info(uint16_t port)
         pAdapterInfo = malloc(ulOutBufLen);
 
         if (pAdapterInfo == NULL) {
-            return;
+            return broadcast;
         }
     }
 
@@ -76,16 +84,16 @@ static void fetch_broadcast_info(uint16_t port)
             if (addr_parse_ip(pAdapter->IpAddressList.IpMask.String, &subnet_mask)
                     && addr_parse_ip(pAdapter->GatewayList.IpAddress.String, &gateway)) {
                 if (gateway.family == AF_INET && subnet_mask.family == AF_INET) {
-                    IP_Port *ip_port = &broadcast_ip_port[broadcast_count];
+                    IP_Port *ip_port = &broadcast->ip_ports[broadcast->count];
                     ip_port->ip.family = AF_INET;
                     uint32_t gateway_ip = ntohl(gateway.ip4.uint32), subnet_ip = ntohl(subnet_mask.ip4.uint32);
                     uint32_t broadcast_ip = gateway_ip + ~subnet_ip - 1;
                     ip_port->ip.ip4.uint32 = htonl(broadcast_ip);
                     ip_port->port = port;
-                    broadcast_count++;
+                    broadcast->count++;
 
-                    if (broadcast_count >= MAX_INTERFACES) {
-                        return;
+                    if (broadcast->count >= MAX_INTERFACES) {
+                        break;
                     }
                 }
             }
@@ -97,21 +105,27 @@ static void fetch_broadcast_info(uint16_t port)
     if (pAdapterInfo) {
         free(pAdapterInfo);
     }
+
+    return broadcast;
 }
 
 #elif defined(__linux__)
 
-static void fetch_broadcast_info(uint16_t port)
+static Broadcast_Info *fetch_broadcast_info(uint16_t port)
 {
     /* Not sure how many platforms this will run on,
      * so it's wrapped in __linux for now.
      * Definitely won't work like this on Windows...
      */
-    broadcast_count = 0;
+    Broadcast_Info *broadcast = calloc(1, sizeof(Broadcast_Info));
+
+    if (broadcast == NULL)
+        return NULL;
+
     sock_t sock = 0;
 
     if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0)
-        return;
+        return broadcast;
 
     /* Configure ifconf for the ioctl call. */
     struct ifreq i_faces[MAX_INTERFACES];
@@ -123,7 +137,7 @@ static void fetch_broadcast_info(uint16_t port)
 
     if (ioctl(sock, SIOCGIFCONF, &ifconf) < 0) {
         close(sock);
-        return;
+        return broadcast;
     }
 
     /* ifconf.ifc_len is set by the ioctl() to the actual length used;
@@ -144,12 +158,11 @@ static void fetch_broadcast_info(uint16_t port)
 
         struct sockaddr_in *sock4 = (struct sockaddr_in *)&i_faces[i].ifr_broadaddr;
 
-        if (broadcast_count >= MAX_INTERFACES) {
-            close(sock);
-            return;
+        if (broadcast->count >= MAX_INTERFACES) {
+            break;
         }
 
-        IP_Port *ip_port = &broadcast_ip_port[broadcast_count];
+        IP_Port *ip_port = &broadcast->ip_ports[broadcast->count];
         ip_port->ip.family = AF_INET;
         ip_port->ip.ip4.in_addr = sock4->sin_addr;
 
@@ -158,17 +171,18 @@ static void fetch_broadcast_info(uint16_t port)
         }
 
         ip_port->port = port;
-        broadcast_count++;
+        broadcast->count++;
     }
 
     close(sock);
+    return broadcast;
 }
 
 #else //TODO: Other platforms?
 
-static void fetch_broadcast_info(uint16_t port)
+static Broadcast_Info *fetch_broadcast_info(uint16_t port)
 {
-    broadcast_count = 0;
+    return calloc(1, sizeof(Broadcast_Info));
 }
 
 #endif
@@ -177,20 +191,20 @@ static void fetch_broadcast_info(uint16_t port)
  *  return 1 if sent to at least one broadcast target.
  *  return 0 on failure to find any valid broadcast target.
  */
-static uint32_t send_broadcasts(Networking_Core *net, uint16_t port, const uint8_t *data, uint16_t length)
+static uint32_t send_broadcasts(DHT *dht, uint16_t port, const uint8_t *data, uint16_t length)
 {
     /* fetch only once? on every packet? every X seconds?
      * old: every packet, new: once */
-    if (broadcast_count < 0)
-        fetch_broadcast_info(port);
+    if (!dht->broadcast)
+        dht->broadcast = fetch_broadcast_info(port);
 
-    if (!broadcast_count)
+    if (!dht->broadcast || !dht->broadcast->count)
         return 0;
 
-    int i;
+    uint32_t i;
 
-    for (i = 0; i < broadcast_count; i++)
-        sendpacket(net, broadcast_ip_port[i], data, length);
+    for (i = 0; i < dht->broadcast->count; i++)
+        sendpacket(dht->net, dht->broadcast->ip_ports[i], data, length);
 
     return 1;
 }
@@ -327,7 +341,7 @@ int send_LANdiscovery(uint16_t port, DHT *dht)
     data[0] = NET_PACKET_LAN_DISCOVERY;
     id_copy(data + 1, dht->self_public_key);
 
-    send_broadcasts(dht->net, port, data, 1 + crypto_box_PUBLICKEYBYTES);
+    send_broadcasts(dht, port, data, 1 + crypto_box_PUBLICKEYBYTES);
 
     int res = -1;
     IP_Port ip_port;
@@ -642,6 +642,31 @@ int m_get_friend_connectionstatus(const Tox *tox, int32_t friendnumber)
     }
 }
 
+int m_friend_congested(const Tox *tox, int32_t friendnumber)
+{
+    Messenger *m = tox->m;
+
+    if (friend_not_valid(tox->m, friendnumber))
+        return -1;
+
+    if (m->friendlist[friendnumber].status != FRIEND_ONLINE)
+        return 0;
+
+    return crypto_congested(tox->net_crypto, toxconn_crypt_connection_id(m->fr_c,
+                            m->friendlist[friendnumber].dev_list[0].friendcon_id));
+}
+
+int m_friend_rtt(const Tox *tox, int32_t friendnumber)
+{
+    Messenger *m = tox->m;
+
+    if (friend_not_valid(tox->m, friendnumber) || m->friendlist[friendnumber].status != FRIEND_ONLINE)
+        return -1;
+
+    return crypto_rtt(tox->net_crypto, toxconn_crypt_connection_id(m->fr_c,
+                      m->friendlist[friendnumber].dev_list[0].friendcon_id));
+}
+
 int m_friend_exists(const Tox *tox, int32_t friendnumber)
 {
     if (friend_not_valid(tox->m, friendnumber))
@@ -2005,6 +2030,62 @@ int send_custom_lossless_packet(const Tox *tox, int32_t friendnumber, const uint
     }
 }
 
+#define CUSTOM_LOSSLESS_BATCH_SIZE 64
+
+int send_custom_lossless_packets(const Tox *tox, int32_t friendnumber, const uint8_t *const *data, const size_t *length,
+                                 uint32_t num)
+{
+    if (friend_not_valid(tox->m, friendnumber))
+        return -1;
+
+    uint32_t i;
+
+    for (i = 0; i < num; ++i) {
+        if (length[i] == 0 || length[i] > MAX_CRYPTO_DATA_SIZE)
+            return -2;
+
+        if (data[i][0] < PACKET_ID_LOSSLESS_RANGE_START)
+            return -3;
+
+        if (data[i][0] >= (PACKET_ID_LOSSLESS_RANGE_START + PACKET_ID_LOSSLESS_RANGE_SIZE))
+            return -3;
+    }
+
+    if (tox->m->friendlist[friendnumber].status != FRIEND_ONLINE)
+        return -4;
+
+    int crypt_con_id = toxconn_crypt_connection_id(tox->m->fr_c, tox->m->friendlist[friendnumber].dev_list[0].friendcon_id);
+    uint16_t lengths[CUSTOM_LOSSLESS_BATCH_SIZE];
+    int64_t packet_numbers[CUSTOM_LOSSLESS_BATCH_SIZE];
+    uint32_t sent = 0;
+
+    while (sent < num) {
+        uint32_t batch_num = num - sent;
+
+        if (batch_num > CUSTOM_LOSSLESS_BATCH_SIZE)
+            batch_num = CUSTOM_LOSSLESS_BATCH_SIZE;
+
+        for (i = 0; i < batch_num; ++i)
+            lengths[i] = length[sent + i];
+
+        int32_t ret = write_cryptpacket_batch(tox->net_crypto, crypt_con_id, data + sent, lengths, batch_num, 1,
+                                              packet_numbers);
+
+        if (ret <= 0)
+            break;
+
+        sent += ret;
+
+        if ((uint32_t)ret != batch_num)
+            break;
+    }
+
+    if (sent == 0)
+        return -5;
+
+    return sent;
+}
+
 /* Function to filter out some friend requests*/
 static int friend_already_added(const uint8_t *real_pk, void *data)
 {
@@ -2465,17 +2546,16 @@ static void connection_status_cb(Tox *tox)
 
 #ifdef TOX_LOGGER
 #define DUMPING_CLIENTS_FRIENDS_EVERY_N_SECONDS 60UL
-static time_t lastdump = 0;
-static char IDString[crypto_box_PUBLICKEYBYTES * 2 + 1];
-static char *ID2String(const uint8_t *pk)
+#define IDSTRING_LEN (crypto_box_PUBLICKEYBYTES * 2 + 1)
+static char *ID2String(const uint8_t *pk, char *id_str)
 {
     uint32_t i;
 
     for (i = 0; i < crypto_box_PUBLICKEYBYTES; i++)
-        sprintf(&IDString[i * 2], "%02X", pk[i]);
+        sprintf(&id_str[i * 2], "%02X", pk[i]);
 
-    IDString[crypto_box_PUBLICKEYBYTES * 2] = 0;
-    return IDString;
+    id_str[crypto_box_PUBLICKEYBYTES * 2] = 0;
+    return id_str;
 }
 #endif
 
@@ -2540,10 +2620,13 @@ void do_messenger(Tox *tox)
 
 #ifdef TOX_LOGGER
 
-    if (unix_time() > lastdump + DUMPING_CLIENTS_FRIENDS_EVERY_N_SECONDS) {
+    if (unix_time() > tox->m->lastdump + DUMPING_CLIENTS_FRIENDS_EVERY_N_SECONDS) {
 
-        lastdump = unix_time();
+        tox->m->lastdump = unix_time();
+        uint64_t lastdump = tox->m->lastdump;
         uint32_t client, last_pinged;
+        char ip_str[IP_NTOA_LEN];
+        char id_str[IDSTRING_LEN];
 
         for (client = 0; client < LCLIENT_LIST; client++) {
             Client_data *cptr = &m->dht->close_clientlist[client];
@@ -2558,8 +2641,8 @@ void do_messenger(Tox *tox)
                         last_pinged = 999;
 
                     LOGGER_TRACE("C[%2u] %s:%u [%3u] %s",
-                                 client, ip_ntoa(&assoc->ip_port.ip), ntohs(assoc->ip_port.port),
-                                 last_pinged, ID2String(cptr->public_key));
+                                 client, ip_ntoa(&assoc->ip_port.ip, ip_str, sizeof(ip_str)), ntohs(assoc->ip_port.port),
+                                 last_pinged, ID2String(cptr->public_key, id_str));
                 }
         }
 
@@ -2607,9 +2690,9 @@ void do_messenger(Tox *tox)
             if (msgfptr) {
                 LOGGER_TRACE("F[%2u:%2u] <%s> %s",
                              dht2m[friend], friend, msgfptr->name,
-                             ID2String(msgfptr->real_pk));
+                             ID2String(msgfptr->real_pk, id_str));
             } else {
-                LOGGER_TRACE("F[--:%2u] %s", friend, ID2String(dhtfptr->public_key));
+                LOGGER_TRACE("F[--:%2u] %s", friend, ID2String(dhtfptr->public_key, id_str));
             }
 
             for (client = 0; client < MAX_FRIEND_CLIENTS; client++) {
@@ -2625,9 +2708,9 @@ void do_messenger(Tox *tox)
                             last_pinged = 999;
 
                         LOGGER_TRACE("F[%2u] => C[%2u] %s:%u [%3u] %s",
-                                     friend, client, ip_ntoa(&assoc->ip_port.ip),
+                                     friend, client, ip_ntoa(&assoc->ip_port.ip, ip_str, sizeof(ip_str)),
                                      ntohs(assoc->ip_port.port), last_pinged,
-                                     ID2String(cptr->public_key));
+                                     ID2String(cptr->public_key, id_str));
                     }
             }
         }
@@ -320,6 +320,9 @@ struct Messenger {
     void *core_connection_change_userdata;
     unsigned int last_connection_status;
 
+    /* Last time the client lists were dumped to the log (TOX_LOGGER only). */
+    uint64_t lastdump;
+
     Messenger_Options options;
 };
 
@@ -405,6 +408,22 @@ int m_delfriend(Tox *tox, int32_t friendnumber);
  */
 int m_get_friend_connectionstatus(const Tox *tox, int32_t friendnumber);
 
+/* Checks if the connection to friend is congested, its lossless packets having hit the
+ * limit of the path within the last second.
+ *
+ *  return 1 if congested.
+ *  return 0 if not.
+ *  return -1 on failure.
+ */
+int m_friend_congested(const Tox *tox, int32_t friendnumber);
+
+/* Shortest round trip time measured on the connection to the friend, in ms.
+ *
+ *  return the time on success.
+ *  return -1 if the friend is not valid or not online.
+ */
+int m_friend_rtt(const Tox *tox, int32_t friendnumber);
+
 /* Checks if there exists a friend with given friendnumber.
  *
  *  return 1 if friend exists.
@@ -792,6 +811,19 @@ void custom_lossless_packet_registerhandler(Tox *tox, void (*packet_handler_call
  */
 int send_custom_lossless_packet(const Tox *tox, int32_t friendnumber, const uint8_t *data, uint32_t length);
 
+/* High level function to send num custom lossless packets at once.
+ * The packets are queued in order until the send queue is full.
+ *
+ * return -1 if friend invalid.
+ * return -2 if a length is wrong.
+ * return -3 if a first byte is invalid.
+ * return -4 if friend offline.
+ * return -5 if no packet could be queued.
+ * return number of packets queued on success.
+ */
+int send_custom_lossless_packets(const Tox *tox, int32_t friendnumber, const uint8_t *const *data, const size_t *length,
+                                 uint32_t num);
+
 /**********************************************/
 
 enum {
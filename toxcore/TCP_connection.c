@@ -274,6 +274,153 @@ int send_packet_tcp_connection(TCP_Connections *tcp_c, int connections_number, c
     }
 }
 
+/* return the multipath weight of relay i of con_to.
+ * return 0 if that relay is not online.
+ */
+static uint32_t relay_multipath_weight(const TCP_Connections *tcp_c, const TCP_Connection_to *con_to, unsigned int i)
+{
+    uint32_t tcp_con_num = con_to->connections[i].tcp_connection;
+
+    if (!tcp_con_num || con_to->connections[i].status != TCP_CONNECTIONS_STATUS_ONLINE)
+        return 0;
+
+    TCP_con *tcp_con = get_tcp_connection(tcp_c, tcp_con_num - 1);
+
+    if (!tcp_con || !tcp_con->connection)
+        return 0;
+
+    uint32_t rtt = con_to->connections[i].multipath_rtt;
+
+    if (!rtt)
+        rtt = TCP_MULTIPATH_DEFAULT_RTT;
+
+    uint32_t weight = TCP_MULTIPATH_WEIGHT(rtt);
+
+    if (con_to->connections[i].multipath_congested)
+        weight /= TCP_MULTIPATH_CONGESTED_PENALTY;
+
+    return weight ? weight : 1;
+}
+
+/* return the sum of the multipath weights of the online relays of the TCP connection.
+ * return 0 if there are none.
+ */
+uint32_t tcp_connection_multipath_weight(const TCP_Connections *tcp_c, int connections_number)
+{
+    const TCP_Connection_to *con_to = get_connection(tcp_c, connections_number);
+
+    if (!con_to) {
+        return 0;
+    }
+
+    uint32_t total = 0;
+    unsigned int i;
+
+    for (i = 0; i < MAX_TCP_CONNECTIONS_FRIENDS; ++i) {
+        total += relay_multipath_weight(tcp_c, con_to, i);
+    }
+
+    return total;
+}
+
+/* Smooth weighted round robin: pick one of count paths so that, over consecutive calls,
+ * each is picked in proportion to its weight and as evenly spread out as possible.
+ * current holds the state between calls and starts zeroed, paths with a weight of 0
+ * are never picked.
+ *
+ * return the index of the path to use.
+ * return -1 if all weights are 0.
+ */
+int multipath_pick(int32_t *current, const uint32_t *weight, unsigned int count)
+{
+    unsigned int i;
+    int best = -1;
+    int32_t total = 0;
+
+    for (i = 0; i < count; ++i) {
+        if (!weight[i]) {
+            current[i] = 0;
+            continue;
+        }
+
+        current[i] += weight[i];
+        total += weight[i];
+
+        if (best == -1 || current[i] > current[best]) {
+            best = i;
+        }
+    }
+
+    if (best != -1) {
+        current[best] -= total;
+    }
+
+    return best;
+}
+
+/* Send a packet to the TCP connection, spreading consecutive packets over all the online
+ * relays of the connection in proportion to their multipath weight.
+ *
+ * Falls back to send_packet_tcp_connection() if the chosen relay can't take the packet.
+ *
+ * return -1 on failure.
+ * return the index of the relay it was sent through (below MAX_TCP_CONNECTIONS_FRIENDS).
+ * return MAX_TCP_CONNECTIONS_FRIENDS if it was sent by send_packet_tcp_connection().
+ */
+int send_packet_tcp_connection_multipath(TCP_Connections *tcp_c, int connections_number, const uint8_t *packet,
+        uint16_t length)
+{
+    TCP_Connection_to *con_to = get_connection(tcp_c, connections_number);
+
+    if (!con_to) {
+        return -1;
+    }
+
+    uint32_t weight[MAX_TCP_CONNECTIONS_FRIENDS];
+    unsigned int i;
+
+    for (i = 0; i < MAX_TCP_CONNECTIONS_FRIENDS; ++i) {
+        weight[i] = relay_multipath_weight(tcp_c, con_to, i);
+    }
+
+    int best = multipath_pick(con_to->multipath_current, weight, MAX_TCP_CONNECTIONS_FRIENDS);
+
+    if (best != -1) {
+        TCP_con *tcp_con = get_tcp_connection(tcp_c, con_to->connections[best].tcp_connection - 1);
+        int ret = send_data(tcp_con->connection, con_to->connections[best].connection_id, packet, length);
+
+        if (ret == 1) {
+            con_to->connections[best].multipath_congested = 0;
+            return best;
+        }
+
+        if (ret == 0) {
+            con_to->connections[best].multipath_congested = 1;
+        }
+    }
+
+    if (send_packet_tcp_connection(tcp_c, connections_number, packet, length) != 0) {
+        return -1;
+    }
+
+    return MAX_TCP_CONNECTIONS_FRIENDS;
+}
+
+/* Add a measured round trip time of rtt ms to the peer through relay (an index returned by
+ * send_packet_tcp_connection_multipath()) to its smoothed rtt.
+ */
+void tcp_connection_multipath_rtt(TCP_Connections *tcp_c, int connections_number, unsigned int relay, uint32_t rtt)
+{
+    TCP_Connection_to *con_to = get_connection(tcp_c, connections_number);
+
+    if (!con_to || relay >= MAX_TCP_CONNECTIONS_FRIENDS) {
+        return;
+    }
+
+    uint32_t old = con_to->connections[relay].multipath_rtt;
+    con_to->connections[relay].multipath_rtt = old ? (old * 7 + rtt) / 8 : rtt;
+}
+
 /* Return a random TCP connection number for use in send_tcp_onion_request.
  *
  * TODO: This number is just the index of an array that the elements can
@@ -580,6 +727,7 @@ static int add_tcp_connection_to_conn(TCP_Connection_to *con_to, unsigned int tc
             con_to->connections[i].tcp_connection = tcp_connections_number + 1;
             con_to->connections[i].status = TCP_CONNECTIONS_STATUS_NONE;
             con_to->connections[i].connection_id = 0;
+            con_to->connections[i].multipath_rtt = 0;
             return i;
         }
     }
@@ -599,6 +747,7 @@ static int rm_tcp_connection_from_conn(TCP_Connection_to *con_to, unsigned int t
             con_to->connections[i].tcp_connection = 0;
             con_to->connections[i].status = TCP_CONNECTIONS_STATUS_NONE;
             con_to->connections[i].connection_id = 0;
+            con_to->connections[i].multipath_rtt = 0;
             return i;
         }
     }
@@ -51,6 +51,18 @@
 /* Number of TCP connections used for onion purposes. */
 #define NUM_ONION_TCP_CONNECTIONS RECOMMENDED_TCP_CONNECTIONS_FRIENDS
 
+/* Multipath weight of a path with a round trip time of rtt ms.
+ *
+ * The rtt of every path, the direct one or one through a relay, is measured the same way:
+ * end to end, from sending a data packet over it to the friend acknowledging it. Paths
+ * with no measured rtt yet use TCP_MULTIPATH_DEFAULT_RTT, relays that recently refused a
+ * packet because their send queue was full get their weight divided by
+ * TCP_MULTIPATH_CONGESTED_PENALTY.
+ */
+#define TCP_MULTIPATH_WEIGHT(rtt) (1000000 / ((rtt) + 10))
+#define TCP_MULTIPATH_DEFAULT_RTT 250
+#define TCP_MULTIPATH_CONGESTED_PENALTY 4
+
 typedef struct {
     uint8_t status;
     uint8_t public_key[crypto_box_PUBLICKEYBYTES]; /* The dht public key of the peer */
@@ -59,8 +71,14 @@ typedef struct {
         uint32_t tcp_connection;
         unsigned int status;
         unsigned int connection_id;
+
+        /* Used by send_packet_tcp_connection_multipath() */
+        uint32_t multipath_rtt; /* Smoothed rtt to the peer through this relay in ms, 0 if not measured yet. */
+        _Bool multipath_congested;
     } connections[MAX_TCP_CONNECTIONS_FRIENDS];
 
+    int32_t multipath_current[MAX_TCP_CONNECTIONS_FRIENDS]; /* multipath_pick() state of the relays. */
+
     int id; /* id used in callbacks. */
 } TCP_Connection_to;
 
@@ -113,6 +131,38 @@ typedef struct {
  */
 int send_packet_tcp_connection(TCP_Connections *tcp_c, int connections_number, const uint8_t *packet, uint16_t length);
 
+/* Smooth weighted round robin: pick one of count paths so that, over consecutive calls,
+ * each is picked in proportion to its weight and as evenly spread out as possible.
+ * current holds the state between calls and starts zeroed, paths with a weight of 0
+ * are never picked.
+ *
+ * return the index of the path to use.
+ * return -1 if all weights are 0.
+ */
+int multipath_pick(int32_t *current, const uint32_t *weight, unsigned int count);
+
+/* Send a packet to the TCP connection, spreading consecutive packets over all the online
+ * relays of the connection in proportion to their multipath weight.
+ *
+ * Falls back to send_packet_tcp_connection() if the chosen relay can't take the packet.
+ *
+ * return -1 on failure.
+ * return the index of the relay it was sent through (below MAX_TCP_CONNECTIONS_FRIENDS).
+ * return MAX_TCP_CONNECTIONS_FRIENDS if it was sent by send_packet_tcp_connection().
+ */
+int send_packet_tcp_connection_multipath(TCP_Connections *tcp_c, int connections_number, const uint8_t *packet,
+        uint16_t length);
+
+/* Add a measured round trip time of rtt ms to the peer through relay (an index returned by
+ * send_packet_tcp_connection_multipath()) to its smoothed rtt.
+ */
+void tcp_connection_multipath_rtt(TCP_Connections *tcp_c, int connections_number, unsigned int relay, uint32_t rtt);
+
+/* return the sum of the multipath weights of the online relays of the TCP connection.
+ * return 0 if there are none.
+ */
+uint32_t tcp_connection_multipath_weight(const TCP_Connections *tcp_c, int connections_number);
+
 /* Return a random TCP connection number for use in send_tcp_onion_request.
  *
  * TODO: This number is just the index of an array that the elements can
@@ -120,6 +120,71 @@ int decrypt_data_symmetric(const uint8_t *secret_key, const uint8_t *nonce, cons
     return length - crypto_box_MACBYTES;
 }
 
+#ifndef VANILLA_NACL
+/* The libsodium _easy functions produce the same output as the padded
+ * crypto_box_afternm() calls above without needing the padding copies.
+ */
+static int32_t encrypt_batch_entry(const Crypto_Batch_Entry *entry)
+{
+    if (entry->length == 0 || !entry->shared_key || !entry->nonce || !entry->in || !entry->out)
+        return -1;
+
+    if (crypto_box_easy_afternm(entry->out, entry->in, entry->length, entry->nonce, entry->shared_key) != 0)
+        return -1;
+
+    return entry->length + crypto_box_MACBYTES;
+}
+
+static int32_t decrypt_batch_entry(const Crypto_Batch_Entry *entry)
+{
+    if (entry->length <= crypto_box_BOXZEROBYTES || !entry->shared_key || !entry->nonce || !entry->in || !entry->out)
+        return -1;
+
+    if (crypto_box_open_easy_afternm(entry->out, entry->in, entry->length, entry->nonce, entry->shared_key) != 0)
+        return -1;
+
+    return entry->length - crypto_box_MACBYTES;
+}
+#else
+static int32_t encrypt_batch_entry(const Crypto_Batch_Entry *entry)
+{
+    return encrypt_data_symmetric(entry->shared_key, entry->nonce, entry->in, entry->length, entry->out);
+}
+
+static int32_t decrypt_batch_entry(const Crypto_Batch_Entry *entry)
+{
+    return decrypt_data_symmetric(entry->shared_key, entry->nonce, entry->in, entry->length, entry->out);
+}
+#endif
+
+uint32_t encrypt_data_symmetric_batch(Crypto_Batch_Entry *entries, uint32_t num)
+{
+    uint32_t i, count = 0;
+
+    for (i = 0; i < num; ++i) {
+        entries[i].out_length = encrypt_batch_entry(&entries[i]);
+
+        if (entries[i].out_length != -1)
+            ++count;
+    }
+
+    return count;
+}
+
+uint32_t decrypt_data_symmetric_batch(Crypto_Batch_Entry *entries, uint32_t num)
+{
+    uint32_t i, count = 0;
+
+    for (i = 0; i < num; ++i) {
+        entries[i].out_length = decrypt_batch_entry(&entries[i]);
+
+        if (entries[i].out_length != -1)
+            ++count;
+    }
+
+    return count;
+}
+
 int encrypt_data(const uint8_t *public_key, const uint8_t *secret_key, const uint8_t *nonce,
                  const uint8_t *plain, uint32_t length, uint8_t *encrypted)
 {
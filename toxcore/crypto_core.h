@@ -107,6 +107,34 @@ int encrypt_data_symmetric(const uint8_t *secret_key, const uint8_t *nonce, cons
 int decrypt_data_symmetric(const uint8_t *secret_key, const uint8_t *nonce, const uint8_t *encrypted, uint32_t length,
                            uint8_t *plain);
 
+/* One encryption or decryption operation of a batch.
+ *
+ * out may be equal to or overlap in for in place operation.
+ * out_length is set by the batch functions to the length written to out, or -1 on failure.
+ */
+typedef struct {
+    const uint8_t *shared_key;
+    const uint8_t *nonce;
+    const uint8_t *in;
+    uint32_t length;
+    uint8_t *out;
+    int32_t out_length;
+} Crypto_Batch_Entry;
+
+/* Encrypt num entries with encrypt_data_symmetric() semantics.
+ * Unlike encrypt_data_symmetric() no padded copies of the data are made.
+ *
+ *  return the number of entries that were successfully encrypted.
+ */
+uint32_t encrypt_data_symmetric_batch(Crypto_Batch_Entry *entries, uint32_t num);
+
+/* Decrypt num entries with decrypt_data_symmetric() semantics.
+ * Unlike decrypt_data_symmetric() no padded copies of the data are made.
+ *
+ *  return the number of entries that were successfully decrypted.
+ */
+uint32_t decrypt_data_symmetric_batch(Crypto_Batch_Entry *entries, uint32_t num);
+
 /* Increment the given nonce by 1. */
 void increment_nonce(uint8_t *nonce);
 
@@ -1811,6 +1811,55 @@ int send_group_lossy_packet(const Group_Chats *g_c, int groupnumber, const uint8
     return 0;
 }
 
+/* Send a custom lossy packet to one peer over our direct connection to them.
+ * Their handler should return -1 so that it goes no further.
+ *
+ * return -1 on failure, which includes not being connected to them directly.
+ * return 0 on success.
+ */
+int send_group_lossy_packet_peer(const Group_Chats *g_c, int groupnumber, int peernumber, const uint8_t *data,
+                                 uint16_t length)
+{
+    Group_c *g = get_group_c(g_c, groupnumber);
+
+    if (!g)
+        return -1;
+
+    if ((uint32_t)peernumber >= g->numpeers)
+        return -1;
+
+    unsigned int i;
+
+    for (i = 0; i < MAX_GROUP_CONNECTIONS; ++i) {
+        if (g->close[i].type != GROUPCHAT_CLOSE_ONLINE)
+            continue;
+
+        uint8_t real_pk[crypto_box_PUBLICKEYBYTES];
+        uint8_t dht_temp_pk[crypto_box_PUBLICKEYBYTES];
+        toxconn_get_public_keys(real_pk, dht_temp_pk, g_c->fr_c, g->close[i].number);
+
+        if (id_equal(real_pk, g->group[peernumber].real_pk))
+            break;
+    }
+
+    if (i == MAX_GROUP_CONNECTIONS)
+        return -1;
+
+    uint8_t packet[sizeof(uint16_t) * 2 + length];
+    uint16_t peer_number = htons(g->peer_number);
+    memcpy(packet, &peer_number, sizeof(uint16_t));
+    uint16_t message_num = htons(g->lossy_message_number);
+    memcpy(packet + sizeof(uint16_t), &message_num, sizeof(uint16_t));
+    memcpy(packet + sizeof(uint16_t) * 2, data, length);
+
+    if (!send_lossy_group_peer(g_c->fr_c, g->close[i].number, PACKET_ID_LOSSY_GROUPCHAT, g->close[i].group_number,
+                               packet, sizeof(packet)))
+        return -1;
+
+    ++g->lossy_message_number;
+    return 0;
+}
+
 static void handle_message_packet_group(Group_Chats *g_c, int groupnumber, const uint8_t *data, uint16_t length,
                                         int close_index)
 {
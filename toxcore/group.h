@@ -294,6 +294,15 @@ void group_lossy_packet_registerhandler(Group_Chats *g_c, uint8_t byte, int (*fu
  */
 int send_group_lossy_packet(const Group_Chats *g_c, int groupnumber, const uint8_t *data, uint16_t length);
 
+/* Send a custom lossy packet to one peer over our direct connection to them.
+ * Their handler should return -1 so that it goes no further.
+ *
+ * return -1 on failure, which includes not being connected to them directly.
+ * return 0 on success.
+ */
+int send_group_lossy_packet_peer(const Group_Chats *g_c, int groupnumber, int peernumber, const uint8_t *data,
+                                 uint16_t length);
+
 /* Return the number of chats in the instance m.
  * You should use this to determine how much memory to allocate
  * for copy_chatlist.
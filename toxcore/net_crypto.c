@@ -32,20 +32,57 @@
 #include "math.h"
 #include "logger.h"
 
+/* return the slot of connection id in the chunked connections table.
+ * id must be smaller than c->crypto_connections_chunks * CRYPTO_CONNECTIONS_CHUNK_SIZE.
+ */
+static Crypto_Connection *crypto_connection_slot(const Net_Crypto *c, uint32_t id)
+{
+    return &c->crypto_connections[id / CRYPTO_CONNECTIONS_CHUNK_SIZE][id % CRYPTO_CONNECTIONS_CHUNK_SIZE];
+}
+
 static uint8_t crypt_connection_id_not_valid(const Net_Crypto *c, int crypt_connection_id)
 {
     if ((uint32_t)crypt_connection_id >= c->crypto_connections_length)
         return 1;
 
-    if (c->crypto_connections == NULL)
-        return 1;
-
-    if (c->crypto_connections[crypt_connection_id].status == CRYPTO_CONN_NO_CONNECTION)
+    if (crypto_connection_slot(c, crypt_connection_id)->status == CRYPTO_CONN_NO_CONNECTION)
         return 1;
 
     return 0;
 }
 
+/* Mark the calling thread as using a connection.
+ * Connections are only wiped once every user has called connections_use_end().
+ */
+static void connections_use_begin(Net_Crypto *c)
+{
+    pthread_mutex_lock(&c->connections_mutex);
+    ++c->connection_use_counter;
+    pthread_mutex_unlock(&c->connections_mutex);
+}
+
+static void connections_use_end(Net_Crypto *c)
+{
+    pthread_mutex_lock(&c->connections_mutex);
+    --c->connection_use_counter;
+
+    if (c->connection_use_counter == 0)
+        pthread_cond_broadcast(&c->connections_cond);
+
+    pthread_mutex_unlock(&c->connections_mutex);
+}
+
+/* Lock connections_mutex and wait until no thread is using a connection.
+ * Must be released with pthread_mutex_unlock(&c->connections_mutex).
+ */
+static void connections_lock_exclusive(Net_Crypto *c)
+{
+    pthread_mutex_lock(&c->connections_mutex);
+
+    while (c->connection_use_counter)
+        pthread_cond_wait(&c->connections_cond, &c->connections_mutex);
+}
+
 /* cookie timeout in seconds */
 #define COOKIE_TIMEOUT 15
 #define COOKIE_DATA_LENGTH (crypto_box_PUBLICKEYBYTES * 2)
@@ -135,6 +172,148 @@ static int open_cookie(uint8_t *bytes, const uint8_t *cookie, const uint8_t *enc
 }
 
 
+/* Refill bucket at rate tokens per second up to burst tokens and take one token.
+ *
+ * return 1 if a token was taken.
+ * return 0 if the bucket is empty.
+ */
+static _Bool admission_bucket_take(Admission_Bucket *bucket, uint32_t rate, uint32_t burst, uint64_t current_time)
+{
+    uint64_t tokens = bucket->tokens;
+
+    if (current_time > bucket->last_refill) {
+        tokens += (current_time - bucket->last_refill) * rate;
+        bucket->last_refill = current_time;
+    }
+
+    if (tokens > burst * 1000)
+        tokens = burst * 1000;
+
+    if (tokens < 1000) {
+        bucket->tokens = tokens;
+        return 0;
+    }
+
+    bucket->tokens = tokens - 1000;
+    return 1;
+}
+
+/* Find the bucket of the source with key in family.
+ *
+ * return the bucket if the source is in the table.
+ * return NULL, and set victim to the bucket to replace with it, if it isn't.
+ */
+static Admission_Bucket *admission_bucket_find(Net_Crypto *c, uint64_t key, uint8_t family, Admission_Bucket **victim)
+{
+    uint32_t index = ((key ^ c->admission_seed) * 11400714819323198485ULL) >> 56;
+    Admission_Bucket *set = &c->admission_buckets[(index * CRYPTO_ADMISSION_WAYS) % CRYPTO_ADMISSION_BUCKETS];
+    uint32_t i;
+
+    *victim = NULL;
+
+    for (i = 0; i < CRYPTO_ADMISSION_WAYS; ++i) {
+        Admission_Bucket *bucket = &set[i];
+
+        if (bucket->family == family && bucket->key == key) {
+            bucket->returning = 1;
+            return bucket;
+        }
+
+        /* Prefer unused buckets, then sources that never came back, then the one used longest ago. */
+        if (*victim == NULL || bucket->family == 0
+                || ((*victim)->family != 0 && (*victim)->returning > bucket->returning)
+                || ((*victim)->family != 0 && (*victim)->returning == bucket->returning
+                    && bucket->last_refill < (*victim)->last_refill)) {
+            *victim = bucket;
+        }
+    }
+
+    return NULL;
+}
+
+/* Decide if a packet from source may use a public key operation.
+ * public_key is the key of a peer sending over TCP, NULL for UDP.
+ * LAN sources are not limited per IP.
+ *
+ * return 1 if it may.
+ * return 0 if it should be dropped.
+ */
+static _Bool crypto_admit(Net_Crypto *c, IP_Port source, const uint8_t *public_key)
+{
+    uint64_t current_time = current_time_monotonic();
+    uint64_t key;
+    uint8_t family;
+
+    if ((source.ip.family == AF_INET || source.ip.family == AF_INET6) && LAN_ip(source.ip) != 0) {
+        family = AF_INET;
+
+        if (source.ip.family == AF_INET) {
+            key = source.ip.ip4.uint32;
+        } else if (IPV6_IPV4_IN_V6(source.ip.ip6)) {
+            key = source.ip.ip6.uint32[3];
+        } else {
+            /* Any host can use a whole /64. */
+            key = source.ip.ip6.uint64[0];
+            family = AF_INET6;
+        }
+    } else if (source.ip.family == TCP_FAMILY && public_key != NULL) {
+        memcpy(&key, public_key, sizeof(key));
+        family = TCP_FAMILY;
+    } else {
+        return admission_bucket_take(&c->admission_global, CRYPTO_ADMISSION_GLOBAL_RATE, CRYPTO_ADMISSION_GLOBAL_BURST,
+                                     current_time);
+    }
+
+    Admission_Bucket *victim;
+    Admission_Bucket *bucket = admission_bucket_find(c, key, family, &victim);
+
+    /* A source over its own limit must not use up the global one. */
+    if (bucket != NULL && !admission_bucket_take(bucket, CRYPTO_ADMISSION_IP_RATE, CRYPTO_ADMISSION_IP_BURST,
+            current_time))
+        return 0;
+
+    if (!admission_bucket_take(&c->admission_global, CRYPTO_ADMISSION_GLOBAL_RATE, CRYPTO_ADMISSION_GLOBAL_BURST,
+                               current_time)) {
+        if (bucket != NULL)
+            bucket->tokens += 1000; /* Not used after all. */
+
+        return 0;
+    }
+
+    if (bucket != NULL)
+        return 1;
+
+    /* Only sources that got through are remembered, each with a burst of its own. */
+    victim->key = key;
+    victim->family = family;
+    victim->returning = 0;
+    victim->tokens = (CRYPTO_ADMISSION_IP_BURST - 1) * 1000;
+    victim->last_refill = current_time;
+    return 1;
+}
+
+/* return 1 if the handshake cookie was already used.
+ * return 0 if it wasn't.
+ */
+static _Bool cookie_spent(const Net_Crypto *c, const uint8_t *cookie)
+{
+    uint32_t i;
+
+    /* The nonce is random for every cookie we create. */
+    for (i = 0; i < CRYPTO_SPENT_COOKIES; ++i) {
+        if (memcmp(c->spent_cookies[i], cookie, crypto_box_NONCEBYTES) == 0)
+            return 1;
+    }
+
+    return 0;
+}
+
+static void add_spent_cookie(Net_Crypto *c, const uint8_t *cookie)
+{
+    memcpy(c->spent_cookies[c->spent_cookies_index % CRYPTO_SPENT_COOKIES], cookie, crypto_box_NONCEBYTES);
+    ++c->spent_cookies_index;
+}
+
 /* Create a cookie response packet and put it in packet.
  * request_plain must be COOKIE_REQUEST_PLAIN_LENGTH bytes.
  * packet must be of size COOKIE_RESPONSE_LENGTH or bigger.
@@ -198,6 +377,16 @@ static int udp_handle_cookie_request(void *object, IP_Port source, const uint8_t
     uint8_t shared_key[crypto_box_BEFORENMBYTES];
     uint8_t dht_public_key[crypto_box_PUBLICKEYBYTES];
 
+    if (length != COOKIE_REQUEST_LENGTH)
+        return 1;
+
+    if (!crypto_admit(c, source, NULL)) {
+        ++c->admission_stats.cookie_requests_rate_limited;
+        return 1;
+    }
+
+    ++c->admission_stats.cookie_requests_accepted;
+
     if (handle_cookie_request(c, request_plain, shared_key, dht_public_key, packet, length) != 0)
         return 1;
 
@@ -214,12 +403,26 @@ static int udp_handle_cookie_request(void *object, IP_Port source, const uint8_t
 
 /* Handle the cookie request packet (for TCP)
  */
-static int tcp_handle_cookie_request(Net_Crypto *c, int connections_number, const uint8_t *packet, uint16_t length)
+static int tcp_handle_cookie_request(Net_Crypto *c, int connections_number, const uint8_t *sender_public_key,
+                                     const uint8_t *packet, uint16_t length)
 {
     uint8_t request_plain[COOKIE_REQUEST_PLAIN_LENGTH];
     uint8_t shared_key[crypto_box_BEFORENMBYTES];
     uint8_t dht_public_key[crypto_box_PUBLICKEYBYTES];
 
+    if (length != COOKIE_REQUEST_LENGTH)
+        return -1;
+
+    IP_Port source;
+    source.ip.family = TCP_FAMILY;
+
+    if (!crypto_admit(c, source, sender_public_key)) {
+        ++c->admission_stats.cookie_requests_rate_limited;
+        return -1;
+    }
+
+    ++c->admission_stats.cookie_requests_accepted;
+
     if (handle_cookie_request(c, request_plain, shared_key, dht_public_key, packet, length) != 0)
         return -1;
 
@@ -234,13 +437,26 @@ static int tcp_handle_cookie_request(Net_Crypto *c, int connections_number, cons
 
 /* Handle the cookie request packet (for TCP oob packets)
  */
-static int tcp_oob_handle_cookie_request(const Net_Crypto *c, unsigned int tcp_connections_number,
+static int tcp_oob_handle_cookie_request(Net_Crypto *c, unsigned int tcp_connections_number,
         const uint8_t *dht_public_key, const uint8_t *packet, uint16_t length)
 {
     uint8_t request_plain[COOKIE_REQUEST_PLAIN_LENGTH];
     uint8_t shared_key[crypto_box_BEFORENMBYTES];
     uint8_t dht_public_key_temp[crypto_box_PUBLICKEYBYTES];
 
+    if (length != COOKIE_REQUEST_LENGTH)
+        return -1;
+
+    IP_Port source;
+    source.ip.family = TCP_FAMILY;
+
+    if (!crypto_admit(c, source, dht_public_key)) {
+        ++c->admission_stats.cookie_requests_rate_limited;
+        return -1;
+    }
+
+    ++c->admission_stats.cookie_requests_accepted;
+
     if (handle_cookie_request(c, request_plain, shared_key, dht_public_key_temp, packet, length) != 0)
         return -1;
 
@@ -381,7 +597,7 @@ static Crypto_Connection *get_crypto_connection(const Net_Crypto *c, int crypt_c
     if (crypt_connection_id_not_valid(c, crypt_connection_id))
         return 0;
 
-    return &c->crypto_connections[crypt_connection_id];
+    return crypto_connection_slot(c, crypt_connection_id);
 }
 
 
@@ -457,12 +673,42 @@ IP_Port return_ip_port_connection(Net_Crypto *c, int crypt_connection_id)
     }
 }
 
+/* Pick between the direct UDP path and the TCP relays of the connection taken as a whole.
+ *
+ * return 1 if the next packet should be sent directly.
+ * return 0 if it should be sent over TCP.
+ */
+static _Bool multipath_pick_direct(Crypto_Connection *conn, uint32_t tcp_weight)
+{
+    uint32_t weight[2];
+    weight[0] = TCP_MULTIPATH_WEIGHT(conn->multipath_udp_rtt ? conn->multipath_udp_rtt : TCP_MULTIPATH_DEFAULT_RTT);
+    weight[1] = tcp_weight;
+
+    return multipath_pick(conn->multipath_current, weight, 2) == 0;
+}
+
+/* Add a round trip time of rtt ms measured on path to the multipath weights. */
+static void multipath_add_rtt(Net_Crypto *c, Crypto_Connection *conn, uint8_t path, uint32_t rtt)
+{
+    if (path == CRYPTO_PATH_DIRECT) {
+        pthread_mutex_lock(&conn->mutex);
+        conn->multipath_udp_rtt = conn->multipath_udp_rtt ? (conn->multipath_udp_rtt * 7 + rtt) / 8 : rtt;
+        pthread_mutex_unlock(&conn->mutex);
+    } else if (path < MAX_TCP_CONNECTIONS_FRIENDS) {
+        pthread_mutex_lock(&c->tcp_mutex);
+        tcp_connection_multipath_rtt(c->tcp_c, conn->connection_number_tcp, path, rtt);
+        pthread_mutex_unlock(&c->tcp_mutex);
+    }
+}
+
 /* Sends a packet to the peer using the fastest route.
+ * If path isn't NULL, the path it was sent on is put in it.
  *
  * return -1 on failure.
  * return 0 on success.
  */
-static int send_packet_to(Net_Crypto *c, int crypt_connection_id, const uint8_t *data, uint16_t length)
+static int send_packet_to(Net_Crypto *c, int crypt_connection_id, const uint8_t *data, uint16_t length,
+                          uint8_t *path)
 {
 //TODO TCP, etc...
     Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
@@ -470,7 +716,25 @@ static int send_packet_to(Net_Crypto *c, int crypt_connection_id, const uint8_t
     if (conn == 0)
         return -1;
 
+    uint8_t unused_path;
+
+    if (path == NULL)
+        path = &unused_path;
+
+    *path = CRYPTO_PATH_UNKNOWN;
+
+    /* In multipath mode data packets are striped, the Packets_Array on the other side puts them back in order. */
+    _Bool multipath = c->multipath && data[0] == NET_PACKET_CRYPTO_DATA;
+    uint32_t tcp_weight = 0;
+
+    if (multipath) {
+        pthread_mutex_lock(&c->tcp_mutex);
+        tcp_weight = tcp_connection_multipath_weight(c->tcp_c, conn->connection_number_tcp);
+        pthread_mutex_unlock(&c->tcp_mutex);
+    }
+
     int direct_send_attempt = 0;
+    _Bool striped = 0;
 
     pthread_mutex_lock(&conn->mutex);
     IP_Port ip_port = return_ip_port_connection(c, crypt_connection_id);
@@ -480,9 +744,10 @@ static int send_packet_to(Net_Crypto *c, int crypt_connection_id, const uint8_t
         _Bool direct_connected = 0;
         crypto_connection_status(c, crypt_connection_id, &direct_connected, NULL);
 
-        if (direct_connected) {
+        if (direct_connected && (!tcp_weight || multipath_pick_direct(conn, tcp_weight))) {
             if ((uint32_t)sendpacket(c->dht->net, ip_port, data, length) == length) {
                 pthread_mutex_unlock(&conn->mutex);
+                *path = CRYPTO_PATH_DIRECT;
                 return 0;
             } else {
                 pthread_mutex_unlock(&conn->mutex);
@@ -490,23 +755,54 @@ static int send_packet_to(Net_Crypto *c, int crypt_connection_id, const uint8_t
             }
         }
 
-        //TODO: a better way of sending packets directly to confirm the others ip.
-        uint64_t current_time = unix_time();
-
-        if ((((UDP_DIRECT_TIMEOUT / 2) + conn->direct_send_attempt_time) > current_time && length < 96)
-                || data[0] == NET_PACKET_COOKIE_REQUEST || data[0] == NET_PACKET_CRYPTO_HS) {
-            if ((uint32_t)sendpacket(c->dht->net, ip_port, data, length) == length) {
-                direct_send_attempt = 1;
-                conn->direct_send_attempt_time = unix_time();
+        if (direct_connected) {
+            striped = 1;
+        } else {
+            //TODO: a better way of sending packets directly to confirm the others ip.
+            uint64_t current_time = unix_time();
+
+            if ((((UDP_DIRECT_TIMEOUT / 2) + conn->direct_send_attempt_time) > current_time && length < 96)
+                    || data[0] == NET_PACKET_COOKIE_REQUEST || data[0] == NET_PACKET_CRYPTO_HS) {
+                if ((uint32_t)sendpacket(c->dht->net, ip_port, data, length) == length) {
+                    direct_send_attempt = 1;
+                    conn->direct_send_attempt_time = unix_time();
+                }
             }
         }
     }
 
     pthread_mutex_unlock(&conn->mutex);
     pthread_mutex_lock(&c->tcp_mutex);
-    int ret = send_packet_tcp_connection(c->tcp_c, conn->connection_number_tcp, data, length);
+    int ret;
+
+    if (multipath) {
+        ret = send_packet_tcp_connection_multipath(c->tcp_c, conn->connection_number_tcp, data, length);
+
+        if (ret >= 0) {
+            /* Sent by send_packet_tcp_connection() on a relay we don't know the rtt of */
+            *path = ret < MAX_TCP_CONNECTIONS_FRIENDS ? ret : CRYPTO_PATH_UNKNOWN;
+            ret = 0;
+        }
+    } else {
+        ret = send_packet_tcp_connection(c->tcp_c, conn->connection_number_tcp, data, length);
+    }
+
     pthread_mutex_unlock(&c->tcp_mutex);
 
+    if (striped) {
+        /* Packets striped over TCP while the direct path is up must not be seen as a switch to TCP
+         * by the congestion control, if the relays can't take it the direct path still can. */
+        if (ret == 0)
+            return 0;
+
+        if ((uint32_t)sendpacket(c->dht->net, ip_port, data, length) == length) {
+            *path = CRYPTO_PATH_DIRECT;
+            return 0;
+        }
+
+        return -1;
+    }
+
     pthread_mutex_lock(&conn->mutex);
 
     if (ret == 0) {
@@ -821,11 +1117,13 @@ static int handle_request_packet(Packets_Array *send_array, const uint8_t *data,
 #define MAX_DATA_DATA_PACKET_SIZE (MAX_CRYPTO_PACKET_SIZE - (1 + sizeof(uint16_t) + crypto_box_MACBYTES))
 
 /* Creates and sends a data packet to the peer using the fastest route.
+ * If path isn't NULL, the path it was sent on is put in it.
  *
  * return -1 on failure.
  * return 0 on success.
  */
-static int send_data_packet(Net_Crypto *c, int crypt_connection_id, const uint8_t *data, uint16_t length)
+static int send_data_packet(Net_Crypto *c, int crypt_connection_id, const uint8_t *data, uint16_t length,
+                            uint8_t *path)
 {
     if (length == 0 || length + (1 + sizeof(uint16_t) + crypto_box_MACBYTES) > MAX_CRYPTO_PACKET_SIZE)
         return -1;
@@ -849,30 +1147,99 @@ static int send_data_packet(Net_Crypto *c, int crypt_connection_id, const uint8_
     increment_nonce(conn->sent_nonce);
     pthread_mutex_unlock(&conn->mutex);
 
-    return send_packet_to(c, crypt_connection_id, packet, sizeof(packet));
+    return send_packet_to(c, crypt_connection_id, packet, sizeof(packet), path);
+}
+
+/* Write the plain data of a data packet with buffer_start and num to plain.
+ * plain must be at least MAX_DATA_DATA_PACKET_SIZE big.
+ *
+ * return length of the plain data.
+ */
+static uint16_t create_data_packet_plain(uint8_t *plain, uint32_t buffer_start, uint32_t num, const uint8_t *data,
+        uint16_t length)
+{
+    num = htonl(num);
+    buffer_start = htonl(buffer_start);
+    uint16_t padding_length = (MAX_CRYPTO_DATA_SIZE - length) % CRYPTO_MAX_PADDING;
+    memcpy(plain, &buffer_start, sizeof(uint32_t));
+    memcpy(plain + sizeof(uint32_t), &num, sizeof(uint32_t));
+    memset(plain + (sizeof(uint32_t) * 2), PACKET_ID_PADDING, padding_length);
+    memcpy(plain + (sizeof(uint32_t) * 2) + padding_length, data, length);
+    return (sizeof(uint32_t) * 2) + padding_length + length;
 }
 
 /* Creates and sends a data packet with buffer_start and num to the peer using the fastest route.
+ * If path isn't NULL, the path it was sent on is put in it.
  *
  * return -1 on failure.
  * return 0 on success.
  */
 static int send_data_packet_helper(Net_Crypto *c, int crypt_connection_id, uint32_t buffer_start, uint32_t num,
-                                   const uint8_t *data, uint16_t length)
+                                   const uint8_t *data, uint16_t length, uint8_t *path)
 {
     if (length == 0 || length > MAX_CRYPTO_DATA_SIZE)
         return -1;
 
-    num = htonl(num);
-    buffer_start = htonl(buffer_start);
-    uint16_t padding_length = (MAX_CRYPTO_DATA_SIZE - length) % CRYPTO_MAX_PADDING;
-    uint8_t packet[sizeof(uint32_t) + sizeof(uint32_t) + padding_length + length];
-    memcpy(packet, &buffer_start, sizeof(uint32_t));
-    memcpy(packet + sizeof(uint32_t), &num, sizeof(uint32_t));
-    memset(packet + (sizeof(uint32_t) * 2), PACKET_ID_PADDING, padding_length);
-    memcpy(packet + (sizeof(uint32_t) * 2) + padding_length, data, length);
+    uint8_t packet[MAX_DATA_DATA_PACKET_SIZE];
+    uint16_t packet_length = create_data_packet_plain(packet, buffer_start, num, data, length);
+
+    return send_data_packet(c, crypt_connection_id, packet, packet_length, path);
+}
+
+/* Number of data packets encrypted together by send_requested_packets. */
+#define CRYPTO_SEND_BATCH_SIZE 16
+
+typedef struct {
+    Packet_Data *dt;
+    uint8_t nonce[crypto_box_NONCEBYTES];
+    uint8_t packet[MAX_CRYPTO_PACKET_SIZE];
+} Send_Batch_Packet;
+
+/* Encrypt the plain data already in batch[i].packet + 1 + sizeof(uint16_t) with one
+ * encrypt_data_symmetric_batch call and send the resulting data packets.
+ * The sent_time of every packet that was sent is set to sent_time.
+ *
+ * return number of packets sent.
+ */
+static uint32_t send_data_packet_batch(Net_Crypto *c, int crypt_connection_id, Send_Batch_Packet *batch,
+                                       Crypto_Batch_Entry *entries, uint32_t num, uint64_t sent_time)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == 0)
+        return 0;
 
-    return send_data_packet(c, crypt_connection_id, packet, sizeof(packet));
+    uint32_t i, num_sent = 0;
+
+    pthread_mutex_lock(&conn->mutex);
+
+    for (i = 0; i < num; ++i) {
+        batch[i].packet[0] = NET_PACKET_CRYPTO_DATA;
+        memcpy(batch[i].packet + 1, conn->sent_nonce + (crypto_box_NONCEBYTES - sizeof(uint16_t)), sizeof(uint16_t));
+        memcpy(batch[i].nonce, conn->sent_nonce, crypto_box_NONCEBYTES);
+        increment_nonce(conn->sent_nonce);
+
+        entries[i].shared_key = conn->shared_key;
+        entries[i].nonce = batch[i].nonce;
+        entries[i].in = batch[i].packet + 1 + sizeof(uint16_t);
+        entries[i].out = batch[i].packet + 1 + sizeof(uint16_t);
+    }
+
+    encrypt_data_symmetric_batch(entries, num);
+    pthread_mutex_unlock(&conn->mutex);
+
+    for (i = 0; i < num; ++i) {
+        if (entries[i].out_length != (int32_t)(entries[i].length + crypto_box_MACBYTES))
+            continue;
+
+        if (send_packet_to(c, crypt_connection_id, batch[i].packet, 1 + sizeof(uint16_t) + entries[i].out_length,
+                           &batch[i].dt->path) == 0) {
+            batch[i].dt->sent_time = sent_time;
+            ++num_sent;
+        }
+    }
+
+    return num_sent;
 }
 
 static int reset_max_speed_reached(Net_Crypto *c, int crypt_connection_id)
@@ -894,7 +1261,7 @@ static int reset_max_speed_reached(Net_Crypto *c, int crypt_connection_id)
         if (ret == 1) {
             if (!dt->sent_time) {
                 if (send_data_packet_helper(c, crypt_connection_id, conn->recv_array.buffer_start, packet_num, dt->data,
-                                            dt->length) != 0) {
+                                            dt->length, &dt->path) != 0) {
                     send_failed = 1;
                 } else {
                     dt->sent_time = current_time_monotonic();
@@ -936,6 +1303,7 @@ static int64_t send_lossless_packet(Net_Crypto *c, int crypt_connection_id, cons
 
     Packet_Data dt;
     dt.sent_time = 0;
+    dt.path = CRYPTO_PATH_UNKNOWN;
     dt.length = length;
     memcpy(dt.data, data, length);
     pthread_mutex_lock(&conn->mutex);
@@ -949,11 +1317,16 @@ static int64_t send_lossless_packet(Net_Crypto *c, int crypt_connection_id, cons
         return packet_num;
     }
 
-    if (send_data_packet_helper(c, crypt_connection_id, conn->recv_array.buffer_start, packet_num, data, length) == 0) {
+    uint8_t path;
+
+    if (send_data_packet_helper(c, crypt_connection_id, conn->recv_array.buffer_start, packet_num, data, length,
+                                &path) == 0) {
         Packet_Data *dt1 = NULL;
 
-        if (get_data_pointer(&conn->send_array, &dt1, packet_num) == 1)
+        if (get_data_pointer(&conn->send_array, &dt1, packet_num) == 1) {
             dt1->sent_time = current_time_monotonic();
+            dt1->path = path;
+        }
     } else {
         conn->maximum_speed_reached = 1;
         LOGGER_ERROR("send_data_packet failed\n");
@@ -1032,7 +1405,7 @@ static int send_request_packet(Net_Crypto *c, int crypt_connection_id)
         return -1;
 
     return send_data_packet_helper(c, crypt_connection_id, conn->recv_array.buffer_start, conn->send_array.buffer_end, data,
-                                   len);
+                                   len, NULL);
 }
 
 /* Send up to max num previously requested data packets.
@@ -1053,7 +1426,11 @@ static int send_requested_packets(Net_Crypto *c, int crypt_connection_id, uint32
     uint64_t temp_time = current_time_monotonic();
     uint32_t i, num_sent = 0, array_size = num_packets_array(&conn->send_array);
 
-    for (i = 0; i < array_size; ++i) {
+    Send_Batch_Packet batch[CRYPTO_SEND_BATCH_SIZE];
+    Crypto_Batch_Entry entries[CRYPTO_SEND_BATCH_SIZE];
+    uint32_t batch_num = 0;
+
+    for (i = 0; i < array_size && num_sent + batch_num < max_num; ++i) {
         Packet_Data *dt;
         uint32_t packet_num = (i + conn->send_array.buffer_start);
         int ret = get_data_pointer(&conn->send_array, &dt, packet_num);
@@ -1068,16 +1445,20 @@ static int send_requested_packets(Net_Crypto *c, int crypt_connection_id, uint32
             continue;
         }
 
-        if (send_data_packet_helper(c, crypt_connection_id, conn->recv_array.buffer_start, packet_num, dt->data,
-                                    dt->length) == 0) {
-            dt->sent_time = temp_time;
-            ++num_sent;
-        }
+        batch[batch_num].dt = dt;
+        entries[batch_num].length = create_data_packet_plain(batch[batch_num].packet + 1 + sizeof(uint16_t),
+                                    conn->recv_array.buffer_start, packet_num, dt->data, dt->length);
+        ++batch_num;
 
-        if (num_sent >= max_num)
-            break;
+        if (batch_num == CRYPTO_SEND_BATCH_SIZE) {
+            num_sent += send_data_packet_batch(c, crypt_connection_id, batch, entries, batch_num, temp_time);
+            batch_num = 0;
+        }
     }
 
+    if (batch_num)
+        num_sent += send_data_packet_batch(c, crypt_connection_id, batch, entries, batch_num, temp_time);
+
     return num_sent;
 }
 
@@ -1151,7 +1532,7 @@ static int send_temp_packet(Net_Crypto *c, int crypt_connection_id)
     if (!conn->temp_packet)
         return -1;
 
-    if (send_packet_to(c, crypt_connection_id, conn->temp_packet, conn->temp_packet_length) != 0)
+    if (send_packet_to(c, crypt_connection_id, conn->temp_packet, conn->temp_packet_length, NULL) != 0)
         return -1;
 
     conn->temp_packet_sent_time = current_time_monotonic();
@@ -1200,7 +1581,7 @@ static int send_kill_packet(Net_Crypto *c, int crypt_connection_id)
 
     uint8_t kill_packet = PACKET_ID_KILL;
     return send_data_packet_helper(c, crypt_connection_id, conn->recv_array.buffer_start, conn->send_array.buffer_end,
-                                   &kill_packet, sizeof(kill_packet));
+                                   &kill_packet, sizeof(kill_packet), NULL);
 }
 
 static void connection_kill(Net_Crypto *c, int crypt_connection_id)
@@ -1246,12 +1627,14 @@ static int handle_data_packet_helper(Net_Crypto *c, int crypt_connection_id, con
     num = ntohl(num);
 
     uint64_t rtt_calc_time = 0;
+    uint8_t rtt_calc_path = CRYPTO_PATH_UNKNOWN;
 
     if (buffer_start != conn->send_array.buffer_start) {
         Packet_Data *packet_time;
 
         if (get_data_pointer(&conn->send_array, &packet_time, conn->send_array.buffer_start) == 1) {
             rtt_calc_time = packet_time->sent_time;
+            rtt_calc_path = packet_time->path;
         }
 
         if (clear_buffer_until(&conn->send_array, buffer_start) != 0) {
@@ -1349,6 +1732,9 @@ static int handle_data_packet_helper(Net_Crypto *c, int crypt_connection_id, con
 
         if (rtt_time < conn->rtt_time)
             conn->rtt_time = rtt_time;
+
+        if (c->multipath)
+            multipath_add_rtt(c, conn, rtt_calc_path, MIN(rtt_time, UINT32_MAX));
     }
 
     return 0;
@@ -1441,29 +1827,39 @@ static int handle_packet_connection(Net_Crypto *c, int crypt_connection_id, cons
     return 0;
 }
 
-/* Set the size of the friend list to numfriends.
+/* Allocate a new chunk of connections.
+ * Chunks are never moved or freed until kill_net_crypto().
  *
- *  return -1 if realloc fails.
- *  return 0 if it succeeds.
+ *  return -1 on failure.
+ *  return 0 on success.
  */
-static int realloc_cryptoconnection(Net_Crypto *c, uint32_t num)
+static int add_cryptoconnection_chunk(Net_Crypto *c)
 {
-    if (num == 0) {
-        free(c->crypto_connections);
-        c->crypto_connections = NULL;
-        return 0;
-    }
+    if (c->crypto_connections_chunks >= CRYPTO_CONNECTIONS_MAX_CHUNKS)
+        return -1;
 
-    Crypto_Connection *newcrypto_connections = realloc(c->crypto_connections, num * sizeof(Crypto_Connection));
+    Crypto_Connection *chunk = calloc(CRYPTO_CONNECTIONS_CHUNK_SIZE, sizeof(Crypto_Connection));
 
-    if (newcrypto_connections == NULL)
+    if (chunk == NULL)
         return -1;
 
-    c->crypto_connections = newcrypto_connections;
+    uint32_t i;
+
+    for (i = 0; i < CRYPTO_CONNECTIONS_CHUNK_SIZE; ++i) {
+        if (pthread_mutex_init(&chunk[i].mutex, NULL) != 0) {
+            while (i--)
+                pthread_mutex_destroy(&chunk[i].mutex);
+
+            free(chunk);
+            return -1;
+        }
+    }
+
+    c->crypto_connections[c->crypto_connections_chunks] = chunk;
+    ++c->crypto_connections_chunks;
     return 0;
 }
 
-
 /* Create a new empty crypto connection.
  *
  * return -1 on failure.
@@ -1474,31 +1870,19 @@ static int create_crypto_connection(Net_Crypto *c)
     uint32_t i;
 
     for (i = 0; i < c->crypto_connections_length; ++i) {
-        if (c->crypto_connections[i].status == CRYPTO_CONN_NO_CONNECTION)
+        if (crypto_connection_slot(c, i)->status == CRYPTO_CONN_NO_CONNECTION)
             return i;
     }
 
-    while (1) { /* TODO: is this really the best way to do this? */
-        pthread_mutex_lock(&c->connections_mutex);
-
-        if (!c->connection_use_counter) {
-            break;
-        }
-
-        pthread_mutex_unlock(&c->connections_mutex);
-    }
+    /* Existing connections never move, so there is no need to wait for senders here. */
+    pthread_mutex_lock(&c->connections_mutex);
 
     int id = -1;
 
-    if (realloc_cryptoconnection(c, c->crypto_connections_length + 1) == 0) {
+    if (c->crypto_connections_length < c->crypto_connections_chunks * CRYPTO_CONNECTIONS_CHUNK_SIZE
+            || add_cryptoconnection_chunk(c) == 0) {
         id = c->crypto_connections_length;
         ++c->crypto_connections_length;
-        memset(&(c->crypto_connections[id]), 0, sizeof(Crypto_Connection));
-
-        if (pthread_mutex_init(&c->crypto_connections[id].mutex, NULL) != 0) {
-            pthread_mutex_unlock(&c->connections_mutex);
-            return -1;
-        }
     }
 
     pthread_mutex_unlock(&c->connections_mutex);
@@ -1517,24 +1901,18 @@ static int wipe_crypto_connection(Net_Crypto *c, int crypt_connection_id)
 
     uint32_t i;
 
-    /* Keep mutex, only destroy it when connection is realloced out. */
-    pthread_mutex_t mutex = c->crypto_connections[crypt_connection_id].mutex;
-    sodium_memzero(&(c->crypto_connections[crypt_connection_id]), sizeof(Crypto_Connection));
-    c->crypto_connections[crypt_connection_id].mutex = mutex;
+    /* Keep mutex, it is only destroyed when the chunk is freed. */
+    Crypto_Connection *conn = crypto_connection_slot(c, crypt_connection_id);
+    pthread_mutex_t mutex = conn->mutex;
+    sodium_memzero(conn, sizeof(Crypto_Connection));
+    conn->mutex = mutex;
 
     for (i = c->crypto_connections_length; i != 0; --i) {
-        if (c->crypto_connections[i - 1].status == CRYPTO_CONN_NO_CONNECTION) {
-            pthread_mutex_destroy(&c->crypto_connections[i - 1].mutex);
-        } else {
+        if (crypto_connection_slot(c, i - 1)->status != CRYPTO_CONN_NO_CONNECTION)
             break;
-        }
-    }
-
-    if (c->crypto_connections_length != i) {
-        c->crypto_connections_length = i;
-        realloc_cryptoconnection(c, c->crypto_connections_length);
     }
 
+    c->crypto_connections_length = i;
     return 0;
 }
 
@@ -1548,8 +1926,10 @@ static int getcryptconnection_id(const Net_Crypto *c, const uint8_t *public_key)
     uint32_t i;
 
     for (i = 0; i < c->crypto_connections_length; ++i) {
-        if (c->crypto_connections[i].status != CRYPTO_CONN_NO_CONNECTION)
-            if (public_key_cmp(public_key, c->crypto_connections[i].public_key) == 0)
+        const Crypto_Connection *conn = crypto_connection_slot(c, i);
+
+        if (conn->status != CRYPTO_CONN_NO_CONNECTION)
+            if (public_key_cmp(public_key, conn->public_key) == 0)
                 return i;
     }
 
@@ -1615,12 +1995,37 @@ void new_connection_handler(Net_Crypto *c, int (*new_connection_callback)(void *
 
 /* Handle a handshake packet by someone who wants to initiate a new connection with us.
  * This calls the callback set by new_connection_handler() if the handshake is ok.
+ * sender_public_key is the key of the peer that sent it over TCP, NULL for UDP.
  *
  * return -1 on failure.
  * return 0 on success.
  */
-static int handle_new_connection_handshake(Net_Crypto *c, IP_Port source, const uint8_t *data, uint16_t length)
+static int handle_new_connection_handshake(Net_Crypto *c, IP_Port source, const uint8_t *sender_public_key,
+        const uint8_t *data, uint16_t length)
 {
+    if (length != HANDSHAKE_PACKET_LENGTH)
+        return -1;
+
+    /* Reject bad, replayed or excess handshakes before doing any public key operation. */
+    uint8_t cookie_plain[COOKIE_DATA_LENGTH];
+
+    if (open_cookie(cookie_plain, data + 1, c->secret_symmetric_key) != 0) {
+        ++c->admission_stats.handshakes_bad_cookie;
+        return -1;
+    }
+
+    if (cookie_spent(c, data + 1)) {
+        ++c->admission_stats.handshakes_replayed;
+        return -1;
+    }
+
+    if (!crypto_admit(c, source, sender_public_key)) {
+        ++c->admission_stats.handshakes_rate_limited;
+        return -1;
+    }
+
+    ++c->admission_stats.handshakes_accepted;
+
     New_Connection n_c;
     n_c.cookie = malloc(COOKIE_LENGTH);
 
@@ -1659,12 +2064,21 @@ static int handle_new_connection_handshake(Net_Crypto *c, IP_Port source, const
                 }
             }
 
+            /* Only a handshake that got its connection spends the cookie, so a retransmission
+             * of one that failed here can still succeed. */
+            if (ret == 0)
+                add_spent_cookie(c, data + 1);
+
             free(n_c.cookie);
             return ret;
         }
     }
 
     int ret = c->new_connection_callback(c->new_connection_callback_object, &n_c);
+
+    if (ret == 0)
+        add_spent_cookie(c, data + 1);
+
     free(n_c.cookie);
     return ret;
 }
@@ -1684,7 +2098,7 @@ int accept_crypto_connection(Net_Crypto *c, New_Connection *n_c)
     if (crypt_connection_id == -1)
         return -1;
 
-    Crypto_Connection *conn = &c->crypto_connections[crypt_connection_id];
+    Crypto_Connection *conn = crypto_connection_slot(c, crypt_connection_id);
 
     if (n_c->cookie_length != COOKIE_LENGTH)
         return -1;
@@ -1740,7 +2154,7 @@ int new_crypto_connection(Net_Crypto *c, const uint8_t *real_public_key, const u
     if (crypt_connection_id == -1)
         return -1;
 
-    Crypto_Connection *conn = &c->crypto_connections[crypt_connection_id];
+    Crypto_Connection *conn = crypto_connection_slot(c, crypt_connection_id);
 
     if (conn == 0)
         return -1;
@@ -1828,7 +2242,7 @@ static int tcp_data_callback(void *object, int id, const uint8_t *data, uint16_t
         return -1;
 
     if (data[0] == NET_PACKET_COOKIE_REQUEST) {
-        return tcp_handle_cookie_request(c, conn->connection_number_tcp, data, length);
+        return tcp_handle_cookie_request(c, conn->connection_number_tcp, conn->dht_public_key, data, length);
     }
 
     pthread_mutex_unlock(&c->tcp_mutex);
@@ -1858,7 +2272,7 @@ static int tcp_oob_callback(void *object, const uint8_t *public_key, unsigned in
         source.ip.family = TCP_FAMILY;
         source.ip.ip6.uint32[0] = tcp_connections_number;
 
-        if (handle_new_connection_handshake(c, source, data, length) != 0)
+        if (handle_new_connection_handshake(c, source, public_key, data, length) != 0)
             return -1;
 
         return 0;
@@ -2103,7 +2517,7 @@ static int udp_handle_packet(void *object, IP_Port source, const uint8_t *packet
         if (packet[0] != NET_PACKET_CRYPTO_HS)
             return 1;
 
-        if (handle_new_connection_handshake(c, source, packet, length) != 0)
+        if (handle_new_connection_handshake(c, source, NULL, packet, length) != 0)
             return 1;
 
         return 0;
@@ -2384,6 +2798,32 @@ _Bool max_speed_reached(Net_Crypto *c, int crypt_connection_id)
     return reset_max_speed_reached(c, crypt_connection_id) != 0;
 }
 
+/* Return 1 if lossless packets used up the send rate of this connection within the last second.
+ * Return 0 if it didn't or on failure.
+ */
+_Bool crypto_congested(const Net_Crypto *c, int crypt_connection_id)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == 0)
+        return 0;
+
+    return conn->last_congestion_event && conn->last_congestion_event + CONGESTION_EVENT_TIMEOUT >= current_time_monotonic();
+}
+
+/* Return the shortest round trip time measured on this connection in ms.
+ * Return 0 on failure.
+ */
+uint32_t crypto_rtt(const Net_Crypto *c, int crypt_connection_id)
+{
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == 0)
+        return 0;
+
+    return conn->rtt_time;
+}
+
 /* returns the number of packet slots left in the sendbuffer.
  * return 0 if failure.
  */
@@ -2422,29 +2862,141 @@ int64_t write_cryptpacket(Net_Crypto *c, int crypt_connection_id, const uint8_t
     if (data[0] >= PACKET_ID_LOSSY_RANGE_START)
         return -1;
 
+    connections_use_begin(c);
+
     Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
 
-    if (conn == 0)
+    int64_t ret = -1;
+
+    if (conn && conn->status == CRYPTO_CONN_ESTABLISHED && !(congestion_control && conn->packets_left == 0)) {
+        ret = send_lossless_packet(c, crypt_connection_id, data, length, congestion_control);
+
+        if (ret != -1 && congestion_control) {
+            pthread_mutex_lock(&conn->mutex);
+            --conn->packets_left;
+            --conn->packets_left_requested;
+            conn->packets_sent++;
+            pthread_mutex_unlock(&conn->mutex);
+        }
+    }
+
+    connections_use_end(c);
+    return ret;
+}
+
+/* Sends up to num lossless cryptopackets, taking the connection lock once.
+ *
+ * return -1 on failure.
+ * return number of packets put in the queue on success.
+ */
+int32_t write_cryptpacket_batch(Net_Crypto *c, int crypt_connection_id, const uint8_t *const *data,
+                                const uint16_t *length, uint32_t num, uint8_t congestion_control, int64_t *packet_numbers)
+{
+    if (num == 0)
         return -1;
 
-    if (conn->status != CRYPTO_CONN_ESTABLISHED)
+    uint32_t i;
+
+    for (i = 0; i < num; ++i) {
+        if (length[i] == 0 || length[i] > MAX_CRYPTO_DATA_SIZE)
+            break;
+
+        if (data[i][0] < CRYPTO_RESERVED_PACKETS || data[i][0] >= PACKET_ID_LOSSY_RANGE_START)
+            break;
+    }
+
+    num = i;
+
+    if (num == 0)
         return -1;
 
-    if (congestion_control && conn->packets_left == 0)
+    connections_use_begin(c);
+
+    Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == 0 || conn->status != CRYPTO_CONN_ESTABLISHED) {
+        connections_use_end(c);
         return -1;
+    }
 
-    int64_t ret = send_lossless_packet(c, crypt_connection_id, data, length, congestion_control);
+    /* If last packet send failed, try to send packet again.
+       If sending it fails we won't be able to send the new packets. */
+    reset_max_speed_reached(c, crypt_connection_id);
 
-    if (ret == -1)
+    if (congestion_control && (conn->maximum_speed_reached || conn->packets_left == 0)) {
+        connections_use_end(c);
         return -1;
+    }
+
+    if (congestion_control && num > conn->packets_left)
+        num = conn->packets_left;
+
+    Packet_Data dt;
+    dt.sent_time = 0;
+    dt.path = CRYPTO_PATH_UNKNOWN;
+
+    pthread_mutex_lock(&conn->mutex);
+
+    for (i = 0; i < num; ++i) {
+        dt.length = length[i];
+        memcpy(dt.data, data[i], length[i]);
+        packet_numbers[i] = add_data_end_of_buffer(&conn->send_array, &dt);
+
+        if (packet_numbers[i] == -1)
+            break;
+    }
+
+    num = i;
 
     if (congestion_control) {
-        --conn->packets_left;
-        --conn->packets_left_requested;
-        conn->packets_sent++;
+        conn->packets_left -= num;
+        conn->packets_left_requested -= num;
+        conn->packets_sent += num;
     }
 
-    return ret;
+    pthread_mutex_unlock(&conn->mutex);
+
+    if (num == 0) {
+        connections_use_end(c);
+        return -1;
+    }
+
+    if (!congestion_control && conn->maximum_speed_reached) {
+        connections_use_end(c);
+        return num;
+    }
+
+    /* Packets that can't be sent now keep a sent_time of 0 and are sent by send_requested_packets. */
+    uint64_t temp_time = current_time_monotonic();
+    Send_Batch_Packet batch[CRYPTO_SEND_BATCH_SIZE];
+    Crypto_Batch_Entry entries[CRYPTO_SEND_BATCH_SIZE];
+    uint32_t batch_num = 0;
+    _Bool send_failed = 0;
+
+    for (i = 0; i < num && !send_failed; ++i) {
+        if (get_data_pointer(&conn->send_array, &batch[batch_num].dt, packet_numbers[i]) != 1)
+            continue;
+
+        entries[batch_num].length = create_data_packet_plain(batch[batch_num].packet + 1 + sizeof(uint16_t),
+                                    conn->recv_array.buffer_start, packet_numbers[i], data[i], length[i]);
+        ++batch_num;
+
+        if (batch_num == CRYPTO_SEND_BATCH_SIZE) {
+            send_failed = send_data_packet_batch(c, crypt_connection_id, batch, entries, batch_num, temp_time) != batch_num;
+            batch_num = 0;
+        }
+    }
+
+    if (batch_num && !send_failed)
+        send_failed = send_data_packet_batch(c, crypt_connection_id, batch, entries, batch_num, temp_time) != batch_num;
+
+    if (send_failed) {
+        conn->maximum_speed_reached = 1;
+        LOGGER_ERROR("send_data_packet_batch failed\n");
+    }
+
+    connections_use_end(c);
+    return num;
 }
 
 /* Check if packet_number was received by the other side.
@@ -2487,9 +3039,7 @@ int send_lossy_cryptpacket(Net_Crypto *c, int crypt_connection_id, const uint8_t
     if (data[0] >= (PACKET_ID_LOSSY_RANGE_START + PACKET_ID_LOSSY_RANGE_SIZE))
         return -1;
 
-    pthread_mutex_lock(&c->connections_mutex);
-    ++c->connection_use_counter;
-    pthread_mutex_unlock(&c->connections_mutex);
+    connections_use_begin(c);
 
     Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
 
@@ -2500,12 +3050,10 @@ int send_lossy_cryptpacket(Net_Crypto *c, int crypt_connection_id, const uint8_t
         uint32_t buffer_start = conn->recv_array.buffer_start;
         uint32_t buffer_end = conn->send_array.buffer_end;
         pthread_mutex_unlock(&conn->mutex);
-        ret = send_data_packet_helper(c, crypt_connection_id, buffer_start, buffer_end, data, length);
+        ret = send_data_packet_helper(c, crypt_connection_id, buffer_start, buffer_end, data, length, NULL);
     }
 
-    pthread_mutex_lock(&c->connections_mutex);
-    --c->connection_use_counter;
-    pthread_mutex_unlock(&c->connections_mutex);
+    connections_use_end(c);
 
     return ret;
 }
@@ -2517,15 +3065,7 @@ int send_lossy_cryptpacket(Net_Crypto *c, int crypt_connection_id, const uint8_t
  */
 int crypto_kill(Net_Crypto *c, int crypt_connection_id)
 {
-    while (1) { /* TODO: is this really the best way to do this? */
-        pthread_mutex_lock(&c->connections_mutex);
-
-        if (!c->connection_use_counter) {
-            break;
-        }
-
-        pthread_mutex_unlock(&c->connections_mutex);
-    }
+    connections_lock_exclusive(c);
 
     Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
 
@@ -2584,6 +3124,11 @@ unsigned int crypto_connection_status(const Net_Crypto *c, int crypt_connection_
     return conn->status;
 }
 
+void crypto_get_admission_stats(const Net_Crypto *c, Crypto_Admission_Stats *stats)
+{
+    memcpy(stats, &c->admission_stats, sizeof(Crypto_Admission_Stats));
+}
+
 void new_keys(Net_Crypto *c)
 {
     crypto_box_keypair(c->self_public_key, c->self_secret_key);
@@ -2609,6 +3154,14 @@ void load_secret_key(Net_Crypto *c, const uint8_t *sk)
     crypto_scalarmult_curve25519_base(c->self_public_key, c->self_secret_key);
 }
 
+/* Set if data packets should be spread over the direct UDP path and all the online TCP relays
+ * of each connection (1) or sent over a single path (0, default).
+ */
+void net_crypto_set_multipath(Net_Crypto *c, _Bool enabled)
+{
+    c->multipath = enabled;
+}
+
 /* Run this to (re)initialize net_crypto.
  * Sets all the global connection variables to their default values.
  */
@@ -2641,10 +3194,21 @@ Net_Crypto *new_net_crypto(DHT *dht, TCP_Proxy_Info *proxy_info)
         return NULL;
     }
 
+    if (pthread_cond_init(&temp->connections_cond, NULL) != 0) {
+        pthread_mutex_destroy(&temp->connections_mutex);
+        pthread_mutex_destroy(&temp->tcp_mutex);
+        kill_tcp_connections(temp->tcp_c);
+        free(temp);
+        return NULL;
+    }
+
     temp->dht = dht;
 
     new_keys(temp);
     new_symmetric_key(temp->secret_symmetric_key);
+    temp->admission_seed = random_64b();
+    temp->admission_global.tokens = CRYPTO_ADMISSION_GLOBAL_BURST * 1000;
+    temp->admission_global.last_refill = current_time_monotonic();
 
     temp->current_sleep_time = CRYPTO_SEND_PACKET_INTERVAL;
 
@@ -2711,8 +3275,18 @@ void kill_net_crypto(Net_Crypto *c)
         crypto_kill(c, i);
     }
 
+    for (i = 0; i < c->crypto_connections_chunks; ++i) {
+        uint32_t j;
+
+        for (j = 0; j < CRYPTO_CONNECTIONS_CHUNK_SIZE; ++j)
+            pthread_mutex_destroy(&c->crypto_connections[i][j].mutex);
+
+        free(c->crypto_connections[i]);
+    }
+
     pthread_mutex_destroy(&c->tcp_mutex);
     pthread_mutex_destroy(&c->connections_mutex);
+    pthread_cond_destroy(&c->connections_cond);
 
     kill_tcp_connections(c->tcp_c);
     bs_list_free(&c->ip_port_list);
@@ -87,8 +87,21 @@
 #define DEFAULT_PING_CONNECTION 1000
 #define DEFAULT_TCP_PING_CONNECTION 500
 
+/* Crypto connections are stored in chunks of CRYPTO_CONNECTIONS_CHUNK_SIZE that are
+ * never moved or freed before kill_net_crypto(), so a Crypto_Connection pointer
+ * (and its mutex) stays valid while other connections are created or killed.
+ */
+#define CRYPTO_CONNECTIONS_CHUNK_SIZE 64
+#define CRYPTO_CONNECTIONS_MAX_CHUNKS 256
+
+/* Paths a packet can be sent on in multipath mode, besides the TCP relay indexes
+ * returned by send_packet_tcp_connection_multipath(). Neither is ever a relay index. */
+#define CRYPTO_PATH_DIRECT UINT8_MAX
+#define CRYPTO_PATH_UNKNOWN (UINT8_MAX - 1)
+
 typedef struct {
     uint64_t sent_time;
+    uint8_t path; /* Path it was last sent on, to time that path when it is acknowledged. */
     uint16_t length;
     uint8_t data[MAX_CRYPTO_DATA_SIZE];
 } Packet_Data;
@@ -127,6 +140,10 @@ typedef struct {
 
     uint64_t last_tcp_sent; /* Time the last TCP packet was sent. */
 
+    /* multipath_pick() state between the direct path (0) and the TCP relays (1) in multipath mode. */
+    int32_t multipath_current[2];
+    uint32_t multipath_udp_rtt; /* Smoothed rtt of the direct path in ms, 0 if not measured yet. */
+
     Packets_Array send_array;
     Packets_Array recv_array;
 
@@ -178,6 +195,45 @@ typedef struct {
     uint32_t dht_pk_callback_number;
 } Crypto_Connection;
 
+/* Admission control for incoming cookie requests and handshakes.
+ *
+ * Each (non LAN) source IP, or /64 for IPv6, may trigger CRYPTO_ADMISSION_IP_RATE public key
+ * operations per second with bursts of CRYPTO_ADMISSION_IP_BURST. Over TCP the source is the
+ * public key the relay saw the packet come from.
+ *
+ * Sources are remembered in a table of CRYPTO_ADMISSION_BUCKETS buckets, CRYPTO_ADMISSION_WAYS
+ * per hash. Spoofed sources can come back as often as real ones, so every admitted packet also
+ * takes from a global bucket limiting all sources together to CRYPTO_ADMISSION_GLOBAL_RATE per
+ * second. A source is only added to the table once the global bucket admitted it. Established
+ * connections don't go through admission, so a flood only holds up new ones.
+ */
+#define CRYPTO_ADMISSION_BUCKETS 256 /* Must be a power of 2 */
+#define CRYPTO_ADMISSION_WAYS 4
+#define CRYPTO_ADMISSION_IP_RATE 8
+#define CRYPTO_ADMISSION_IP_BURST 16
+#define CRYPTO_ADMISSION_GLOBAL_RATE 512
+#define CRYPTO_ADMISSION_GLOBAL_BURST 1024
+
+/* Number of recently used handshake cookies remembered to reject replays. */
+#define CRYPTO_SPENT_COOKIES 256
+
+typedef struct {
+    uint64_t key;
+    uint8_t family; /* 0 if the bucket is unused. */
+    _Bool returning; /* The source came back after being added. */
+    uint32_t tokens; /* In thousandths of a token. */
+    uint64_t last_refill; /* In ms. */
+} Admission_Bucket;
+
+typedef struct {
+    uint64_t cookie_requests_accepted;
+    uint64_t cookie_requests_rate_limited;
+    uint64_t handshakes_accepted;
+    uint64_t handshakes_rate_limited;
+    uint64_t handshakes_bad_cookie; /* Rejected because the cookie could not be opened. */
+    uint64_t handshakes_replayed; /* Rejected because the cookie was already used by an accepted handshake. */
+} Crypto_Admission_Stats;
+
 typedef struct {
     IP_Port source;
     uint8_t public_key[crypto_box_PUBLICKEYBYTES]; /* The real public key of the peer. */
@@ -194,13 +250,17 @@ typedef struct Net_Crypto {
     DHT *dht;
     TCP_Connections *tcp_c;
 
-    Crypto_Connection *crypto_connections;
+    Crypto_Connection *crypto_connections[CRYPTO_CONNECTIONS_MAX_CHUNKS];
+    uint32_t crypto_connections_chunks; /* Number of allocated chunks. */
     pthread_mutex_t tcp_mutex;
 
+    /* connection_use_counter counts the threads currently sending on a connection.
+     * Wiping a connection waits on connections_cond until no sender is left. */
     pthread_mutex_t connections_mutex;
+    pthread_cond_t connections_cond;
     unsigned int connection_use_counter;
 
-    uint32_t crypto_connections_length; /* Length of connections array. */
+    uint32_t crypto_connections_length; /* Highest used connection id + 1. */
 
     /* Our public and secret keys. */
     uint8_t self_public_key[crypto_box_PUBLICKEYBYTES];
@@ -215,6 +275,15 @@ typedef struct Net_Crypto {
     /* The current optimal sleep time */
     uint32_t current_sleep_time;
 
+    _Bool multipath;
+
+    Admission_Bucket admission_buckets[CRYPTO_ADMISSION_BUCKETS];
+    Admission_Bucket admission_global;
+    uint64_t admission_seed;
+    uint8_t spent_cookies[CRYPTO_SPENT_COOKIES][crypto_box_NONCEBYTES];
+    uint32_t spent_cookies_index;
+    Crypto_Admission_Stats admission_stats;
+
     BS_LIST ip_port_list;
 } Net_Crypto;
 
@@ -315,6 +384,16 @@ uint32_t crypto_num_free_sendqueue_slots(const Net_Crypto *c, int crypt_connecti
  */
 _Bool max_speed_reached(Net_Crypto *c, int crypt_connection_id);
 
+/* Return 1 if lossless packets used up the send rate of this connection within the last second.
+ * Return 0 if it didn't or on failure.
+ */
+_Bool crypto_congested(const Net_Crypto *c, int crypt_connection_id);
+
+/* Return the shortest round trip time measured on this connection in ms.
+ * Return 0 on failure.
+ */
+uint32_t crypto_rtt(const Net_Crypto *c, int crypt_connection_id);
+
 /* Sends a lossless cryptopacket.
  *
  * return -1 if data could not be put in packet queue.
@@ -327,6 +406,19 @@ _Bool max_speed_reached(Net_Crypto *c, int crypt_connection_id);
 int64_t write_cryptpacket(Net_Crypto *c, int crypt_connection_id, const uint8_t *data, uint16_t length,
                           uint8_t congestion_control);
 
+/* Sends up to num lossless cryptopackets, taking the connection lock once.
+ *
+ * data[i] of length[i] must follow the same rules as the data of write_cryptpacket.
+ * Packets are queued in order. Queuing stops at the first invalid packet, when the queue
+ * is full or, if congestion_control is set, when the congestion window is exhausted.
+ * packet_numbers[i] is set to the packet number of each queued packet.
+ *
+ * return -1 if no packet could be put in the packet queue.
+ * return number of packets (always the first ones) put in the queue on success.
+ */
+int32_t write_cryptpacket_batch(Net_Crypto *c, int crypt_connection_id, const uint8_t *const *data,
+                                const uint16_t *length, uint32_t num, uint8_t congestion_control, int64_t *packet_numbers);
+
 /* Check if packet_number was received by the other side.
  *
  * packet_number must be a valid packet number of a packet sent on this connection.
@@ -394,6 +486,10 @@ int crypto_kill(Net_Crypto *c, int crypt_connection_id);
 unsigned int crypto_connection_status(const Net_Crypto *c, int crypt_connection_id, _Bool *direct_connected,
                                       unsigned int *online_tcp_relays);
 
+/* Copy the counters of the cookie request and handshake admission control to stats.
+ */
+void crypto_get_admission_stats(const Net_Crypto *c, Crypto_Admission_Stats *stats);
+
 /* Generate our public and private keys.
  *  Only call this function the first time the program starts.
  */
@@ -409,6 +505,11 @@ void save_keys(const Net_Crypto *c, uint8_t *keys);
  */
 void load_secret_key(Net_Crypto *c, const uint8_t *sk);
 
+/* Set if data packets should be spread over the direct UDP path and all the online TCP relays
+ * of each connection (1) or sent over a single path (0, default).
+ */
+void net_crypto_set_multipath(Net_Crypto *c, _Bool enabled);
+
 /* Create new instance of Net_Crypto.
  *  Sets all the global connection variables to their default values.
  */
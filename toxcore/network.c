@@ -38,6 +38,7 @@
 #ifdef __APPLE__
 #include <mach/clock.h>
 #include <mach/mach.h>
+#include <mach/mach_time.h>
 #endif
 
 #include "network.h"
@@ -225,8 +226,10 @@ static uint64_t current_time_actual(void)
 
 
 #if defined(_WIN32) || defined(__WIN32__) || defined (WIN32)
+/* Wrap tracking for the 32 bit tick count, shared by every thread. */
 static uint64_t last_monotime;
 static uint64_t add_monotime;
+static pthread_mutex_t monotime_mutex = PTHREAD_MUTEX_INITIALIZER;
 #endif
 
 /* return current monotonic time in milliseconds (ms). */
@@ -234,6 +237,7 @@ uint64_t current_time_monotonic(void)
 {
     uint64_t time;
 #if defined(_WIN32) || defined(__WIN32__) || defined (WIN32)
+    pthread_mutex_lock(&monotime_mutex);
     time = (uint64_t)GetTickCount() + add_monotime;
 
     if (time < last_monotime) { /* Prevent time from ever decreasing because of 32 bit wrap. */
@@ -243,6 +247,7 @@ uint64_t current_time_monotonic(void)
     }
 
     last_monotime = time;
+    pthread_mutex_unlock(&monotime_mutex);
 #else
     struct timespec monotime;
 #if defined(__linux__) && defined(CLOCK_MONOTONIC_RAW)
@@ -265,6 +270,30 @@ uint64_t current_time_monotonic(void)
     return time;
 }
 
+uint64_t current_time_monotonic_us(void)
+{
+#if defined(_WIN32) || defined(__WIN32__) || defined (WIN32)
+    LARGE_INTEGER count, frequency;
+
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&frequency);
+
+    /* Split so the multiplication can't overflow */
+    return count.QuadPart / frequency.QuadPart * 1000000ULL +
+           count.QuadPart % frequency.QuadPart * 1000000ULL / frequency.QuadPart;
+#elif defined(__APPLE__)
+    mach_timebase_info_data_t timebase;
+
+    mach_timebase_info(&timebase);
+    return (double)mach_absolute_time() * timebase.numer / timebase.denom / 1000;
+#else
+    struct timespec monotime;
+
+    clock_gettime(CLOCK_MONOTONIC, &monotime);
+    return 1000000ULL * monotime.tv_sec + (monotime.tv_nsec / 1000ULL);
+#endif
+}
+
 /* In case no logging */
 #ifndef TOX_LOGGER
 #define loglogdata(__message__, __buffer__, __buflen__, __ip_port__, __res__)
@@ -273,19 +302,21 @@ uint64_t current_time_monotonic(void)
 #define data_1(__buflen__, __buffer__) __buflen__ > 7 ? ntohl(*(uint32_t *)&__buffer__[5]) : 0
 
 #define loglogdata(__message__, __buffer__, __buflen__, __ip_port__, __res__) \
-    (__ip_port__) .ip; \
-    if (__res__ < 0) /* Windows doesn't necessarily know %zu */ \
-        LOGGER_TRACE("[%2u] %s %3hu%c %s:%hu (%u: %s) | %04x%04x", \
-                 __buffer__[0], __message__, (__buflen__ < 999 ? (uint16_t)__buflen__ : 999), 'E', \
-                 ip_ntoa(&((__ip_port__).ip)), ntohs((__ip_port__).port), errno, strerror(errno), data_0(__buflen__, __buffer__), data_1(__buflen__, __buffer__)); \
-    else if ((__res__ > 0) && ((size_t)__res__ <= __buflen__)) \
-        LOGGER_TRACE("[%2u] %s %3zu%c %s:%hu (%u: %s) | %04x%04x", \
-                 __buffer__[0], __message__, (__res__ < 999 ? (size_t)__res__ : 999), ((size_t)__res__ < __buflen__ ? '<' : '='), \
-                 ip_ntoa(&((__ip_port__).ip)), ntohs((__ip_port__).port), 0, "OK", data_0(__buflen__, __buffer__), data_1(__buflen__, __buffer__)); \
-    else /* empty or overwrite */ \
-        LOGGER_TRACE("[%2u] %s %zu%c%zu %s:%hu (%u: %s) | %04x%04x", \
-                 __buffer__[0], __message__, (size_t)__res__, (!__res__ ? '!' : '>'), __buflen__, \
-                 ip_ntoa(&((__ip_port__).ip)), ntohs((__ip_port__).port), 0, "OK", data_0(__buflen__, __buffer__), data_1(__buflen__, __buffer__));
+    do { \
+        char ip_str[IP_NTOA_LEN]; \
+        if (__res__ < 0) /* Windows doesn't necessarily know %zu */ \
+            LOGGER_TRACE("[%2u] %s %3hu%c %s:%hu (%u: %s) | %04x%04x", \
+                     __buffer__[0], __message__, (__buflen__ < 999 ? (uint16_t)__buflen__ : 999), 'E', \
+                     ip_ntoa(&((__ip_port__).ip), ip_str, sizeof(ip_str)), ntohs((__ip_port__).port), errno, strerror(errno), data_0(__buflen__, __buffer__), data_1(__buflen__, __buffer__)); \
+        else if ((__res__ > 0) && ((size_t)__res__ <= __buflen__)) \
+            LOGGER_TRACE("[%2u] %s %3zu%c %s:%hu (%u: %s) | %04x%04x", \
+                     __buffer__[0], __message__, (__res__ < 999 ? (size_t)__res__ : 999), ((size_t)__res__ < __buflen__ ? '<' : '='), \
+                     ip_ntoa(&((__ip_port__).ip), ip_str, sizeof(ip_str)), ntohs((__ip_port__).port), 0, "OK", data_0(__buflen__, __buffer__), data_1(__buflen__, __buffer__)); \
+        else /* empty or overwrite */ \
+            LOGGER_TRACE("[%2u] %s %zu%c%zu %s:%hu (%u: %s) | %04x%04x", \
+                     __buffer__[0], __message__, (size_t)__res__, (!__res__ ? '!' : '>'), __buflen__, \
+                     ip_ntoa(&((__ip_port__).ip), ip_str, sizeof(ip_str)), ntohs((__ip_port__).port), 0, "OK", data_0(__buflen__, __buffer__), data_1(__buflen__, __buffer__)); \
+    } while (0)
 
 #endif /* TOX_LOGGER */
 
@@ -440,10 +471,13 @@ void networking_poll(Networking_Core *net)
 #include <sodium.h>
 #endif
 
-uint8_t at_startup_ran = 0;
+/* Instances may be created from several threads at once. Running the startup
+ * twice is harmless (sodium_init() and WSAStartup() both allow it), so an
+ * atomic flag is enough to skip it afterwards. */
+static uint8_t at_startup_ran = 0;
 int networking_at_startup(void)
 {
-    if (at_startup_ran != 0)
+    if (__atomic_load_n(&at_startup_ran, __ATOMIC_ACQUIRE) != 0)
         return 0;
 
 #ifndef VANILLA_NACL
@@ -464,7 +498,7 @@ int networking_at_startup(void)
 
 #endif
     srand((uint32_t)current_time_actual());
-    at_startup_ran = 1;
+    __atomic_store_n(&at_startup_ran, 1, __ATOMIC_RELEASE);
     return 0;
 }
 
@@ -663,7 +697,9 @@ Networking_Core *new_networking_ex(IP ip, uint16_t port_from, uint16_t port_to,
         if (!res) {
             temp->port = *portptr;
 
-            LOGGER_DEBUG("Bound successfully to %s:%u", ip_ntoa(&ip), ntohs(temp->port));
+            LOGGER_SCOPE( char ip_str[IP_NTOA_LEN];
+                          LOGGER_DEBUG("Bound successfully to %s:%u", ip_ntoa(&ip, ip_str, sizeof(ip_str)), ntohs(temp->port));
+                        );
 
             /* errno isn't reset on success, only set on failure, the failed
              * binds with parallel clients yield a -EPERM to the outside if
@@ -685,8 +721,10 @@ Networking_Core *new_networking_ex(IP ip, uint16_t port_from, uint16_t port_to,
         *portptr = htons(port_to_try);
     }
 
-    LOGGER_ERROR("Failed to bind socket: %u, %s IP: %s port_from: %u port_to: %u", errno, strerror(errno),
-                 ip_ntoa(&ip), port_from, port_to);
+    LOGGER_SCOPE( char ip_str[IP_NTOA_LEN];
+                  LOGGER_ERROR("Failed to bind socket: %u, %s IP: %s port_from: %u port_to: %u", errno, strerror(errno),
+                               ip_ntoa(&ip, ip_str, sizeof(ip_str)), port_from, port_to);
+                );
 
     kill_networking(temp);
 
@@ -820,39 +858,45 @@ void ipport_copy(IP_Port *target, const IP_Port *source)
 
 /* ip_ntoa
  *   converts ip into a string
- *   uses a static buffer, so mustn't used multiple times in the same output
+ *   writes into the caller's buffer (length should be at least IP_NTOA_LEN)
+ *   so it is safe to use from several threads and several times in one output
  *
  *   IPv6 addresses are enclosed into square brackets, i.e. "[IPv6]"
  *   writes error message into the buffer on error
+ *
+ *   returns ip_str
  */
-/* there would be INET6_ADDRSTRLEN, but it might be too short for the error message */
-static char addresstext[96]; // FIXME magic number. Why not INET6_ADDRSTRLEN ?
-const char *ip_ntoa(const IP *ip)
+const char *ip_ntoa(const IP *ip, char *ip_str, size_t length)
 {
+    if (length < IP_NTOA_LEN) {
+        snprintf(ip_str, length, "Bad buf length");
+        return ip_str;
+    }
+
     if (ip) {
         if (ip->family == AF_INET) {
             /* returns standard quad-dotted notation */
             struct in_addr *addr = (struct in_addr *)&ip->ip4;
 
-            addresstext[0] = 0;
-            inet_ntop(ip->family, addr, addresstext, sizeof(addresstext));
+            ip_str[0] = 0;
+            inet_ntop(ip->family, addr, ip_str, length);
         } else if (ip->family == AF_INET6) {
             /* returns hex-groups enclosed into square brackets */
             struct in6_addr *addr = (struct in6_addr *)&ip->ip6;
 
-            addresstext[0] = '[';
-            inet_ntop(ip->family, addr, &addresstext[1], sizeof(addresstext) - 3);
-            size_t len = strlen(addresstext);
-            addresstext[len] = ']';
-            addresstext[len + 1] = 0;
+            ip_str[0] = '[';
+            inet_ntop(ip->family, addr, &ip_str[1], length - 3);
+            size_t len = strlen(ip_str);
+            ip_str[len] = ']';
+            ip_str[len + 1] = 0;
         } else
-            snprintf(addresstext, sizeof(addresstext), "(IP invalid, family %u)", ip->family);
+            snprintf(ip_str, length, "(IP invalid, family %u)", ip->family);
     } else
-        snprintf(addresstext, sizeof(addresstext), "(IP invalid: NULL)");
+        snprintf(ip_str, length, "(IP invalid: NULL)");
 
     /* brute force protection against lacking termination */
-    addresstext[sizeof(addresstext) - 1] = 0;
-    return addresstext;
+    ip_str[length - 1] = 0;
+    return ip_str;
 }
 
 /*
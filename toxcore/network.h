@@ -180,14 +180,19 @@ IP_Port;
 #define TOX_ADDR_RESOLVE_INET  1
 #define TOX_ADDR_RESOLVE_INET6 2
 
+/* Buffer size for ip_ntoa(), long enough for the error messages too. */
+#define IP_NTOA_LEN 96
+
 /* ip_ntoa
  *   converts ip into a string
- *   uses a static buffer, so mustn't used multiple times in the same output
+ *   writes into ip_str, which should be at least IP_NTOA_LEN long
  *
  *   IPv6 addresses are enclosed into square brackets, i.e. "[IPv6]"
  *   writes error message into the buffer on error
+ *
+ *   returns ip_str
  */
-const char *ip_ntoa(const IP *ip);
+const char *ip_ntoa(const IP *ip, char *ip_str, size_t length);
 
 /*
  * ip_parse_addr
@@ -355,6 +360,9 @@ int set_socket_dualstack(sock_t sock);
 /* return current monotonic time in milliseconds (ms). */
 uint64_t current_time_monotonic(void);
 
+/* return current monotonic time in microseconds (us), for timing things shorter than a ms. */
+uint64_t current_time_monotonic_us(void);
+
 /* Basic network functions: */
 
 /* Function to send packet(data) of length length to ip_port. */
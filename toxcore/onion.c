@@ -111,12 +111,13 @@ static int ipport_unpack(IP_Port *target, const uint8_t *data, unsigned int data
  * return -1 on failure.
  * return 0 on success.
  */
-int create_onion_path(const DHT *dht, Onion_Path *new_path, const Node_format *nodes)
+int create_onion_path(DHT *dht, Onion_Path *new_path, const Node_format *nodes)
 {
     if (!new_path || !nodes)
         return -1;
 
-    encrypt_precompute(nodes[0].public_key, dht->self_secret_key, new_path->shared_key1);
+    /* The first hop uses our DHT key, the shared key is likely cached already. */
+    DHT_get_shared_key_sent(dht, new_path->shared_key1, nodes[0].public_key);
     memcpy(new_path->public_key1, dht->self_public_key, crypto_box_PUBLICKEYBYTES);
 
     uint8_t random_public_key[crypto_box_PUBLICKEYBYTES];
@@ -129,6 +130,7 @@ int create_onion_path(const DHT *dht, Onion_Path *new_path, const Node_format *n
     crypto_box_keypair(random_public_key, random_secret_key);
     encrypt_precompute(nodes[2].public_key, random_secret_key, new_path->shared_key3);
     memcpy(new_path->public_key3, random_public_key, crypto_box_PUBLICKEYBYTES);
+    sodium_memzero(random_secret_key, sizeof(random_secret_key));
 
     new_path->ip_port1 = nodes[0].ip_port;
     new_path->ip_port2 = nodes[1].ip_port;
@@ -138,6 +140,11 @@ int create_onion_path(const DHT *dht, Onion_Path *new_path, const Node_format *n
     memcpy(new_path->node_public_key2, nodes[1].public_key, crypto_box_PUBLICKEYBYTES);
     memcpy(new_path->node_public_key3, nodes[2].public_key, crypto_box_PUBLICKEYBYTES);
 
+    ipport_pack(new_path->layer2_header, &new_path->ip_port2);
+    memcpy(new_path->layer2_header + SIZE_IPPORT, new_path->public_key2, crypto_box_PUBLICKEYBYTES);
+    ipport_pack(new_path->layer3_header, &new_path->ip_port3);
+    memcpy(new_path->layer3_header + SIZE_IPPORT, new_path->public_key3, crypto_box_PUBLICKEYBYTES);
+
     return 0;
 }
 
@@ -161,6 +168,51 @@ int onion_path_to_nodes(Node_format *nodes, unsigned int num_nodes, const Onion_
     return 0;
 }
 
+/* Encrypt the length bytes at data + crypto_box_MACBYTES, the encrypted layer is written at data.
+ *
+ * return -1 on failure.
+ * return length of the encrypted layer on success.
+ */
+static int encrypt_layer_in_place(const uint8_t *shared_key, const uint8_t *nonce, uint8_t *data, uint16_t length)
+{
+    Crypto_Batch_Entry entry = {shared_key, nonce, data + crypto_box_MACBYTES, length, data, -1};
+
+    if (encrypt_data_symmetric_batch(&entry, 1) != 1)
+        return -1;
+
+    return entry.out_length;
+}
+
+/* Write the plain text of the first layer of an onion packet for data of length to dest in out.
+ * The inner layers are encrypted in place, out must have room for SIZE_IPPORT + SEND_BASE * 2 + length bytes.
+ *
+ * return -1 on failure.
+ * return length of the first layer on success.
+ */
+static int create_onion_layers(uint8_t *out, const Onion_Path *path, const uint8_t *nonce, IP_Port dest,
+                               const uint8_t *data, uint16_t length)
+{
+    uint8_t *layer2 = out + sizeof(path->layer2_header);
+    uint8_t *layer3 = layer2 + crypto_box_MACBYTES + sizeof(path->layer3_header);
+
+    memcpy(out, path->layer2_header, sizeof(path->layer2_header));
+    memcpy(layer2 + crypto_box_MACBYTES, path->layer3_header, sizeof(path->layer3_header));
+    ipport_pack(layer3 + crypto_box_MACBYTES, &dest);
+    memcpy(layer3 + crypto_box_MACBYTES + SIZE_IPPORT, data, length);
+
+    int len = encrypt_layer_in_place(path->shared_key3, nonce, layer3, SIZE_IPPORT + length);
+
+    if (len != SIZE_IPPORT + length + crypto_box_MACBYTES)
+        return -1;
+
+    len = encrypt_layer_in_place(path->shared_key2, nonce, layer2, sizeof(path->layer3_header) + len);
+
+    if (len != SIZE_IPPORT + SEND_BASE + length + crypto_box_MACBYTES)
+        return -1;
+
+    return sizeof(path->layer2_header) + len;
+}
+
 /* Create a onion packet.
  *
  * Use Onion_Path path to create packet for data of length to dest.
@@ -176,39 +228,19 @@ int create_onion_packet(uint8_t *packet, uint16_t max_packet_length, const Onion
     if (1 + length + SEND_1 > max_packet_length || length == 0)
         return -1;
 
-    uint8_t step1[SIZE_IPPORT + length];
+    uint8_t *nonce = packet + 1;
+    uint8_t *layer1 = packet + 1 + crypto_box_NONCEBYTES + crypto_box_PUBLICKEYBYTES;
 
-    ipport_pack(step1, &dest);
-    memcpy(step1 + SIZE_IPPORT, data, length);
-
-    uint8_t nonce[crypto_box_NONCEBYTES];
+    packet[0] = NET_PACKET_ONION_SEND_INITIAL;
     random_nonce(nonce);
+    memcpy(packet + 1 + crypto_box_NONCEBYTES, path->public_key1, crypto_box_PUBLICKEYBYTES);
 
-    uint8_t step2[SIZE_IPPORT + SEND_BASE + length];
-    ipport_pack(step2, &path->ip_port3);
-    memcpy(step2 + SIZE_IPPORT, path->public_key3, crypto_box_PUBLICKEYBYTES);
-
-    int len = encrypt_data_symmetric(path->shared_key3, nonce, step1, sizeof(step1),
-                                     step2 + SIZE_IPPORT + crypto_box_PUBLICKEYBYTES);
-
-    if (len != SIZE_IPPORT + length + crypto_box_MACBYTES)
-        return -1;
-
-    uint8_t step3[SIZE_IPPORT + SEND_BASE * 2 + length];
-    ipport_pack(step3, &path->ip_port2);
-    memcpy(step3 + SIZE_IPPORT, path->public_key2, crypto_box_PUBLICKEYBYTES);
-    len = encrypt_data_symmetric(path->shared_key2, nonce, step2, sizeof(step2),
-                                 step3 + SIZE_IPPORT + crypto_box_PUBLICKEYBYTES);
+    int len = create_onion_layers(layer1 + crypto_box_MACBYTES, path, nonce, dest, data, length);
 
-    if (len != SIZE_IPPORT + SEND_BASE + length + crypto_box_MACBYTES)
+    if (len == -1)
         return -1;
 
-    packet[0] = NET_PACKET_ONION_SEND_INITIAL;
-    memcpy(packet + 1, nonce, crypto_box_NONCEBYTES);
-    memcpy(packet + 1 + crypto_box_NONCEBYTES, path->public_key1, crypto_box_PUBLICKEYBYTES);
-
-    len = encrypt_data_symmetric(path->shared_key1, nonce, step3, sizeof(step3),
-                                 packet + 1 + crypto_box_NONCEBYTES + crypto_box_PUBLICKEYBYTES);
+    len = encrypt_layer_in_place(path->shared_key1, nonce, layer1, len);
 
     if (len != SIZE_IPPORT + SEND_BASE * 2 + length + crypto_box_MACBYTES)
         return -1;
@@ -231,35 +263,14 @@ int create_onion_packet_tcp(uint8_t *packet, uint16_t max_packet_length, const O
     if (crypto_box_NONCEBYTES + SIZE_IPPORT + SEND_BASE * 2 + length > max_packet_length || length == 0)
         return -1;
 
-    uint8_t step1[SIZE_IPPORT + length];
-
-    ipport_pack(step1, &dest);
-    memcpy(step1 + SIZE_IPPORT, data, length);
-
-    uint8_t nonce[crypto_box_NONCEBYTES];
-    random_nonce(nonce);
-
-    uint8_t step2[SIZE_IPPORT + SEND_BASE + length];
-    ipport_pack(step2, &path->ip_port3);
-    memcpy(step2 + SIZE_IPPORT, path->public_key3, crypto_box_PUBLICKEYBYTES);
+    random_nonce(packet);
 
-    int len = encrypt_data_symmetric(path->shared_key3, nonce, step1, sizeof(step1),
-                                     step2 + SIZE_IPPORT + crypto_box_PUBLICKEYBYTES);
+    int len = create_onion_layers(packet + crypto_box_NONCEBYTES, path, packet, dest, data, length);
 
-    if (len != SIZE_IPPORT + length + crypto_box_MACBYTES)
-        return -1;
-
-    ipport_pack(packet + crypto_box_NONCEBYTES, &path->ip_port2);
-    memcpy(packet + crypto_box_NONCEBYTES + SIZE_IPPORT, path->public_key2, crypto_box_PUBLICKEYBYTES);
-    len = encrypt_data_symmetric(path->shared_key2, nonce, step2, sizeof(step2),
-                                 packet + crypto_box_NONCEBYTES + SIZE_IPPORT + crypto_box_PUBLICKEYBYTES);
-
-    if (len != SIZE_IPPORT + SEND_BASE + length + crypto_box_MACBYTES)
+    if (len == -1)
         return -1;
 
-    memcpy(packet, nonce, crypto_box_NONCEBYTES);
-
-    return crypto_box_NONCEBYTES + SIZE_IPPORT + crypto_box_PUBLICKEYBYTES + len;
+    return crypto_box_NONCEBYTES + len;
 }
 
 /* Create and send a onion packet.
@@ -306,6 +317,58 @@ int send_onion_response(Networking_Core *net, IP_Port dest, const uint8_t *data,
     return 0;
 }
 
+/* Relayed packets are built in a single buffer: each layer is decrypted straight into the
+ * outgoing packet so that the packed ip_port in front of the plain text ends where the
+ * forwarded data must start, and the return block is encrypted in place in the tailroom.
+ */
+#define RELAY_SEND_1_OFFSET (1 + crypto_box_NONCEBYTES - SIZE_IPPORT)
+
+/* Encrypt the ret_length bytes at ret_part + crypto_box_NONCEBYTES + crypto_box_MACBYTES
+ * into a return block starting at ret_part.
+ *
+ * return -1 on failure.
+ * return length of the return block on success.
+ */
+static int encrypt_return_in_place(const Onion *onion, uint8_t *ret_part, uint16_t ret_length)
+{
+    new_nonce(ret_part);
+    int len = encrypt_layer_in_place(onion->secret_symmetric_key, ret_part, ret_part + crypto_box_NONCEBYTES,
+                                     ret_length);
+
+    if (len != ret_length + crypto_box_MACBYTES)
+        return -1;
+
+    return crypto_box_NONCEBYTES + len;
+}
+
+/* Forward the plain text of length len of a first layer, found at data + RELAY_SEND_1_OFFSET.
+ * data must be ONION_MAX_PACKET_SIZE big and len must have been checked by the caller.
+ */
+static int relay_send_1(const Onion *onion, uint8_t *data, uint16_t len, IP_Port source, const uint8_t *nonce)
+{
+    IP_Port send_to;
+
+    if (ipport_unpack(&send_to, data + RELAY_SEND_1_OFFSET, len, 0) == -1)
+        return 1;
+
+    data[0] = NET_PACKET_ONION_SEND_1;
+    memcpy(data + 1, nonce, crypto_box_NONCEBYTES);
+    uint16_t data_len = 1 + crypto_box_NONCEBYTES + (len - SIZE_IPPORT);
+    uint8_t *ret_part = data + data_len;
+    ipport_pack(ret_part + crypto_box_NONCEBYTES + crypto_box_MACBYTES, &source);
+    int ret_len = encrypt_return_in_place(onion, ret_part, SIZE_IPPORT);
+
+    if (ret_len != RETURN_1)
+        return 1;
+
+    data_len += ret_len;
+
+    if ((uint32_t)sendpacket(onion->net, send_to, data, data_len) != data_len)
+        return 1;
+
+    return 0;
+}
+
 static int handle_send_initial(void *object, IP_Port source, const uint8_t *packet, uint16_t length)
 {
     Onion *onion = object;
@@ -318,16 +381,17 @@ static int handle_send_initial(void *object, IP_Port source, const uint8_t *pack
 
     change_symmetric_key(onion);
 
-    uint8_t plain[ONION_MAX_PACKET_SIZE];
+    uint8_t data[ONION_MAX_PACKET_SIZE];
     uint8_t shared_key[crypto_box_BEFORENMBYTES];
     get_shared_key(&onion->shared_keys_1, shared_key, onion->dht->self_secret_key, packet + 1 + crypto_box_NONCEBYTES);
     int len = decrypt_data_symmetric(shared_key, packet + 1, packet + 1 + crypto_box_NONCEBYTES + crypto_box_PUBLICKEYBYTES,
-                                     length - (1 + crypto_box_NONCEBYTES + crypto_box_PUBLICKEYBYTES), plain);
+                                     length - (1 + crypto_box_NONCEBYTES + crypto_box_PUBLICKEYBYTES),
+                                     data + RELAY_SEND_1_OFFSET);
 
     if (len != length - (1 + crypto_box_NONCEBYTES + crypto_box_PUBLICKEYBYTES + crypto_box_MACBYTES))
         return 1;
 
-    return onion_send_1(onion, plain, len, source, packet + 1);
+    return relay_send_1(onion, data, len, source, packet + 1);
 }
 
 int onion_send_1(const Onion *onion, const uint8_t *plain, uint16_t len, IP_Port source, const uint8_t *nonce)
@@ -338,33 +402,9 @@ int onion_send_1(const Onion *onion, const uint8_t *plain, uint16_t len, IP_Port
     if (len <= SIZE_IPPORT + SEND_BASE * 2)
         return 1;
 
-    IP_Port send_to;
-
-    if (ipport_unpack(&send_to, plain, len, 0) == -1)
-        return 1;
-
-    uint8_t ip_port[SIZE_IPPORT];
-    ipport_pack(ip_port, &source);
-
     uint8_t data[ONION_MAX_PACKET_SIZE];
-    data[0] = NET_PACKET_ONION_SEND_1;
-    memcpy(data + 1, nonce, crypto_box_NONCEBYTES);
-    memcpy(data + 1 + crypto_box_NONCEBYTES, plain + SIZE_IPPORT, len - SIZE_IPPORT);
-    uint16_t data_len = 1 + crypto_box_NONCEBYTES + (len - SIZE_IPPORT);
-    uint8_t *ret_part = data + data_len;
-    new_nonce(ret_part);
-    len = encrypt_data_symmetric(onion->secret_symmetric_key, ret_part, ip_port, SIZE_IPPORT,
-                                 ret_part + crypto_box_NONCEBYTES);
-
-    if (len != SIZE_IPPORT + crypto_box_MACBYTES)
-        return 1;
-
-    data_len += crypto_box_NONCEBYTES + len;
-
-    if ((uint32_t)sendpacket(onion->net, send_to, data, data_len) != data_len)
-        return 1;
-
-    return 0;
+    memcpy(data + RELAY_SEND_1_OFFSET, plain, len);
+    return relay_send_1(onion, data, len, source, nonce);
 }
 
 static int handle_send_1(void *object, IP_Port source, const uint8_t *packet, uint16_t length)
@@ -379,37 +419,34 @@ static int handle_send_1(void *object, IP_Port source, const uint8_t *packet, ui
 
     change_symmetric_key(onion);
 
-    uint8_t plain[ONION_MAX_PACKET_SIZE];
+    uint8_t data[ONION_MAX_PACKET_SIZE];
     uint8_t shared_key[crypto_box_BEFORENMBYTES];
     get_shared_key(&onion->shared_keys_2, shared_key, onion->dht->self_secret_key, packet + 1 + crypto_box_NONCEBYTES);
     int len = decrypt_data_symmetric(shared_key, packet + 1, packet + 1 + crypto_box_NONCEBYTES + crypto_box_PUBLICKEYBYTES,
-                                     length - (1 + crypto_box_NONCEBYTES + crypto_box_PUBLICKEYBYTES + RETURN_1), plain);
+                                     length - (1 + crypto_box_NONCEBYTES + crypto_box_PUBLICKEYBYTES + RETURN_1),
+                                     data + RELAY_SEND_1_OFFSET);
 
     if (len != length - (1 + crypto_box_NONCEBYTES + crypto_box_PUBLICKEYBYTES + RETURN_1 + crypto_box_MACBYTES))
         return 1;
 
     IP_Port send_to;
 
-    if (ipport_unpack(&send_to, plain, len, 0) == -1)
+    if (ipport_unpack(&send_to, data + RELAY_SEND_1_OFFSET, len, 0) == -1)
         return 1;
 
-    uint8_t data[ONION_MAX_PACKET_SIZE];
     data[0] = NET_PACKET_ONION_SEND_2;
     memcpy(data + 1, packet + 1, crypto_box_NONCEBYTES);
-    memcpy(data + 1 + crypto_box_NONCEBYTES, plain + SIZE_IPPORT, len - SIZE_IPPORT);
     uint16_t data_len = 1 + crypto_box_NONCEBYTES + (len - SIZE_IPPORT);
     uint8_t *ret_part = data + data_len;
-    new_nonce(ret_part);
-    uint8_t ret_data[RETURN_1 + SIZE_IPPORT];
+    uint8_t *ret_data = ret_part + crypto_box_NONCEBYTES + crypto_box_MACBYTES;
     ipport_pack(ret_data, &source);
     memcpy(ret_data + SIZE_IPPORT, packet + (length - RETURN_1), RETURN_1);
-    len = encrypt_data_symmetric(onion->secret_symmetric_key, ret_part, ret_data, sizeof(ret_data),
-                                 ret_part + crypto_box_NONCEBYTES);
+    int ret_len = encrypt_return_in_place(onion, ret_part, SIZE_IPPORT + RETURN_1);
 
-    if (len != RETURN_2 - crypto_box_NONCEBYTES)
+    if (ret_len != RETURN_2)
         return 1;
 
-    data_len += crypto_box_NONCEBYTES + len;
+    data_len += ret_len;
 
     if ((uint32_t)sendpacket(onion->net, send_to, data, data_len) != data_len)
         return 1;
@@ -443,21 +480,19 @@ static int handle_send_2(void *object, IP_Port source, const uint8_t *packet, ui
     if (ipport_unpack(&send_to, plain, len, 0) == -1)
         return 1;
 
-    uint8_t data[ONION_MAX_PACKET_SIZE];
-    memcpy(data, plain + SIZE_IPPORT, len - SIZE_IPPORT);
+    /* The forwarded data is the plain text after the packed ip_port. */
+    uint8_t *data = plain + SIZE_IPPORT;
     uint16_t data_len = (len - SIZE_IPPORT);
-    uint8_t *ret_part = data + (len - SIZE_IPPORT);
-    new_nonce(ret_part);
-    uint8_t ret_data[RETURN_2 + SIZE_IPPORT];
+    uint8_t *ret_part = data + data_len;
+    uint8_t *ret_data = ret_part + crypto_box_NONCEBYTES + crypto_box_MACBYTES;
     ipport_pack(ret_data, &source);
     memcpy(ret_data + SIZE_IPPORT, packet + (length - RETURN_2), RETURN_2);
-    len = encrypt_data_symmetric(onion->secret_symmetric_key, ret_part, ret_data, sizeof(ret_data),
-                                 ret_part + crypto_box_NONCEBYTES);
+    int ret_len = encrypt_return_in_place(onion, ret_part, SIZE_IPPORT + RETURN_2);
 
-    if (len != RETURN_3 - crypto_box_NONCEBYTES)
+    if (ret_len != RETURN_3)
         return 1;
 
-    data_len += RETURN_3;
+    data_len += ret_len;
 
     if ((uint32_t)sendpacket(onion->net, send_to, data, data_len) != data_len)
         return 1;
@@ -478,11 +513,12 @@ static int handle_recv_3(void *object, IP_Port source, const uint8_t *packet, ui
 
     change_symmetric_key(onion);
 
-    uint8_t plain[SIZE_IPPORT + RETURN_2];
+    /* Decrypted so that the inner return block is already in place in the outgoing packet. */
+    uint8_t plain[SIZE_IPPORT + ONION_MAX_PACKET_SIZE];
     int len = decrypt_data_symmetric(onion->secret_symmetric_key, packet + 1, packet + 1 + crypto_box_NONCEBYTES,
                                      SIZE_IPPORT + RETURN_2 + crypto_box_MACBYTES, plain);
 
-    if ((uint32_t)len != sizeof(plain))
+    if ((uint32_t)len != SIZE_IPPORT + RETURN_2)
         return 1;
 
     IP_Port send_to;
@@ -490,9 +526,8 @@ static int handle_recv_3(void *object, IP_Port source, const uint8_t *packet, ui
     if (ipport_unpack(&send_to, plain, len, 0) == -1)
         return 1;
 
-    uint8_t data[ONION_MAX_PACKET_SIZE];
+    uint8_t *data = plain + SIZE_IPPORT - 1;
     data[0] = NET_PACKET_ONION_RECV_2;
-    memcpy(data + 1, plain + SIZE_IPPORT, RETURN_2);
     memcpy(data + 1 + RETURN_2, packet + 1 + RETURN_3, length - (1 + RETURN_3));
     uint16_t data_len = 1 + RETURN_2 + (length - (1 + RETURN_3));
 
@@ -514,11 +549,11 @@ static int handle_recv_2(void *object, IP_Port source, const uint8_t *packet, ui
 
     change_symmetric_key(onion);
 
-    uint8_t plain[SIZE_IPPORT + RETURN_1];
+    uint8_t plain[SIZE_IPPORT + ONION_MAX_PACKET_SIZE];
     int len = decrypt_data_symmetric(onion->secret_symmetric_key, packet + 1, packet + 1 + crypto_box_NONCEBYTES,
                                      SIZE_IPPORT + RETURN_1 + crypto_box_MACBYTES, plain);
 
-    if ((uint32_t)len != sizeof(plain))
+    if ((uint32_t)len != SIZE_IPPORT + RETURN_1)
         return 1;
 
     IP_Port send_to;
@@ -526,9 +561,8 @@ static int handle_recv_2(void *object, IP_Port source, const uint8_t *packet, ui
     if (ipport_unpack(&send_to, plain, len, 0) == -1)
         return 1;
 
-    uint8_t data[ONION_MAX_PACKET_SIZE];
+    uint8_t *data = plain + SIZE_IPPORT - 1;
     data[0] = NET_PACKET_ONION_RECV_1;
-    memcpy(data + 1, plain + SIZE_IPPORT, RETURN_1);
     memcpy(data + 1 + RETURN_1, packet + 1 + RETURN_2, length - (1 + RETURN_2));
     uint16_t data_len = 1 + RETURN_1 + (length - (1 + RETURN_2));
 
@@ -75,6 +75,11 @@ typedef struct {
     IP_Port     ip_port3;
     uint8_t     node_public_key3[crypto_box_PUBLICKEYBYTES];
 
+    /* Packed (ip_port, public_key) that start the plain text of the second and third layer,
+     * computed once in create_onion_path() and copied as is into every packet. */
+    uint8_t layer2_header[SIZE_IPPORT + crypto_box_PUBLICKEYBYTES];
+    uint8_t layer3_header[SIZE_IPPORT + crypto_box_PUBLICKEYBYTES];
+
     uint32_t path_num;
 } Onion_Path;
 
@@ -87,7 +92,7 @@ typedef struct {
  * return -1 on failure.
  * return 0 on success.
  */
-int create_onion_path(const DHT *dht, Onion_Path *new_path, const Node_format *nodes);
+int create_onion_path(DHT *dht, Onion_Path *new_path, const Node_format *nodes);
 
 /* Dump nodes in onion path to nodes of length num_nodes;
  *
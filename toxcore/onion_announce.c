@@ -200,51 +200,184 @@ static void generate_ping_id(const Onion_Announce *onion_a, uint64_t time, const
     crypto_hash_sha256(ping_id, data, sizeof(data));
 }
 
-/* check if public key is in entries list
- *
- * return -1 if no
- * return position in list if yes
+/* Number of entries checked for timeouts each time an announce is added. */
+#define ANNOUNCE_SWEEP_ENTRIES 4
+
+static uint32_t index_hash(const Onion_Announce *onion_a, const uint8_t *public_key)
+{
+    uint64_t key;
+    memcpy(&key, public_key, sizeof(key));
+    return (((key ^ onion_a->index_seed) * 11400714819323198485ULL) >> 32) & onion_a->index_mask;
+}
+
+/* return position of public_key in the index table.
+ * return -1 if it is not in it.
  */
-static int in_entries(const Onion_Announce *onion_a, const uint8_t *public_key)
+static int64_t index_find(const Onion_Announce *onion_a, const uint8_t *public_key)
 {
-    unsigned int i;
+    uint32_t i = index_hash(onion_a, public_key);
 
-    for (i = 0; i < ONION_ANNOUNCE_MAX_ENTRIES; ++i) {
-        if (!is_timeout(onion_a->entries[i].time, ONION_ANNOUNCE_TIMEOUT)
-                && public_key_cmp(onion_a->entries[i].public_key, public_key) == 0)
+    while (onion_a->index[i]) {
+        if (public_key_cmp(onion_a->entries[onion_a->index[i] - 1].public_key, public_key) == 0)
             return i;
+
+        i = (i + 1) & onion_a->index_mask;
     }
 
     return -1;
 }
 
-static uint8_t cmp_public_key[crypto_box_PUBLICKEYBYTES];
-static int cmp_entry(const void *a, const void *b)
+static void index_add(Onion_Announce *onion_a, uint32_t pos)
 {
-    Onion_Announce_Entry entry1, entry2;
-    memcpy(&entry1, a, sizeof(Onion_Announce_Entry));
-    memcpy(&entry2, b, sizeof(Onion_Announce_Entry));
-    int t1 = is_timeout(entry1.time, ONION_ANNOUNCE_TIMEOUT);
-    int t2 = is_timeout(entry2.time, ONION_ANNOUNCE_TIMEOUT);
+    uint32_t i = index_hash(onion_a, onion_a->entries[pos].public_key);
+
+    while (onion_a->index[i])
+        i = (i + 1) & onion_a->index_mask;
+
+    onion_a->index[i] = pos + 1;
+}
+
+/* Remove position i of the index table, moving back the following entries of the probe sequence. */
+static void index_remove(Onion_Announce *onion_a, uint32_t i)
+{
+    uint32_t j = i;
+
+    while (1) {
+        onion_a->index[i] = 0;
+        uint32_t k;
+
+        do {
+            j = (j + 1) & onion_a->index_mask;
+
+            if (!onion_a->index[j])
+                return;
+
+            k = index_hash(onion_a, onion_a->entries[onion_a->index[j] - 1].public_key);
+        } while (i <= j ? (i < k && k <= j) : (i < k || k <= j));
+
+        onion_a->index[i] = onion_a->index[j];
+        i = j;
+    }
+}
+
+/* return the position in the sorted list at which public_key is or would be inserted. */
+static uint32_t sorted_position(const Onion_Announce *onion_a, const uint8_t *public_key)
+{
+    uint32_t low = 0, high = onion_a->entries_count;
+
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+
+        if (id_closest(onion_a->dht->self_public_key, onion_a->entries[onion_a->sorted[mid]].public_key, public_key) == 1) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    return low;
+}
+
+/* Remove the entry at pos, the last entry is moved to pos. */
+static void remove_entry(Onion_Announce *onion_a, uint32_t pos)
+{
+    const uint8_t *public_key = onion_a->entries[pos].public_key;
+    uint32_t last = onion_a->entries_count - 1;
+    int64_t i = index_find(onion_a, public_key);
+
+    if (i < 0)
+        return;
+
+    index_remove(onion_a, i);
+
+    uint32_t s = sorted_position(onion_a, public_key);
+    memmove(onion_a->sorted + s, onion_a->sorted + s + 1, (last - s) * sizeof(uint32_t));
+
+    if (pos != last) {
+        onion_a->entries[pos] = onion_a->entries[last];
+        i = index_find(onion_a, onion_a->entries[pos].public_key);
+
+        if (i >= 0)
+            onion_a->index[i] = pos + 1;
+
+        /* The sorted list is one shorter now, search it as such. */
+        --onion_a->entries_count;
+        onion_a->sorted[sorted_position(onion_a, onion_a->entries[pos].public_key)] = pos;
+    } else {
+        --onion_a->entries_count;
+    }
+
+    sodium_memzero(&onion_a->entries[last], sizeof(Onion_Announce_Entry));
+}
+
+/* Remove some timed out entries. */
+static void sweep_entries(Onion_Announce *onion_a)
+{
+    unsigned int i;
+
+    for (i = 0; i < ANNOUNCE_SWEEP_ENTRIES && onion_a->entries_count; ++i) {
+        if (onion_a->sweep_position >= onion_a->entries_count)
+            onion_a->sweep_position = 0;
+
+        if (is_timeout(onion_a->entries[onion_a->sweep_position].time, ONION_ANNOUNCE_TIMEOUT)) {
+            remove_entry(onion_a, onion_a->sweep_position);
+        } else {
+            ++onion_a->sweep_position;
+        }
+    }
+}
 
-    if (t1 && t2)
+/* Remove one timed out entry, searching on from where the sweep stopped.
+ *
+ * Entries only time out when unix_time() changes, so a search through all of them
+ * that found none isn't repeated in the same second.
+ *
+ * return 1 if an entry was removed.
+ * return 0 if none is timed out.
+ */
+static _Bool remove_timed_out_entry(Onion_Announce *onion_a)
+{
+    if (onion_a->timed_out_search_time == unix_time())
         return 0;
 
-    if (t1)
-        return -1;
+    uint32_t i;
 
-    if (t2)
-        return 1;
+    for (i = 0; i < onion_a->entries_count; ++i) {
+        if (onion_a->sweep_position >= onion_a->entries_count)
+            onion_a->sweep_position = 0;
 
-    int close = id_closest(cmp_public_key, entry1.public_key, entry2.public_key);
+        if (is_timeout(onion_a->entries[onion_a->sweep_position].time, ONION_ANNOUNCE_TIMEOUT)) {
+            remove_entry(onion_a, onion_a->sweep_position);
+            return 1;
+        }
 
-    if (close == 1)
-        return 1;
+        ++onion_a->sweep_position;
+    }
+
+    onion_a->timed_out_search_time = unix_time();
+    return 0;
+}
+
+/* check if public key is in entries list
+ *
+ * return -1 if no
+ * return position in list if yes
+ */
+static int in_entries(Onion_Announce *onion_a, const uint8_t *public_key)
+{
+    int64_t i = index_find(onion_a, public_key);
 
-    if (close == 2)
+    if (i == -1)
         return -1;
 
-    return 0;
+    uint32_t pos = onion_a->index[i] - 1;
+
+    if (is_timeout(onion_a->entries[pos].time, ONION_ANNOUNCE_TIMEOUT)) {
+        remove_entry(onion_a, pos);
+        return -1;
+    }
+
+    return pos;
 }
 
 /* add entry to entries list
@@ -255,35 +388,36 @@ static int cmp_entry(const void *a, const void *b)
 static int add_to_entries(Onion_Announce *onion_a, IP_Port ret_ip_port, const uint8_t *public_key,
                           const uint8_t *data_public_key, const uint8_t *ret)
 {
+    sweep_entries(onion_a);
 
     int pos = in_entries(onion_a, public_key);
 
-    unsigned int i;
-
     if (pos == -1) {
-        for (i = 0; i < ONION_ANNOUNCE_MAX_ENTRIES; ++i) {
-            if (is_timeout(onion_a->entries[i].time, ONION_ANNOUNCE_TIMEOUT))
-                pos = i;
+        /* A full store makes room with a timed out entry first, then with the farthest one. */
+        if (onion_a->entries_count == onion_a->entries_capacity && !remove_timed_out_entry(onion_a)) {
+            uint32_t farthest = onion_a->sorted[onion_a->entries_count - 1];
+
+            if (id_closest(onion_a->dht->self_public_key, public_key, onion_a->entries[farthest].public_key) != 1)
+                return -1;
+
+            remove_entry(onion_a, farthest);
         }
-    }
 
-    if (pos == -1) {
-        if (id_closest(onion_a->dht->self_public_key, public_key, onion_a->entries[0].public_key) == 1)
-            pos = 0;
-    }
+        pos = onion_a->entries_count;
+        memcpy(onion_a->entries[pos].public_key, public_key, crypto_box_PUBLICKEYBYTES);
 
-    if (pos == -1)
-        return -1;
+        uint32_t s = sorted_position(onion_a, public_key);
+        memmove(onion_a->sorted + s + 1, onion_a->sorted + s, (onion_a->entries_count - s) * sizeof(uint32_t));
+        onion_a->sorted[s] = pos;
+        ++onion_a->entries_count;
+        index_add(onion_a, pos);
+    }
 
-    memcpy(onion_a->entries[pos].public_key, public_key, crypto_box_PUBLICKEYBYTES);
     onion_a->entries[pos].ret_ip_port = ret_ip_port;
     memcpy(onion_a->entries[pos].ret, ret, ONION_RETURN_3);
     memcpy(onion_a->entries[pos].data_public_key, data_public_key, crypto_box_PUBLICKEYBYTES);
     onion_a->entries[pos].time = unix_time();
-
-    memcpy(cmp_public_key, onion_a->dht->self_public_key, crypto_box_PUBLICKEYBYTES);
-    qsort(onion_a->entries, ONION_ANNOUNCE_MAX_ENTRIES, sizeof(Onion_Announce_Entry), cmp_entry);
-    return in_entries(onion_a, public_key);
+    return pos;
 }
 
 static int handle_announce_request(void *object, IP_Port source, const uint8_t *packet, uint16_t length)
@@ -408,7 +542,12 @@ static int handle_data_request(void *object, IP_Port source, const uint8_t *pack
 
 Onion_Announce *new_onion_announce(DHT *dht)
 {
-    if (dht == NULL)
+    return new_onion_announce_ex(dht, ONION_ANNOUNCE_MAX_ENTRIES);
+}
+
+Onion_Announce *new_onion_announce_ex(DHT *dht, uint32_t max_entries)
+{
+    if (dht == NULL || max_entries == 0 || max_entries > (1 << 30))
         return NULL;
 
     Onion_Announce *onion_a = calloc(1, sizeof(Onion_Announce));
@@ -416,6 +555,27 @@ Onion_Announce *new_onion_announce(DHT *dht)
     if (onion_a == NULL)
         return NULL;
 
+    uint32_t index_size = 1;
+
+    while (index_size < max_entries * 2)
+        index_size <<= 1;
+
+    onion_a->entries = calloc(max_entries, sizeof(Onion_Announce_Entry));
+    onion_a->sorted = calloc(max_entries, sizeof(uint32_t));
+    onion_a->index = calloc(index_size, sizeof(uint32_t));
+
+    if (!onion_a->entries || !onion_a->sorted || !onion_a->index) {
+        free(onion_a->entries);
+        free(onion_a->sorted);
+        free(onion_a->index);
+        free(onion_a);
+        return NULL;
+    }
+
+    onion_a->entries_capacity = max_entries;
+    onion_a->index_mask = index_size - 1;
+    onion_a->index_seed = random_64b();
+
     onion_a->dht = dht;
     onion_a->net = dht->net;
     new_symmetric_key(onion_a->secret_bytes);
@@ -433,5 +593,8 @@ void kill_onion_announce(Onion_Announce *onion_a)
 
     networking_registerhandler(onion_a->net, NET_PACKET_ANNOUNCE_REQUEST, NULL, NULL);
     networking_registerhandler(onion_a->net, NET_PACKET_ONION_DATA_REQUEST, NULL, NULL);
+    free(onion_a->entries);
+    free(onion_a->sorted);
+    free(onion_a->index);
     free(onion_a);
 }
@@ -26,6 +26,8 @@
 #include "onion.h"
 
 #define ONION_ANNOUNCE_MAX_ENTRIES 160
+/* Announce store size used by bootstrap nodes. */
+#define ONION_ANNOUNCE_BOOTSTRAP_MAX_ENTRIES 16384
 #define ONION_ANNOUNCE_TIMEOUT 300
 #define ONION_PING_ID_SIZE crypto_hash_sha256_BYTES
 
@@ -56,7 +58,27 @@ typedef struct {
 struct Onion_Announce {
     DHT     *dht;
     Networking_Core *net;
-    Onion_Announce_Entry entries[ONION_ANNOUNCE_MAX_ENTRIES];
+
+    /* Announced nodes, the used ones packed at the start. Removing an entry moves the last one
+     * into its place, so a position is only good until the next entry is added or removed. */
+    Onion_Announce_Entry *entries;
+    uint32_t entries_capacity;
+    uint32_t entries_count;
+
+    /* Positions of the used entries, closest public key to ours first. */
+    uint32_t *sorted;
+
+    /* Open addressing hash table of public key -> (position in entries + 1), 0 means empty. */
+    uint32_t *index;
+    uint32_t index_mask;
+    uint64_t index_seed;
+
+    /* Next position in entries checked for timed out entries. */
+    uint32_t sweep_position;
+
+    /* unix_time() of the last search through all the entries that found none timed out. */
+    uint64_t timed_out_search_time;
+
     /* This is crypto_box_KEYBYTES long just so we can use new_symmetric_key() to fill it */
     uint8_t secret_bytes[crypto_box_KEYBYTES];
 
@@ -133,7 +155,12 @@ int send_data_request(Networking_Core *net, const Onion_Path *path, IP_Port dest
                       const uint8_t *encrypt_public_key, const uint8_t *nonce, const uint8_t *data, uint16_t length);
 
 
+/* Create a new Onion_Announce that stores at most max_entries announced nodes.
+ *
+ * new_onion_announce() uses ONION_ANNOUNCE_MAX_ENTRIES.
+ */
 Onion_Announce *new_onion_announce(DHT *dht);
+Onion_Announce *new_onion_announce_ex(DHT *dht, uint32_t max_entries);
 
 void kill_onion_announce(Onion_Announce *onion_a);
 
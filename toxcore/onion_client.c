@@ -248,12 +248,14 @@ static int random_path(const Onion_Client *onion_c, Onion_Client_Paths *onion_pa
             path_num += pathnum;
 
             onion_paths->paths[pathnum].path_num = path_num;
+            ++onion_paths->num_paths_built;
         } else {
             pathnum = n;
         }
     }
 
     ++onion_paths->last_path_used_times[pathnum];
+    ++onion_paths->num_path_uses;
     onion_paths->last_path_used[pathnum] = unix_time();
     memcpy(path, &onion_paths->paths[pathnum], sizeof(Onion_Path));
     return 0;
@@ -441,14 +443,117 @@ static int client_send_announce_request(Onion_Client *onion_c, uint32_t num, IP_
     return send_onion_packet_tcp_udp(onion_c, &path, dest, request, len);
 }
 
-static uint8_t cmp_public_key[crypto_box_PUBLICKEYBYTES];
-static int cmp_entry(const void *a, const void *b)
+/* Friend schedule (min heap on next_run) */
+
+static void schedule_set(Onion_Client *onion_c, uint32_t pos, uint16_t friend_num)
+{
+    onion_c->friends_schedule[pos] = friend_num;
+    onion_c->friends_list[friend_num].schedule_index = pos + 1;
+}
+
+static void schedule_sift_up(Onion_Client *onion_c, uint32_t pos)
+{
+    uint16_t friend_num = onion_c->friends_schedule[pos];
+    uint64_t next_run = onion_c->friends_list[friend_num].next_run;
+
+    while (pos) {
+        uint32_t parent = (pos - 1) / 2;
+
+        if (onion_c->friends_list[onion_c->friends_schedule[parent]].next_run <= next_run)
+            break;
+
+        schedule_set(onion_c, pos, onion_c->friends_schedule[parent]);
+        pos = parent;
+    }
+
+    schedule_set(onion_c, pos, friend_num);
+}
+
+static void schedule_sift_down(Onion_Client *onion_c, uint32_t pos)
 {
-    Onion_Node entry1, entry2;
-    memcpy(&entry1, a, sizeof(Onion_Node));
-    memcpy(&entry2, b, sizeof(Onion_Node));
-    int t1 = is_timeout(entry1.timestamp, ONION_NODE_TIMEOUT);
-    int t2 = is_timeout(entry2.timestamp, ONION_NODE_TIMEOUT);
+    uint16_t friend_num = onion_c->friends_schedule[pos];
+    uint64_t next_run = onion_c->friends_list[friend_num].next_run;
+    uint32_t length = onion_c->friends_schedule_length;
+
+    while (pos * 2 + 1 < length) {
+        uint32_t child = pos * 2 + 1;
+
+        if (child + 1 < length && onion_c->friends_list[onion_c->friends_schedule[child + 1]].next_run <
+                onion_c->friends_list[onion_c->friends_schedule[child]].next_run)
+            ++child;
+
+        if (next_run <= onion_c->friends_list[onion_c->friends_schedule[child]].next_run)
+            break;
+
+        schedule_set(onion_c, pos, onion_c->friends_schedule[child]);
+        pos = child;
+    }
+
+    schedule_set(onion_c, pos, friend_num);
+}
+
+/* Make do_onion_client() run do_friend() for friend_num at time. */
+static void schedule_friend(Onion_Client *onion_c, uint16_t friend_num, uint64_t time)
+{
+    Onion_Friend *onion_friend = &onion_c->friends_list[friend_num];
+
+    if (onion_friend->schedule_index) {
+        uint64_t old_time = onion_friend->next_run;
+        onion_friend->next_run = time;
+
+        if (time < old_time) {
+            schedule_sift_up(onion_c, onion_friend->schedule_index - 1);
+        } else {
+            schedule_sift_down(onion_c, onion_friend->schedule_index - 1);
+        }
+
+        return;
+    }
+
+    onion_friend->next_run = time;
+    schedule_set(onion_c, onion_c->friends_schedule_length, friend_num);
+    ++onion_c->friends_schedule_length;
+    schedule_sift_up(onion_c, onion_c->friends_schedule_length - 1);
+}
+
+static void unschedule_friend(Onion_Client *onion_c, uint16_t friend_num)
+{
+    uint32_t pos = onion_c->friends_list[friend_num].schedule_index;
+
+    if (!pos)
+        return;
+
+    --pos;
+    onion_c->friends_list[friend_num].schedule_index = 0;
+    --onion_c->friends_schedule_length;
+
+    if (pos == onion_c->friends_schedule_length)
+        return;
+
+    schedule_set(onion_c, pos, onion_c->friends_schedule[onion_c->friends_schedule_length]);
+    schedule_sift_up(onion_c, pos);
+    schedule_sift_down(onion_c, onion_c->friends_list[onion_c->friends_schedule[pos]].schedule_index - 1);
+}
+
+/* Make sure do_friend() runs for friend_num no later than now. */
+static void schedule_friend_now(Onion_Client *onion_c, uint16_t friend_num)
+{
+    uint64_t now = unix_time();
+
+    if (onion_c->friends_list[friend_num].status == 0)
+        return;
+
+    if (!onion_c->friends_list[friend_num].schedule_index || onion_c->friends_list[friend_num].next_run > now)
+        schedule_friend(onion_c, friend_num, now);
+}
+
+/* Compare two nodes for sort_onion_node_list(): timed out nodes come first,
+ * then nodes further away from comp_public_key.
+ */
+static int cmp_entry(const Onion_Node *entry1, const Onion_Node *entry2, const uint8_t *comp_public_key)
+{
+    int t1 = is_timeout(entry1->timestamp, ONION_NODE_TIMEOUT);
+    int t2 = is_timeout(entry2->timestamp, ONION_NODE_TIMEOUT);
 
     if (t1 && t2)
         return 0;
@@ -459,7 +564,7 @@ static int cmp_entry(const void *a, const void *b)
     if (t2)
         return 1;
 
-    int close = id_closest(cmp_public_key, entry1.public_key, entry2.public_key);
+    int close = id_closest(comp_public_key, entry1->public_key, entry2->public_key);
 
     if (close == 1)
         return 1;
@@ -470,6 +575,28 @@ static int cmp_entry(const void *a, const void *b)
     return 0;
 }
 
+/* Sort the list so that the nodes furthest from comp_public_key come first.
+ *
+ * qsort() has no way to pass the reference key to the compare function without
+ * a global, so the (short) lists are insertion sorted instead.
+ */
+static void sort_onion_node_list(Onion_Node *list, unsigned int length, const uint8_t *comp_public_key)
+{
+    unsigned int i;
+
+    for (i = 1; i < length; ++i) {
+        Onion_Node entry = list[i];
+        unsigned int j = i;
+
+        while (j > 0 && cmp_entry(&list[j - 1], &entry, comp_public_key) > 0) {
+            list[j] = list[j - 1];
+            --j;
+        }
+
+        list[j] = entry;
+    }
+}
+
 static int client_add_to_list(Onion_Client *onion_c, uint32_t num, const uint8_t *public_key, IP_Port ip_port,
                               uint8_t is_stored, const uint8_t *pingid_or_key, uint32_t path_num)
 {
@@ -498,8 +625,7 @@ static int client_add_to_list(Onion_Client *onion_c, uint32_t num, const uint8_t
         list_length = MAX_ONION_CLIENTS;
     }
 
-    memcpy(cmp_public_key, reference_id, crypto_box_PUBLICKEYBYTES);
-    qsort(list_nodes, list_length, sizeof(Onion_Node), cmp_entry);
+    sort_onion_node_list(list_nodes, list_length, reference_id);
 
     int index = -1, stored = 0;
     unsigned int i;
@@ -535,9 +661,13 @@ static int client_add_to_list(Onion_Client *onion_c, uint32_t num, const uint8_t
     list_nodes[index].is_stored = is_stored;
     list_nodes[index].timestamp = unix_time();
 
-    if (!stored)
+    if (!stored) {
         list_nodes[index].last_pinged = 0;
 
+        if (num != 0)
+            schedule_friend_now(onion_c, num - 1);
+    }
+
     list_nodes[index].path_used = set_path_timeouts(onion_c, num, path_num);
     return 0;
 }
@@ -739,6 +869,7 @@ static int handle_dhtpk_announce(void *object, const uint8_t *source_pubkey, con
 
     onion_set_friend_DHT_pubkey(onion_c, friend_num, data + 1 + sizeof(uint64_t));
     onion_c->friends_list[friend_num].last_seen = unix_time();
+    schedule_friend_now(onion_c, friend_num);
 
     uint16_t len_nodes = length - DHTPK_DATA_MIN_LENGTH;
 
@@ -1000,6 +1131,8 @@ static int realloc_onion_friends(Onion_Client *onion_c, uint32_t num)
     if (num == 0) {
         free(onion_c->friends_list);
         onion_c->friends_list = NULL;
+        free(onion_c->friends_schedule);
+        onion_c->friends_schedule = NULL;
         return 0;
     }
 
@@ -1009,6 +1142,13 @@ static int realloc_onion_friends(Onion_Client *onion_c, uint32_t num)
         return -1;
 
     onion_c->friends_list = newonion_friends;
+
+    uint16_t *new_schedule = realloc(onion_c->friends_schedule, num * sizeof(uint16_t));
+
+    if (new_schedule == NULL)
+        return -1;
+
+    onion_c->friends_schedule = new_schedule;
     return 0;
 }
 
@@ -1045,6 +1185,8 @@ int onion_addfriend(Onion_Client *onion_c, const uint8_t *public_key)
     onion_c->friends_list[index].status = 1;
     memcpy(onion_c->friends_list[index].real_public_key, public_key, crypto_box_PUBLICKEYBYTES);
     crypto_box_keypair(onion_c->friends_list[index].temp_public_key, onion_c->friends_list[index].temp_secret_key);
+    onion_c->friends_list[index].added_time = unix_time();
+    schedule_friend_now(onion_c, index);
     return index;
 }
 
@@ -1061,6 +1203,7 @@ int onion_delfriend(Onion_Client *onion_c, int friend_num)
     //if (onion_c->friends_list[friend_num].know_dht_public_key)
     //    DHT_delfriend(onion_c->dht, onion_c->friends_list[friend_num].dht_public_key, 0);
 
+    unschedule_friend(onion_c, friend_num);
     sodium_memzero(&(onion_c->friends_list[friend_num]), sizeof(Onion_Friend));
     unsigned int i;
 
@@ -1142,6 +1285,9 @@ int onion_set_friend_DHT_pubkey(Onion_Client *onion_c, int friend_num, const uin
     onion_c->friends_list[friend_num].know_dht_public_key = 1;
     memcpy(onion_c->friends_list[friend_num].dht_public_key, dht_key, crypto_box_PUBLICKEYBYTES);
 
+    if (!onion_c->friends_list[friend_num].is_online)
+        schedule_friend_now(onion_c, friend_num);
+
     return 0;
 }
 
@@ -1206,6 +1352,7 @@ int onion_set_friend_online(Onion_Client *onion_c, int friend_num, uint8_t is_on
     if (!is_online) {
         onion_c->friends_list[friend_num].last_noreplay = 0;
         onion_c->friends_list[friend_num].run_count = 0;
+        schedule_friend_now(onion_c, friend_num);
     }
 
     return 0;
@@ -1238,44 +1385,91 @@ static void populate_path_nodes_tcp(Onion_Client *onion_c)
 
 #define ANNOUNCE_FRIEND (ONION_NODE_PING_INTERVAL * 6)
 #define ANNOUNCE_FRIEND_BEGINNING 3
-#define FRIEND_ONION_NODE_TIMEOUT (ONION_NODE_TIMEOUT * 6)
 
 #define RUN_COUNT_FRIEND_ANNOUNCE_BEGINNING 17
 
-static void do_friend(Onion_Client *onion_c, uint16_t friendnum)
+/* return how many times (as a power of 2) less often friend friendnum should be searched
+ * because it has not been seen for a long time.
+ */
+static unsigned int friend_search_backoff(const Onion_Client *onion_c, uint16_t friendnum)
 {
-    if (friendnum >= onion_c->num_friends)
-        return;
+    const Onion_Friend *onion_friend = &onion_c->friends_list[friendnum];
+    uint64_t seen = onion_friend->last_seen > onion_friend->added_time ? onion_friend->last_seen : onion_friend->added_time;
+    uint64_t now = unix_time();
 
-    if (onion_c->friends_list[friendnum].status == 0)
-        return;
+    if (seen >= now)
+        return 0;
+
+    uint64_t offline_time = now - seen;
+    unsigned int backoff = 0;
+
+    while (offline_time >= ONION_FRIEND_BACKOFF_START && backoff < ONION_FRIEND_MAX_BACKOFF) {
+        offline_time /= 2;
+        ++backoff;
+    }
 
+    return backoff;
+}
+
+/* return the interval at which friend friendnum pings its onion nodes after backing off
+ * backoff times. It never goes over ONION_FRIEND_MAX_PING_INTERVAL so that the nodes don't time out.
+ */
+static unsigned int friend_ping_interval(const Onion_Client *onion_c, uint16_t friendnum, unsigned int backoff)
+{
     unsigned int interval = ANNOUNCE_FRIEND;
 
     if (onion_c->friends_list[friendnum].run_count < RUN_COUNT_FRIEND_ANNOUNCE_BEGINNING)
         interval = ANNOUNCE_FRIEND_BEGINNING;
 
-    unsigned int i, count = 0;
+    if ((interval << backoff) > ONION_FRIEND_MAX_PING_INTERVAL)
+        return ONION_FRIEND_MAX_PING_INTERVAL;
+
+    return interval << backoff;
+}
+
+/* Handle the announces of friend friendnum and schedule its next run.
+ * Only offline friends get scheduled again.
+ *
+ * return the number of packets sent.
+ */
+static unsigned int do_friend(Onion_Client *onion_c, uint16_t friendnum)
+{
+    if (friendnum >= onion_c->num_friends)
+        return 0;
+
+    if (onion_c->friends_list[friendnum].status == 0)
+        return 0;
+
+    unsigned int i, count = 0, sent = 0;
     Onion_Node *list_nodes = onion_c->friends_list[friendnum].clients_list;
 
     if (!onion_c->friends_list[friendnum].is_online) {
+        unsigned int backoff = friend_search_backoff(onion_c, friendnum);
+        unsigned int interval = friend_ping_interval(onion_c, friendnum, backoff);
+        uint64_t dhtpk_onion_interval = ONION_DHTPK_SEND_INTERVAL << backoff;
+        uint64_t dhtpk_dht_interval = DHT_DHTPK_SEND_INTERVAL << backoff;
+        uint64_t next_run = unix_time() + interval;
+
         for (i = 0; i < MAX_ONION_CLIENTS; ++i) {
             if (is_timeout(list_nodes[i].timestamp, FRIEND_ONION_NODE_TIMEOUT))
                 continue;
 
             ++count;
 
+            if (list_nodes[i].timestamp + FRIEND_ONION_NODE_TIMEOUT < next_run)
+                next_run = list_nodes[i].timestamp + FRIEND_ONION_NODE_TIMEOUT;
 
             if (list_nodes[i].last_pinged == 0) {
                 list_nodes[i].last_pinged = unix_time();
-                continue;
-            }
-
-            if (is_timeout(list_nodes[i].last_pinged, interval)) {
+            } else if (is_timeout(list_nodes[i].last_pinged, interval)) {
                 if (client_send_announce_request(onion_c, friendnum + 1, list_nodes[i].ip_port, list_nodes[i].public_key, 0, ~0) == 0) {
                     list_nodes[i].last_pinged = unix_time();
+                    ++sent;
                 }
             }
+
+            if (list_nodes[i].last_pinged + interval < next_run)
+                next_run = list_nodes[i].last_pinged + interval;
         }
 
         if (count != MAX_ONION_CLIENTS) {
@@ -1291,25 +1485,106 @@ static void do_friend(Onion_Client *onion_c, uint16_t friendnum)
 
                 for (j = 0; j < n; ++j) {
                     unsigned int num = rand() % num_nodes;
-                    client_send_announce_request(onion_c, friendnum + 1, onion_c->path_nodes[num].ip_port,
-                                                 onion_c->path_nodes[num].public_key, 0, ~0);
+
+                    if (client_send_announce_request(onion_c, friendnum + 1, onion_c->path_nodes[num].ip_port,
+                                                     onion_c->path_nodes[num].public_key, 0, ~0) == 0)
+                        ++sent;
                 }
 
                 ++onion_c->friends_list[friendnum].run_count;
             }
+
+            /* Keep searching for nodes every second, or less often if the friend hasn't been seen in a while. */
+            next_run = unix_time() + (1 << backoff);
         } else {
             ++onion_c->friends_list[friendnum].run_count;
         }
 
+        int ret;
+
         /* send packets to friend telling them our DHT public key. */
-        if (is_timeout(onion_c->friends_list[friendnum].last_dht_pk_onion_sent, ONION_DHTPK_SEND_INTERVAL))
-            if (send_dhtpk_announce(onion_c, friendnum, 0) >= 1)
+        if (is_timeout(onion_c->friends_list[friendnum].last_dht_pk_onion_sent, dhtpk_onion_interval))
+            if ((ret = send_dhtpk_announce(onion_c, friendnum, 0)) >= 1) {
                 onion_c->friends_list[friendnum].last_dht_pk_onion_sent = unix_time();
+                sent += ret;
+            }
 
-        if (is_timeout(onion_c->friends_list[friendnum].last_dht_pk_dht_sent, DHT_DHTPK_SEND_INTERVAL))
-            if (send_dhtpk_announce(onion_c, friendnum, 1) >= 1)
+        if (is_timeout(onion_c->friends_list[friendnum].last_dht_pk_dht_sent, dhtpk_dht_interval))
+            if ((ret = send_dhtpk_announce(onion_c, friendnum, 1)) >= 1) {
                 onion_c->friends_list[friendnum].last_dht_pk_dht_sent = unix_time();
+                sent += ret;
+            }
+
+        /* A dhtpk announce that could not be sent is retried by the next run, it must not make the
+         * friend due every second. */
+        uint64_t dhtpk_onion_next = onion_c->friends_list[friendnum].last_dht_pk_onion_sent + dhtpk_onion_interval;
+        uint64_t dhtpk_dht_next = onion_c->friends_list[friendnum].last_dht_pk_dht_sent + dhtpk_dht_interval;
+
+        if (dhtpk_onion_next > unix_time() && dhtpk_onion_next < next_run)
+            next_run = dhtpk_onion_next;
+
+        if (dhtpk_dht_next > unix_time() && dhtpk_dht_next < next_run)
+            next_run = dhtpk_dht_next;
+
+        if (next_run <= unix_time())
+            next_run = unix_time() + 1;
+
+        schedule_friend(onion_c, friendnum, next_run);
+    }
+
+    return sent;
+}
+
+/* Set the maximum number of packets per second used to search for offline friends.
+ * 0 means no limit.
+ */
+void onion_set_friend_search_rate(Onion_Client *onion_c, uint32_t packets_per_second)
+{
+    onion_c->friend_search_rate = packets_per_second;
+
+    if (onion_c->friend_search_tokens > packets_per_second)
+        onion_c->friend_search_tokens = packets_per_second;
+}
+
+/* Run do_friend() for the friends that are due, within the search rate. */
+static void do_friends(Onion_Client *onion_c)
+{
+    uint64_t now = unix_time();
+    uint32_t rate = onion_c->friend_search_rate;
+
+    if (rate) {
+        onion_c->friend_search_tokens += (now - onion_c->friend_search_refill) * rate;
 
+        if (onion_c->friend_search_tokens > rate)
+            onion_c->friend_search_tokens = rate;
+    }
+
+    onion_c->friend_search_refill = now;
+
+    unsigned int i;
+
+    for (i = 0; i < MAX_ONION_FRIEND_RUNS && onion_c->friends_schedule_length; ++i) {
+        uint16_t friendnum = onion_c->friends_schedule[0];
+
+        if (onion_c->friends_list[friendnum].next_run > now)
+            break;
+
+        if (rate) {
+            if (onion_c->friend_search_tokens <= 0)
+                break;
+
+            /* Friends that haven't been seen in a while must leave half of the rate to the others. */
+            if (onion_c->friend_search_tokens <= rate / 2 && friend_search_backoff(onion_c, friendnum)) {
+                schedule_friend(onion_c, friendnum, now + 1);
+                continue;
+            }
+        }
+
+        unschedule_friend(onion_c, friendnum);
+        unsigned int sent = do_friend(onion_c, friendnum);
+
+        if (rate)
+            onion_c->friend_search_tokens -= sent;
     }
 }
 
@@ -1438,8 +1713,6 @@ unsigned int onion_connection_status(const Onion_Client *onion_c)
 
 void do_onion_client(Onion_Client *onion_c)
 {
-    unsigned int i;
-
     if (onion_c->last_run == unix_time())
         return;
 
@@ -1471,9 +1744,7 @@ void do_onion_client(Onion_Client *onion_c)
                              || get_random_tcp_onion_conn_number(onion_c->c->tcp_c) == -1; /* Check if connected to any TCP relays. */
 
     if (onion_connection_status(onion_c)) {
-        for (i = 0; i < onion_c->num_friends; ++i) {
-            do_friend(onion_c, i);
-        }
+        do_friends(onion_c);
     }
 
     if (onion_c->last_run == 0) {
@@ -1501,6 +1772,9 @@ Onion_Client *new_onion_client(Net_Crypto *c)
     onion_c->dht = c->dht;
     onion_c->net = c->dht->net;
     onion_c->c = c;
+    onion_c->friend_search_rate = ONION_FRIEND_SEARCH_RATE;
+    onion_c->friend_search_tokens = ONION_FRIEND_SEARCH_RATE;
+    onion_c->friend_search_refill = unix_time();
     new_symmetric_key(onion_c->secret_symmetric_key);
     crypto_box_keypair(onion_c->temp_public_key, onion_c->temp_secret_key);
     networking_registerhandler(onion_c->net, NET_PACKET_ANNOUNCE_RESPONSE, &handle_announce_response, onion_c);
@@ -51,6 +51,24 @@
 
 #define MAX_PATH_NODES 32
 
+/* Maximum number of friends handled by each do_onion_client() run, friends that are
+ * due but over the limit are handled by the next runs. */
+#define MAX_ONION_FRIEND_RUNS 128
+
+/* Default number of packets per second that can be used to search for offline friends. */
+#define ONION_FRIEND_SEARCH_RATE 512
+
+/* Friends not seen for ONION_FRIEND_BACKOFF_START seconds are searched half as often,
+ * and half as often again each time that duration doubles, up to 2^ONION_FRIEND_MAX_BACKOFF
+ * times less often. They are also only searched when less than half of the rate is used. */
+#define ONION_FRIEND_BACKOFF_START 600
+#define ONION_FRIEND_MAX_BACKOFF 6
+
+/* Onion nodes of friends time out when not heard from in FRIEND_ONION_NODE_TIMEOUT seconds,
+ * backed off friends still ping them at least every ONION_FRIEND_MAX_PING_INTERVAL seconds. */
+#define FRIEND_ONION_NODE_TIMEOUT (ONION_NODE_TIMEOUT * 6)
+#define ONION_FRIEND_MAX_PING_INTERVAL (FRIEND_ONION_NODE_TIMEOUT - ONION_NODE_PING_INTERVAL)
+
 /* If no packets are received within that interval tox will
  * be considered offline.
  */
@@ -81,6 +99,10 @@ typedef struct {
     uint64_t path_creation_time[NUMBER_ONION_PATHS];
     /* number of times used without success. */
     unsigned int last_path_used_times[NUMBER_ONION_PATHS];
+
+    /* Statistics: number of paths built and number of packets sent through them. */
+    uint64_t num_paths_built;
+    uint64_t num_path_uses;
 } Onion_Client_Paths;
 
 typedef struct {
@@ -106,6 +128,7 @@ typedef struct {
     uint64_t last_noreplay;
 
     uint64_t last_seen;
+    uint64_t added_time;
 
     Last_Pinged last_pinged[MAX_STORED_PINGED_NODES];
     uint8_t last_pinged_index;
@@ -119,6 +142,9 @@ typedef struct {
     uint32_t dht_pk_callback_number;
 
     uint32_t run_count;
+
+    uint64_t next_run; /* Time at which do_friend() must next run for this friend. */
+    uint32_t schedule_index; /* Position in friends_schedule + 1, 0 if not scheduled. */
 } Onion_Friend;
 
 typedef int (*oniondata_handler_callback)(void *object, const uint8_t *source_pubkey, const uint8_t *data,
@@ -131,6 +157,15 @@ struct Onion_Client {
     Onion_Friend    *friends_list;
     uint16_t       num_friends;
 
+    /* Min heap of the friends waiting for do_friend(), ordered by next_run. */
+    uint16_t       *friends_schedule;
+    uint16_t       friends_schedule_length;
+
+    /* Token bucket limiting the packets sent to search for offline friends. */
+    uint32_t friend_search_rate;
+    int64_t friend_search_tokens;
+    uint64_t friend_search_refill;
+
     Onion_Node clients_announce_list[MAX_ONION_CLIENTS_ANNOUNCE];
 
     Onion_Client_Paths onion_paths_self;
@@ -275,6 +310,11 @@ int send_onion_data(Onion_Client *onion_c, int friend_num, const uint8_t *data,
 /* Function to call when onion data packet with contents beginning with byte is received. */
 void oniondata_registerhandler(Onion_Client *onion_c, uint8_t byte, oniondata_handler_callback cb, void *object);
 
+/* Set the maximum number of packets per second used to search for offline friends.
+ * 0 means no limit.
+ */
+void onion_set_friend_search_rate(Onion_Client *onion_c, uint32_t packets_per_second);
+
 void do_onion_client(Onion_Client *onion_c);
 
 Onion_Client *new_onion_client(Net_Crypto *c);
@@ -39,54 +39,56 @@ static void clear_entry(Ping_Array *array, uint32_t index)
             array->entries[index].ping_id = 0;
 }
 
-/* Clear timed out entries.
- */
-static void ping_array_clear_timedout(Ping_Array *array)
+/* return a random number to build a ping_id from. */
+static uint64_t random_ping_id(Ping_Array *array)
 {
-    while (array->last_deleted != array->last_added) {
-        uint32_t index = array->last_deleted % array->total_size;
-
-        if (!is_timeout(array->entries[index].time, array->timeout))
-            break;
-
-        clear_entry(array, index);
-        ++array->last_deleted;
+    if (array->random_ids_left == 0) {
+        randombytes((uint8_t *)array->random_ids, sizeof(array->random_ids));
+        array->random_ids_left = PING_ARRAY_RANDOM_IDS;
     }
+
+    --array->random_ids_left;
+    return array->random_ids[array->random_ids_left];
 }
 
 /* Add a data with length to the Ping_Array list and return a ping_id.
+ *
+ * Entries are reused in order, so the oldest entry is simply overwritten: timed out
+ * entries never need to be swept since ping_array_check() rejects them.
  *
  * return ping_id on success.
  * return 0 on failure.
  */
 uint64_t ping_array_add(Ping_Array *array, const uint8_t *data, uint32_t length)
 {
-    ping_array_clear_timedout(array);
-    uint32_t index = array->last_added % array->total_size;
+    uint32_t index = array->last_added & array->mask;
+    Ping_Array_Entry *entry = &array->entries[index];
 
-    if (array->entries[index].data != NULL) {
-        array->last_deleted = array->last_added - array->total_size;
+    if (entry->data != NULL)
         clear_entry(array, index);
-    }
 
-    array->entries[index].data = malloc(length);
+    if (length > PING_ARRAY_INLINE_SIZE) {
+        entry->data = malloc(length);
+
+        if (entry->data == NULL)
+            return 0;
 
-    if (array->entries[index].data == NULL)
-        return 0;
+        memcpy(entry->data, data, length);
+    } else {
+        memcpy(entry->inline_data, data, length);
+    }
 
-    memcpy(array->entries[index].data, data, length);
-    array->entries[index].length = length;
-    array->entries[index].time = unix_time();
+    entry->length = length;
+    entry->time = unix_time();
     ++array->last_added;
-    uint64_t ping_id = random_64b();
-    ping_id /= array->total_size;
-    ping_id *= array->total_size;
-    ping_id += index;
+    uint64_t ping_id = random_ping_id(array);
+    ping_id &= ~(uint64_t)array->mask;
+    ping_id |= index;
 
     if (ping_id == 0)
         ping_id += array->total_size;
 
-    array->entries[index].ping_id = ping_id;
+    entry->ping_id = ping_id;
     return ping_id;
 }
 
@@ -103,28 +105,26 @@ int ping_array_check(uint8_t *data, uint32_t length, Ping_Array *array, uint64_t
     if (ping_id == 0)
         return -1;
 
-    uint32_t index = ping_id % array->total_size;
-
-    if (array->entries[index].ping_id != ping_id)
-        return -1;
+    uint32_t index = ping_id & array->mask;
+    Ping_Array_Entry *entry = &array->entries[index];
 
-    if (is_timeout(array->entries[index].time, array->timeout))
+    if (entry->ping_id != ping_id)
         return -1;
 
-    if (array->entries[index].length > length)
+    if (is_timeout(entry->time, array->timeout))
         return -1;
 
-    if (array->entries[index].data == NULL)
+    if (entry->length > length)
         return -1;
 
-    memcpy(data, array->entries[index].data, array->entries[index].length);
-    uint32_t len = array->entries[index].length;
+    memcpy(data, entry->data ? entry->data : entry->inline_data, entry->length);
+    uint32_t len = entry->length;
     clear_entry(array, index);
     return len;
 }
 
 /* Initialize a Ping_Array.
- * size represents the total size of the array and should be a power of 2.
+ * size represents the total size of the array and must be a power of 2.
  * timeout represents the maximum timeout in seconds for the entry.
  *
  * return 0 on success.
@@ -135,14 +135,19 @@ int ping_array_init(Ping_Array *empty_array, uint32_t size, uint32_t timeout)
     if (size == 0 || timeout == 0 || empty_array == NULL)
         return -1;
 
+    if ((size & (size - 1)) != 0)
+        return -1;
+
     empty_array->entries = calloc(size, sizeof(Ping_Array_Entry));
 
     if (empty_array->entries == NULL)
         return -1;
 
-    empty_array->last_deleted = empty_array->last_added = 0;
+    empty_array->last_added = 0;
     empty_array->total_size = size;
+    empty_array->mask = size - 1;
     empty_array->timeout = timeout;
+    empty_array->random_ids_left = 0;
     return 0;
 }
 
@@ -150,13 +155,12 @@ int ping_array_init(Ping_Array *empty_array, uint32_t size, uint32_t timeout)
  */
 void ping_array_free_all(Ping_Array *array)
 {
-    while (array->last_deleted != array->last_added) {
-        uint32_t index = array->last_deleted % array->total_size;
-        clear_entry(array, index);
-        ++array->last_deleted;
+    uint32_t i;
+
+    for (i = 0; i < array->total_size; ++i) {
+        free(array->entries[i].data);
     }
 
     free(array->entries);
     array->entries = NULL;
 }
-
@@ -25,21 +25,33 @@
 
 #include "network.h"
 
+/* Data up to this length is stored in the entry itself, longer data is allocated.
+ * Big enough for every user in toxcore (the largest is two Node_format for hardening pings).
+ */
+#define PING_ARRAY_INLINE_SIZE 128
+
+/* Number of random ping ids fetched from the random number generator at once. */
+#define PING_ARRAY_RANDOM_IDS 32
+
 typedef struct {
-    void *data;
+    uint8_t inline_data[PING_ARRAY_INLINE_SIZE];
+    uint8_t *data; /* NULL if the data is stored in inline_data. */
     uint32_t length;
     uint64_t time;
-    uint64_t ping_id;
+    uint64_t ping_id; /* 0 if the entry is empty. */
 } Ping_Array_Entry;
 
 
 typedef struct {
     Ping_Array_Entry *entries;
 
-    uint32_t last_deleted; /* number representing the next entry to be deleted. */
     uint32_t last_added; /* number representing the last entry to be added. */
-    uint32_t total_size; /* The length of entries */
+    uint32_t total_size; /* The length of entries, a power of 2. */
+    uint32_t mask; /* total_size - 1 */
     uint32_t timeout; /* The timeout after which entries are cleared. */
+
+    uint64_t random_ids[PING_ARRAY_RANDOM_IDS];
+    uint32_t random_ids_left;
 } Ping_Array;
 
 
@@ -60,7 +72,7 @@ uint64_t ping_array_add(Ping_Array *array, const uint8_t *data, uint32_t length)
 int ping_array_check(uint8_t *data, uint32_t length, Ping_Array *array, uint64_t ping_id);
 
 /* Initialize a Ping_Array.
- * size represents the total size of the array and should be a power of 2.
+ * size represents the total size of the array and must be a power of 2.
  * timeout represents the maximum timeout in seconds for the entry.
  *
  * return 0 on success.
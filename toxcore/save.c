@@ -150,15 +150,17 @@ void save_get_savedata(const Tox *tox, uint8_t *data)
     save_keys(tox->net_crypto, data + size32);
     data += len;
 
-    len = DHT_size(tox->dht);
+    /* The DHT is saved before its length is known, the subheader is written after */
     type = SAVE_STATE_TYPE_DHT;
-    data = save_write_subheader(data, len, type, SAVE_STATE_COOKIE_TYPE);
-    DHT_save(tox->dht, data);
+    uint8_t *temp_data = data;
+    data = save_write_subheader(data, 0, type, SAVE_STATE_COOKIE_TYPE);
+    len = DHT_save(tox->dht, data);
+    data = save_write_subheader(temp_data, len, type, SAVE_STATE_COOKIE_TYPE);
     data += len;
 
     Node_format nodes[NUM_SAVED_PATH_NODES];
     type = SAVE_STATE_TYPE_PATH_NODE;
-    uint8_t *temp_data = data;
+    temp_data = data;
     data = save_write_subheader(data, 0, type, SAVE_STATE_COOKIE_TYPE);
     memset(nodes, 0, sizeof(nodes));
     unsigned int num = onion_backup_nodes(tox->onion_c, nodes, NUM_SAVED_PATH_NODES);
@@ -262,6 +262,9 @@ Tox *tox_new(const struct Tox_Options *options, TOX_ERR_NEW *error)
         return NULL;
     }
 
+    if (options)
+        net_crypto_set_multipath(tox->net_crypto, options->multipath_enabled);
+
     tox->onion   = new_onion(tox->dht);
     tox->onion_a = new_onion_announce(tox->dht);
     tox->onion_c = new_onion_client(tox->net_crypto);
@@ -277,6 +280,12 @@ Tox *tox_new(const struct Tox_Options *options, TOX_ERR_NEW *error)
         return NULL;
     }
 
+    /* 0 keeps the default, UINT32_MAX is what the onion client calls no limit (0). */
+    if (options && options->friend_search_rate == UINT32_MAX)
+        onion_set_friend_search_rate(tox->onion_c, 0);
+    else if (options && options->friend_search_rate)
+        onion_set_friend_search_rate(tox->onion_c, options->friend_search_rate);
+
     Messenger *m = new_messenger(tox, &m_options, &m_error);
     if (!m) {
         return NULL;
@@ -1462,6 +1471,44 @@ bool tox_friend_send_lossless_packet(Tox *tox, uint32_t friend_number, const uin
     }
 }
 
+size_t tox_friend_send_lossless_packets(Tox *tox, uint32_t friend_number, const uint8_t *const *data,
+                                        const size_t *length, size_t count, TOX_ERR_FRIEND_CUSTOM_PACKET *error)
+{
+    if (!data || !length) {
+        SET_ERROR_PARAMETER(error, TOX_ERR_FRIEND_CUSTOM_PACKET_NULL);
+        return 0;
+    }
+
+    size_t i;
+
+    for (i = 0; i < count; ++i) {
+        if (!data[i]) {
+            SET_ERROR_PARAMETER(error, TOX_ERR_FRIEND_CUSTOM_PACKET_NULL);
+            return 0;
+        }
+
+        if (length[i] == 0) {
+            SET_ERROR_PARAMETER(error, TOX_ERR_FRIEND_CUSTOM_PACKET_EMPTY);
+            return 0;
+        }
+    }
+
+    if (count == 0 || count > UINT32_MAX) {
+        SET_ERROR_PARAMETER(error, TOX_ERR_FRIEND_CUSTOM_PACKET_EMPTY);
+        return 0;
+    }
+
+    int ret = send_custom_lossless_packets(tox, friend_number, data, length, count);
+
+    if (ret > 0) {
+        SET_ERROR_PARAMETER(error, TOX_ERR_FRIEND_CUSTOM_PACKET_OK);
+        return ret;
+    }
+
+    set_custom_packet_error(ret, error);
+    return 0;
+}
+
 void tox_callback_friend_lossless_packet(Tox *tox, tox_friend_lossless_packet_cb *function, void *user_data)
 {
     custom_lossless_packet_registerhandler(tox, function, user_data);
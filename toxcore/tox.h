@@ -504,6 +504,32 @@ struct Tox_Options {
      */
     size_t savedata_length;
 
+
+    /**
+     * Spread the data packets of each friend connection over all the working
+     * paths to the friend (the direct UDP path and every online TCP relay)
+     * instead of using only one of them. Each path gets a share of the packets
+     * that depends on its measured round trip time and on whether it recently
+     * refused packets.
+     *
+     * This can increase the throughput of friend connections that go through
+     * TCP relays.
+     */
+    bool multipath_enabled;
+
+
+    /**
+     * The maximum number of packets per second used to look for offline
+     * friends through the onion. Friends that were seen recently are searched
+     * first, friends that have been offline for a long time are searched less
+     * and less often.
+     *
+     * 0 uses the library default and UINT32_MAX removes the limit. Accounts
+     * with very large friend lists can lower this to reduce their idle
+     * bandwidth.
+     */
+    uint32_t friend_search_rate;
+
 };
 
 
@@ -2551,6 +2577,25 @@ bool tox_friend_send_lossy_packet(Tox *tox, uint32_t friend_number, const uint8_
 bool tox_friend_send_lossless_packet(Tox *tox, uint32_t friend_number, const uint8_t *data, size_t length,
                                      TOX_ERR_FRIEND_CUSTOM_PACKET *error);
 
+/**
+ * Send several custom lossless packets to a friend at once.
+ *
+ * Each packet follows the same rules as in tox_friend_send_lossless_packet.
+ * Packets are queued in order until the send queue is full, which is cheaper
+ * than calling tox_friend_send_lossless_packet once per packet.
+ *
+ * @param friend_number The friend number of the friend these lossless packets
+ *   should be sent to.
+ * @param data An array of count byte arrays containing the packet data.
+ * @param length An array of count packet data lengths.
+ * @param count The number of packets.
+ *
+ * @return the number of packets that were queued. If fewer than count packets
+ *   were queued, the rest should be sent again later.
+ */
+size_t tox_friend_send_lossless_packets(Tox *tox, uint32_t friend_number, const uint8_t *const *data,
+                                        const size_t *length, size_t count, TOX_ERR_FRIEND_CUSTOM_PACKET *error);
+
 /**
  * @param friend_number The friend number of the friend who sent a lossy packet.
  * @param data A byte array containing the received packet data.
@@ -34,21 +34,42 @@
 #include "util.h"
 
 
-/* don't call into system billions of times for no reason */
+/* don't call into system billions of times for no reason
+ *
+ * The cached clock is shared by every instance in the process, and instances
+ * may be iterated on different threads, so it is only touched atomically.
+ * Whichever instance updates it last, all of them read the same wall clock.
+ */
 static uint64_t unix_time_value;
 static uint64_t unix_base_time_value;
 
 void unix_time_update()
 {
-    if (unix_base_time_value == 0)
-        unix_base_time_value = ((uint64_t)time(NULL) - (current_time_monotonic() / 1000ULL));
+    uint64_t monotime = current_time_monotonic() / 1000ULL;
+    uint64_t base = __atomic_load_n(&unix_base_time_value, __ATOMIC_RELAXED);
+
+    if (base == 0) {
+        uint64_t expected = 0;
+        base = (uint64_t)time(NULL) - monotime;
+
+        /* first caller wins so the clock never jumps between threads */
+        if (!__atomic_compare_exchange_n(&unix_base_time_value, &expected, base, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            base = expected;
+    }
+
+    uint64_t now = monotime + base;
+    uint64_t old = __atomic_load_n(&unix_time_value, __ATOMIC_RELAXED);
 
-    unix_time_value = (current_time_monotonic() / 1000ULL) + unix_base_time_value;
+    /* threads racing here may have read the clock in any order, only ever move it forward */
+    while (old < now) {
+        if (__atomic_compare_exchange_n(&unix_time_value, &old, now, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            break;
+    }
 }
 
 uint64_t unix_time()
 {
-    return unix_time_value;
+    return __atomic_load_n(&unix_time_value, __ATOMIC_RELAXED);
 }
 
 int is_timeout(uint64_t timestamp, uint64_t timeout)
@@ -136,6 +157,14 @@ int create_recursive_mutex(pthread_mutex_t *mutex)
     return 0;
 }
 
+void average_add(uint32_t *average, uint64_t value)
+{
+    uint32_t old = __atomic_load_n(average, __ATOMIC_RELAXED);
+    uint32_t add = MIN(value, UINT32_MAX / 2);
+
+    __atomic_store_n(average, old ? old - old / 8 + add / 8 : add, __ATOMIC_RELAXED);
+}
+
 
 struct RingBuffer {
     uint16_t size; /* Max size */
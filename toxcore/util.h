@@ -53,6 +53,11 @@ void lendian_to_host32(uint32_t *dest, const uint8_t *lendian);
 /* Returns -1 if failed or 0 if success */
 int create_recursive_mutex(pthread_mutex_t *mutex);
 
+/* Fold value into a recent average that other threads read with __atomic at any time.
+ * Only one thread at a time may add to it.
+ */
+void average_add(uint32_t *average, uint64_t value);
+
 /* Ring buffer */
 typedef struct RingBuffer RingBuffer;
 bool rb_full(const RingBuffer *b);